@@ -0,0 +1,183 @@
+#!/usr/local/bin/lua
+--
+--------------------------------------------------------------------------------
+--         File:  b_ex04.lua
+--
+--        Usage:  make bench_ex04
+--
+--  Description:  Benchmarks for ex04's NumArray.  Streaming kernels over
+--                arrays whose elements start at a 64-byte boundary versus
+--                the same kernels over views that start 8 bytes further,
+--                so half of the vector loads straddle a cache line.
+--                Then the cost per call of a few accessors, mostly the
+--                type check of the array (see udata.h).  Last, vmath.h's
+--                math functions versus the C library's, random fills,
+--                parse_csv and a:format().
+--
+--      Options:  ---
+-- Requirements:  ---
+--         Bugs:  os.clock() is CPU time, sizes stay below the threshold
+--                where reductions go multithreaded.
+--        Notes:  ---
+--       Author:  YOUR NAME (), <>
+-- Organization:
+--      Version:  1.0
+--      Created:  26-05-19
+--     Revision:  ---
+--------------------------------------------------------------------------------
+--
+
+package.cpath = "bld/?.so"
+array = require("ex04");
+
+local WORK = 2^27           -- elements processed per measurement
+
+local function zeros(n)
+  local t = {}
+  for i = 1, n do t[i] = 0 end
+  return array.from_table(t)
+end
+
+-- two views on n elements of one array: aligned & 8 bytes off
+local function operands(n)
+  local a = zeros(n + 1):fill(1.5)
+  return a:view(1, n), a:view(2, n)
+end
+
+local function nsper(n, f)
+  local reps = math.max(1, WORK // n)
+  f()                                   -- warm up caches & page tables
+  local t0 = os.clock()
+  for _ = 1, reps do f() end
+  return (os.clock() - t0) * 1e9 / (reps * n)
+end
+
+local kernels = {
+  {"add", function (x, y, r) return function () x:add(y, r) end end},
+  {"fma", function (x, y, r) return function () x:fma(y, r, r) end end},
+  {"sum", function (x)       return function () x:sum() end end},
+  {"dot", function (x, y)    return function () x:dot(y) end end},
+}
+
+print(string.format("%-6s %9s %12s %12s %8s", "kernel", "n",
+                    "aligned", "offset 8", "ratio"))
+for _, n in ipairs({1024, 32 * 1024, 512 * 1024}) do
+  local x, xo = operands(n)
+  local y, yo = operands(n)
+  local r, ro = operands(n)
+  for _, k in ipairs(kernels) do
+    local name, make = k[1], k[2]
+    local ta = nsper(n, make(x, y, r))
+    local tu = nsper(n, make(xo, yo, ro))
+    print(string.format("%-6s %9d %9.3f ns %9.3f ns %8.2f", name, n,
+                        ta, tu, tu / ta))
+  end
+end
+print("(ns per element, lower is better)")
+
+-- per-call overhead of the accessors, where the type check of the array
+-- is a good part of the work
+local a = zeros(1024)
+local CALLS = 2^22
+local accessors = {
+  {"a[i]",      function () local s = 0
+                  for i = 1, CALLS do s = s + a[(i & 1023) + 1] end end},
+  {"a[i] = v",  function ()
+                  for i = 1, CALLS do a[(i & 1023) + 1] = 1.5 end end},
+  {"#a",        function () local s = 0
+                  for _ = 1, CALLS do s = s + #a end end},
+  {"a:dtype()", function ()
+                  for _ = 1, CALLS do a:dtype() end end},
+}
+print()
+print(string.format("%-10s %12s", "accessor", "per call"))
+for _, k in ipairs(accessors) do
+  k[2]()
+  local t0 = os.clock()
+  k[2]()
+  print(string.format("%-10s %9.1f ns", k[1], (os.clock() - t0) * 1e9 / CALLS))
+end
+
+-- math functions: vmath.h's polynomials versus the C library's, per element
+local N = 64 * 1024
+local x = zeros(N)
+for i = 1, N do x[i] = (i - N / 2) * 10 / N end    -- -5 .. 5
+local ax, mr = x:abs(), zeros(N)
+local maths = {
+  {"sin",  function () x:sin(mr) end},
+  {"exp",  function () x:exp(mr) end},
+  {"log",  function () ax:log(mr) end},
+  {"sqrt", function () ax:sqrt(mr) end},
+  {"tanh", function () x:tanh(mr) end},
+  {"erf",  function () x:erf(mr) end},
+  {"pow",  function () ax:pow(1.5, mr) end},
+}
+print()
+print(string.format("%-6s %12s %12s %8s", "math", "fast", "strict", "ratio"))
+for _, k in ipairs(maths) do
+  array.mathmode("fast")
+  local tf = nsper(N, k[2])
+  array.mathmode("strict")
+  local ts = nsper(N, k[2])
+  print(string.format("%-6s %9.3f ns %9.3f ns %8.2f", k[1], tf, ts, ts / tf))
+end
+array.mathmode("fast")
+
+-- random fills versus math.random in a Lua loop
+local R = 256 * 1024
+local ra = zeros(R)
+local fills = {
+  {"math.random", function () for i = 1, R do ra[i] = math.random() end end},
+  {"uniform",     function () ra:random_uniform(0, 1, 1) end},
+  {"normal",      function () ra:random_normal(0, 1, 1) end},
+  {"shuffle",     function () ra:shuffle(1) end},
+}
+print()
+print(string.format("%-12s %12s", "fill", "per element"))
+for _, k in ipairs(fills) do
+  print(string.format("%-12s %9.3f ns", k[1], nsper(R, k[2])))
+end
+
+-- parse_csv versus splitting lines in Lua and tonumber per field
+local lines = {}
+for i = 1, 100000 do
+  lines[i] = string.format("%d,%.6f,%.3e", i, i / 7, i * 1.1e-3)
+end
+local csv = table.concat(lines, "\n") .. "\n"
+local parsers = {
+  {"Lua loop",  function ()
+                  local n = #lines
+                  local c1, c2, c3 = zeros(n), zeros(n), zeros(n)
+                  local i = 0
+                  for x, y, z in csv:gmatch("([^,\n]+),([^,\n]+),([^,\n]+)") do
+                    i = i + 1
+                    c1[i], c2[i], c3[i] = tonumber(x), tonumber(y), tonumber(z)
+                  end
+                end},
+  {"parse_csv", function () array.parse_csv(csv) end},
+}
+print()
+print(string.format("%-10s %12s", "parser", "MB/s"))
+for _, k in ipairs(parsers) do
+  k[2]()
+  local t0 = os.clock()
+  k[2]()
+  print(string.format("%-10s %12.1f", k[1], #csv / 1e6 / (os.clock() - t0)))
+end
+
+-- a:format() versus tostring per element & table.concat
+local fx = zeros(100000):random_uniform(0, 1000, 1)
+local formatters = {
+  {"tostring", function ()
+                 local t = {}
+                 for i = 1, #fx do t[i] = tostring(fx[i]) end
+                 return table.concat(t, "\n")
+               end},
+  {"format",   function () return fx:format("\n") end},
+  {"format 6", function () return fx:format("\n", 6) end},
+}
+print()
+print(string.format("%-10s %12s", "formatter", "per element"))
+for _, k in ipairs(formatters) do
+  print(string.format("%-10s %9.1f ns", k[1], nsper(#fx, k[2])))
+end
@@ -0,0 +1,343 @@
+// file dtoa.h
+// Number formatting for ex04's a:format() and a:write_text().
+//
+// dtoa_shortest(buf, v, single) writes the fewest significant digits that
+// read back (by strtod, or strtof if single) as exactly v.  It runs Grisu3
+// (Loitsch, "Printing Floating-Point Numbers Quickly and Accurately with
+// Integers", 2010): v and the boundaries halfway to its neighbours are
+// scaled by a cached power of ten into 64-bit fixed point, where digits
+// are generated until they lie between the boundaries, keeping track of
+// the rounding errors made so far.  For about 0.5% of doubles Grisu3 can
+// not be sure its digits are the shortest ones & correct, and says so;
+// those take the slow path, snprintf's %.*e with 1, 2, .. 17 digits until
+// the number reads back.  (Ryu needs no slow path, but tables of 128-bit
+// powers of five, where Grisu3 does with 87 powers of ten.)
+//
+// The digits are laid out like %.17g lays them out: without an exponent
+// for exponents -4 .. 16, e.g. 0.001, 1.5 or 1234 (integers without a
+// decimal point), and like 1e+20 or 2.5e-07 otherwise.  Infinities are
+// inf and -inf, NaNs nan.  dtoa_int & dtoa_uint format integers.
+
+#define DTOA_MAX    32              /* longest output, with its NUL */
+#define DTOA_ALPHA  (-60)           /* scaled binary exponents, at least */
+
+typedef struct DtoaFp {
+    uint64_t f;
+    int e;                          /* the number is f * 2^e */
+} DtoaFp;
+
+// 10^k ~ f * 2^e, for k = -348, -340, .. 340, f rounded to 64 bits
+static const struct { uint64_t f; int16_t e, k; } dtoa_powers[] = {
+    {0xfa8fd5a0081c0288ULL, -1220, -348},
+    {0xbaaee17fa23ebf76ULL, -1193, -340},
+    {0x8b16fb203055ac76ULL, -1166, -332},
+    {0xcf42894a5dce35eaULL, -1140, -324},
+    {0x9a6bb0aa55653b2dULL, -1113, -316},
+    {0xe61acf033d1a45dfULL, -1087, -308},
+    {0xab70fe17c79ac6caULL, -1060, -300},
+    {0xff77b1fcbebcdc4fULL, -1034, -292},
+    {0xbe5691ef416bd60cULL, -1007, -284},
+    {0x8dd01fad907ffc3cULL, -980, -276},
+    {0xd3515c2831559a83ULL, -954, -268},
+    {0x9d71ac8fada6c9b5ULL, -927, -260},
+    {0xea9c227723ee8bcbULL, -901, -252},
+    {0xaecc49914078536dULL, -874, -244},
+    {0x823c12795db6ce57ULL, -847, -236},
+    {0xc21094364dfb5637ULL, -821, -228},
+    {0x9096ea6f3848984fULL, -794, -220},
+    {0xd77485cb25823ac7ULL, -768, -212},
+    {0xa086cfcd97bf97f4ULL, -741, -204},
+    {0xef340a98172aace5ULL, -715, -196},
+    {0xb23867fb2a35b28eULL, -688, -188},
+    {0x84c8d4dfd2c63f3bULL, -661, -180},
+    {0xc5dd44271ad3cdbaULL, -635, -172},
+    {0x936b9fcebb25c996ULL, -608, -164},
+    {0xdbac6c247d62a584ULL, -582, -156},
+    {0xa3ab66580d5fdaf6ULL, -555, -148},
+    {0xf3e2f893dec3f126ULL, -529, -140},
+    {0xb5b5ada8aaff80b8ULL, -502, -132},
+    {0x87625f056c7c4a8bULL, -475, -124},
+    {0xc9bcff6034c13053ULL, -449, -116},
+    {0x964e858c91ba2655ULL, -422, -108},
+    {0xdff9772470297ebdULL, -396, -100},
+    {0xa6dfbd9fb8e5b88fULL, -369, -92},
+    {0xf8a95fcf88747d94ULL, -343, -84},
+    {0xb94470938fa89bcfULL, -316, -76},
+    {0x8a08f0f8bf0f156bULL, -289, -68},
+    {0xcdb02555653131b6ULL, -263, -60},
+    {0x993fe2c6d07b7facULL, -236, -52},
+    {0xe45c10c42a2b3b06ULL, -210, -44},
+    {0xaa242499697392d3ULL, -183, -36},
+    {0xfd87b5f28300ca0eULL, -157, -28},
+    {0xbce5086492111aebULL, -130, -20},
+    {0x8cbccc096f5088ccULL, -103, -12},
+    {0xd1b71758e219652cULL, -77, -4},
+    {0x9c40000000000000ULL, -50, 4},
+    {0xe8d4a51000000000ULL, -24, 12},
+    {0xad78ebc5ac620000ULL, 3, 20},
+    {0x813f3978f8940984ULL, 30, 28},
+    {0xc097ce7bc90715b3ULL, 56, 36},
+    {0x8f7e32ce7bea5c70ULL, 83, 44},
+    {0xd5d238a4abe98068ULL, 109, 52},
+    {0x9f4f2726179a2245ULL, 136, 60},
+    {0xed63a231d4c4fb27ULL, 162, 68},
+    {0xb0de65388cc8ada8ULL, 189, 76},
+    {0x83c7088e1aab65dbULL, 216, 84},
+    {0xc45d1df942711d9aULL, 242, 92},
+    {0x924d692ca61be758ULL, 269, 100},
+    {0xda01ee641a708deaULL, 295, 108},
+    {0xa26da3999aef774aULL, 322, 116},
+    {0xf209787bb47d6b85ULL, 348, 124},
+    {0xb454e4a179dd1877ULL, 375, 132},
+    {0x865b86925b9bc5c2ULL, 402, 140},
+    {0xc83553c5c8965d3dULL, 428, 148},
+    {0x952ab45cfa97a0b3ULL, 455, 156},
+    {0xde469fbd99a05fe3ULL, 481, 164},
+    {0xa59bc234db398c25ULL, 508, 172},
+    {0xf6c69a72a3989f5cULL, 534, 180},
+    {0xb7dcbf5354e9beceULL, 561, 188},
+    {0x88fcf317f22241e2ULL, 588, 196},
+    {0xcc20ce9bd35c78a5ULL, 614, 204},
+    {0x98165af37b2153dfULL, 641, 212},
+    {0xe2a0b5dc971f303aULL, 667, 220},
+    {0xa8d9d1535ce3b396ULL, 694, 228},
+    {0xfb9b7cd9a4a7443cULL, 720, 236},
+    {0xbb764c4ca7a44410ULL, 747, 244},
+    {0x8bab8eefb6409c1aULL, 774, 252},
+    {0xd01fef10a657842cULL, 800, 260},
+    {0x9b10a4e5e9913129ULL, 827, 268},
+    {0xe7109bfba19c0c9dULL, 853, 276},
+    {0xac2820d9623bf429ULL, 880, 284},
+    {0x80444b5e7aa7cf85ULL, 907, 292},
+    {0xbf21e44003acdd2dULL, 933, 300},
+    {0x8e679c2f5e44ff8fULL, 960, 308},
+    {0xd433179d9c8cb841ULL, 986, 316},
+    {0x9e19db92b4e31ba9ULL, 1013, 324},
+    {0xeb96bf6ebadf77d9ULL, 1039, 332},
+    {0xaf87023b9bf0ee6bULL, 1066, 340},
+};
+
+static inline DtoaFp
+dtoa_norm (DtoaFp x)
+{
+    int s = __builtin_clzll(x.f);
+    x.f <<= s;
+    x.e -= s;
+    return x;
+}
+
+static inline DtoaFp
+dtoa_mul (DtoaFp x, DtoaFp y)
+{
+    // the upper 64 bits of the product, rounded
+    unsigned __int128 p = (unsigned __int128)x.f * y.f;
+    DtoaFp r = { (uint64_t)(p >> 64) + ((uint64_t)p >> 63), x.e + y.e + 64 };
+    return r;
+}
+
+static int
+dtoa_weed (char *d, int n, uint64_t dist, uint64_t unsafe, uint64_t rest,
+           uint64_t tenk, uint64_t unit)
+{
+    // move the last digit towards the scaled v, which lies dist below the
+    // upper boundary give or take unit; 0 if the result can't be trusted
+    uint64_t small = dist - unit, big = dist + unit;
+    while (rest < small && unsafe - rest >= tenk
+           && (rest + tenk < small || small - rest >= rest + tenk - small)) {
+        d[n - 1]--;
+        rest += tenk;
+    }
+    if (rest < big && unsafe - rest >= tenk
+        && (rest + tenk < big || big - rest > rest + tenk - big))
+        return 0;
+    return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+static int
+dtoa_digits (DtoaFp lo, DtoaFp w, DtoaFp hi, char *d, int *n, int *kappa)
+{
+    // digits of a number in (lo, hi), as close to w as they can be; the
+    // boundaries are widened by one unit (their error), which makes the
+    // interval unsafe: digits in it may or may not be in (lo, hi)
+    uint64_t unit = 1, one = (uint64_t)1 << -w.e;
+    uint64_t high = hi.f + unit, unsafe = high - (lo.f - unit);
+    uint32_t ints = (uint32_t)(high >> -w.e), div = 1;
+    uint64_t frac = high & (one - 1), rest;
+
+    *kappa = 1;
+    while (div <= ints / 10) {
+        div *= 10;
+        ++*kappa;
+    }
+    *n = 0;
+    for (; *kappa > 0; div /= 10) {
+        d[(*n)++] = (char)('0' + ints / div);
+        ints %= div;
+        --*kappa;
+        rest = ((uint64_t)ints << -w.e) + frac;
+        if (rest < unsafe)
+            return dtoa_weed(d, *n, high - w.f, unsafe, rest,
+                             (uint64_t)div << -w.e, unit);
+    }
+    for (;;) {
+        frac *= 10;
+        unit *= 10;
+        unsafe *= 10;
+        d[(*n)++] = (char)('0' + (frac >> -w.e));
+        frac &= one - 1;
+        --*kappa;
+        if (frac < unsafe)
+            return dtoa_weed(d, *n, (high - w.f) * unit, unsafe, frac, one,
+                             unit);
+    }
+}
+
+static int
+dtoa_grisu3 (uint64_t f, int e, int lowercloser, char *d, int *n, int *k)
+{
+    // digits d[0 .. n) with d * 10^k == f * 2^e, 0 if unsure
+    DtoaFp w = dtoa_norm((DtoaFp){ f, e });
+    DtoaFp hi = dtoa_norm((DtoaFp){ (f << 1) + 1, e - 1 });
+    DtoaFp lo = lowercloser ? (DtoaFp){ (f << 2) - 1, e - 2 }
+                            : (DtoaFp){ (f << 1) - 1, e - 1 };
+    DtoaFp c;
+    int dk = (int)ceil((DTOA_ALPHA - (w.e + 64) + 63) * 0.30102999566398114);
+    int i = (348 + dk - 1) / 8 + 1, kappa, ok;
+
+    lo.f <<= lo.e - hi.e;
+    lo.e = hi.e;
+    c = (DtoaFp){ dtoa_powers[i].f, dtoa_powers[i].e };
+    ok = dtoa_digits(dtoa_mul(lo, c), dtoa_mul(w, c), dtoa_mul(hi, c), d, n,
+                     &kappa);
+    *k = kappa - dtoa_powers[i].k;
+    return ok;
+}
+
+static int
+dtoa_slow (double v, int single, char *d, int *n, int *k)
+{
+    // the first of %.0e, %.1e, .. that reads back as v
+    char s[DTOA_MAX], *p;
+    int prec;
+    for (prec = 0; prec < 16; prec++) {
+        snprintf(s, sizeof(s), "%.*e", prec, v);
+        if (single ? strtof(s, NULL) == (float)v : strtod(s, NULL) == v)
+            break;
+    }
+    if (prec == 16)
+        snprintf(s, sizeof(s), "%.*e", prec, v);
+    for (*n = 0, p = s + (*s == '-'); *p != 'e'; p++)
+        if (*p != '.')
+            d[(*n)++] = *p;
+    *k = atoi(p + 1) - prec;
+    return 1;
+}
+
+static int
+dtoa_layout (char *buf, int neg, char *d, int n, int k)
+{
+    // d[0 .. n) * 10^k as %.17g would write it
+    char *p = buf;
+    int x, i;
+    while (n > 1 && d[n - 1] == '0')
+        n--, k++;
+    x = n + k - 1;                      // exponent of the first digit
+    if (neg)
+        *p++ = '-';
+    if (x < -4 || x >= 17) {
+        *p++ = d[0];
+        if (n > 1) {
+            *p++ = '.';
+            memcpy(p, d + 1, (size_t)n - 1);
+            p += n - 1;
+        }
+        *p++ = 'e';
+        *p++ = x < 0 ? '-' : '+';
+        x = x < 0 ? -x : x;
+        if (x >= 100)
+            *p++ = (char)('0' + x / 100);
+        *p++ = (char)('0' + x / 10 % 10);
+        *p++ = (char)('0' + x % 10);
+    } else if (x < 0) {
+        *p++ = '0';
+        *p++ = '.';
+        for (i = -1; i > x; i--)
+            *p++ = '0';
+        memcpy(p, d, (size_t)n);
+        p += n;
+    } else if (k >= 0) {
+        memcpy(p, d, (size_t)n);
+        p += n;
+        for (i = 0; i < k; i++)
+            *p++ = '0';
+    } else {
+        memcpy(p, d, (size_t)x + 1);
+        p += x + 1;
+        *p++ = '.';
+        memcpy(p, d + x + 1, (size_t)(n - x - 1));
+        p += n - x - 1;
+    }
+    *p = '\0';
+    return (int)(p - buf);
+}
+
+static int
+dtoa_shortest (char *buf, double v, int single)
+{
+    // buf gets the shortest digits that read back as v, returns the length
+    char d[24];
+    uint64_t bits, f;
+    int e, n, k, neg, lowercloser;
+
+    if (v != v)
+        return (int)(memcpy(buf, "nan", 4), 3);
+    neg = signbit(v) != 0;
+    if (isinf(v))
+        return (int)(strcpy(buf, neg ? "-inf" : "inf"), 3 + neg);
+    if (v == 0)
+        return (int)(strcpy(buf, neg ? "-0" : "0"), 1 + neg);
+    if (single) {
+        float x = (float)v;
+        uint32_t b;
+        memcpy(&b, &x, sizeof(b));
+        f = b & 0x7fffff;
+        e = (int)(b >> 23 & 0xff);
+        lowercloser = f == 0 && e > 1;
+        f = e ? f | 0x800000 : f;
+        e = (e ? e : 1) - 150;
+    } else {
+        memcpy(&bits, &v, sizeof(bits));
+        f = bits & 0xfffffffffffffULL;
+        e = (int)(bits >> 52 & 0x7ff);
+        lowercloser = f == 0 && e > 1;
+        f = e ? f | 0x10000000000000ULL : f;
+        e = (e ? e : 1) - 1075;
+    }
+    if (!dtoa_grisu3(f, e, lowercloser, d, &n, &k))
+        dtoa_slow(v, single, d, &n, &k);
+    return dtoa_layout(buf, neg, d, n, k);
+}
+
+static int
+dtoa_uint (char *buf, uint64_t u)
+{
+    char t[24];
+    int n = 0, i;
+    do {
+        t[n++] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    for (i = 0; i < n; i++)
+        buf[i] = t[n - 1 - i];
+    buf[n] = '\0';
+    return n;
+}
+
+static int
+dtoa_int (char *buf, int64_t i)
+{
+    if (i >= 0)
+        return dtoa_uint(buf, (uint64_t)i);
+    *buf = '-';
+    return 1 + dtoa_uint(buf + 1, 0 - (uint64_t)i);
+}
@@ -0,0 +1,805 @@
+// file dtypes.h
+// Element types (dtypes) for ex04's NumArray and their kernels.
+//
+// All dtypes are listed once, in DTYPES below, and every kernel is written
+// once as a macro template that gets expanded for each of them.  Where the
+// semantics differ per kind of element (signed, unsigned or floating
+// point), the template pastes the KIND onto a macro name, as in
+// sdiv_##KIND, to pick the right variant.  Likewise, IF_SIMD_##DT(..)
+// only keeps its code for F64, whose kernels get a vectorized main loop
+// (via simd.h) in front of the scalar one.
+//
+// Integer semantics follow Lua's own integers:
+// - get/set are exact: values must fit the dtype, floats must have an
+//   exact integer representation (u64 takes lua_Integer's bit pattern)
+// - add, sub, mul, neg, fma wrap around
+// - div is floor division (like //), division by zero raises an error
+// - sum & dot wrap around in 64 bits, like a Lua loop would
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "simd.h"
+
+//          dtype  C-type    wrap type  kind       name
+#define DTYPES(X)                                                             \
+        X(I8,  int8_t,   uint64_t,  SIGNED,    "i8")                          \
+        X(I16, int16_t,  uint64_t,  SIGNED,    "i16")                         \
+        X(I32, int32_t,  uint64_t,  SIGNED,    "i32")                         \
+        X(I64, int64_t,  uint64_t,  SIGNED,    "i64")                         \
+        X(U8,  uint8_t,  uint64_t,  UNSIGNED,  "u8")                          \
+        X(U16, uint16_t, uint64_t,  UNSIGNED,  "u16")                         \
+        X(U32, uint32_t, uint64_t,  UNSIGNED,  "u32")                         \
+        X(U64, uint64_t, uint64_t,  UNSIGNED,  "u64")                         \
+        X(F32, float,    float,     FLOAT,     "f32")                         \
+        X(F64, double,   double,    FLOAT,     "f64")
+
+#define DT_ENUM(DT, T, WT, KIND, NAME)  DT_##DT,
+#define DT_NAME(DT, T, WT, KIND, NAME)  NAME,
+#define DT_ELEM(DT, T, WT, KIND, NAME)  T DT;
+
+enum { DTYPES(DT_ENUM) NDTYPES };
+enum { KIND_SIGNED, KIND_UNSIGNED, KIND_FLOAT };
+
+// room for a single element of any dtype
+typedef union Elem { DTYPES(DT_ELEM) } Elem;
+
+// result of a reduction, d for floats, i for signed and u for unsigned
+typedef union Acc { double d; int64_t i; uint64_t u; } Acc;
+
+#define ACCF_SIGNED   i
+#define ACCF_UNSIGNED u
+#define ACCF_FLOAT    d
+
+// the vectorized main loop, F64 only
+#define IF_SIMD_I8(...)
+#define IF_SIMD_I16(...)
+#define IF_SIMD_I32(...)
+#define IF_SIMD_I64(...)
+#define IF_SIMD_U8(...)
+#define IF_SIMD_U16(...)
+#define IF_SIMD_U32(...)
+#define IF_SIMD_U64(...)
+#define IF_SIMD_F32(...)
+#define IF_SIMD_F64(...)  __VA_ARGS__
+
+// value conversions, Lua -> element
+
+enum { CONV_OK, CONV_NAN, CONV_NOINT, CONV_RANGE };
+
+#define TOVALUE_SIGNED(DT, T)                                                 \
+static int                                                                    \
+tovalue_##DT (lua_State *L, int idx, void *p)                                 \
+{                                                                             \
+    int isnum;                                                                \
+    lua_Integer v = lua_tointegerx(L, idx, &isnum);                           \
+    if (!isnum)                                                               \
+        return lua_isnumber(L, idx) ? CONV_NOINT : CONV_NAN;                  \
+    if ((lua_Integer)(T)v != v)                                               \
+        return CONV_RANGE;                                                    \
+    *(T *)p = (T)v;                                                           \
+    return CONV_OK;                                                           \
+}
+#define TOVALUE_UNSIGNED TOVALUE_SIGNED
+#define TOVALUE_FLOAT(DT, T)                                                  \
+static int                                                                    \
+tovalue_##DT (lua_State *L, int idx, void *p)                                 \
+{                                                                             \
+    int isnum;                                                                \
+    lua_Number v = lua_tonumberx(L, idx, &isnum);                             \
+    if (!isnum)                                                               \
+        return CONV_NAN;                                                      \
+    *(T *)p = (T)v;                                                           \
+    return CONV_OK;                                                           \
+}
+
+// value conversions, element -> Lua
+
+#define PUSH_SIGNED(DT, T)                                                    \
+static void                                                                   \
+push_##DT (lua_State *L, const void *p)                                       \
+{                                                                             \
+    lua_pushinteger(L, (lua_Integer)*(const T *)p);                           \
+}
+#define PUSH_UNSIGNED PUSH_SIGNED
+#define PUSH_FLOAT(DT, T)                                                     \
+static void                                                                   \
+push_##DT (lua_State *L, const void *p)                                       \
+{                                                                             \
+    lua_pushnumber(L, (lua_Number)*(const T *)p);                             \
+}
+
+static void
+fill_bytes (void *r, const void *v, size_t size, int n)
+{
+    // n copies of the size bytes at v, doubling the filled part each time
+    if (n <= 0) return;
+    memcpy(r, v, size);
+    size_t done = size, total = size * (size_t)n;
+    while (done < total) {
+        size_t chunk = done < total - done ? done : total - done;
+        memcpy((char *)r + done, r, chunk);
+        done += chunk;
+    }
+}
+
+// scalar operations per kind, T the element type, WT its wrap type
+
+static inline int64_t
+ifloordiv (int64_t x, int64_t y)
+{
+    // like Lua's // for integers, y != 0
+    if (y == -1)
+        return (int64_t)(0u - (uint64_t)x);  // avoid INT64_MIN / -1
+    int64_t q = x / y;
+    if ((x % y != 0) && ((x ^ y) < 0))
+        q -= 1;
+    return q;
+}
+
+#define sadd_SIGNED(T, WT, x, y)    ((T)((WT)(x) + (WT)(y)))
+#define sadd_UNSIGNED               sadd_SIGNED
+#define sadd_FLOAT                  sadd_SIGNED
+#define ssub_SIGNED(T, WT, x, y)    ((T)((WT)(x) - (WT)(y)))
+#define ssub_UNSIGNED               ssub_SIGNED
+#define ssub_FLOAT                  ssub_SIGNED
+#define smul_SIGNED(T, WT, x, y)    ((T)((WT)(x) * (WT)(y)))
+#define smul_UNSIGNED               smul_SIGNED
+#define smul_FLOAT                  smul_SIGNED
+#define sdiv_SIGNED(T, WT, x, y)    ((T)ifloordiv((int64_t)(x), (int64_t)(y)))
+#define sdiv_UNSIGNED(T, WT, x, y)  ((T)((x) / (y)))
+#define sdiv_FLOAT                  sdiv_UNSIGNED
+#define smin_SIGNED(T, WT, x, y)    smin(x, y)
+#define smin_UNSIGNED               smin_SIGNED
+#define smin_FLOAT                  smin_SIGNED
+#define smax_SIGNED(T, WT, x, y)    smax(x, y)
+#define smax_UNSIGNED               smax_SIGNED
+#define smax_FLOAT                  smax_SIGNED
+
+#define sneg_SIGNED(T, WT, x)       ((T)(0 - (WT)(x)))
+#define sneg_UNSIGNED               sneg_SIGNED
+#define sneg_FLOAT(T, WT, x)        (-(x))
+#define sabs_SIGNED(T, WT, x)       ((x) < 0 ? (T)(0 - (WT)(x)) : (x))
+#define sabs_UNSIGNED(T, WT, x)     (x)
+#define sabs_FLOAT(T, WT, x)        ((T)fabs(x))
+#define sfma_SIGNED(T, WT, x, y, z) ((T)((WT)(x) * (WT)(y) + (WT)(z)))
+#define sfma_UNSIGNED               sfma_SIGNED
+#define sfma_FLOAT(T, WT, x, y, z)  ((T)sfma(x, y, z))
+
+// elementwise kernels
+// Binary operations come in three shapes: array op array (aa), array op
+// scalar (as) and scalar op array (sa), the scalar given as a pointer to
+// an element of the array's dtype.  Results may overwrite an input.
+
+typedef void (*BinKernel)(void *, const void *, const void *, int);
+
+typedef struct BinOp {
+    BinKernel aa, as, sa;
+} BinOp;
+
+enum { OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MIN, OP_MAX, NBINOPS };
+
+#define BINOP_KERNELS(OP, DT, T, WT, KIND)                                    \
+static void                                                                   \
+OP##_##DT##_aa (void *r_, const void *x_, const void *y_, int n)              \
+{                                                                             \
+    T *r = (T *)r_;                                                           \
+    const T *x = (const T *)x_, *y = (const T *)y_;                           \
+    int i = 0;                                                                \
+    IF_SIMD_##DT(for (; i + VLEN <= n; i += VLEN)                             \
+                   vstore(r + i, v##OP(vload(x + i), vload(y + i)));)         \
+    for (; i < n; i++)                                                        \
+        r[i] = s##OP##_##KIND(T, WT, x[i], y[i]);                             \
+}                                                                             \
+static void                                                                   \
+OP##_##DT##_as (void *r_, const void *x_, const void *y_, int n)              \
+{                                                                             \
+    T *r = (T *)r_;                                                           \
+    const T *x = (const T *)x_, y = *(const T *)y_;                           \
+    int i = 0;                                                                \
+    IF_SIMD_##DT(vdouble vy = vset1(y);                                       \
+                 for (; i + VLEN <= n; i += VLEN)                             \
+                   vstore(r + i, v##OP(vload(x + i), vy));)                   \
+    for (; i < n; i++)                                                        \
+        r[i] = s##OP##_##KIND(T, WT, x[i], y);                                \
+}                                                                             \
+static void                                                                   \
+OP##_##DT##_sa (void *r_, const void *x_, const void *y_, int n)              \
+{                                                                             \
+    T *r = (T *)r_;                                                           \
+    const T x = *(const T *)x_, *y = (const T *)y_;                           \
+    int i = 0;                                                                \
+    IF_SIMD_##DT(vdouble vx = vset1(x);                                       \
+                 for (; i + VLEN <= n; i += VLEN)                             \
+                   vstore(r + i, v##OP(vx, vload(y + i)));)                   \
+    for (; i < n; i++)                                                        \
+        r[i] = s##OP##_##KIND(T, WT, x, y[i]);                                \
+}
+
+#define BINOP_ENTRY(OP, DT) { OP##_##DT##_aa, OP##_##DT##_as, OP##_##DT##_sa }
+
+// r = x*y + z, y and z are arrays (a) or pointers to a scalar (s)
+#define FMA_KERNEL(SHAPE, DT, T, WT, KIND, YV, YS, ZV, ZS)                    \
+static void                                                                   \
+fma_##DT##_##SHAPE (void *r_, const void *x_, const void *y_, const void *z_, \
+                    int n)                                                    \
+{                                                                             \
+    T *r = (T *)r_;                                                           \
+    const T *x = (const T *)x_, *y = (const T *)y_, *z = (const T *)z_;       \
+    int i = 0;                                                                \
+    IF_SIMD_##DT(for (; i + VLEN <= n; i += VLEN)                             \
+                   vstore(r + i, vfma(vload(x + i), YV, ZV));)                \
+    for (; i < n; i++)                                                        \
+        r[i] = sfma_##KIND(T, WT, x[i], YS, ZS);                              \
+}
+
+typedef void (*FmaKernel)(void *, const void *, const void *, const void *,
+                          int);
+typedef void (*UnKernel)(void *, const void *, int);
+typedef void (*ClipKernel)(void *, const void *, const void *, const void *,
+                           int);
+
+#define UNARY_KERNEL(OP, DT, T, WT, KIND, VEXPR)                              \
+static void                                                                   \
+OP##_##DT (void *r_, const void *x_, int n)                                   \
+{                                                                             \
+    T *r = (T *)r_;                                                           \
+    const T *x = (const T *)x_;                                               \
+    int i = 0;                                                                \
+    IF_SIMD_##DT(for (; i + VLEN <= n; i += VLEN)                             \
+                   vstore(r + i, VEXPR(vload(x + i)));)                       \
+    for (; i < n; i++)                                                        \
+        r[i] = s##OP##_##KIND(T, WT, x[i]);                                   \
+}
+
+#define CLIP_KERNEL(DT, T)                                                    \
+static void                                                                   \
+clip_##DT (void *r_, const void *x_, const void *lo_, const void *hi_, int n) \
+{                                                                             \
+    T *r = (T *)r_;                                                           \
+    const T *x = (const T *)x_, lo = *(const T *)lo_, hi = *(const T *)hi_;   \
+    int i = 0;                                                                \
+    IF_SIMD_##DT(vdouble vlo = vset1(lo);                                     \
+                 vdouble vhi = vset1(hi);                                     \
+                 for (; i + VLEN <= n; i += VLEN)                             \
+                   vstore(r + i, vmax(vmin(vload(x + i), vhi), vlo));)        \
+    for (; i < n; i++)                                                        \
+        r[i] = smax(smin(x[i], hi), lo);                                      \
+}
+
+// comparisons
+// Compare x op y into a mask: an array of bytes, 1 where the comparison
+// holds and 0 where it does not.  y is an array (aa) or a pointer to a
+// scalar (as), like for the binary operations.  where selects x[i] where
+// mask m[i] is not 0 and y[i] elsewhere, with x & y arrays (a) or scalars
+// (s) in the same four shapes as fma.
+
+enum { CMP_EQ, CMP_NE, CMP_LT, CMP_LE, CMP_GT, CMP_GE, NCMPS };
+
+#define scmp_eq(x, y)  ((x) == (y))
+#define scmp_ne(x, y)  ((x) != (y))
+#define scmp_lt(x, y)  ((x) < (y))
+#define scmp_le(x, y)  ((x) <= (y))
+#define scmp_gt(x, y)  ((x) > (y))
+#define scmp_ge(x, y)  ((x) >= (y))
+
+// the lanes of a vector comparison to bytes r[i] .. r[i+VLEN-1]
+#define CMP_STORE(r, bits)                                                    \
+    do {                                                                      \
+        int b_ = (bits), j_;                                                  \
+        for (j_ = 0; j_ < VLEN; j_++)                                         \
+            (r)[j_] = (uint8_t)(b_ >> j_ & 1);                                \
+    } while (0)
+
+#define CMP_KERNELS(OP, DT, T)                                                \
+static void                                                                   \
+OP##_##DT##_aa (void *r_, const void *x_, const void *y_, int n)              \
+{                                                                             \
+    uint8_t *r = (uint8_t *)r_;                                               \
+    const T *x = (const T *)x_, *y = (const T *)y_;                           \
+    int i = 0;                                                                \
+    IF_SIMD_##DT(for (; i + VLEN <= n; i += VLEN)                             \
+                   CMP_STORE(r + i, v##OP(vload(x + i), vload(y + i)));)      \
+    for (; i < n; i++)                                                        \
+        r[i] = scmp_##OP(x[i], y[i]);                                         \
+}                                                                             \
+static void                                                                   \
+OP##_##DT##_as (void *r_, const void *x_, const void *y_, int n)              \
+{                                                                             \
+    uint8_t *r = (uint8_t *)r_;                                               \
+    const T *x = (const T *)x_, y = *(const T *)y_;                           \
+    int i = 0;                                                                \
+    IF_SIMD_##DT(vdouble vy = vset1(y);                                       \
+                 for (; i + VLEN <= n; i += VLEN)                             \
+                   CMP_STORE(r + i, v##OP(vload(x + i), vy));)                \
+    for (; i < n; i++)                                                        \
+        r[i] = scmp_##OP(x[i], y);                                            \
+}
+
+#define CMP_ENTRY(OP, DT)  { OP##_##DT##_aa, OP##_##DT##_as, NULL }
+
+#define WHERE_KERNEL(SHAPE, DT, T, XS, YS)                                    \
+static void                                                                   \
+where_##DT##_##SHAPE (void *r_, const void *m_, const void *x_,               \
+                      const void *y_, int n)                                  \
+{                                                                             \
+    T *r = (T *)r_;                                                           \
+    const uint8_t *m = (const uint8_t *)m_;                                   \
+    const T *x = (const T *)x_, *y = (const T *)y_;                           \
+    int i;                                                                    \
+    for (i = 0; i < n; i++)                                                   \
+        r[i] = m[i] ? XS : YS;                                                \
+}
+
+// reductions
+// All reduction kernels share the signature f(x, y, c, lo, hi) -> Acc over
+// the range x[lo..hi), with y an optional 2nd array and c an optional
+// constant, so that they can be split across threads.
+//
+// Floating point sums use pairwise summation: blocks of PW_BLOCK elements
+// are summed with 4 independent accumulators (which also keeps the FP
+// adders busy) and block sums are combined recursively in pairs, so the
+// rounding error grows with O(log n) instead of O(n).  Integer elements
+// are converted to double for mean, var & norm.  Integer sums and dot
+// products are exact, modulo 2^64.
+
+#define PW_BLOCK 256   // multiple of 4*VLEN
+
+typedef Acc (*Reducer)(const void *, const void *, double, int, int);
+
+static inline double sq (double x) { return x * x; }
+static inline vdouble vsq (vdouble x) { return vmul(x, x); }
+
+#define SUM_V(i)     vload(x + (i))
+#define SUM_S(i)     ((double)x[i])
+#define DOT_V(i)     vmul(vload(x + (i)), vload(y + (i)))
+#define DOT_S(i)     ((double)x[i] * (double)y[i])
+#define SUMSQ_V(i)   vsq(vload(x + (i)))
+#define SUMSQ_S(i)   sq((double)x[i])
+#define SQDEV_V(i)   vsq(vsub(vload(x + (i)), vc))
+#define SQDEV_S(i)   sq((double)x[i] - c)
+
+#define PAIRWISE_KERNEL(NAME, DT, T, VTERM, STERM)                            \
+static Acc                                                                    \
+NAME##_##DT (const void *x_, const void *y_, double c, int lo, int hi)        \
+{                                                                             \
+    const T *x = (const T *)x_, *y = (const T *)y_;                           \
+    Acc r;                                                                    \
+    (void)y; (void)c;                                                         \
+    if (hi - lo > PW_BLOCK) {                                                 \
+        int mid = lo + ((hi - lo) / 2 / PW_BLOCK) * PW_BLOCK;                 \
+        if (mid == lo) mid = lo + PW_BLOCK;                                   \
+        r.d = NAME##_##DT(x, y, c, lo, mid).d                                 \
+              + NAME##_##DT(x, y, c, mid, hi).d;                              \
+        return r;                                                             \
+    }                                                                         \
+    double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;                            \
+    int i = lo;                                                               \
+    IF_SIMD_##DT(vdouble vc = vset1(c);                                       \
+                 vdouble v0 = vset1(0.0);                                     \
+                 vdouble v1 = v0;                                             \
+                 vdouble v2 = v0;                                             \
+                 vdouble v3 = v0;                                             \
+                 (void)vc;                                                    \
+                 for (; i + 4*VLEN <= hi; i += 4*VLEN) {                      \
+                     v0 = vadd(v0, VTERM(i));                                 \
+                     v1 = vadd(v1, VTERM(i + VLEN));                          \
+                     v2 = vadd(v2, VTERM(i + 2*VLEN));                        \
+                     v3 = vadd(v3, VTERM(i + 3*VLEN));                        \
+                 }                                                            \
+                 s0 = vhsum(vadd(vadd(v0, v1), vadd(v2, v3)));)               \
+    for (; i + 4 <= hi; i += 4) {                                             \
+        s0 += STERM(i);                                                       \
+        s1 += STERM(i + 1);                                                   \
+        s2 += STERM(i + 2);                                                   \
+        s3 += STERM(i + 3);                                                   \
+    }                                                                         \
+    for (; i < hi; i++)                                                       \
+        s0 += STERM(i);                                                       \
+    r.d = (s0 + s1) + (s2 + s3);                                              \
+    return r;                                                                 \
+}
+
+#define INT_KERNEL(NAME, DT, T, TERM)                                         \
+static Acc                                                                    \
+NAME##_##DT (const void *x_, const void *y_, double c, int lo, int hi)        \
+{                                                                             \
+    const T *x = (const T *)x_, *y = (const T *)y_;                           \
+    uint64_t s = 0;                                                           \
+    int i;                                                                    \
+    Acc r;                                                                    \
+    (void)y; (void)c;                                                         \
+    for (i = lo; i < hi; i++)                                                 \
+        s += TERM(i);                                                         \
+    r.u = s;                                                                  \
+    return r;                                                                 \
+}
+
+#define ISUM_T(i)    ((uint64_t)x[i])
+#define IDOT_T(i)    ((uint64_t)x[i] * (uint64_t)y[i])
+
+// sum & dot depend on the kind, fsum is a floating point sum for mean
+#define SUMDOT_KERNELS_SIGNED(DT, T)                                          \
+    INT_KERNEL(sum, DT, T, ISUM_T)                                            \
+    INT_KERNEL(dot, DT, T, IDOT_T)                                            \
+    PAIRWISE_KERNEL(fsum, DT, T, SUM_V, SUM_S)
+#define SUMDOT_KERNELS_UNSIGNED SUMDOT_KERNELS_SIGNED
+#define SUMDOT_KERNELS_FLOAT(DT, T)                                           \
+    PAIRWISE_KERNEL(sum, DT, T, SUM_V, SUM_S)                                 \
+    PAIRWISE_KERNEL(dot, DT, T, DOT_V, DOT_S)
+
+#define FSUM_SIGNED(DT)    fsum_##DT
+#define FSUM_UNSIGNED(DT)  fsum_##DT
+#define FSUM_FLOAT(DT)     sum_##DT
+
+// the extremes of each kind, the initial values for min & max
+#define TMAX_SIGNED(T)     ((T)(((uint64_t)1 << (8*sizeof(T) - 1)) - 1))
+#define TMIN_SIGNED(T)     ((T)(-TMAX_SIGNED(T) - 1))
+#define TMAX_UNSIGNED(T)   ((T)~(T)0)
+#define TMIN_UNSIGNED(T)   ((T)0)
+#define TMAX_FLOAT(T)      ((T)HUGE_VAL)
+#define TMIN_FLOAT(T)      ((T)-HUGE_VAL)
+
+// min/max skip NaNs: smin(x, m) yields m whenever x is NaN.  An array of
+// only NaNs reduces to +/-HUGE_VAL, which findfirst then fails to find.
+#define MINMAX_KERNEL(OP, DT, T, KIND, INIT, HOP)                             \
+static Acc                                                                    \
+OP##_##DT (const void *x_, const void *y_, double c, int lo, int hi)          \
+{                                                                             \
+    const T *x = (const T *)x_;                                               \
+    T m = INIT(T);                                                            \
+    int i = lo;                                                               \
+    Acc r;                                                                    \
+    (void)y_; (void)c;                                                        \
+    IF_SIMD_##DT(vdouble m0 = vset1(m);                                       \
+                 vdouble m1 = m0;                                             \
+                 for (; i + 2*VLEN <= hi; i += 2*VLEN) {                      \
+                     m0 = v##OP(vload(x + i), m0);                            \
+                     m1 = v##OP(vload(x + i + VLEN), m1);                     \
+                 }                                                            \
+                 m = HOP(v##OP(m0, m1));)                                     \
+    for (; i < hi; i++)                                                       \
+        m = s##OP(x[i], m);                                                   \
+    r.ACCF_##KIND = m;                                                        \
+    return r;                                                                 \
+}
+
+#define FINDFIRST_KERNEL(DT, T, KIND)                                         \
+static int                                                                    \
+findfirst_##DT (const void *x_, int n, Acc v)                                 \
+{                                                                             \
+    /* 0-based index of the first element equal to v, -1 if none */          \
+    const T *x = (const T *)x_, t = (T)v.ACCF_##KIND;                         \
+    int i;                                                                    \
+    for (i = 0; i < n; i++)                                                   \
+        if (x[i] == t) return i;                                              \
+    return -1;                                                                \
+}
+
+// r[ix[i]] += x[i] for i = 0 .. n-1, in that order, with 0-based indices
+// that are known to be in range and steps in bytes (0 repeats a single x).
+// Prefetches the target GATHER_AHEAD indices on, random accesses into a
+// large r spend most of their time waiting for memory otherwise.
+
+#define GATHER_AHEAD 16
+
+#define SCATTERADD_KERNEL(DT, T, WT, KIND)                                    \
+static void                                                                   \
+scatteradd_##DT (void *r_, ptrdiff_t rstep, const int64_t *ix,                \
+                 const void *x_, ptrdiff_t xstep, int n)                      \
+{                                                                             \
+    char *r = (char *)r_;                                                     \
+    const char *x = (const char *)x_;                                         \
+    int i;                                                                    \
+    for (i = 0; i < n; i++, x += xstep) {                                     \
+        T *p = (T *)(r + ix[i] * rstep);                                      \
+        if (i + GATHER_AHEAD < n)                                             \
+            __builtin_prefetch(r + ix[i + GATHER_AHEAD] * rstep, 1);          \
+        *p = sadd_##KIND(T, WT, *p, *(const T *)x);                           \
+    }                                                                         \
+}
+
+// sort keys: unsigned 64-bit integers that order like the elements do, so
+// one radix sort (sort.h) handles all dtypes.  Signed integers get their
+// sign bit flipped, floats go via double: positive ones get the sign bit
+// set, negative ones get all bits flipped.  NaNs get the largest key
+// (or the smallest, with KEY_NANFIRST).  Keys of floats convert back to
+// the same values, except for the NaN payloads.
+
+#define KEY_NANFIRST  0x1   // NaNs sort before everything else
+#define KEY_ZERO      0x2   // -0.0 gets the key of 0.0, for a stable order
+
+#define KEYSIGN(T)    ((uint64_t)1 << (8 * sizeof(T) - 1))
+#define KEYMASK(T)    (KEYSIGN(T) | (KEYSIGN(T) - 1))
+
+static inline uint64_t
+fkey (double v, int flags)
+{
+    uint64_t b;
+    if (v != v)
+        return flags & KEY_NANFIRST ? 0 : ~(uint64_t)0;
+    if (v == 0 && (flags & KEY_ZERO))
+        v = 0.0;
+    memcpy(&b, &v, sizeof(b));
+    return b >> 63 ? ~b : b | (uint64_t)1 << 63;
+}
+
+static inline double
+fromfkey (uint64_t k)
+{
+    uint64_t b = k >> 63 ? k ^ (uint64_t)1 << 63 : ~k;
+    double v;
+    memcpy(&v, &b, sizeof(v));
+    return v;
+}
+
+#define tokey_SIGNED(T, v, flags)    (((uint64_t)(int64_t)(v) & KEYMASK(T))  \
+                                      ^ KEYSIGN(T))
+#define tokey_UNSIGNED(T, v, flags)  ((uint64_t)(v))
+#define tokey_FLOAT(T, v, flags)     fkey((double)(v), flags)
+#define fromkey_SIGNED(T, k)         ((T)((k) ^ KEYSIGN(T)))
+#define fromkey_UNSIGNED(T, k)       ((T)(k))
+#define fromkey_FLOAT(T, k)          ((T)fromfkey(k))
+
+#define KEY_KERNELS(DT, T, KIND)                                              \
+static void                                                                   \
+tokeys_##DT (uint64_t *k, const void *x, ptrdiff_t step, const int *ix,      \
+             int n, int flags)                                                \
+{                                                                             \
+    /* keys of elements 0 .. n-1, or ix[0] .. ix[n-1], step bytes apart */    \
+    int i;                                                                    \
+    (void)flags;  /* only used by floats */                                   \
+    for (i = 0; i < n; i++) {                                                 \
+        T v = *(const T *)((const char *)x + (ix ? ix[i] : i) * step);        \
+        k[i] = tokey_##KIND(T, v, flags);                                     \
+    }                                                                         \
+}                                                                             \
+static void                                                                   \
+fromkeys_##DT (void *x, ptrdiff_t step, const uint64_t *k, int n)             \
+{                                                                             \
+    int i;                                                                    \
+    for (i = 0; i < n; i++)                                                   \
+        *(T *)((char *)x + i * step) = fromkey_##KIND(T, k[i]);               \
+}
+
+// searches in sorted arrays, sorted like a:sort() does (NaNs last).  For
+// each query v, out gets the number of elements < v (left) or <= v
+// (right), found by a branch-free binary search: the only branch depends
+// on the loop count, the comparisons become conditional moves.  The
+// Eytzinger version searches a copy of the elements in breadth-first
+// order (see buildindex in ex04.c), where the 8 or more nodes of the
+// next levels share one cache line and can be prefetched.  It steps
+// EYTZ_LANES queries in lock-step, so their cache misses overlap.
+
+#define lt_SIGNED(x, y)     ((x) < (y))
+#define lt_UNSIGNED(x, y)   ((x) < (y))
+#define lt_FLOAT(x, y)      ((x) < (y) || ((y) != (y) && (x) == (x)))
+
+// go right past e?  left: e < v, right: e <= v
+#define GOES(KIND, e, v, right)                                               \
+        (lt_##KIND(e, v) | ((right) & !lt_##KIND(v, e)))
+
+#define EYTZ_LANES 8
+
+#define SEARCH_KERNELS(DT, T, KIND)                                           \
+static void                                                                   \
+search_##DT (const void *a, ptrdiff_t step, int n, const void *q,             \
+             ptrdiff_t qstep, int m, int right, int *out)                     \
+{                                                                             \
+    int i;                                                                    \
+    for (i = 0; i < m; i++) {                                                 \
+        T v = *(const T *)((const char *)q + i * qstep);                      \
+        const char *base = (const char *)a;                                   \
+        int len = n;                                                          \
+        if (n == 0) {                                                         \
+            out[i] = 0;                                                       \
+            continue;                                                         \
+        }                                                                     \
+        while (len > 1) {                                                     \
+            int half = len / 2;                                               \
+            T e = *(const T *)(base + half * step);                           \
+            base = GOES(KIND, e, v, right) ? base + half * step : base;       \
+            len -= half;                                                      \
+        }                                                                     \
+        out[i] = (int)((base - (const char *)a) / step)                       \
+                 + GOES(KIND, *(const T *)base, v, right);                    \
+    }                                                                         \
+}                                                                             \
+static void                                                                   \
+eytzsearch_##DT (const void *b_, const int *rank, int n, const void *q,       \
+                 ptrdiff_t qstep, int m, int right, int *out)                 \
+{                                                                             \
+    /* b_[1..n] holds the nodes, b_[0] is a dummy, rank the sorted index */   \
+    const T *b = (const T *)b_;                                               \
+    uint64_t k[EYTZ_LANES];                                                   \
+    T v[EYTZ_LANES];                                                          \
+    int levels = 0, i, g, l;                                                  \
+    while ((n >> levels) > 0)                                                 \
+        levels++;                                                             \
+    for (i = 0; i < m; i += EYTZ_LANES) {                                     \
+        int w = m - i < EYTZ_LANES ? m - i : EYTZ_LANES;                      \
+        for (g = 0; g < w; g++) {                                             \
+            k[g] = 1;                                                         \
+            v[g] = *(const T *)((const char *)q + (i + g) * qstep);           \
+        }                                                                     \
+        for (l = 0; l < levels; l++)                                          \
+            for (g = 0; g < w; g++) {                                         \
+                uint64_t kk = k[g];                                           \
+                int in = kk <= (uint64_t)n;                                   \
+                T e = b[in ? kk : 0];                                         \
+                /* the line with k's descendants a few levels down */         \
+                __builtin_prefetch((const char *)b + kk * 64);                \
+                k[g] = in ? 2 * kk + GOES(KIND, e, v[g], right) : kk;         \
+            }                                                                 \
+        for (g = 0; g < w; g++) {                                             \
+            /* undo the right turns after the last left one */               \
+            uint64_t kk = k[g] >> __builtin_ffsll((long long)~k[g]);          \
+            out[i + g] = kk ? rank[kk] : n;                                   \
+        }                                                                     \
+    }                                                                         \
+}
+
+// scans
+// r[i] = x[0] op x[1] op .. op x[i], strided (steps in bytes) and starting
+// from *carry when given, so a scan can be split into chunks.  add & mul
+// wrap around like their elementwise versions; min & max skip NaNs (which
+// only show up front, before the first number).
+
+typedef void (*ScanKernel)(void *, ptrdiff_t, const void *, ptrdiff_t, int,
+                           const void *);
+
+enum { SCAN_ADD, SCAN_MUL, SCAN_MIN, SCAN_MAX, NSCANS };
+
+#define SCAN_add(T, WT, KIND, a, v)  sadd_##KIND(T, WT, a, v)
+#define SCAN_mul(T, WT, KIND, a, v)  smul_##KIND(T, WT, a, v)
+#define SCAN_min(T, WT, KIND, a, v)  ((v) < (a) || (a) != (a) ? (v) : (a))
+#define SCAN_max(T, WT, KIND, a, v)  ((v) > (a) || (a) != (a) ? (v) : (a))
+
+#define SCAN_KERNEL(OP, DT, T, WT, KIND)                                      \
+static void                                                                   \
+scan##OP##_##DT (void *r_, ptrdiff_t rstep, const void *x_, ptrdiff_t xstep,  \
+                 int n, const void *carry)                                    \
+{                                                                             \
+    char *r = (char *)r_;                                                     \
+    const char *x = (const char *)x_;                                         \
+    T acc;                                                                    \
+    int i;                                                                    \
+    if (n <= 0) return;                                                       \
+    acc = *(const T *)x;                                                      \
+    if (carry)                                                                \
+        acc = SCAN_##OP(T, WT, KIND, *(const T *)carry, acc);                 \
+    *(T *)r = acc;                                                            \
+    for (i = 1; i < n; i++) {                                                 \
+        x += xstep; r += rstep;                                               \
+        acc = SCAN_##OP(T, WT, KIND, acc, *(const T *)x);                     \
+        *(T *)r = acc;                                                        \
+    }                                                                         \
+}
+
+#define SCAN_ENTRY(DT)                                                        \
+    { scanadd_##DT, scanmul_##DT, scanmin_##DT, scanmax_##DT }
+
+// conversion to & from blocks of doubles, for array.eval's formulas; only
+// floats convert back, integers would need a rounding & range policy
+
+#define TODOUBLE_KERNEL(DT, T)                                                \
+static void                                                                   \
+todouble_##DT (double *r, const void *x_, ptrdiff_t step, int n)              \
+{                                                                             \
+    /* r[i] = x[i], with step the distance between elements in bytes */      \
+    const char *x = (const char *)x_;                                         \
+    int i;                                                                    \
+    for (i = 0; i < n; i++, x += step)                                        \
+        r[i] = (double)*(const T *)x;                                         \
+}
+
+#define FROMDOUBLE_KERNEL_SIGNED(DT, T)
+#define FROMDOUBLE_KERNEL_UNSIGNED(DT, T)
+#define FROMDOUBLE_KERNEL_FLOAT(DT, T)                                        \
+static void                                                                   \
+fromdouble_##DT (void *r_, ptrdiff_t step, const double *x, int n)            \
+{                                                                             \
+    char *r = (char *)r_;                                                     \
+    int i;                                                                    \
+    for (i = 0; i < n; i++, r += step)                                        \
+        *(T *)r = (T)x[i];                                                    \
+}
+
+#define FROMDOUBLE_SIGNED(DT)    NULL
+#define FROMDOUBLE_UNSIGNED(DT)  NULL
+#define FROMDOUBLE_FLOAT(DT)     fromdouble_##DT
+
+// all kernels for a single dtype
+
+#define DTYPE_KERNELS(DT, T, WT, KIND, NAME)                                  \
+    TOVALUE_##KIND(DT, T)                                                     \
+    PUSH_##KIND(DT, T)                                                        \
+    BINOP_KERNELS(add, DT, T, WT, KIND)                                       \
+    BINOP_KERNELS(sub, DT, T, WT, KIND)                                       \
+    BINOP_KERNELS(mul, DT, T, WT, KIND)                                       \
+    BINOP_KERNELS(div, DT, T, WT, KIND)                                       \
+    BINOP_KERNELS(min, DT, T, WT, KIND)                                       \
+    BINOP_KERNELS(max, DT, T, WT, KIND)                                       \
+    FMA_KERNEL(aa, DT, T, WT, KIND, vload(y + i), y[i], vload(z + i), z[i])   \
+    FMA_KERNEL(as, DT, T, WT, KIND, vload(y + i), y[i], vset1(*z), *z)        \
+    FMA_KERNEL(sa, DT, T, WT, KIND, vset1(*y), *y, vload(z + i), z[i])        \
+    FMA_KERNEL(ss, DT, T, WT, KIND, vset1(*y), *y, vset1(*z), *z)             \
+    UNARY_KERNEL(neg, DT, T, WT, KIND, vneg)                                  \
+    UNARY_KERNEL(abs, DT, T, WT, KIND, vabs)                                  \
+    CLIP_KERNEL(DT, T)                                                        \
+    CMP_KERNELS(eq, DT, T)                                                    \
+    CMP_KERNELS(ne, DT, T)                                                    \
+    CMP_KERNELS(lt, DT, T)                                                    \
+    CMP_KERNELS(le, DT, T)                                                    \
+    CMP_KERNELS(gt, DT, T)                                                    \
+    CMP_KERNELS(ge, DT, T)                                                    \
+    WHERE_KERNEL(aa, DT, T, x[i], y[i])                                       \
+    WHERE_KERNEL(as, DT, T, x[i], *y)                                         \
+    WHERE_KERNEL(sa, DT, T, *x, y[i])                                         \
+    WHERE_KERNEL(ss, DT, T, *x, *y)                                           \
+    SUMDOT_KERNELS_##KIND(DT, T)                                              \
+    PAIRWISE_KERNEL(sumsq, DT, T, SUMSQ_V, SUMSQ_S)                           \
+    PAIRWISE_KERNEL(sqdev, DT, T, SQDEV_V, SQDEV_S)                           \
+    MINMAX_KERNEL(min, DT, T, KIND, TMAX_##KIND, vhmin)                       \
+    MINMAX_KERNEL(max, DT, T, KIND, TMIN_##KIND, vhmax)                       \
+    FINDFIRST_KERNEL(DT, T, KIND)                                             \
+    SCATTERADD_KERNEL(DT, T, WT, KIND)                                        \
+    KEY_KERNELS(DT, T, KIND)                                                  \
+    SEARCH_KERNELS(DT, T, KIND)                                               \
+    SCAN_KERNEL(add, DT, T, WT, KIND)                                         \
+    SCAN_KERNEL(mul, DT, T, WT, KIND)                                         \
+    SCAN_KERNEL(min, DT, T, WT, KIND)                                         \
+    SCAN_KERNEL(max, DT, T, WT, KIND)                                         \
+    TODOUBLE_KERNEL(DT, T)                                                    \
+    FROMDOUBLE_KERNEL_##KIND(DT, T)
+
+DTYPES(DTYPE_KERNELS)
+
+// the dtype table, indexed by DT_xxx
+
+typedef struct DType {
+    const char *name;
+    int kind;                   // KIND_xxx
+    size_t size;                // bytes per element
+    int (*tovalue)(lua_State *, int, void *);
+    void (*push)(lua_State *, const void *);
+    BinOp binop[NBINOPS];       // indexed by OP_xxx
+    FmaKernel fma[4];           // aa, as, sa, ss
+    UnKernel neg, abs;
+    ClipKernel clip;
+    BinOp cmp[NCMPS];           // indexed by CMP_xxx, no sa kernels
+    FmaKernel where[4];         // aa, as, sa, ss
+    Reducer sum, dot, fsum, sumsq, sqdev, min, max;
+    int (*findfirst)(const void *, int, Acc);
+    void (*scatteradd)(void *, ptrdiff_t, const int64_t *, const void *,
+                       ptrdiff_t, int);
+    void (*tokeys)(uint64_t *, const void *, ptrdiff_t, const int *, int, int);
+    void (*fromkeys)(void *, ptrdiff_t, const uint64_t *, int);
+    void (*search)(const void *, ptrdiff_t, int, const void *, ptrdiff_t,
+                   int, int, int *);
+    void (*eytzsearch)(const void *, const int *, int, const void *,
+                       ptrdiff_t, int, int, int *);
+    ScanKernel scan[NSCANS];    // indexed by SCAN_xxx
+    void (*todouble)(double *, const void *, ptrdiff_t, int);
+    void (*fromdouble)(void *, ptrdiff_t, const double *, int);  // or NULL
+} DType;
+
+#define DTYPE_ENTRY(DT, T, WT, KIND, NAME)                                    \
+    { NAME, KIND_##KIND, sizeof(T), tovalue_##DT, push_##DT,                  \
+      { BINOP_ENTRY(add, DT), BINOP_ENTRY(sub, DT), BINOP_ENTRY(mul, DT),     \
+        BINOP_ENTRY(div, DT), BINOP_ENTRY(min, DT), BINOP_ENTRY(max, DT) },   \
+      { fma_##DT##_aa, fma_##DT##_as, fma_##DT##_sa, fma_##DT##_ss },         \
+      neg_##DT, abs_##DT, clip_##DT,                                          \
+      { CMP_ENTRY(eq, DT), CMP_ENTRY(ne, DT), CMP_ENTRY(lt, DT),              \
+        CMP_ENTRY(le, DT), CMP_ENTRY(gt, DT), CMP_ENTRY(ge, DT) },            \
+      { where_##DT##_aa, where_##DT##_as, where_##DT##_sa, where_##DT##_ss }, \
+      sum_##DT, dot_##DT, FSUM_##KIND(DT), sumsq_##DT, sqdev_##DT,            \
+      min_##DT, max_##DT, findfirst_##DT, scatteradd_##DT,                    \
+      tokeys_##DT, fromkeys_##DT,                                             \
+      search_##DT, eytzsearch_##DT, SCAN_ENTRY(DT), todouble_##DT,            \
+      FROMDOUBLE_##KIND(DT) },
+
+static const DType dtypes[NDTYPES] = { DTYPES(DTYPE_ENTRY) };
+
+static const char *const dtypenames[NDTYPES + 1] = { DTYPES(DT_NAME) NULL };
@@ -20,6 +20,7 @@ c_swap (lua_State *L)
     return 2;
 }
 
+// one number per call; ex04's a:sin() (vmath.h) does whole arrays
 static int
 c_sin (lua_State *L)
 {
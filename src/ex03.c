@@ -5,6 +5,7 @@
 #include "lualib.h"
 #include "lauxlib.h"
 #include <stdio.h>
+#include "udata.h"
 
 /* https://www.lua.org/pil/28.2.html
 * -------------------------------------------------------------------------
@@ -26,7 +27,7 @@ typedef struct NumArray {
 static NumArray *
 checkarray (lua_State *L)
 {
-    void *ud = luaL_checkudata(L, 1, "ex03.array");
+    void *ud = udata_check(L, 1, 1, "ex03.array");  // M is upvalue 1
     fprintf(stderr, "hmm ud @ %p\n", ud);
     luaL_argcheck(L, ud != NULL, 1, "`array' expected");
     return (NumArray *)ud;
@@ -55,8 +56,8 @@ newarray (lua_State *L)
   NumArray *a = (NumArray *)lua_newuserdata(L, nbytes);
   // [.., n, {ud}]
 
-  luaL_getmetatable(L, "ex03.array");
-  // [.., n, {ud}, {M}]  gets M via name & pushed onto stack
+  udata_meta(L, 1, "ex03.array");
+  // [.., n, {ud}, {M}]  gets M from upvalue 1 & pushed onto stack
   lua_setmetatable(L, -2);
 
   // [.., n, {ud}], M is now ud's metatable
@@ -126,6 +127,8 @@ int luaopen_ex03 (lua_State *L)
   // In Lua you would do: arr = require("ex03"); and use it: arr.new(..)
   luaL_newmetatable(L, "ex03.array");  // creates, pushes & registers
   lua_newtable(L);                     // [.., {M},{f's}]
-  luaL_newlib(L, funcs);
+  luaL_newlibtable(L, funcs);          // [.., {M},{f's},{}]
+  lua_pushvalue(L, -3);
+  luaL_setfuncs(L, funcs, 1);          // every func gets M as upvalue 1
   return 1;
 }
@@ -5,13 +5,87 @@
 #include "lualib.h"
 #include "lauxlib.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /* https://www.lua.org/pil/28.3.html
 * -------------------------------------------------------------------------
 * Turn array to an object in Lua
 * - only export the new function, the other functions go into the metatable
 *   with new metamethod names like __len, __index, __newindex, etc..
+* - __index hands out methods for non-numeric keys, so a:fill(0) works too
+* - arrays are typed: array.new(n, "i32") holds 32-bit integers, the
+*   default dtype is "f64" (see dtypes.h for the list)
+* - bulk transfers (from_table, to_table, fill, unpack, copy_from) check
+*   their bounds once and move all elements in a single C call
+* - elementwise arithmetic, vectorized via simd.h, comes in three forms:
+*     r = a:add(b)       new array r
+*     r = a:add(b, out)  result into existing array out (r == out)
+*     a:add_(b)          in-place, a is updated & returned
+*   where b is an array of the same size and dtype, or a number.  Operators
+*   +, -, *, / and unary - are available as well, those always create a new
+*   array.  a:min() and a:max() without an operand are reductions.
+* - reductions (sum, mean, min, max, argmin, argmax, dot, norm, var) use
+*   unrolled SIMD loops with pairwise summation
+* - a:sin(), a:exp(), a:log(), a:pow(y) and other math functions compute
+*   whole arrays with the SIMD polynomials of vmath.h (into f64 arrays),
+*   array.mathmode("strict") switches to the C library's functions
+* - a:take(idx), a:put(idx, vals) and a:scatter_add(idx, vals) gather &
+*   scatter through index arrays, checking the indices once per call
+* - a:random_uniform(lo, hi, seed), a:random_normal(mu, sigma, seed),
+*   a:shuffle(seed) & a:sample(k, replace, seed) draw from xoshiro256**
+*   streams (rand.h), one per block of elements, so parallel fills are
+*   reproducible from a seed
+* - a:cumsum(), a:cumprod(), a:cummin(), a:cummax(), a:scan(op) and a:diff()
+*   (two-pass parallel scans for large arrays)
+* - large arrays are split into chunks that run on a work-stealing thread
+*   pool (pool.h), array.threads(n) & array.grain(n) configure it
+* - a:sort(), a:argsort() and array.lexsort({k1, k2, ..}) radix sort the
+*   elements (sort.h), merging sorted runs in parallel for large arrays
+* - a:quantile(q), a:median() and a:partition(k) select instead of sort,
+*   several quantiles or indices in one pass
+* - a:searchsorted(x, side) finds insertion points in a sorted array, for
+*   a number or an array of them; a:build_index() speeds that up
+* - a:digitize(edges), a:bincount(nbins, weights) and a:histogram(lo, hi, n)
+*   bin the elements, counting into private histograms per thread
+* - a:lt(b) and friends compare into masks (u8 arrays of 0/1), which
+*   combine with & | ~ and select with a:compress(m) & array.where(m, x, y)
+* - a:lazy() starts a lazy expression: arithmetic on it builds a tree that
+*   e:eval() or a reduction (e:sum() ..) runs in one fused pass
+* - array.eval("x*2 + sin(y)", {x = a, y = b}) computes a formula over
+*   arrays & numbers in one pass (formula.h); formulas are compiled once,
+*   array.compile(src) returns the compiled formula f, called as f(env)
+* - array.matrix(rows, cols) and a:matrix(rows, cols) are 2D views on f64
+*   elements with row & column strides: m:matmul(n) (blocked GEMM, gemm.h),
+*   m:matvec(x), m:transpose() and row/column reductions like m:sum(dim)
+* - a:view(offset, len) and a:slice(i, j, step) return views: arrays that
+*   share (part of) a's storage rather than copying it.  A view keeps its
+*   parent alive through its uservalue and is accepted by every operation.
+* - array.mmap(path, dtype, mode) maps a file of raw elements into memory,
+*   the result is an ordinary array (so all operations work on it) that
+*   gets unmapped by __gc.  a:advise(hint) & a:sync() wrap madvise/msync.
+* - array.parse_csv(text, opts) & array.read_csv(path, opts) parse delimited
+*   numbers straight into typed column arrays, in parallel for large inputs
+* - a:format(sep, precision) & a:write_text(path, ..) write the elements as
+*   text, floats with the shortest digits that read back exactly (dtoa.h)
+* - a:tobytes(), array.frombytes(s), a:save(path) and array.load(path)
+*   (de)serialize an array as a small header followed by the raw elements
+* - array.growable(dtype, capacity) is an array whose elements live in a
+*   separate buffer that grows geometrically: push, pop, extend, reserve
+*   and shrink_to_fit
+* - the elements of an array start at a 64-byte boundary (ARRAY_ALIGN), so
+*   vector loads never straddle a cache line; see a:alignment()
+* - type checks compare metatables that all functions hold as upvalues
+*   (udata.h), instead of looking them up by name in the registry
 *
 */
 
@@ -19,119 +93,5496 @@
 
 #include "stackdump.h"
 
+// the dtypes and their kernels, generated from one template per kernel
+
+#include "dtypes.h"
+
+// the thread pool that runs large kernels in parallel
+
+#include "pool.h"
+
+// sorting of the keys that dtypes.h derives from the elements
+
+#include "sort.h"
+
+// the compiler for array.eval's formulas
+
+#include "formula.h"
+
+// matrix products & transposes
+
+#include "gemm.h"
+
+// vectorized math functions: sin, exp, log, ..
+
+#include "vmath.h"
+
+// random number generators, independent streams per block of elements
+
+#include "rand.h"
+
+// shortest round-trip formatting of numbers
+
+#include "dtoa.h"
+
+// type checks against the metatables in the upvalues of the library's C
+// functions, which all get the same four
+
+#include "udata.h"
+
+enum { UV_ARRAY = 1, UV_EXPR, UV_MATRIX, UV_FORMULA, NUPVALUES = UV_FORMULA };
+
 // the C-datastructure
 
-typedef struct NumArray {
-  int size;
-  double values[1];  /* variable part */
-} NumArray;
+typedef struct NumArray {
+  int size;
+  int dtype;      /* index into dtypes[] */
+  int stride;     /* distance between elements, 1 unless a strided view */
+  int flags;      /* ARRAY_xxx */
+  void *data;     /* the elements, right after this header unless a view */
+  size_t mapped;  /* bytes mmap'ed at data, if this array owns a mapping */
+  int capacity;   /* elements allocated at data, if growable */
+  int views;      /* number of views on a growable array */
+  struct Index *index;  /* search index, see build_index */
+} NumArray;
+
+#define ARRAY_READONLY  0x1   /* elements may not be modified */
+#define ARRAY_MAPPED    0x2   /* elements live in a file mapping */
+#define ARRAY_GROWABLE  0x4   /* elements live in a buffer that may move */
+#define ARRAY_PINNING   0x8   /* a view that counts in its parent's views */
+
+// Element data starts at an ARRAY_ALIGN boundary: a cache line, and a
+// multiple of the widest vector in simd.h.  Arrays with their elements in
+// the userdatum reserve ARRAY_ALIGN - 1 bytes of padding after the header.
+#define ARRAY_ALIGN 64
+#define ALIGNUP(p)  ((void *)(((uintptr_t)(p) + ARRAY_ALIGN - 1)              \
+                              & ~(uintptr_t)(ARRAY_ALIGN - 1)))
+#define PAYLOAD(a)  ALIGNUP((a) + 1)
+
+#define DTYPE(a)    (&dtypes[(a)->dtype])
+#define STEP(a)     ((ptrdiff_t)(a)->stride * (ptrdiff_t)DTYPE(a)->size)
+#define ELEM(a, i)  ((char *)(a)->data + (ptrdiff_t)(i) * STEP(a))
+#define CONTIGUOUS(a)  ((a)->stride == 1)
+
+static NumArray *
+checkarray (lua_State *L, int arg)
+{
+    // check arg (valid userdatum) & return as ptr to NumArray
+    void *ud = udata_check(L, arg, UV_ARRAY, "ex04.array");
+    luaL_argcheck(L, ud != NULL, arg, "`array' expected");
+
+    return (NumArray *)ud;
+}
+
+static void dropindex (NumArray *a);
+
+static void
+checkwritable (lua_State *L, int arg, NumArray *a)
+{
+    // a is about to be modified, so its search index is outdated
+    luaL_argcheck(L, !(a->flags & ARRAY_READONLY), arg, "array is read-only");
+    dropindex(a);
+}
+
+static void *
+getelem (lua_State *L)
+{
+    // check 2nd argument (valid integer) & return ptr to indexed array elm
+    NumArray *a = checkarray(L, 1);
+    int index = luaL_checkinteger(L, 2);
+
+    luaL_argcheck(L, 1 <= index && index <= a->size, 2,
+            "index out of range");
+
+    /* return element address */
+    return ELEM(a, index - 1);
+}
+
+static const char *
+convmsg (lua_State *L, const DType *dt, int conv)
+{
+    // error message for a failed Lua -> element conversion
+    switch (conv) {
+    case CONV_NOINT: return "number has no integer representation";
+    case CONV_RANGE: return lua_pushfstring(L, "value out of range for %s",
+                                            dt->name);
+    default:         return "number expected";
+    }
+}
+
+static void
+checkvalue (lua_State *L, const DType *dt, int arg, void *p)
+{
+    // convert the Lua value at arg to an element of dtype dt at p
+    int conv = dt->tovalue(L, arg, p);
+    if (conv == CONV_NAN)
+        luaL_checknumber(L, arg);  // raises the usual error
+    else if (conv != CONV_OK)
+        luaL_argerror(L, arg, convmsg(L, dt, conv));
+}
+
+static int
+checkdtype (lua_State *L, int arg)
+{
+    // optional dtype name at arg, defaults to f64
+    return luaL_checkoption(L, arg, "f64", dtypenames);
+}
+
+static NumArray *
+pusharray (lua_State *L, int n, int dtype)
+{
+    // newarray sans the debug output, for functions that return new arrays
+    size_t nbytes = sizeof(NumArray) + ARRAY_ALIGN - 1
+                    + (size_t)n * dtypes[dtype].size;
+    NumArray *a = (NumArray *)lua_newuserdata(L, nbytes);
+    udata_meta(L, UV_ARRAY, "ex04.array");
+    lua_setmetatable(L, -2);
+    a->size = n;
+    a->dtype = dtype;
+    a->stride = 1;
+    a->flags = 0;
+    a->data = PAYLOAD(a);
+    a->mapped = 0;
+    a->capacity = n;
+    a->views = 0;
+    a->index = NULL;
+
+    return a;
+}
+
+static NumArray *
+pushview (lua_State *L, int parent, int first, int n, int step)
+{
+    // push a view on n elements of the array at index parent, starting at
+    // its (0-based) element first and taking every step'th element
+    NumArray *a = checkarray(L, parent);
+    NumArray *v = (NumArray *)lua_newuserdata(L, sizeof(NumArray));
+    udata_meta(L, UV_ARRAY, "ex04.array");
+    lua_setmetatable(L, -2);
+    v->size = n;
+    v->dtype = a->dtype;
+    v->stride = a->stride * step;
+    v->flags = a->flags & ~(ARRAY_GROWABLE | ARRAY_PINNING);
+    v->data = ELEM(a, first);
+    v->mapped = 0;
+    v->capacity = n;
+    v->views = 0;
+    v->index = NULL;
+    if (a->flags & ARRAY_GROWABLE) {
+        // a must not move its elements while v points into them
+        a->views++;
+        v->flags |= ARRAY_PINNING;
+    }
+
+    lua_pushvalue(L, parent);   // [.. v parent]
+    lua_setuservalue(L, -2);    // [.. v], v's uservalue keeps parent alive
+
+    return v;
+}
+
+// the array library
+
+static int
+newarray (lua_State *L)
+{
+    // The elements follow the NumArray header in the same userdatum, so
+    // nbytes == sizeof(NumArray) + n * (size of an element of the dtype)
+    // plus room to align a->data, the first ARRAY_ALIGN boundary past the
+    // header.
+
+
+    int n = luaL_checkinteger(L, 1);
+    int dtype = checkdtype(L, 2);
+    luaL_argcheck(L, n >= 0, 1, "invalid size");
+    printf("newarray\n");
+    stackDump(L, "1");                // [n dtype]
+
+    size_t nbytes = sizeof(NumArray) + ARRAY_ALIGN - 1
+                    + (size_t)n * dtypes[dtype].size;
+    NumArray *a = (NumArray *)lua_newuserdata(L, nbytes);
+    stackDump(L, "2");               // [n, dtype, ud]
+    udata_meta(L, UV_ARRAY, "ex04.array");
+    stackDump(L, "3");              // [n, dtype, ud{}, M{}]
+    printf("Top elm %p\n", lua_touserdata(L,-2));
+    printf("Top elm %p\n", lua_touserdata(L,-1));
+    lua_setmetatable(L, -2);
+    stackDump(L, "4");              // [n, dtype, ud{}]
+    a->size = n;
+    a->dtype = dtype;
+    a->stride = 1;
+    a->flags = 0;
+    a->data = PAYLOAD(a);
+    a->mapped = 0;
+    a->capacity = n;
+    a->views = 0;
+    a->index = NULL;
+
+    return 1;  /* new userdatum is already on the stack */
+}
+
+static int
+setarray (lua_State *L)
+{   // [userdata index value]
+    void *p = getelem(L);
+    checkwritable(L, 1, (NumArray *)lua_touserdata(L, 1));
+    checkvalue(L, DTYPE((NumArray *)lua_touserdata(L, 1)), 3, p);
+
+    return 0;
+}
+
+static int
+getarray (lua_State *L)
+{
+    // [userdata key]
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        // a method name, look it up in the metatable
+        checkarray(L, 1);
+        lua_getmetatable(L, 1);     // [ud name M]
+        lua_rotate(L, 2, 1);        // [ud M name]
+        lua_rawget(L, 2);           // [ud M M[name]]
+        return 1;
+    }
+    void *p = getelem(L);
+    DTYPE((NumArray *)lua_touserdata(L, 1))->push(L, p);
+
+    return 1;
+}
+
+static int
+getsize (lua_State *L)
+{
+  NumArray *a = checkarray(L, 1);
+  lua_pushnumber(L, a->size);
+
+  return 1;
+}
+
+static int
+getdtype (lua_State *L)
+{
+    NumArray *a = checkarray(L, 1);
+    lua_pushstring(L, DTYPE(a)->name);
+    return 1;
+}
+
+// __tostring method
+int
+array2string (lua_State *L)
+{
+    NumArray *a = checkarray(L, 1);
+    lua_pushfstring(L, "array(%d, %s)", a->size, DTYPE(a)->name);
+    return 1;
+}
+
+// strided element access
+// Views may have any stride, so runs of elements are moved with memcpy
+// per element (sizes 1, 2, 4 & 8 are special cased), with step the
+// distance in bytes.  A step of 0 repeats a single element.
+
+#define MOVE_ELEMS(T)                                                         \
+    for (i = 0; i < n; i++)                                                   \
+        *(T *)(d + i * dstep) = *(const T *)(s + i * sstep)
+
+static void
+scatter (void *dst, ptrdiff_t dstep, const void *src, ptrdiff_t sstep,
+         size_t size, int n)
+{
+    char *d = (char *)dst;
+    const char *s = (const char *)src;
+    ptrdiff_t i;
+    switch (size) {
+    case 1: MOVE_ELEMS(uint8_t); break;
+    case 2: MOVE_ELEMS(uint16_t); break;
+    case 4: MOVE_ELEMS(uint32_t); break;
+    case 8: MOVE_ELEMS(uint64_t); break;
+    default:
+        for (i = 0; i < n; i++)
+            memcpy(d + i * dstep, s + i * sstep, size);
+    }
+}
+
+static void
+span (const NumArray *a, int n, const char **lo, const char **hi)
+{
+    // the range of bytes [lo, hi) taken by the first n elements of a
+    const char *first = (const char *)a->data;
+    const char *last = first + (ptrdiff_t)(n > 0 ? n - 1 : 0) * STEP(a);
+    *lo = first < last ? first : last;
+    *hi = (first < last ? last : first) + (n > 0 ? DTYPE(a)->size : 0);
+}
+
+static int
+intersects (const NumArray *a, int na, const NumArray *b, int nb)
+{
+    // do the first na elements of a and the first nb of b share any bytes?
+    const char *alo, *ahi, *blo, *bhi;
+    span(a, na, &alo, &ahi);
+    span(b, nb, &blo, &bhi);
+    return alo < bhi && blo < ahi;
+}
+
+static int
+overlaps (const NumArray *a, const NumArray *b, int n)
+{
+    // do the first n elements of a and b share any bytes?
+    return intersects(a, n, b, n);
+}
+
+static void
+copyelems (lua_State *L, void *dst, ptrdiff_t dstep, const NumArray *src,
+           int n)
+{
+    // copy n elements of src to dst, which may overlap src
+    size_t size = DTYPE(src)->size;
+    if (CONTIGUOUS(src) && dstep == (ptrdiff_t)size) {
+        memmove(dst, src->data, (size_t)n * size);
+        return;
+    }
+    // strided: via a temporary buffer when dst and src overlap
+    NumArray d = *src;
+    d.data = dst;
+    d.stride = (int)(dstep / (ptrdiff_t)size);
+    if (!overlaps(&d, src, n)) {
+        scatter(dst, dstep, src->data, STEP(src), size, n);
+        return;
+    }
+    void *tmp = malloc((size_t)n * size);
+    if (tmp == NULL)
+        luaL_error(L, "not enough memory");
+    scatter(tmp, size, src->data, STEP(src), size, n);
+    scatter(dst, dstep, tmp, size, size, n);
+    free(tmp);
+}
+
+// bulk transfers
+// Each of these checks its arguments and bounds once and then moves all
+// elements in a single C call, rather than paying for the __index or
+// __newindex dispatch (and its arg checks) once per element.
+
+static int
+fromtable (lua_State *L)
+{
+    // [tbl dtype] -> [tbl dtype ud], new array with the values of tbl[1..#tbl]
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int dtype = checkdtype(L, 2);
+    int n = (int)lua_rawlen(L, 1);
+    NumArray *a = pusharray(L, n, dtype);
+    const DType *dt = DTYPE(a);
+    int i;
+
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);               // [tbl dtype ud tbl[i]]
+        int conv = dt->tovalue(L, -1, ELEM(a, i - 1));
+        if (conv != CONV_OK)
+            return luaL_error(L, "table element %d: %s", i,
+                              convmsg(L, dt, conv));
+        lua_pop(L, 1);                      // [tbl dtype ud]
+    }
+
+    return 1;
+}
+
+static int
+totable (lua_State *L)
+{
+    // [ud] -> [ud tbl], a presized sequence with all values
+    NumArray *a = checkarray(L, 1);
+    const DType *dt = DTYPE(a);
+    int i;
+
+    lua_createtable(L, a->size, 0);
+    for (i = 0; i < a->size; i++) {
+        dt->push(L, ELEM(a, i));
+        lua_rawseti(L, -2, i + 1);
+    }
+
+    return 1;
+}
+
+static int
+fill (lua_State *L)
+{
+    // [ud val] -> [ud val ud], returns the array for chaining
+    NumArray *a = checkarray(L, 1);
+    Elem val;
+    checkwritable(L, 1, a);
+
+    checkvalue(L, DTYPE(a), 2, &val);
+    if (CONTIGUOUS(a))
+        fill_bytes(a->data, &val, DTYPE(a)->size, a->size);
+    else
+        scatter(a->data, STEP(a), &val, 0, DTYPE(a)->size, a->size);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int
+unpack (lua_State *L)
+{
+    // [ud i j] -> a[i], .., a[j], like table.unpack
+    NumArray *a = checkarray(L, 1);
+    int i = luaL_optinteger(L, 2, 1);
+    int j = luaL_optinteger(L, 3, a->size);
+    const DType *dt = DTYPE(a);
+
+    int k;
+
+    if (i > j) return 0;  // empty range
+    luaL_argcheck(L, 1 <= i, 2, "index out of range");
+    luaL_argcheck(L, j <= a->size, 3, "index out of range");
+    luaL_checkstack(L, j - i + 1, "too many results to unpack");
+    for (k = i; k <= j; k++)
+        dt->push(L, ELEM(a, k - 1));
+
+    return j - i + 1;
+}
+
+static int
+copyfrom (lua_State *L)
+{
+    // [ud other offset] -> copy all of other into ud, starting at offset
+    NumArray *a = checkarray(L, 1);
+    NumArray *b = checkarray(L, 2);
+    int offset = luaL_optinteger(L, 3, 1);
+
+    checkwritable(L, 1, a);
+    luaL_argcheck(L, a->dtype == b->dtype, 2, "array dtypes differ");
+    luaL_argcheck(L, 1 <= offset && offset - 1 <= a->size - b->size, 3,
+            "index out of range");
+    copyelems(L, ELEM(a, offset - 1), STEP(a), b, b->size);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+// views
+// A view is a NumArray header without elements of its own: data points
+// into the storage of its parent and its stride may be any non-zero
+// number of elements.  Contiguous views (stride 1) go straight into the
+// kernels, strided ones are gathered into blocks first (see elementwise).
+
+static int
+view (lua_State *L)
+{
+    // [ud offset len] -> [.. v], v = a[offset], .., a[offset + len - 1]
+    NumArray *a = checkarray(L, 1);
+    int offset = luaL_optinteger(L, 2, 1);
+    luaL_argcheck(L, 1 <= offset && offset <= a->size + 1, 2,
+            "index out of range");
+    int len = luaL_optinteger(L, 3, a->size - offset + 1);
+    luaL_argcheck(L, 0 <= len && len <= a->size - offset + 1, 3,
+            "length out of range");
+
+    pushview(L, 1, offset - 1, len, 1);
+    return 1;
+}
+
+static int
+slice (lua_State *L)
+{
+    // [ud i j step] -> [.. v], v = a[i], a[i + step], .. up to & including j
+    // like a numeric for-loop, so a:slice(#a, 1, -1) is a reversed view
+    NumArray *a = checkarray(L, 1);
+    lua_Integer step = luaL_optinteger(L, 4, 1);
+    luaL_argcheck(L, step != 0, 4, "step is zero");
+    // the view's stride, a->stride * step, must fit an int (so must -step)
+    luaL_argcheck(L, step >= -INT_MAX && step <= INT_MAX
+                     && (step < 0 ? -step : step)
+                        <= INT_MAX / (a->stride < 0 ? -a->stride : a->stride),
+                  4, "step too large");
+    lua_Integer i = luaL_optinteger(L, 2, step > 0 ? 1 : a->size);
+    lua_Integer j = luaL_optinteger(L, 3, step > 0 ? a->size : 1);
+    // out of range either way, clamped so that nothing below overflows
+    i = i < 0 ? 0 : i > a->size ? a->size + 1 : i;
+    j = j < 0 ? 0 : j > a->size ? a->size + 1 : j;
+    lua_Integer n = step > 0 ? (j >= i ? (j - i) / step + 1 : 0)
+                             : (i >= j ? (i - j) / -step + 1 : 0);
+
+    if (n > 0) {
+        luaL_argcheck(L, 1 <= i && i <= a->size, 2, "index out of range");
+        lua_Integer last = i + (n - 1) * step;
+        luaL_argcheck(L, 1 <= last && last <= a->size, 3,
+                "index out of range");
+    }
+
+    pushview(L, 1, n > 0 ? (int)i - 1 : 0, (int)n, (int)step);
+    return 1;
+}
+
+static int
+copy (lua_State *L)
+{
+    // [ud] -> [ud r], r a new (contiguous) array with a copy of ud's values
+    NumArray *a = checkarray(L, 1);
+    NumArray *r = pusharray(L, a->size, a->dtype);
+    copyelems(L, r->data, STEP(r), a, a->size);
+    return 1;
+}
+
+// growable arrays
+// The header stays in the userdatum, the elements live in an ARRAY_ALIGN
+// aligned buffer that doubles in size when full, so appending is O(1)
+// amortized.  A view points into that buffer, so while a growable array
+// has views, anything that would move its elements raises an error.
+// Views that are garbage but not yet collected still count, so
+// collectgarbage() may be needed after dropping them.
+
+static void
+resize (lua_State *L, NumArray *a, int capacity)
+{
+    // move the elements of growable a to a buffer for capacity elements
+    // (realloc does not keep the alignment, hence allocate, copy & free)
+    size_t size = DTYPE(a)->size;
+    void *p = PAYLOAD(a);
+
+    if (capacity == a->capacity)
+        return;
+    if (a->views > 0)
+        luaL_error(L, "array has views, its elements cannot move");
+    if (capacity > 0 &&
+        posix_memalign(&p, ARRAY_ALIGN, (size_t)capacity * size) != 0)
+        luaL_error(L, "not enough memory");
+    memcpy(p, a->data, (size_t)(a->size < capacity ? a->size : capacity)
+                       * size);
+    if (a->capacity > 0)
+        free(a->data);
+    a->data = p;
+    a->capacity = capacity;
+}
+
+static void
+grow (lua_State *L, NumArray *a, int extra)
+{
+    // make room for extra more elements
+    int need, cap;
+
+    if (extra > INT_MAX - a->size)
+        luaL_error(L, "array too large");
+    need = a->size + extra;
+    if (need <= a->capacity)
+        return;
+    cap = a->capacity < 8 ? 8 : a->capacity;
+    while (cap < need)
+        cap = cap > INT_MAX / 2 ? INT_MAX : 2 * cap;
+    resize(L, a, cap);
+}
+
+static NumArray *
+checkgrowable (lua_State *L, int arg)
+{
+    NumArray *a = checkarray(L, arg);
+    luaL_argcheck(L, a->flags & ARRAY_GROWABLE, arg, "array is not growable");
+    return a;
+}
+
+static int
+growable (lua_State *L)
+{
+    // [dtype capacity] -> [.. ud], an empty array with room for capacity
+    int dtype = checkdtype(L, 1);
+    int capacity = luaL_optinteger(L, 2, 0);
+    luaL_argcheck(L, capacity >= 0, 2, "invalid capacity");
+
+    NumArray *a = pusharray(L, 0, dtype);
+    a->flags = ARRAY_GROWABLE;
+    a->capacity = 0;
+    resize(L, a, capacity);
+
+    return 1;
+}
+
+static int
+push (lua_State *L)
+{
+    // [ud v1 .. vn] -> [.. ud], appends v1 .. vn, all or none of them
+    NumArray *a = checkgrowable(L, 1);
+    int n = lua_gettop(L) - 1;
+    int i;
+    dropindex(a);
+
+    grow(L, a, n);
+    for (i = 0; i < n; i++)
+        checkvalue(L, DTYPE(a), i + 2, ELEM(a, a->size + i));
+    a->size += n;
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int
+pop (lua_State *L)
+{
+    // [ud] -> [.. v], removes & returns the last element, nothing if empty
+    NumArray *a = checkgrowable(L, 1);
+    dropindex(a);
+
+    if (a->size == 0)
+        return 0;
+    a->size--;
+    DTYPE(a)->push(L, ELEM(a, a->size));
+
+    return 1;
+}
+
+static int
+extend (lua_State *L)
+{
+    // [ud other] -> [.. ud], appends all elements of other (may be ud)
+    NumArray *a = checkgrowable(L, 1);
+    NumArray *b = checkarray(L, 2);
+    luaL_argcheck(L, a->dtype == b->dtype, 2, "array dtypes differ");
+    dropindex(a);
+
+    grow(L, a, b->size);
+    copyelems(L, ELEM(a, a->size), STEP(a), b, b->size);
+    a->size += b->size;
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int
+reserve (lua_State *L)
+{
+    // [ud n] -> [.. ud], makes room for at least n elements
+    NumArray *a = checkgrowable(L, 1);
+    int n = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, n >= 0, 2, "invalid capacity");
+
+    if (n > a->capacity)
+        resize(L, a, n);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int
+shrinktofit (lua_State *L)
+{
+    // [ud] -> [.. ud], releases the room not used by elements
+    NumArray *a = checkgrowable(L, 1);
+
+    resize(L, a, a->size);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int
+getcapacity (lua_State *L)
+{
+    NumArray *a = checkarray(L, 1);
+    lua_pushinteger(L, a->capacity);
+    return 1;
+}
+
+static int
+alignment (lua_State *L)
+{
+    // [ud] -> [.. n], the largest power of 2, up to ARRAY_ALIGN, that divides
+    // the address of the first element; less than ARRAY_ALIGN for views
+    // with an offset (and later elements of a strided view may do worse)
+    NumArray *a = checkarray(L, 1);
+    uintptr_t p = (uintptr_t)a->data;
+    uintptr_t n = p & -p;
+    lua_pushinteger(L, n == 0 || n > ARRAY_ALIGN ? ARRAY_ALIGN : n);
+    return 1;
+}
+
+// memory-mapped arrays
+// The elements of a mapped array are the raw bytes of a file, in native
+// byte order, mapped MAP_SHARED so that the page cache is shared with
+// other processes mapping the same file and opening it costs the same
+// regardless of its size.  Modes are like those of io.open:
+// - "r"   read-only, the file must exist
+// - "r+"  read/write, the file must exist
+// - "w+"  read/write, the file is created or truncated to n elements
+
+static int
+mmaparray (lua_State *L)
+{
+    // [path dtype mode n] -> [.. ud] or nil, msg, errno (like io.open)
+    static const char *const modes[] = {"r", "r+", "w+", NULL};
+    const char *path = luaL_checkstring(L, 1);
+    int dtype = checkdtype(L, 2);
+    int mode = luaL_checkoption(L, 3, "r", modes);
+    lua_Integer n = luaL_optinteger(L, 4, -1);
+    size_t size = dtypes[dtype].size;
+    struct stat st;
+
+    luaL_argcheck(L, mode != 2 || (0 <= n && n <= INT_MAX), 4,
+            "number of elements expected");
+
+    // the userdatum comes first, so running out of memory can't leak the
+    // file descriptor or the mapping
+    NumArray *a = pusharray(L, 0, dtype);
+
+    int fd = open(path, mode == 0 ? O_RDONLY
+                      : mode == 1 ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return luaL_fileresult(L, 0, path);
+    if (mode == 2) {
+        if (ftruncate(fd, (off_t)(n * size)) != 0)
+            goto failed;
+    } else {
+        if (fstat(fd, &st) != 0)
+            goto failed;
+        if (st.st_size % size != 0 || st.st_size / size > INT_MAX) {
+            close(fd);
+            lua_pushnil(L);
+            lua_pushfstring(L, "%s: size is not a multiple of %d bytes "
+                            "or too large", path, (int)size);
+            return 2;
+        }
+        n = st.st_size / size;
+    }
+
+    if (n > 0) {
+        int prot = mode == 0 ? PROT_READ : PROT_READ | PROT_WRITE;
+        void *p = mmap(NULL, n * size, prot, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+            goto failed;
+        a->data = p;
+        a->mapped = n * size;
+    }
+    close(fd);
+    a->size = a->capacity = (int)n;
+    a->flags = ARRAY_MAPPED | (mode == 0 ? ARRAY_READONLY : 0);
+
+    return 1;
+
+failed: {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return luaL_fileresult(L, 0, path);
+    }
+}
+
+static NumArray *
+checkmapped (lua_State *L, char **lo, size_t *len)
+{
+    // arg 1 is a mapped array (or a view on one), return the page aligned
+    // range of its elements.  That range is empty for an empty array,
+    // whose data does not point into a mapping (mmaparray maps nothing
+    // for 0 elements), so that its page is never advised or synced.
+    NumArray *a = checkarray(L, 1);
+    const char *first, *last;
+    luaL_argcheck(L, a->flags & ARRAY_MAPPED, 1, "array is not mapped");
+
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    *lo = NULL;
+    *len = 0;
+    if (a->size > 0) {
+        span(a, a->size, &first, &last);
+        *lo = (char *)((uintptr_t)first & ~(page - 1));
+        *len = (size_t)(last - *lo);
+    }
+
+    return a;
+}
+
+static int
+advisearray (lua_State *L)
+{
+    // [ud hint] -> true or nil, msg, errno; madvise for the array's pages
+    static const char *const hints[] = {"normal", "sequential", "random",
+        "willneed", "dontneed", "hugepage", NULL};
+    static const int advice[] = {MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM,
+        MADV_WILLNEED, MADV_DONTNEED,
+#ifdef MADV_HUGEPAGE
+        MADV_HUGEPAGE
+#else
+        MADV_NORMAL
+#endif
+    };
+    char *lo;
+    size_t len;
+    checkmapped(L, &lo, &len);
+    int hint = luaL_checkoption(L, 2, NULL, hints);
+
+    if (len == 0)
+        lua_pushboolean(L, 1);
+    else
+        luaL_fileresult(L, madvise(lo, len, advice[hint]) == 0, NULL);
+    return lua_isnil(L, -1) ? 3 : 1;
+}
+
+static int
+syncarray (lua_State *L)
+{
+    // [ud] -> true or nil, msg, errno; write modified pages to the file
+    char *lo;
+    size_t len;
+    checkmapped(L, &lo, &len);
+
+    if (len == 0)
+        lua_pushboolean(L, 1);
+    else
+        luaL_fileresult(L, msync(lo, len, MS_SYNC) == 0, NULL);
+    return lua_isnil(L, -1) ? 3 : 1;
+}
+
+// __gc garbage collection, release storage outside the userdatum
+static int
+destroy (lua_State *L)
+{
+    NumArray *a = checkarray(L, 1);
+    dropindex(a);
+    if (a->mapped > 0) {
+        munmap(a->data, a->mapped);
+        a->mapped = 0;
+        a->data = PAYLOAD(a);
+        a->size = 0;
+    }
+    if ((a->flags & ARRAY_GROWABLE) && a->capacity > 0) {
+        free(a->data);
+        a->capacity = 0;
+        a->data = PAYLOAD(a);
+        a->size = 0;
+    }
+    if (a->flags & ARRAY_PINNING) {
+        // the parent is still valid, even if it is being collected as well
+        lua_getuservalue(L, 1);
+        ((NumArray *)lua_touserdata(L, -1))->views--;
+    }
+    return 0;
+}
+
+// serialization
+// A serialized array is a 32 byte header followed by the elements, exactly
+// as they are in memory.  The header is written in the byte order of the
+// writer, which is recorded in the header itself, so a reader on a machine
+// with the other byte order swaps the header fields and the elements.
+// The checksum covers the elements as stored.
+
+#define HDR_MAGIC    "NUMA"
+#define HDR_VERSION  1
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_ORDER   'B'
+#else
+#define HOST_ORDER   'L'
+#endif
+
+typedef struct Header {
+  char magic[4];      /* HDR_MAGIC */
+  uint8_t version;    /* HDR_VERSION */
+  uint8_t order;      /* 'L' or 'B' for little or big endian */
+  char dtype[6];      /* dtype name, NUL padded */
+  uint32_t reserved;  /* 0 */
+  uint64_t length;    /* number of elements */
+  uint64_t checksum;  /* of the elements, see checksum() */
+} Header;
+
+#define SWAP_ELEMS(T, BITS)                                                   \
+    for (i = 0; i < n; i++)                                                   \
+        ((T *)p)[i] = __builtin_bswap##BITS(((T *)p)[i])
+
+static void
+swapbytes (void *p, size_t size, size_t n)
+{
+    // reverse the byte order of n elements of size bytes each
+    size_t i;
+    switch (size) {
+    case 2: SWAP_ELEMS(uint16_t, 16); break;
+    case 4: SWAP_ELEMS(uint32_t, 32); break;
+    case 8: SWAP_ELEMS(uint64_t, 64); break;
+    }
+}
+
+static uint64_t
+load64 (const unsigned char *p)
+{
+    // 8 bytes as a little endian word, whatever the host
+    uint64_t w;
+    memcpy(&w, p, 8);
+    return HOST_ORDER == 'L' ? w : __builtin_bswap64(w);
+}
+
+#define ROTL(x, r)  (((x) << (r)) | ((x) >> (64 - (r))))
+#define PRIME1      0x9E3779B185EBCA87ULL
+#define PRIME2      0xC2B2AE3D27D4EB4FULL
+#define MIX(h, w)   (ROTL((h) + (w) * PRIME2, 31) * PRIME1)
+
+static uint64_t
+checksum (const void *p, size_t len)
+{
+    // a multiply-rotate hash in the style of xxHash64, four independent
+    // lanes per 32 bytes so it runs at memory speed.  Not cryptographic,
+    // it only catches truncated or corrupted payloads.
+    const unsigned char *s = p;
+    uint64_t h0 = PRIME1 + PRIME2, h1 = PRIME2, h2 = 0, h3 = -PRIME1;
+    uint64_t h;
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        h0 = MIX(h0, load64(s + i));
+        h1 = MIX(h1, load64(s + i + 8));
+        h2 = MIX(h2, load64(s + i + 16));
+        h3 = MIX(h3, load64(s + i + 24));
+    }
+    h = ROTL(h0, 1) + ROTL(h1, 7) + ROTL(h2, 12) + ROTL(h3, 18) + len;
+    for (; i + 8 <= len; i += 8)
+        h = MIX(h, load64(s + i));
+    if (i < len) {
+        unsigned char tail[8] = {0};
+        memcpy(tail, s + i, len - i);
+        h = MIX(h, load64(tail));
+    }
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    return h;
+}
+
+static void
+makeheader (Header *h, const NumArray *a, const void *payload)
+{
+    memset(h, 0, sizeof(Header));
+    memcpy(h->magic, HDR_MAGIC, 4);
+    h->version = HDR_VERSION;
+    h->order = HOST_ORDER;
+    strncpy(h->dtype, DTYPE(a)->name, sizeof(h->dtype) - 1);
+    h->length = (uint64_t)a->size;
+    h->checksum = checksum(payload, (size_t)a->size * DTYPE(a)->size);
+}
+
+static const char *
+readheader (const void *buf, Header *h, int *dtype)
+{
+    // decode the header in buf into h & dtype, returns an error message or
+    // NULL on success.  h->order tells whether the payload needs swapping.
+    int i;
+    memcpy(h, buf, sizeof(Header));
+    if (memcmp(h->magic, HDR_MAGIC, 4) != 0)
+        return "not a serialized array";
+    if (h->version != HDR_VERSION)
+        return "unsupported version";
+    if (h->order != 'L' && h->order != 'B')
+        return "bad byte order";
+    if (h->order != HOST_ORDER) {
+        h->length = __builtin_bswap64(h->length);
+        h->checksum = __builtin_bswap64(h->checksum);
+    }
+    h->dtype[sizeof(h->dtype) - 1] = '\0';
+    for (i = 0; i < NDTYPES; i++)
+        if (strcmp(h->dtype, dtypes[i].name) == 0)
+            break;
+    if (i == NDTYPES)
+        return "unknown dtype";
+    if (h->length > INT_MAX)
+        return "too many elements";
+    *dtype = i;
+    return NULL;
+}
+
+static const char *
+readpayload (const Header *h, NumArray *a)
+{
+    // verify the elements just read into a & fix their byte order
+    size_t size = DTYPE(a)->size;
+    if (checksum(a->data, (size_t)a->size * size) != h->checksum)
+        return "checksum mismatch";
+    if (h->order != HOST_ORDER)
+        swapbytes(a->data, size, a->size);
+    return NULL;
+}
+
+static int
+tobytes (lua_State *L)
+{
+    // [ud] -> [ud s], s is the serialized array
+    NumArray *a = checkarray(L, 1);
+    size_t size = DTYPE(a)->size;
+    size_t nbytes = (size_t)a->size * size;
+    luaL_Buffer b;
+    Header h;
+
+    char *p = luaL_buffinitsize(L, &b, sizeof(Header) + nbytes);
+    char *payload = p + sizeof(Header);
+    if (CONTIGUOUS(a))
+        memcpy(payload, a->data, nbytes);
+    else
+        scatter(payload, size, a->data, STEP(a), size, a->size);
+    makeheader(&h, a, payload);
+    memcpy(p, &h, sizeof(Header));
+    luaL_pushresultsize(&b, sizeof(Header) + nbytes);
+
+    return 1;
+}
+
+static int
+frombytes (lua_State *L)
+{
+    // [s dtype] -> [.. ud], if given, dtype must match the one in s
+    size_t len;
+    const char *s = luaL_checklstring(L, 1, &len);
+    const char *err;
+    Header h;
+    int dtype;
+
+    luaL_argcheck(L, len >= sizeof(Header), 1, "not a serialized array");
+    if ((err = readheader(s, &h, &dtype)) != NULL)
+        return luaL_argerror(L, 1, err);
+    luaL_argcheck(L, lua_isnoneornil(L, 2) || checkdtype(L, 2) == dtype, 2,
+            "dtype differs from the serialized one");
+    luaL_argcheck(L, len - sizeof(Header) == h.length * dtypes[dtype].size,
+            1, "length does not match the header");
+
+    NumArray *a = pusharray(L, (int)h.length, dtype);
+    memcpy(a->data, s + sizeof(Header), len - sizeof(Header));
+    if ((err = readpayload(&h, a)) != NULL)
+        return luaL_argerror(L, 1, err);
+
+    return 1;
+}
+
+static int
+writeall (int fd, const void *p, size_t n)
+{
+    // write(2) until all n bytes are written, 0 on success
+    const char *s = p;
+    while (n > 0) {
+        ssize_t k = write(fd, s, n);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            return -1;
+        s += k;
+        n -= (size_t)k;
+    }
+    return 0;
+}
+
+static int
+readall (int fd, void *p, size_t n)
+{
+    // read(2) until all n bytes are read, 0 on success, -1 with errno set
+    // or 1 on a premature end of file
+    char *s = p;
+    while (n > 0) {
+        ssize_t k = read(fd, s, n);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k < 0)
+            return -1;
+        if (k == 0)
+            return 1;
+        s += k;
+        n -= (size_t)k;
+    }
+    return 0;
+}
+
+static int
+save (lua_State *L)
+{
+    // [ud path] -> true or nil, msg, errno (like io.open)
+    NumArray *a = checkarray(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    size_t size = DTYPE(a)->size;
+    size_t nbytes = (size_t)a->size * size;
+    void *payload = a->data, *tmp = NULL;
+    Header h;
+    int fd, ok, err;
+
+    if (!CONTIGUOUS(a)) {
+        // a strided view is gathered first, so the payload is one write
+        if ((tmp = malloc(nbytes)) == NULL)
+            return luaL_error(L, "not enough memory");
+        scatter(tmp, size, a->data, STEP(a), size, a->size);
+        payload = tmp;
+    }
+    makeheader(&h, a, payload);
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    ok = fd >= 0 && writeall(fd, &h, sizeof(Header)) == 0
+                 && writeall(fd, payload, nbytes) == 0;
+    err = errno;
+    if (fd >= 0 && close(fd) != 0 && ok) {
+        ok = 0;
+        err = errno;  // e.g. a delayed write error on NFS
+    }
+    free(tmp);
+    errno = err;
+
+    return luaL_fileresult(L, ok, path);
+}
+
+static int
+load (lua_State *L)
+{
+    // [path] -> [.. ud] or nil, msg, errno (like io.open)
+    const char *path = luaL_checkstring(L, 1);
+    const char *err = "file is truncated";
+    char buf[sizeof(Header)];
+    struct stat st;
+    Header h;
+    int dtype, rc;
+
+    // the file is closed while the userdatum is allocated, so running out
+    // of memory can't leak the file descriptor: the header is read first,
+    // the payload after opening the file again
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return luaL_fileresult(L, 0, path);
+    if ((rc = readall(fd, buf, sizeof(Header))) < 0 || fstat(fd, &st) != 0)
+        goto failed;
+    close(fd);
+    if (rc == 0 && (err = readheader(buf, &h, &dtype)) == NULL) {
+        size_t nbytes = h.length * dtypes[dtype].size;
+        if ((size_t)st.st_size != sizeof(Header) + nbytes) {
+            err = "file size does not match the header";
+        } else {
+            NumArray *a = pusharray(L, (int)h.length, dtype);
+            if ((fd = open(path, O_RDONLY)) < 0)
+                return luaL_fileresult(L, 0, path);
+            if (lseek(fd, (off_t)sizeof(Header), SEEK_SET) < 0
+                || (rc = readall(fd, a->data, nbytes)) < 0)
+                goto failed;
+            close(fd);
+            err = rc ? "file is truncated" : readpayload(&h, a);
+        }
+    }
+    if (err != NULL) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "%s: %s", path, err);
+        return 2;
+    }
+    return 1;
+
+failed: {
+        int e = errno;
+        close(fd);
+        errno = e;
+        return luaL_fileresult(L, 0, path);
+    }
+}
+
+// text parsing
+// array.parse_csv(text, opts) parses delimited text with a number in every
+// field into one new array per column, returned in a table.
+// array.read_csv(path, opts) does the same for the text of a file, which
+// it maps into memory (like array.mmap) rather than reading it into a Lua
+// string.  opts, all optional:
+//   sep      the field separator, one character (default ",")
+//   header   true if the first line holds column names, which then key
+//            the arrays in the result as well as their positions
+//   columns  the columns to read, by 1-based position or by name, in the
+//            order of the result (default all of them)
+//   dtype    the dtype of all the arrays, or a table with one per column
+//            read (default "f64")
+// Blank lines are skipped, line ends may be \r\n and spaces or tabs around
+// a number are ignored.  An empty field is NaN in a float column, other
+// fields that are not numbers (or not integers in an integer column) are
+// errors, as are lines with fewer fields than needed (or, reading all
+// columns, more fields than the first line).
+//
+// Text is cut into pieces of about CSV_PIECE bytes, at line boundaries,
+// which the thread pool scans twice: once to count the rows in each piece
+// (so every piece knows the row it starts at) and, once the arrays exist,
+// to parse the fields into them.  Lines are found with memchr and fields
+// eight bytes at a time (csvfind).  Floats with at most 19 significant
+// digits and a small power of ten take Clinger's fast path, which is
+// exact; others (and inf, nan or hex floats) go to strtod.
+
+#define CSV_PIECE     (1 << 18)
+#define CSV_MAXFIELD  128           /* longest number strtod gets to see */
+
+enum { CSV_OK, CSV_NUMBER, CSV_INTEGER, CSV_RANGE, CSV_FIELDS };
+
+typedef struct CsvPiece {
+    const char *lo, *hi;    /* text of whole lines */
+    int lines, rows;        /* lines in the piece & those that hold rows */
+    int line0, row0;        /* lines & rows in the pieces before */
+    int err, errline, errcol;   /* the first error, errline in the piece */
+} CsvPiece;
+
+typedef struct CsvJob {
+    CsvPiece *piece;
+    char sep;
+    int nmap;           /* fields a line needs at least */
+    int exact;          /* and at most */
+    const int *map;     /* field -> result column, or -1 */
+    NumArray **col;     /* the result columns */
+} CsvJob;
+
+static const char *
+csvfind (const char *p, const char *e, char c)
+{
+    // the first c in [p, e), or e; eight bytes at a time, where a zero
+    // byte of w ^ c*ones has its top bit set in (w - ones) & ~w, and no
+    // byte before the first zero byte does
+    const uint64_t ones = 0x0101010101010101ULL;
+    uint64_t pat = ones * (unsigned char)c, w, z;
+    for (; e - p >= 8; p += 8) {
+        memcpy(&w, p, 8);
+        w ^= pat;
+        if ((z = (w - ones) & ~w & ones << 7) != 0)
+#if HOST_ORDER == 'B'
+            return p + (__builtin_clzll(z) >> 3);
+#else
+            return p + (__builtin_ctzll(z) >> 3);
+#endif
+    }
+    while (p < e && *p != c)
+        p++;
+    return p;
+}
+
+static const char *
+csvline (const char *p, const char *e, const char **next)
+{
+    // the end of the line at p, without its \r\n or \n; *next after it
+    const char *nl = memchr(p, '\n', (size_t)(e - p));
+    *next = nl ? nl + 1 : e;
+    if (!nl)
+        nl = e;
+    return nl > p && nl[-1] == '\r' ? nl - 1 : nl;
+}
+
+static void
+csvtrim (const char **s, const char **e)
+{
+    while (*s < *e && (**s == ' ' || **s == '\t'))
+        (*s)++;
+    while (*e > *s && ((*e)[-1] == ' ' || (*e)[-1] == '\t'))
+        (*e)--;
+}
+
+static const double csvpow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int
+parsedouble (const char *s, const char *e, double *x)
+{
+    // m * 10^k is exact when m < 2^53 and 10^k is exact (k <= 22), so a
+    // single multiplication or division rounds it correctly; with up to
+    // 15 more powers of ten moved into m while that stays below 2^53
+    char buf[CSV_MAXFIELD], *end;
+    const char *p = s;
+    uint64_t m = 0;
+    int neg = 0, nd = 0, any = 0, k = 0, ek = 0, esign = 1;
+    double v;
+
+    if (p < e && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
+    for (; p < e && (unsigned)(*p - '0') < 10; p++, any = 1) {
+        m = m * 10 + (uint64_t)(*p - '0');
+        nd += m != 0;
+    }
+    if (p < e && *p == '.')
+        for (p++; p < e && (unsigned)(*p - '0') < 10; p++, any = 1, k--) {
+            m = m * 10 + (uint64_t)(*p - '0');
+            nd += m != 0;
+        }
+    if (any && p < e && (*p | 0x20) == 'e') {
+        if (++p < e && (*p == '-' || *p == '+'))
+            esign = *p++ == '-' ? -1 : 1;
+        for (any = 0; p < e && (unsigned)(*p - '0') < 10; p++, any = 1)
+            if (ek < 10000)
+                ek = ek * 10 + (*p - '0');
+        k += esign * ek;
+    }
+    if (!any || p != e || nd > 19 || m > (uint64_t)1 << 53)
+        goto slow;
+    if (m == 0 || k == 0)
+        v = (double)m;
+    else if (0 < k && k <= 22)
+        v = (double)m * csvpow10[k];
+    else if (-22 <= k && k < 0)
+        v = (double)m / csvpow10[-k];
+    else if (22 < k && k <= 22 + 15
+             && m <= ((uint64_t)1 << 53) / (uint64_t)csvpow10[k - 22])
+        v = (double)(m * (uint64_t)csvpow10[k - 22]) * 1e22;
+    else
+        goto slow;
+    *x = neg ? -v : v;
+    return CSV_OK;
+
+slow:
+    if (e - s >= CSV_MAXFIELD)
+        return CSV_NUMBER;
+    memcpy(buf, s, (size_t)(e - s));
+    buf[e - s] = '\0';
+    *x = strtod(buf, &end);
+    return end == buf + (e - s) && end != buf ? CSV_OK : CSV_NUMBER;
+}
+
+static int
+parseuint (const char *s, const char *e, int *neg, uint64_t *u)
+{
+    // an optional sign and decimal digits, magnitude into *u
+    *neg = 0;
+    *u = 0;
+    if (s < e && (*s == '-' || *s == '+'))
+        *neg = *s++ == '-';
+    if (s == e)
+        return CSV_INTEGER;
+    for (; s < e; s++) {
+        unsigned d = (unsigned)(*s - '0');
+        if (d >= 10)
+            return CSV_INTEGER;
+        if (*u > (UINT64_MAX - d) / 10)
+            return CSV_RANGE;
+        *u = *u * 10 + d;
+    }
+    return CSV_OK;
+}
+
+#define CSV_SIGNED(T)                                                         \
+    uint64_t u;                                                               \
+    int64_t v;                                                                \
+    int neg, err = parseuint(s, e, &neg, &u);                                 \
+    if (err != CSV_OK)                                                        \
+        return err;                                                           \
+    if (u > (neg ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX))            \
+        return CSV_RANGE;                                                     \
+    v = neg ? (int64_t)(0 - u) : (int64_t)u;                                  \
+    if ((int64_t)(T)v != v)                                                   \
+        return CSV_RANGE;                                                     \
+    *(T *)p = (T)v;
+#define CSV_UNSIGNED(T)                                                       \
+    uint64_t u;                                                               \
+    int neg, err = parseuint(s, e, &neg, &u);                                 \
+    if (err != CSV_OK)                                                        \
+        return err;                                                           \
+    if ((neg && u != 0) || (uint64_t)(T)u != u)                               \
+        return CSV_RANGE;                                                     \
+    *(T *)p = (T)u;
+#define CSV_FLOAT(T)                                                          \
+    double x = NAN;                                                           \
+    if (s < e && parsedouble(s, e, &x) != CSV_OK)                             \
+        return CSV_NUMBER;                                                    \
+    *(T *)p = (T)x;
+#define CSV_CASE(DT, T, WT, KIND, NAME)                                       \
+    case DT_##DT: { CSV_##KIND(T) } break;
+
+static int
+csvstore (NumArray *r, int row, const char *s, const char *e)
+{
+    // parse field [s, e) into r[row]
+    void *p = ELEM(r, row);
+    csvtrim(&s, &e);
+    switch (r->dtype) {
+    DTYPES(CSV_CASE)
+    }
+    return CSV_OK;
+}
+
+static int
+csvfields (const char *p, const char *e, char sep)
+{
+    // the number of fields in line [p, e)
+    int n = 1;
+    while ((p = csvfind(p, e, sep)) < e) {
+        p++;
+        n++;
+    }
+    return n;
+}
+
+static void
+csvcount (void *ctx, int chunk)
+{
+    // lines & rows in a piece
+    CsvPiece *pc = ((CsvJob *)ctx)->piece + chunk;
+    const char *p = pc->lo, *next, *le;
+    for (; p < pc->hi; p = next) {
+        le = csvline(p, pc->hi, &next);
+        pc->lines++;
+        pc->rows += le > p;
+    }
+}
+
+static void
+csvparse (void *ctx, int chunk)
+{
+    // fields into the columns, stopping at the first error
+    CsvJob *job = (CsvJob *)ctx;
+    CsvPiece *pc = job->piece + chunk;
+    const char *p = pc->lo, *next, *le, *q, *fe;
+    int line = 0, row = pc->row0, field, err;
+
+    for (; p < pc->hi; p = next, line++) {
+        if ((le = csvline(p, pc->hi, &next)) == p)
+            continue;
+        for (field = 0, q = p; ; q = fe + 1) {
+            fe = csvfind(q, le, job->sep);
+            if (field < job->nmap && job->map[field] >= 0
+                && (err = csvstore(job->col[job->map[field]], row, q, fe))
+                   != CSV_OK) {
+                pc->err = err;
+                pc->errline = line;
+                pc->errcol = field + 1;
+                return;
+            }
+            field++;
+            if (fe == le || (field == job->nmap && !job->exact))
+                break;
+        }
+        if (field < job->nmap || (job->exact && field > job->nmap)) {
+            pc->err = CSV_FIELDS;
+            pc->errline = line;
+            pc->errcol = field;
+            return;
+        }
+        row++;
+    }
+}
+
+static const char *
+csvsource (lua_State *L, int arg, int file, size_t *len)
+{
+    // the text at arg or, if file, that of the file it names; pushes the
+    // string or the array that maps the file, which must stay on the stack
+    const char *s = luaL_checklstring(L, arg, len);
+    NumArray *a;
+    if (!file) {
+        lua_pushvalue(L, arg);
+        return s;
+    }
+    lua_pushcfunction(L, mmaparray);
+    lua_pushvalue(L, arg);
+    lua_pushliteral(L, "u8");
+    lua_call(L, 2, 2);
+    if (lua_isnil(L, -2))
+        luaL_error(L, "%s", lua_tostring(L, -1));
+    lua_pop(L, 1);
+    a = (NumArray *)lua_touserdata(L, -1);
+    *len = (size_t)a->size;
+    return (const char *)a->data;
+}
+
+static int
+csvcolumn (lua_State *L, const char *hp, const char *he, char sep,
+           int ncol)
+{
+    // the 0-based field of the column at the top of the stack, a position
+    // or a name in header line [hp, he)
+    const char *q = hp, *fe, *s;
+    int field;
+    if (lua_isinteger(L, -1)) {
+        lua_Integer i = lua_tointeger(L, -1);
+        if (i < 1 || i > ncol)
+            luaL_error(L, "column %d: no such column", (int)i);
+        return (int)i - 1;
+    }
+    if (lua_type(L, -1) != LUA_TSTRING)
+        luaL_error(L, "columns: column number or name expected");
+    if (hp == NULL)
+        luaL_error(L, "column '%s': names need a header", lua_tostring(L, -1));
+    for (field = 0; ; field++, q = fe + 1) {
+        const char *e;
+        fe = csvfind(q, he, sep);
+        s = q;
+        e = fe;
+        csvtrim(&s, &e);
+        if (e - s >= 2 && *s == '"' && e[-1] == '"')
+            s++, e--;
+        lua_pushlstring(L, s, (size_t)(e - s));
+        if (lua_rawequal(L, -1, -2)) {
+            lua_pop(L, 1);
+            return field;
+        }
+        lua_pop(L, 1);
+        if (fe == he)
+            break;
+    }
+    return luaL_error(L, "column '%s': no such column", lua_tostring(L, -1));
+}
+
+static void
+csvname (lua_State *L, const char *hp, const char *he, char sep, int field)
+{
+    // push the name of a field in header line [hp, he)
+    const char *s = hp, *e;
+    while (field-- > 0)
+        s = csvfind(s, he, sep) + 1;
+    e = csvfind(s, he, sep);
+    csvtrim(&s, &e);
+    if (e - s >= 2 && *s == '"' && e[-1] == '"')
+        s++, e--;
+    lua_pushlstring(L, s, (size_t)(e - s));
+}
+
+static int
+csvdtype (lua_State *L, int i, const char *hp, const char *he, char sep,
+          int field)
+{
+    // the dtype at the top of the stack, from opts.dtype or (if that is a
+    // table) its entry i for field; f64 if nil
+    const char *name = lua_tostring(L, -1);
+    int k;
+    if (lua_isnil(L, -1))
+        return DT_F64;
+    for (k = 0; name != NULL && k < NDTYPES; k++)
+        if (strcmp(name, dtypenames[k]) == 0)
+            return k;
+    name = luaL_tolstring(L, -1, NULL);
+    if (!lua_istable(L, 8))
+        return luaL_argerror(L, 2,
+                lua_pushfstring(L, "dtype: invalid dtype '%s'", name));
+    if (hp == NULL)
+        lua_pushfstring(L, "%d", field + 1);
+    else {
+        csvname(L, hp, he, sep, field);
+        lua_pushfstring(L, "'%s'", lua_tostring(L, -1));
+    }
+    return luaL_argerror(L, 2,
+            lua_pushfstring(L, "dtype[%d]: invalid dtype '%s' for column %s",
+                            i + 1, name, lua_tostring(L, -1)));
+}
+
+static int
+csvread (lua_State *L, int file)
+{
+    // [src opts] -> [src opts text cols field map piece dtype col t]
+    static const char *const errs[] = {
+        NULL, "number expected", "integer expected", "value out of range"
+    };
+    size_t len, seplen = 1;
+    const char *sep = ",", *start, *text, *end, *p, *hp = NULL, *he = NULL;
+    int header, all, ncol, nout, nmap, npieces, line0, rows, i;
+    int *field, *map;
+    NumArray **col;
+    CsvPiece *piece;
+    CsvJob job;
+
+    lua_settop(L, 2);
+    if (lua_isnil(L, 2)) {
+        lua_newtable(L);
+        lua_replace(L, 2);
+    }
+    luaL_checktype(L, 2, LUA_TTABLE);
+    if (lua_getfield(L, 2, "sep") != LUA_TNIL)
+        sep = luaL_checklstring(L, -1, &seplen);
+    luaL_argcheck(L, seplen == 1 && *sep != '\n', 2,
+                  "sep: one character expected");
+    lua_getfield(L, 2, "header");
+    header = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+    start = text = csvsource(L, 1, file, &len);
+    end = text + len;
+
+    // blank lines, the header & the number of fields in the first line
+    while (text < end && csvline(text, end, &p) == text)
+        text = p;
+    if (header && text < end) {
+        hp = text;
+        he = csvline(text, end, &text);
+    }
+    ncol = hp ? csvfields(hp, he, *sep)
+              : text < end ? csvfields(text, csvline(text, end, &p), *sep)
+                           : 0;
+    for (line0 = 0, p = start; (p = memchr(p, '\n', text - p)) != NULL; p++)
+        line0++;
+
+    // the fields read, in the order of the result, & field -> column
+    all = lua_getfield(L, 2, "columns") == LUA_TNIL;
+    if (!all)
+        luaL_checktype(L, 4, LUA_TTABLE);
+    nout = all ? ncol : (int)luaL_len(L, 4);
+    field = (int *)lua_newuserdata(L, (size_t)(nout + 1) * sizeof(int));
+    for (i = 0; i < nout; i++) {
+        if (all)
+            field[i] = i;
+        else {
+            lua_geti(L, 4, i + 1);
+            field[i] = csvcolumn(L, hp, he, *sep, ncol);
+            lua_pop(L, 1);
+        }
+    }
+    for (i = nmap = 0; i < nout; i++)
+        nmap = field[i] + 1 > nmap ? field[i] + 1 : nmap;
+    map = (int *)lua_newuserdata(L, (size_t)(nmap + 1) * sizeof(int));
+    for (i = 0; i < nmap; i++)
+        map[i] = -1;
+    for (i = 0; i < nout; i++) {
+        if (map[field[i]] >= 0)
+            return luaL_error(L, "column %d: read twice", field[i] + 1);
+        map[field[i]] = i;
+    }
+
+    // pieces that end after the first \n at or after a multiple of
+    // CSV_PIECE bytes, then the rows in each
+    len = (size_t)(end - text);
+    npieces = (int)(len / CSV_PIECE) + 1;
+    piece = (CsvPiece *)lua_newuserdata(L, (size_t)npieces * sizeof(*piece));
+    memset(piece, 0, (size_t)npieces * sizeof(*piece));
+    for (i = 0, p = text; i < npieces; i++) {
+        const char *cut = text + (size_t)(i + 1) * CSV_PIECE, *nl;
+        piece[i].lo = p;
+        if (i + 1 == npieces)
+            p = end;
+        else if (cut > p)
+            p = (nl = memchr(cut - 1, '\n', (size_t)(end - cut) + 1))
+                ? nl + 1 : end;
+        piece[i].hi = p;
+    }
+    job.piece = piece;
+    pool_run(csvcount, &job, npieces);
+    for (i = 0, rows = 0; i < npieces; i++) {
+        piece[i].line0 = line0;
+        piece[i].row0 = rows;
+        line0 += piece[i].lines;
+        if (rows > INT_MAX - piece[i].rows)
+            return luaL_error(L, "too many rows");
+        rows += piece[i].rows;
+    }
+
+    // the result: the arrays by position, and by name with a header
+    lua_getfield(L, 2, "dtype");
+    col = (NumArray **)lua_newuserdata(L, (size_t)(nout + 1) * sizeof(*col));
+    lua_createtable(L, nout, hp ? nout : 0);
+    for (i = 0; i < nout; i++) {
+        if (lua_istable(L, 8))
+            lua_geti(L, 8, i + 1);
+        else
+            lua_pushvalue(L, 8);
+        col[i] = pusharray(L, rows,
+                           csvdtype(L, i, hp, he, *sep, field[i]));
+        lua_remove(L, -2);
+        if (hp) {
+            csvname(L, hp, he, *sep, field[i]);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, 10);
+        }
+        lua_rawseti(L, 10, i + 1);
+    }
+
+    job.sep = *sep;
+    job.nmap = all ? ncol : nmap;
+    job.exact = all;
+    job.map = map;
+    job.col = col;
+    pool_run(csvparse, &job, npieces);
+    for (i = 0; i < npieces; i++) {
+        CsvPiece *pc = piece + i;
+        if (pc->err == CSV_FIELDS)
+            return luaL_error(L, "line %d: %s%d fields expected",
+                    pc->line0 + pc->errline + 1, all ? "" : "at least ",
+                    job.nmap);
+        if (pc->err != CSV_OK)
+            return luaL_error(L, "line %d, column %d: %s%s%s",
+                    pc->line0 + pc->errline + 1, pc->errcol, errs[pc->err],
+                    pc->err == CSV_RANGE ? " for " : "",
+                    pc->err == CSV_RANGE
+                        ? DTYPE(col[map[pc->errcol - 1]])->name : "");
+    }
+
+    return 1;
+}
+
+static int
+parsecsv (lua_State *L)
+{
+    return csvread(L, 0);
+}
+
+static int
+readcsv (lua_State *L)
+{
+    return csvread(L, 1);
+}
+
+// text output
+// a:format(sep, precision) returns the elements as text, separated by sep
+// (default "\n").  a:write_text(path, sep, precision) writes the same text
+// and a final newline to a file, returning true or nil, msg, errno (like
+// io.open).  Floats get the shortest digits that read back as the same
+// number (dtoa.h; f32 elements as f32s), unlike tostring's %.14g, or with
+// precision 1 .. 17 that many significant digits (%.*g).  Elements are
+// formatted into a buffer on the C stack that goes to a luaL_Buffer or to
+// the file whenever it fills up, so nothing is allocated per element.
+
+#define TEXT_BLOCK  8192
+
+typedef struct TextOut {
+    luaL_Buffer *b;     /* output to a string, or */
+    int fd;             /* to a file, if b is NULL */
+    int err;            /* errno of the first failed write */
+    size_t n;           /* bytes in buf */
+    char buf[TEXT_BLOCK];
+} TextOut;
+
+static void
+textflush (TextOut *out, const char *s, size_t n)
+{
+    // buf, then s[0 .. n)
+    if (out->b != NULL) {
+        luaL_addlstring(out->b, out->buf, out->n);
+        luaL_addlstring(out->b, s, n);
+    } else if (out->err == 0 && (writeall(out->fd, out->buf, out->n) != 0
+                                 || writeall(out->fd, s, n) != 0))
+        out->err = errno;
+    out->n = 0;
+}
+
+static inline void
+textput (TextOut *out, const char *s, size_t n)
+{
+    if (TEXT_BLOCK - out->n < n)
+        textflush(out, s, n);
+    else {
+        memcpy(out->buf + out->n, s, n);
+        out->n += n;
+    }
+}
+
+#define TEXT_SIGNED(T, x)    dtoa_int(p, (int64_t)(x))
+#define TEXT_UNSIGNED(T, x)  dtoa_uint(p, (uint64_t)(x))
+#define TEXT_FLOAT(T, x)                                                      \
+    (prec > 0 && isfinite(x)                                                  \
+        ? snprintf(p, DTOA_MAX, "%.*g", prec, (double)(x))                    \
+        : dtoa_shortest(p, (double)(x), sizeof(T) < sizeof(double)))
+#define TEXT_CASE(DT, T, WT, KIND, NAME)                                      \
+    case DT_##DT:                                                             \
+        for (i = 0; i < a->size; i++) {                                       \
+            char *p;                                                          \
+            if (i > 0)                                                        \
+                textput(out, sep, seplen);                                    \
+            if (TEXT_BLOCK - out->n < DTOA_MAX)                               \
+                textflush(out, NULL, 0);                                      \
+            p = out->buf + out->n;                                            \
+            out->n += (size_t)TEXT_##KIND(T, *(const T *)(x + i * step));     \
+        }                                                                     \
+        break;
+
+static void
+textelems (TextOut *out, const NumArray *a, const char *sep, size_t seplen,
+           int prec)
+{
+    const char *x = (const char *)a->data;
+    ptrdiff_t step = STEP(a);
+    int i;
+    switch (a->dtype) {
+    DTYPES(TEXT_CASE)
+    }
+}
+
+static int
+checkprecision (lua_State *L, int arg)
+{
+    // significant digits, 0 for the shortest that read back
+    lua_Integer prec = luaL_optinteger(L, arg, 0);
+    luaL_argcheck(L, 0 <= prec && prec <= 17, arg,
+                  "precision 1 .. 17 expected");
+    return (int)prec;
+}
+
+static int
+format (lua_State *L)
+{
+    // [ud sep precision] -> [.. s]
+    NumArray *a = checkarray(L, 1);
+    size_t seplen;
+    const char *sep = luaL_optlstring(L, 2, "\n", &seplen);
+    int prec = checkprecision(L, 3);
+    luaL_Buffer b;
+    TextOut out;
+
+    out.b = &b;
+    out.n = 0;
+    luaL_buffinit(L, &b);
+    textelems(&out, a, sep, seplen, prec);
+    textflush(&out, NULL, 0);
+    luaL_pushresult(&b);
+
+    return 1;
+}
+
+static int
+writetext (lua_State *L)
+{
+    // [ud path sep precision] -> true or nil, msg, errno (like io.open)
+    NumArray *a = checkarray(L, 1);
+    const char *path = luaL_checkstring(L, 2);
+    size_t seplen;
+    const char *sep = luaL_optlstring(L, 3, "\n", &seplen);
+    int prec = checkprecision(L, 4);
+    TextOut out;
+    int ok;
+
+    out.b = NULL;
+    out.n = 0;
+    out.err = 0;
+    if ((out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+        return luaL_fileresult(L, 0, path);
+    textelems(&out, a, sep, seplen, prec);
+    textflush(&out, "\n", a->size > 0 ? 1 : 0);
+    if (close(out.fd) != 0 && out.err == 0)
+        out.err = errno;  // e.g. a delayed write error on NFS
+    ok = out.err == 0;
+    errno = out.err;
+
+    return luaL_fileresult(L, ok, path);
+}
+
+// elementwise arithmetic
+// The kernels in dtypes.h do the work, these functions only check the
+// operands: arrays must agree in size and dtype, numbers are converted to
+// the dtype of the array (so an integer array only takes integers).
+
+static void
+checksame (lua_State *L, int arg, NumArray *a, NumArray *b)
+{
+    luaL_argcheck(L, b->size == a->size, arg, "array sizes differ");
+    luaL_argcheck(L, b->dtype == a->dtype, arg, "array dtypes differ");
+}
+
+static NumArray *
+checkoperand (lua_State *L, int arg, NumArray *a, Elem *s)
+{
+    // arg is an array like a (returned) or a number (converted to a's
+    // dtype into *s, NULL is returned)
+    NumArray *b = (NumArray *)udata_test(L, arg, UV_ARRAY, "ex04.array");
+    if (b == NULL) {
+        checkvalue(L, DTYPE(a), arg, s);
+        return NULL;
+    }
+    checksame(L, arg, a, b);
+
+    return b;
+}
+
+static NumArray *
+checkresult (lua_State *L, int arg, NumArray *a, int inplace)
+{
+    // push & return the array to receive a result like a:
+    // - the array itself (arg 1) for in-place operations, or
+    // - the optional output array at arg, or
+    // - a new array
+    NumArray *r;
+    if (inplace) {
+        checkwritable(L, 1, a);
+        lua_pushvalue(L, 1);
+        return checkarray(L, 1);
+    }
+    if (lua_isnoneornil(L, arg))
+        return pusharray(L, a->size, a->dtype);
+    r = checkarray(L, arg);
+    checksame(L, arg, a, r);
+    checkwritable(L, arg, r);
+    lua_pushvalue(L, arg);
+
+    return r;
+}
+
+static int
+haszero (NumArray *a)
+{
+    // any all-zero elements (an integer 0) in a?
+    static const Elem zero;
+    size_t size = DTYPE(a)->size;
+    int i;
+    for (i = 0; i < a->size; i++)
+        if (memcmp(ELEM(a, i), &zero, size) == 0)
+            return 1;
+    return 0;
+}
+
+static void
+checkdivisor (lua_State *L, int op, NumArray *a, NumArray *b, Elem *s)
+{
+    // integer division by zero is an error, like in Lua itself
+    static const Elem zero;
+    if (op != OP_DIV || DTYPE(a)->kind == KIND_FLOAT)
+        return;
+    if (b ? haszero(b) : memcmp(s, &zero, DTYPE(a)->size) == 0)
+        luaL_error(L, "attempt to perform 'n//0'");
+}
+
+// threads
+// Large kernels are split into chunks of grain elements (the last one may
+// be shorter), which the pool in pool.h hands out to its threads.  The
+// chunks do not depend on the number of threads, so neither do results.
+// array.threads(n) and array.grain(n) set both, for all lua_States.
+
+static int grain = 1 << 16;
+
+#define NCHUNKS(n)  ((int)(((long long)(n) + grain - 1) / grain))
+
+static int
+setthreads (lua_State *L)
+{
+    // [n] -> [.. n], sets the number of threads (0 = one per cpu) if given
+    if (!lua_isnoneornil(L, 1)) {
+        lua_Integer n = luaL_checkinteger(L, 1);
+        luaL_argcheck(L, 0 <= n && n <= POOL_MAXTHREADS, 1,
+                "invalid number of threads");
+        pool_setthreads((int)n);
+    }
+    lua_pushinteger(L, pool_threads());
+    return 1;
+}
+
+static int
+setgrain (lua_State *L)
+{
+    // [n] -> [.. n], sets the number of elements per chunk if given
+    if (!lua_isnoneornil(L, 1)) {
+        lua_Integer n = luaL_checkinteger(L, 1);
+        luaL_argcheck(L, 0 < n && n <= INT_MAX, 1, "invalid grain size");
+        grain = (int)n;
+    }
+    lua_pushinteger(L, grain);
+    return 1;
+}
+
+static int
+releasepool (lua_State *L)
+{
+    // __gc of a sentinel in the registry, runs when the lua_State closes
+    (void)L;
+    pool_release();
+    return 0;
+}
+
+// The elementwise engine
+// Calls a kernel on operands that may be views, in chunks of grain
+// elements that run in parallel on the thread pool.  When all arrays are
+// contiguous, the kernel runs once per chunk.  Otherwise the elements are
+// gathered into blocks of EW_BLOCK on the C stack, so strided views cost
+// no allocations either.  An input that overlaps the result in
+// any other way than being the very same elements is copied first, so
+// that e.g. a:add_(a:slice(#a, 1, -1)) sees the original values of a.
+// Inputs may have another dtype than the result, like the masks of bytes
+// that comparisons produce or that where() takes.
+
+#define EW_BLOCK 256
+#define EW_MAXIN 3
+
+typedef enum { K_UNARY, K_BINARY, K_TERNARY } KernelShape;
+
+typedef union Kernel {
+    UnKernel un;
+    BinKernel bin;
+    FmaKernel fma;      // also used for ClipKernel, same signature
+} Kernel;
+
+typedef struct Operand {
+    NumArray *a;        // the array or NULL for a scalar ..
+    const Elem *s;      // .. in s
+} Operand;
+
+static void
+runkernel (KernelShape shape, Kernel k, void *r, const void **in, int n)
+{
+    switch (shape) {
+    case K_UNARY:   k.un(r, in[0], n); break;
+    case K_BINARY:  k.bin(r, in[0], in[1], n); break;
+    case K_TERNARY: k.fma(r, in[0], in[1], in[2], n); break;
+    }
+}
+
+typedef struct EwJob {
+    KernelShape shape;
+    Kernel k;
+    int nin, n;
+    NumArray *r;
+    Operand *in;
+} EwJob;
+
+static void
+ewrange (EwJob *job, int lo, int hi)
+{
+    // run the kernel on elements lo .. hi-1
+    _Alignas(ARRAY_ALIGN) Elem buf[EW_MAXIN + 1][EW_BLOCK];
+    NumArray *r = job->r;
+    size_t size = DTYPE(r)->size;
+    int contiguous = CONTIGUOUS(r), j;
+    const void *p[EW_MAXIN];
+
+    for (j = 0; j < job->nin; j++)
+        contiguous = contiguous && (job->in[j].a == NULL
+                                    || CONTIGUOUS(job->in[j].a));
+    if (contiguous) {
+        for (j = 0; j < job->nin; j++)
+            p[j] = job->in[j].a ? ELEM(job->in[j].a, lo)
+                                : (const void *)job->in[j].s;
+        runkernel(job->shape, job->k, ELEM(r, lo), p, hi - lo);
+        return;
+    }
+    for (; lo < hi; lo += EW_BLOCK) {
+        int m = hi - lo < EW_BLOCK ? hi - lo : EW_BLOCK;
+        for (j = 0; j < job->nin; j++) {
+            NumArray *a = job->in[j].a;
+            if (a == NULL)
+                p[j] = job->in[j].s;
+            else if (CONTIGUOUS(a))
+                p[j] = ELEM(a, lo);
+            else {
+                size_t asize = DTYPE(a)->size;
+                scatter(buf[j], asize, ELEM(a, lo), STEP(a), asize, m);
+                p[j] = buf[j];
+            }
+        }
+        if (CONTIGUOUS(r))
+            runkernel(job->shape, job->k, ELEM(r, lo), p, m);
+        else {
+            runkernel(job->shape, job->k, buf[EW_MAXIN], p, m);
+            scatter(ELEM(r, lo), STEP(r), buf[EW_MAXIN], size, size, m);
+        }
+    }
+}
+
+static void
+ewtask (void *ctx, int chunk)
+{
+    EwJob *job = (EwJob *)ctx;
+    int lo = chunk * grain;
+    ewrange(job, lo, job->n - lo < grain ? job->n : lo + grain);
+}
+
+static void
+elementwise (lua_State *L, KernelShape shape, Kernel k, NumArray *r,
+             Operand *in)
+{
+    int nin = shape == K_UNARY ? 1 : shape == K_BINARY ? 2 : 3;
+    int n = r->size, j;
+    void *tmp[EW_MAXIN] = { NULL, NULL, NULL };
+    NumArray copies[EW_MAXIN];
+
+    for (j = 0; j < nin; j++) {
+        NumArray *a = in[j].a;
+        size_t size;
+        if (a == NULL || a == r)
+            continue;
+        size = DTYPE(a)->size;
+        if (overlaps(a, r, n) && !(a->data == r->data && a->stride == r->stride
+                                   && a->dtype == r->dtype)) {
+            // copy the input out of harm's way
+            tmp[j] = malloc((size_t)n * size);
+            if (tmp[j] == NULL) {
+                while (j-- > 0) free(tmp[j]);
+                luaL_error(L, "not enough memory");
+            }
+            scatter(tmp[j], size, a->data, STEP(a), size, n);
+            copies[j] = *a;
+            copies[j].data = tmp[j];
+            copies[j].stride = 1;
+            in[j].a = &copies[j];
+        }
+    }
+
+    EwJob job = { shape, k, nin, n, r, in };
+    pool_run(ewtask, &job, NCHUNKS(n));
+
+    for (j = 0; j < nin; j++)
+        free(tmp[j]);
+}
+
+static void
+binop (lua_State *L, int op, NumArray *r, NumArray *a, NumArray *b,
+       const Elem *s, int scalarfirst)
+{
+    // r = a op b, or a op s, or s op a (scalarfirst)
+    const BinOp *bo = &DTYPE(a)->binop[op];
+    Operand in[2] = { { a, NULL }, { b, s } };
+    Kernel k;
+
+    if (scalarfirst) {
+        in[0].a = NULL; in[0].s = s;
+        in[1].a = a;
+        k.bin = bo->sa;
+    } else
+        k.bin = b ? bo->aa : bo->as;
+    elementwise(L, K_BINARY, k, r, in);
+}
+
+static int
+arith (lua_State *L, int op, int inplace)
+{
+    // [ud b out] -> [.. r], r = ud op b
+    NumArray *a = checkarray(L, 1);
+    Elem s;
+    NumArray *b = checkoperand(L, 2, a, &s);
+    checkdivisor(L, op, a, b, &s);
+    NumArray *r = checkresult(L, 3, a, inplace);
+
+    binop(L, op, r, a, b, &s, 0);
+
+    return 1;
+}
+
+static int exprbinary (lua_State *L, int op);
+
+static int
+arithmeta (lua_State *L, int op)
+{
+    // [x y] -> [x y r], where x or y (or both) is an array
+    NumArray *a = (NumArray *)udata_test(L, 1, UV_ARRAY, "ex04.array");
+    Elem s;
+
+    if (a != NULL) {
+        if (udata_test(L, 2, UV_EXPR, "ex04.expr"))
+            return exprbinary(L, op);  // array op expr is lazy too
+        NumArray *b = checkoperand(L, 2, a, &s);
+        checkdivisor(L, op, a, b, &s);
+        NumArray *r = pusharray(L, a->size, a->dtype);
+        binop(L, op, r, a, b, &s, 0);
+    } else {
+        a = checkarray(L, 2);
+        checkvalue(L, DTYPE(a), 1, &s);
+        checkdivisor(L, op, a, a, &s);
+        NumArray *r = pusharray(L, a->size, a->dtype);
+        binop(L, op, r, a, NULL, &s, 1);
+    }
+
+    return 1;
+}
+
+// a:add(b [, out]), a:add_(b) and friends, b is an array or a number
+#define ARITH_METHODS(name, OP)                                               \
+static int name##arith (lua_State *L) { return arith(L, OP, 0); }            \
+static int name##arith_ (lua_State *L) { return arith(L, OP, 1); }
+
+ARITH_METHODS(add, OP_ADD)
+ARITH_METHODS(sub, OP_SUB)
+ARITH_METHODS(mul, OP_MUL)
+ARITH_METHODS(div, OP_DIV)
+ARITH_METHODS(min, OP_MIN)
+ARITH_METHODS(max, OP_MAX)
+
+static int addmeta (lua_State *L) { return arithmeta(L, OP_ADD); }
+static int submeta (lua_State *L) { return arithmeta(L, OP_SUB); }
+static int mulmeta (lua_State *L) { return arithmeta(L, OP_MUL); }
+static int divmeta (lua_State *L) { return arithmeta(L, OP_DIV); }
+
+static void
+unary (lua_State *L, UnKernel f, NumArray *r, NumArray *a)
+{
+    Operand in[1] = { { a, NULL } };
+    Kernel k;
+    k.un = f;
+    elementwise(L, K_UNARY, k, r, in);
+}
+
+static int
+unmmeta (lua_State *L)
+{
+    // [ud ud] -> [ud ud r], r = -ud
+    NumArray *a = checkarray(L, 1);
+    NumArray *r = pusharray(L, a->size, a->dtype);
+    unary(L, DTYPE(a)->neg, r, a);
+
+    return 1;
+}
+
+static int
+dofma (lua_State *L, int inplace)
+{
+    // [ud b c out] -> [.. r], r = ud*b + c
+    NumArray *a = checkarray(L, 1);
+    Elem bs, cs;
+    NumArray *b = checkoperand(L, 2, a, &bs);
+    NumArray *c = checkoperand(L, 3, a, &cs);
+    NumArray *r = checkresult(L, 4, a, inplace);
+    int shape = (b == NULL) * 2 + (c == NULL);  // aa, as, sa or ss
+    Operand in[3] = { { a, NULL }, { b, &bs }, { c, &cs } };
+    Kernel k;
+
+    k.fma = DTYPE(a)->fma[shape];
+    elementwise(L, K_TERNARY, k, r, in);
+
+    return 1;
+}
+
+static int fmaarith (lua_State *L) { return dofma(L, 0); }
+static int fmaarith_ (lua_State *L) { return dofma(L, 1); }
+
+static int
+doaxpy (lua_State *L, int inplace)
+{
+    // [ud alpha x out] -> [.. r], r = alpha*x + ud (BLAS' y = a*x + y)
+    NumArray *y = checkarray(L, 1);
+    Elem alpha;
+    checkvalue(L, DTYPE(y), 2, &alpha);
+    NumArray *x = checkarray(L, 3);
+    checksame(L, 3, y, x);
+    NumArray *r = checkresult(L, 4, y, inplace);
+    Operand in[3] = { { x, NULL }, { NULL, &alpha }, { y, NULL } };
+    Kernel k;
+
+    k.fma = DTYPE(y)->fma[2];
+    elementwise(L, K_TERNARY, k, r, in);
+
+    return 1;
+}
+
+static int axpyarith (lua_State *L) { return doaxpy(L, 0); }
+static int axpyarith_ (lua_State *L) { return doaxpy(L, 1); }
+
+static int
+doabs (lua_State *L, int inplace)
+{
+    // [ud out] -> [.. r], r = |ud|
+    NumArray *a = checkarray(L, 1);
+    NumArray *r = checkresult(L, 2, a, inplace);
+
+    unary(L, DTYPE(a)->abs, r, a);
+
+    return 1;
+}
+
+static int absarith (lua_State *L) { return doabs(L, 0); }
+static int absarith_ (lua_State *L) { return doabs(L, 1); }
+
+static int
+doclip (lua_State *L, int inplace)
+{
+    // [ud lo hi out] -> [.. r], r = ud clipped to [lo, hi]
+    NumArray *a = checkarray(L, 1);
+    Elem lo, hi;
+    checkvalue(L, DTYPE(a), 2, &lo);
+    checkvalue(L, DTYPE(a), 3, &hi);
+    luaL_argcheck(L, lua_compare(L, 2, 3, LUA_OPLE), 3, "empty range");
+    NumArray *r = checkresult(L, 4, a, inplace);
+    Operand in[3] = { { a, NULL }, { NULL, &lo }, { NULL, &hi } };
+    Kernel k;
+
+    k.fma = DTYPE(a)->clip;
+    elementwise(L, K_TERNARY, k, r, in);
+
+    return 1;
+}
+
+static int cliparith (lua_State *L) { return doclip(L, 0); }
+static int cliparith_ (lua_State *L) { return doclip(L, 1); }
+
+// math functions
+// a:sin([out]) and likewise cos, tan, exp, log, log1p, sqrt, tanh, sigmoid
+// & erf compute the function of every element, into a new f64 array or
+// into out: an f64 array of the same size, which may be a itself.  Other
+// dtypes are converted to f64 first.  The same functions are in the
+// module, where array.sin(x [, out]) takes a table of numbers for x too.
+// a:pow(y [, out]) and array.pow(x, y [, out]) raise to the power y, an
+// array or table like x or a number.
+//
+// By default the kernels of vmath.h do the work, a vector at a time.
+// array.mathmode("strict") switches to the C library's functions, one
+// element at a time, for results that are (about) correctly rounded;
+// array.mathmode("fast") switches back.  Like array.grain, the mode holds
+// for all lua_States.
+
+static int mathstrict = 0;
+
+static NumArray *
+checkf64 (lua_State *L, int arg)
+{
+    // the f64 array at arg, or a new f64 array (pushed) with the values of
+    // the array or table at arg
+    NumArray *a = (NumArray *)udata_test(L, arg, UV_ARRAY, "ex04.array");
+    NumArray *r;
+    int i, n;
+
+    if (a != NULL && a->dtype == DT_F64)
+        return a;
+    if (a != NULL) {
+        r = pusharray(L, a->size, DT_F64);
+        DTYPE(a)->todouble((double *)r->data, a->data, STEP(a), a->size);
+        return r;
+    }
+    luaL_argcheck(L, lua_istable(L, arg), arg, "array or table expected");
+    n = (int)lua_rawlen(L, arg);
+    r = pusharray(L, n, DT_F64);
+    for (i = 1; i <= n; i++) {
+        int isnum;
+        lua_rawgeti(L, arg, i);
+        ((double *)r->data)[i - 1] = lua_tonumberx(L, -1, &isnum);
+        if (!isnum)
+            luaL_error(L, "table element %d: number expected", i);
+        lua_pop(L, 1);
+    }
+
+    return r;
+}
+
+static NumArray *
+checkf64result (lua_State *L, int arg, int n)
+{
+    // push & return the optional f64 output array at arg, or a new one
+    NumArray *r;
+    if (lua_isnoneornil(L, arg))
+        return pusharray(L, n, DT_F64);
+    r = checkarray(L, arg);
+    luaL_argcheck(L, r->dtype == DT_F64, arg, "f64 array expected");
+    luaL_argcheck(L, r->size == n, arg, "array sizes differ");
+    checkwritable(L, arg, r);
+    lua_pushvalue(L, arg);
+
+    return r;
+}
+
+static int
+mathunary (lua_State *L, UnKernel fast, UnKernel strict)
+{
+    // [x out] -> [.. r], r = f(x)
+    NumArray *x = checkf64(L, 1);
+    NumArray *r = checkf64result(L, 2, x->size);
+
+    unary(L, mathstrict ? strict : fast, r, x);
+
+    return 1;
+}
+
+#define MATH_FUNC(name)                                                       \
+static int name##math (lua_State *L)                                          \
+{ return mathunary(L, vm_##name, vm_##name##_libm); }
+
+MATH_FUNC(sin)
+MATH_FUNC(cos)
+MATH_FUNC(tan)
+MATH_FUNC(exp)
+MATH_FUNC(log)
+MATH_FUNC(log1p)
+MATH_FUNC(sqrt)
+MATH_FUNC(tanh)
+MATH_FUNC(sigmoid)
+MATH_FUNC(erf)
+
+static int
+powmath (lua_State *L)
+{
+    // [x y out] -> [.. r], r = x^y with y an array, a table or a number
+    NumArray *x = checkf64(L, 1), *y = NULL, *r;
+    Elem s;
+    Operand in[2] = { { x, NULL }, { NULL, &s } };
+    Kernel k;
+
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        s.F64 = lua_tonumber(L, 2);
+        k.bin = mathstrict ? vm_pow_libm_as : vm_pow_as;
+    } else {
+        y = checkf64(L, 2);
+        luaL_argcheck(L, y->size == x->size, 2, "array sizes differ");
+        in[1].a = y;
+        k.bin = mathstrict ? vm_pow_libm_aa : vm_pow_aa;
+    }
+    r = checkf64result(L, 3, x->size);
+    elementwise(L, K_BINARY, k, r, in);
+
+    return 1;
+}
+
+static int
+mathmode (lua_State *L)
+{
+    // [mode] -> [.. mode], sets the mode ("fast" or "strict") if given
+    static const char *const modes[] = { "fast", "strict", NULL };
+    if (!lua_isnoneornil(L, 1))
+        mathstrict = luaL_checkoption(L, 1, NULL, modes);
+    lua_pushstring(L, modes[mathstrict]);
+    return 1;
+}
+
+// masks
+// a:eq(b), a:ne(b), a:lt(b), a:le(b), a:gt(b) and a:ge(b) compare a with an
+// array or a number into a mask: a u8 array with 1 where the comparison
+// holds, 0 where it does not (NaNs only compare not equal).  Unlike for
+// arithmetic, a number is not converted to a's dtype: any number compares
+// as its exact value, so u8:lt(300) is all ones and i32:gt(0.5) is
+// i32:ge(1) (see cmpscalar).  Any u8 array works as a mask, with every
+// byte that is not 0 being true.  m:land(b), m:lor(b) and m:lnot() (also
+// m & b, m | b and ~m) combine masks into new ones, m:count(), m:any() and
+// m:all() summarize them.  a:compress(m) returns the elements of a where
+// m is true, array.where(m, x, y) picks x[i] where m[i] is true and y[i]
+// elsewhere, with x & y arrays or numbers.
+//
+// compress is a parallel stream compaction: every chunk counts its true
+// bytes, the counts are turned into offsets in chunk order, and then every
+// chunk compacts its elements into blocks on the C stack, storing each
+// element & only advancing where the mask is true (no branches to
+// mispredict), and copies the blocks to its part of the result.
+
+static NumArray *
+checkmask (lua_State *L, int arg, int n)
+{
+    // a u8 array at arg, of n elements unless n < 0
+    NumArray *m = checkarray(L, arg);
+    luaL_argcheck(L, m->dtype == DT_U8, arg, "mask (u8 array) expected");
+    luaL_argcheck(L, n < 0 || m->size == n, arg, "array sizes differ");
+    return m;
+}
+
+#define CMP_RANGE(DT, T, WT, KIND, NAME)                                      \
+    case DT_##DT:                                                             \
+        mn = (int64_t)TMIN_##KIND(T);                                         \
+        mx = (uint64_t)TMAX_##KIND(T);                                        \
+        break;
+#define CMP_SCALAR(DT, T, WT, KIND, NAME)                                     \
+    case DT_##DT:                                                             \
+        s->DT = (T)i;                                                         \
+        break;
+
+static int
+cmpscalar (lua_State *L, int arg, NumArray *a, int *cmp, Elem *s)
+{
+    // number arg as the element *s to compare a's elements with, maybe
+    // changing *cmp; -1, or 0 or 1 if that is the result for all elements.
+    // For integer dtypes, x < v is x < ceil(v), x <= v is x <= floor(v)
+    // (and so on), and a v beyond the dtype's range decides alone.  For
+    // f32, x < v is x <= the largest float below v if v is not a float.
+    static const int below[NCMPS] = { 0, 1, 0, 0, 1, 1 };
+    static const int above[NCMPS] = { 0, 1, 1, 1, 0, 0 };
+    int64_t mn = 0, i;
+    uint64_t mx = 0;
+    double v, c;
+
+    if (DTYPE(a)->kind == KIND_FLOAT) {
+        float f;
+        v = luaL_checknumber(L, arg);
+        if (a->dtype == DT_F64) {
+            s->F64 = v;
+            return -1;
+        }
+        f = (float)v;
+        if (v == v && (double)f != v) {
+            if (*cmp == CMP_EQ || *cmp == CMP_NE)
+                return *cmp == CMP_NE;
+            if (*cmp == CMP_LT || *cmp == CMP_LE) {
+                *cmp = CMP_LE;
+                f = (double)f < v ? f : nextafterf(f, -INFINITY);
+            } else {
+                *cmp = CMP_GE;
+                f = (double)f > v ? f : nextafterf(f, INFINITY);
+            }
+        }
+        s->F32 = f;
+        return -1;
+    }
+    switch (a->dtype) {
+    DTYPES(CMP_RANGE)
+    }
+    if (lua_isinteger(L, arg)) {
+        i = lua_tointeger(L, arg);
+        if (i < mn)
+            return below[*cmp];
+        if (i >= 0 && (uint64_t)i > mx)
+            return above[*cmp];
+    } else {
+        v = luaL_checknumber(L, arg);
+        if (v != v)
+            return *cmp == CMP_NE;
+        c = *cmp == CMP_LT || *cmp == CMP_GE ? ceil(v) : floor(v);
+        if ((*cmp == CMP_EQ || *cmp == CMP_NE) && c != v)
+            return *cmp == CMP_NE;
+        if (c < (double)mn)
+            return below[*cmp];
+        if (c >= (double)mx + 1.0)      // 2^63 or 2^64 for 64 bits
+            return above[*cmp];
+        i = c < 0 ? (int64_t)c : (int64_t)(uint64_t)c;
+    }
+    switch (a->dtype) {
+    DTYPES(CMP_SCALAR)
+    }
+    return -1;
+}
+
+static int
+compare (lua_State *L, int cmp)
+{
+    // [ud b out] -> [.. m], m = ud cmp b
+    NumArray *a = checkarray(L, 1);
+    Elem s;
+    NumArray *b = (NumArray *)udata_test(L, 2, UV_ARRAY, "ex04.array");
+    NumArray *m;
+    Operand in[2] = { { a, NULL }, { b, &s } };
+    Kernel k;
+    int all = -1;
+
+    if (b != NULL)
+        checksame(L, 2, a, b);
+    else
+        all = cmpscalar(L, 2, a, &cmp, &s);
+
+    if (lua_isnoneornil(L, 3))
+        m = pusharray(L, a->size, DT_U8);
+    else {
+        m = checkmask(L, 3, a->size);
+        checkwritable(L, 3, m);
+        lua_pushvalue(L, 3);
+    }
+    if (all >= 0) {
+        uint8_t val = (uint8_t)all;
+        scatter(m->data, STEP(m), &val, 0, 1, m->size);
+        return 1;
+    }
+    k.bin = b ? DTYPE(a)->cmp[cmp].aa : DTYPE(a)->cmp[cmp].as;
+    elementwise(L, K_BINARY, k, m, in);
+
+    return 1;
+}
+
+static int eqcompare (lua_State *L) { return compare(L, CMP_EQ); }
+static int necompare (lua_State *L) { return compare(L, CMP_NE); }
+static int ltcompare (lua_State *L) { return compare(L, CMP_LT); }
+static int lecompare (lua_State *L) { return compare(L, CMP_LE); }
+static int gtcompare (lua_State *L) { return compare(L, CMP_GT); }
+static int gecompare (lua_State *L) { return compare(L, CMP_GE); }
+
+static void
+maskand (void *r_, const void *x_, const void *y_, int n)
+{
+    uint8_t *r = (uint8_t *)r_;
+    const uint8_t *x = (const uint8_t *)x_, *y = (const uint8_t *)y_;
+    int i;
+    for (i = 0; i < n; i++)
+        r[i] = (x[i] != 0) & (y[i] != 0);
+}
+
+static void
+maskor (void *r_, const void *x_, const void *y_, int n)
+{
+    uint8_t *r = (uint8_t *)r_;
+    const uint8_t *x = (const uint8_t *)x_, *y = (const uint8_t *)y_;
+    int i;
+    for (i = 0; i < n; i++)
+        r[i] = (x[i] != 0) | (y[i] != 0);
+}
+
+static void
+masknot (void *r_, const void *x_, int n)
+{
+    uint8_t *r = (uint8_t *)r_;
+    const uint8_t *x = (const uint8_t *)x_;
+    int i;
+    for (i = 0; i < n; i++)
+        r[i] = x[i] == 0;
+}
+
+static int
+masklogic (lua_State *L, BinKernel f)
+{
+    // [m b] -> [.. r], r = m and b (or m or b)
+    NumArray *m = checkmask(L, 1, -1);
+    NumArray *b = checkmask(L, 2, m->size);
+    NumArray *r = pusharray(L, m->size, DT_U8);
+    Operand in[2] = { { m, NULL }, { b, NULL } };
+    Kernel k;
+
+    k.bin = f;
+    elementwise(L, K_BINARY, k, r, in);
+
+    return 1;
+}
+
+static int landmask (lua_State *L) { return masklogic(L, maskand); }
+static int lormask (lua_State *L) { return masklogic(L, maskor); }
+
+static int
+lnotmask (lua_State *L)
+{
+    // [m] -> [.. r], r = not m
+    NumArray *m = checkmask(L, 1, -1);
+    NumArray *r = pusharray(L, m->size, DT_U8);
+    unary(L, masknot, r, m);
+    return 1;
+}
+
+typedef struct MaskJob {
+    NumArray *m, *a, *r;
+    int *count;             // per chunk, later the offset of the chunk in r
+} MaskJob;
+
+static void
+counttask (void *ctx, int chunk)
+{
+    MaskJob *job = (MaskJob *)ctx;
+    NumArray *m = job->m;
+    int lo = chunk * grain;
+    int hi = m->size - lo < grain ? m->size : lo + grain;
+    const uint8_t *p = (const uint8_t *)ELEM(m, lo);
+    ptrdiff_t step = STEP(m);
+    int i, c = 0;
+
+    if (step == 1) {
+        for (i = 0; i < hi - lo; i++)
+            c += p[i] != 0;
+    } else {
+        for (i = 0; i < hi - lo; i++)
+            c += p[i * step] != 0;
+    }
+    job->count[chunk] = c;
+}
+
+static int
+countmask (lua_State *L, NumArray *m, MaskJob *job)
+{
+    // [..] -> [.. counts], number of true bytes in m, with job->count the
+    // counts per chunk (in a userdata, so that errors later on leak none)
+    int nchunks = NCHUNKS(m->size), c, total = 0;
+    job->m = m;
+    job->count = lua_newuserdata(L, (size_t)nchunks * sizeof(int));
+    pool_run(counttask, job, nchunks);
+    for (c = 0; c < nchunks; c++)
+        total += job->count[c];
+
+    return total;
+}
+
+static int
+counttrue (lua_State *L, NumArray *m)
+{
+    MaskJob job;
+    int n = countmask(L, m, &job);
+    lua_pop(L, 1);
+    return n;
+}
+
+static int
+count (lua_State *L)
+{
+    // [m] -> [.. n], the number of true bytes
+    lua_pushinteger(L, counttrue(L, checkmask(L, 1, -1)));
+    return 1;
+}
+
+static int
+anymask (lua_State *L)
+{
+    NumArray *m = checkmask(L, 1, -1);
+    lua_pushboolean(L, counttrue(L, m) > 0);
+    return 1;
+}
+
+static int
+allmask (lua_State *L)
+{
+    NumArray *m = checkmask(L, 1, -1);
+    lua_pushboolean(L, counttrue(L, m) == m->size);
+    return 1;
+}
+
+// store element i at d[j], and keep it if mask byte i is true
+#define COMPACT_ELEMS(T)                                                      \
+    for (i = 0; i < n; i++) {                                                 \
+        ((T *)d)[j] = *(const T *)(s + i * sstep);                            \
+        j += mp[i * mstep] != 0;                                              \
+    }
+
+static void
+compresstask (void *ctx, int chunk)
+{
+    MaskJob *job = (MaskJob *)ctx;
+    _Alignas(ARRAY_ALIGN) Elem buf[EW_BLOCK];
+    NumArray *a = job->a;
+    size_t size = DTYPE(a)->size;
+    ptrdiff_t sstep = STEP(a), mstep = STEP(job->m);
+    int lo = chunk * grain, off = job->count[chunk];
+    int hi = a->size - lo < grain ? a->size : lo + grain;
+
+    for (; lo < hi; lo += EW_BLOCK) {
+        const char *s = (const char *)ELEM(a, lo);
+        const uint8_t *mp = (const uint8_t *)ELEM(job->m, lo);
+        char *d = (char *)buf;
+        int n = hi - lo < EW_BLOCK ? hi - lo : EW_BLOCK, i, j = 0;
+        switch (size) {
+        case 1: COMPACT_ELEMS(uint8_t); break;
+        case 2: COMPACT_ELEMS(uint16_t); break;
+        case 4: COMPACT_ELEMS(uint32_t); break;
+        default: COMPACT_ELEMS(uint64_t); break;
+        }
+        memcpy(ELEM(job->r, off), buf, (size_t)j * size);
+        off += j;
+    }
+}
+
+static int
+compress (lua_State *L)
+{
+    // [ud m] -> [.. r], the elements of ud where m is true
+    NumArray *a = checkarray(L, 1);
+    NumArray *m = checkmask(L, 2, a->size);
+    MaskJob job;
+    int n = countmask(L, m, &job), nchunks = NCHUNKS(a->size), c, off;
+
+    job.a = a;
+    job.r = pusharray(L, n, a->dtype);
+    for (c = off = 0; c < nchunks; c++) {
+        int t = job.count[c];
+        job.count[c] = off;
+        off += t;
+    }
+    pool_run(compresstask, &job, nchunks);
+
+    return 1;
+}
+
+static NumArray *
+whereoperand (lua_State *L, int arg, int dtype, int n, Elem *s)
+{
+    // arg is an array of dtype & n elements (returned) or a number,
+    // converted into *s (NULL is returned)
+    NumArray *a = (NumArray *)udata_test(L, arg, UV_ARRAY, "ex04.array");
+    if (a == NULL) {
+        checkvalue(L, &dtypes[dtype], arg, s);
+        return NULL;
+    }
+    luaL_argcheck(L, a->size == n, arg, "array sizes differ");
+    luaL_argcheck(L, a->dtype == dtype, arg, "array dtypes differ");
+    return a;
+}
+
+static int
+where (lua_State *L)
+{
+    // [m x y out] -> [.. r], r[i] = m[i] ? x[i] : y[i]
+    NumArray *m = checkmask(L, 1, -1), *x, *y, like = { 0 };
+    NumArray *ax = (NumArray *)udata_test(L, 2, UV_ARRAY, "ex04.array");
+    NumArray *ay = (NumArray *)udata_test(L, 3, UV_ARRAY, "ex04.array");
+    Elem xs, ys;
+    Operand in[3] = { { m, NULL }, { NULL, &xs }, { NULL, &ys } };
+    Kernel k;
+
+    like.size = m->size;
+    like.dtype = ax ? ax->dtype : ay ? ay->dtype : DT_F64;
+    x = in[1].a = whereoperand(L, 2, like.dtype, m->size, &xs);
+    y = in[2].a = whereoperand(L, 3, like.dtype, m->size, &ys);
+    NumArray *r = checkresult(L, 4, &like, 0);
+    k.fma = DTYPE(&like)->where[(x == NULL) * 2 + (y == NULL)];
+    elementwise(L, K_TERNARY, k, r, in);
+
+    return 1;
+}
+
+// parallel reductions
+// Each chunk of grain elements is reduced on its own, by the thread pool,
+// and the partial results are combined in chunk order.  Floating point
+// partial sums are combined with Neumaier's compensated summation.
+
+// how to combine partial results: float sum, integer sum, min & max
+typedef enum {
+    COMBINE_FSUM, COMBINE_ISUM,
+    COMBINE_FMIN, COMBINE_IMIN, COMBINE_UMIN,
+    COMBINE_FMAX, COMBINE_IMAX, COMBINE_UMAX
+} Combine;
+
+static Combine
+combinesum (const DType *dt)
+{
+    return dt->kind == KIND_FLOAT ? COMBINE_FSUM : COMBINE_ISUM;
+}
+
+static Combine
+combineminmax (const DType *dt, int ismax)
+{
+    // relies on the order of KIND_xxx and COMBINE_xxx
+    return (ismax ? COMBINE_FMAX : COMBINE_FMIN)
+           + (dt->kind == KIND_FLOAT ? 0 : dt->kind + 1);
+}
+
+static void
+combine (Combine how, Acc *r, Acc v, double *comp)
+{
+    // fold partial result v into r, comp tracks the lost low order bits
+    // of a floating point sum
+    switch (how) {
+    case COMBINE_FSUM: {
+        double s = r->d + v.d;
+        *comp += fabs(r->d) >= fabs(v.d) ? (r->d - s) + v.d
+                                         : (v.d - s) + r->d;
+        r->d = s;
+        break;
+    }
+    case COMBINE_ISUM: r->u += v.u; break;
+    case COMBINE_FMIN: r->d = smin(v.d, r->d); break;
+    case COMBINE_IMIN: r->i = smin(v.i, r->i); break;
+    case COMBINE_UMIN: r->u = smin(v.u, r->u); break;
+    case COMBINE_FMAX: r->d = smax(v.d, r->d); break;
+    case COMBINE_IMAX: r->i = smax(v.i, r->i); break;
+    case COMBINE_UMAX: r->u = smax(v.u, r->u); break;
+    }
+}
+
+static Acc
+reducerange (Reducer f, Combine how, NumArray *a, NumArray *b, double c,
+             int lo, int hi)
+{
+    // reduce elements lo .. hi-1 of a (and b), either may be a strided
+    // view.  Strided views are reduced in blocks gathered on the C stack.
+    _Alignas(ARRAY_ALIGN) Elem xbuf[EW_BLOCK], ybuf[EW_BLOCK];
+    size_t size = DTYPE(a)->size;
+    double comp = 0.0;
+    Acc r;
+    int i;
+
+    if (CONTIGUOUS(a) && (b == NULL || CONTIGUOUS(b)))
+        return f(a->data, b ? b->data : NULL, c, lo, hi);
+    if (lo == hi)
+        return f(a->data, NULL, c, 0, 0);
+
+    for (i = lo; i < hi; i += EW_BLOCK) {
+        int m = hi - i < EW_BLOCK ? hi - i : EW_BLOCK;
+        scatter(xbuf, size, ELEM(a, i), STEP(a), size, m);
+        if (b != NULL)
+            scatter(ybuf, size, ELEM(b, i), STEP(b), size, m);
+        Acc v = f(xbuf, ybuf, c, 0, m);
+        if (i == lo)
+            r = v;
+        else
+            combine(how, &r, v, &comp);
+    }
+    if (how == COMBINE_FSUM)
+        r.d += comp;
+
+    return r;
+}
+
+typedef struct ReduceJob {
+    Reducer f;
+    Combine how;
+    NumArray *a, *b;
+    double c;
+    Acc *result;        // one per chunk
+} ReduceJob;
+
+static void
+reducetask (void *ctx, int chunk)
+{
+    ReduceJob *job = (ReduceJob *)ctx;
+    int n = job->a->size, lo = chunk * grain;
+    job->result[chunk] = reducerange(job->f, job->how, job->a, job->b,
+            job->c, lo, n - lo < grain ? n : lo + grain);
+}
+
+static Acc
+reduce (Reducer f, Combine how, NumArray *a, NumArray *b, double c)
+{
+    // reduce all of array a (and b) with f
+    int nchunks = NCHUNKS(a->size), t;
+    double comp = 0.0;
+    Acc r, *result;
+
+    if (nchunks <= 1 ||
+        (result = malloc((size_t)nchunks * sizeof(Acc))) == NULL)
+        return reducerange(f, how, a, b, c, 0, a->size);
+
+    ReduceJob job = { f, how, a, b, c, result };
+    pool_run(reducetask, &job, nchunks);
+
+    r = result[0];
+    for (t = 1; t < nchunks; t++)
+        combine(how, &r, result[t], &comp);
+    if (how == COMBINE_FSUM)
+        r.d += comp;
+    free(result);
+
+    return r;
+}
+
+static int
+findfirst (NumArray *a, Acc v)
+{
+    // 0-based index of the first element of a equal to v, -1 if none
+    _Alignas(ARRAY_ALIGN) Elem buf[EW_BLOCK];
+    size_t size = DTYPE(a)->size;
+    int lo, i;
+
+    if (CONTIGUOUS(a))
+        return DTYPE(a)->findfirst(a->data, a->size, v);
+    for (lo = 0; lo < a->size; lo += EW_BLOCK) {
+        int m = a->size - lo < EW_BLOCK ? a->size - lo : EW_BLOCK;
+        scatter(buf, size, ELEM(a, lo), STEP(a), size, m);
+        if ((i = DTYPE(a)->findfirst(buf, m, v)) >= 0)
+            return lo + i;
+    }
+    return -1;
+}
+
+static void
+pushacc (lua_State *L, const DType *dt, Acc v)
+{
+    // push a reduction result as a number of dt's kind
+    switch (dt->kind) {
+    case KIND_FLOAT:  lua_pushnumber(L, v.d); break;
+    case KIND_SIGNED: lua_pushinteger(L, (lua_Integer)v.i); break;
+    default:          lua_pushinteger(L, (lua_Integer)v.u); break;
+    }
+}
+
+static int
+sum (lua_State *L)
+{
+    // floats are summed pairwise, integers exactly (modulo 2^64)
+    NumArray *a = checkarray(L, 1);
+    const DType *dt = DTYPE(a);
+    pushacc(L, dt, reduce(dt->sum, combinesum(dt), a, NULL, 0.0));
+    return 1;
+}
+
+static double
+meanof (NumArray *a)
+{
+    return reduce(DTYPE(a)->fsum, COMBINE_FSUM, a, NULL, 0.0).d / a->size;
+}
+
+static int
+mean (lua_State *L)
+{
+    NumArray *a = checkarray(L, 1);
+    lua_pushnumber(L, meanof(a));
+    return 1;
+}
+
+static int
+var (lua_State *L)
+{
+    // [ud ddof] -> variance, sum of squared deviations / (n - ddof)
+    // two passes (mean, then deviations) avoid the cancellation of the
+    // sum(x^2) - n*mean^2 shortcut; ddof is 0 .. n - 1 (an empty array
+    // has variance NaN, like its mean)
+    NumArray *a = checkarray(L, 1);
+    lua_Integer ddof = luaL_optinteger(L, 2, 0);
+    double m, ss;
+    luaL_argcheck(L, ddof >= 0 && (ddof == 0 || ddof < a->size), 2,
+            "ddof out of range");
+    m = meanof(a);
+    ss = reduce(DTYPE(a)->sqdev, COMBINE_FSUM, a, NULL, m).d;
+    lua_pushnumber(L, ss / (double)(a->size - ddof));
+    return 1;
+}
+
+static int
+dot (lua_State *L)
+{
+    NumArray *a = checkarray(L, 1);
+    NumArray *b = checkarray(L, 2);
+    const DType *dt = DTYPE(a);
+    checksame(L, 2, a, b);
+    pushacc(L, dt, reduce(dt->dot, combinesum(dt), a, b, 0.0));
+    return 1;
+}
+
+static int
+norm (lua_State *L)
+{
+    // the euclidean (L2) norm
+    NumArray *a = checkarray(L, 1);
+    lua_pushnumber(L, sqrt(reduce(DTYPE(a)->sumsq, COMBINE_FSUM, a, NULL,
+                                  0.0).d));
+    return 1;
+}
+
+static int
+minmax (lua_State *L, int ismax, int wantindex)
+{
+    // [ud] -> min or max value (or its 1-based index), NaNs are skipped
+    // unless there is nothing else
+    NumArray *a = checkarray(L, 1);
+    const DType *dt = DTYPE(a);
+    luaL_argcheck(L, a->size > 0, 1, "empty array");
+    Acc m = reduce(ismax ? dt->max : dt->min, combineminmax(dt, ismax), a,
+                   NULL, 0.0);
+    int i = findfirst(a, m);
+    if (i < 0)  // all NaN
+        i = 0;
+    if (wantindex)
+        lua_pushinteger(L, i + 1);
+    else
+        dt->push(L, ELEM(a, i));
+
+    return 1;
+}
+
+static int argmin (lua_State *L) { return minmax(L, 0, 1); }
+static int argmax (lua_State *L) { return minmax(L, 1, 1); }
+
+static int
+minmethod (lua_State *L)
+{
+    // a:min() reduces, a:min(b [, out]) is elementwise
+    return lua_isnoneornil(L, 2) ? minmax(L, 0, 0) : minarith(L);
+}
+
+static int
+maxmethod (lua_State *L)
+{
+    // a:max() reduces, a:max(b [, out]) is elementwise
+    return lua_isnoneornil(L, 2) ? minmax(L, 1, 0) : maxarith(L);
+}
+
+// gather & scatter
+// a:take(idx [, out]) gathers out[i] = a[idx[i]], a:put(idx, vals) sets
+// a[idx[i]] = vals[i] and a:scatter_add(idx, vals) adds vals[i] to
+// a[idx[i]], with idx an integer array of 1-based indices (like argsort
+// returns) and vals an array of a's dtype & #idx elements, or a number.
+// The indices are checked once, by a parallel min & max of idx, so the
+// loops that move the elements do no checks.  They convert a block of
+// indices at a time and prefetch the element GATHER_AHEAD indices on,
+// which hides most of the latency of random accesses into arrays that
+// are larger than the caches.  take runs in parallel; put & scatter_add
+// run in the order of idx, so the last of repeated indices wins & sums
+// come out like those of a Lua loop.
+
+#define INDEX_CASE(DT, T, WT, KIND, NAME)                                     \
+    case DT_##DT:                                                             \
+        for (i = 0; i < n; i++)                                               \
+            r[i] = (int64_t)*(const T *)(p + i * step) - 1;                   \
+        break;
+
+static void
+toindex (int64_t *r, const NumArray *idx, int lo, int n)
+{
+    // r[i] = idx[lo + i] - 1, the 0-based indices
+    const char *p = (const char *)ELEM(idx, lo);
+    ptrdiff_t step = STEP(idx);
+    int i;
+    switch (idx->dtype) {
+    DTYPES(INDEX_CASE)
+    }
+}
+
+static NumArray *
+checkindex (lua_State *L, int arg, const NumArray *a)
+{
+    // an integer array at arg with all elements in 1 .. #a
+    NumArray *idx = checkarray(L, arg);
+    const DType *dt = DTYPE(idx);
+    Acc lo, hi;
+
+    luaL_argcheck(L, dt->kind != KIND_FLOAT, arg, "integer array expected");
+    if (idx->size == 0)
+        return idx;
+    lo = reduce(dt->min, combineminmax(dt, 0), idx, NULL, 0.0);
+    hi = reduce(dt->max, combineminmax(dt, 1), idx, NULL, 0.0);
+    if (dt->kind == KIND_SIGNED)
+        luaL_argcheck(L, lo.i >= 1 && hi.i <= a->size, arg,
+                "index out of range");
+    else
+        luaL_argcheck(L, lo.u >= 1 && hi.u <= (uint64_t)a->size, arg,
+                "index out of range");
+
+    return idx;
+}
+
+// r[i] = s[ix[i]] or r[ix[i]] = s[i], steps in bytes
+#define GATHER_ELEMS(T)                                                       \
+    for (i = 0; i < n; i++) {                                                 \
+        if (i + GATHER_AHEAD < n)                                             \
+            __builtin_prefetch(s + ix[i + GATHER_AHEAD] * sstep);             \
+        *(T *)(d + i * dstep) = *(const T *)(s + ix[i] * sstep);              \
+    }
+#define SCATTER_ELEMS(T)                                                      \
+    for (i = 0; i < n; i++) {                                                 \
+        if (i + GATHER_AHEAD < n)                                             \
+            __builtin_prefetch(d + ix[i + GATHER_AHEAD] * dstep, 1);          \
+        *(T *)(d + ix[i] * dstep) = *(const T *)(s + i * sstep);              \
+    }
+
+static void
+gather (void *dst, ptrdiff_t dstep, const void *src, ptrdiff_t sstep,
+        const int64_t *ix, size_t size, int n)
+{
+    char *d = (char *)dst;
+    const char *s = (const char *)src;
+    int i;
+    switch (size) {
+    case 1: GATHER_ELEMS(uint8_t); break;
+    case 2: GATHER_ELEMS(uint16_t); break;
+    case 4: GATHER_ELEMS(uint32_t); break;
+    default: GATHER_ELEMS(uint64_t); break;
+    }
+}
+
+static void
+scatterix (void *dst, ptrdiff_t dstep, const int64_t *ix, const void *src,
+           ptrdiff_t sstep, size_t size, int n)
+{
+    char *d = (char *)dst;
+    const char *s = (const char *)src;
+    int i;
+    switch (size) {
+    case 1: SCATTER_ELEMS(uint8_t); break;
+    case 2: SCATTER_ELEMS(uint16_t); break;
+    case 4: SCATTER_ELEMS(uint32_t); break;
+    default: SCATTER_ELEMS(uint64_t); break;
+    }
+}
+
+typedef struct TakeJob {
+    NumArray *a, *idx, *r;
+} TakeJob;
+
+static void
+taketask (void *ctx, int chunk)
+{
+    TakeJob *job = (TakeJob *)ctx;
+    int64_t ix[EW_BLOCK];
+    NumArray *a = job->a, *r = job->r;
+    int lo = chunk * grain;
+    int hi = r->size - lo < grain ? r->size : lo + grain;
+
+    for (; lo < hi; lo += EW_BLOCK) {
+        int n = hi - lo < EW_BLOCK ? hi - lo : EW_BLOCK;
+        toindex(ix, job->idx, lo, n);
+        gather(ELEM(r, lo), STEP(r), a->data, STEP(a), ix, DTYPE(a)->size, n);
+    }
+}
+
+static int
+take (lua_State *L)
+{
+    // [ud idx out] -> [.. r], r[i] = ud[idx[i]]
+    NumArray *a = checkarray(L, 1);
+    NumArray *idx = checkindex(L, 2, a), *r;
+    TakeJob job;
+
+    if (lua_isnoneornil(L, 3))
+        r = pusharray(L, idx->size, a->dtype);
+    else {
+        r = checkarray(L, 3);
+        luaL_argcheck(L, r->size == idx->size, 3, "array sizes differ");
+        luaL_argcheck(L, r->dtype == a->dtype, 3, "array dtypes differ");
+        luaL_argcheck(L, !intersects(r, r->size, a, a->size)
+                         && !overlaps(r, idx, r->size), 3,
+                "out overlaps the inputs");
+        checkwritable(L, 3, r);
+        lua_pushvalue(L, 3);
+    }
+    job.a = a;
+    job.idx = idx;
+    job.r = r;
+    pool_run(taketask, &job, NCHUNKS(r->size));
+
+    return 1;
+}
+
+static int
+scatterop (lua_State *L, int add)
+{
+    // [ud idx vals] -> [ud], ud[idx[i]] = vals[i] (or += if add)
+    NumArray *a = checkarray(L, 1);
+    NumArray *idx = checkindex(L, 2, a);
+    int64_t ix[EW_BLOCK];
+    Elem s;
+    NumArray *v = (NumArray *)udata_test(L, 3, UV_ARRAY, "ex04.array");
+    size_t size = DTYPE(a)->size;
+    int lo;
+
+    if (v == NULL)
+        checkvalue(L, DTYPE(a), 3, &s);
+    else {
+        luaL_argcheck(L, v->size == idx->size, 3, "array sizes differ");
+        luaL_argcheck(L, v->dtype == a->dtype, 3, "array dtypes differ");
+    }
+    // indices that are elements of a would change as a does
+    luaL_argcheck(L, !intersects(idx, idx->size, a, a->size), 2,
+            "indices overlap the array");
+    checkwritable(L, 1, a);
+
+    for (lo = 0; lo < idx->size; lo += EW_BLOCK) {
+        int n = idx->size - lo < EW_BLOCK ? idx->size - lo : EW_BLOCK;
+        const void *x = v ? ELEM(v, lo) : (const void *)&s;
+        ptrdiff_t xstep = v ? STEP(v) : 0;
+        toindex(ix, idx, lo, n);
+        if (add)
+            DTYPE(a)->scatteradd(a->data, STEP(a), ix, x, xstep, n);
+        else
+            scatterix(a->data, STEP(a), ix, x, xstep, size, n);
+    }
+    lua_settop(L, 1);
+
+    return 1;
+}
+
+static int put (lua_State *L) { return scatterop(L, 0); }
+static int scatteradd (lua_State *L) { return scatterop(L, 1); }
+
+// random numbers
+// a:random_uniform(lo, hi, seed) fills a with numbers uniform in [lo, hi)
+// (0 & 1 by default), or for integer dtypes with integers in lo .. hi, both
+// included.  a:random_normal(mu, sigma, seed) fills a float array with
+// normal deviates (mean 0 & deviation 1 by default).  a:shuffle(seed)
+// permutes the elements in place (Fisher-Yates) and a:sample(k, replace,
+// seed) returns a new array of k elements drawn from a, without
+// replacement unless replace is true.  All of them take their numbers from
+// the xoshiro256** streams of rand.h: block b of RAND_BLOCK elements from
+// stream b of the seed, the blocks spread over the thread pool, so a seed
+// gives the same numbers whatever array.threads & array.grain say.  Without
+// a seed they take the next one of a global sequence of seeds, which
+// array.randomseed(n) restarts (like math.randomseed, for all lua_States).
+// shuffle & sample without replacement draw from a single stream, in
+// order; the latter runs a partial Fisher-Yates over the indices of a,
+// kept in a scratch array of #a indices if k is a large part of #a, or
+// else in a hash table of the O(k) indices moved (samplesparse).
+
+static _Atomic uint64_t randseeds = RAND_GOLDEN;
+
+enum { RAND_FLOAT, RAND_INT, RAND_NORMAL, RAND_INDEX };
+
+typedef struct RandJob {
+    NumArray *r;        /* the array to fill */
+    const NumArray *a;  /* RAND_INDEX: the array to draw elements from */
+    int kind;           /* RAND_xxx */
+    int perchunk;       /* RAND_BLOCKs per chunk */
+    uint64_t seed;
+    double x, y;        /* lo & hi, or mu & sigma */
+    double top;         /* RAND_FLOAT: the largest element below hi */
+    uint64_t lo, span;  /* RAND_INT: lo + [0, span), span 0 for 2^64 */
+} RandJob;
+
+static uint64_t
+checkseed (lua_State *L, int arg)
+{
+    // the seed at arg, or the next one of the global sequence
+    if (lua_isnoneornil(L, arg))
+        return rand_mix(atomic_fetch_add(&randseeds, RAND_GOLDEN));
+    return (uint64_t)luaL_checkinteger(L, arg);
+}
+
+#define FROMINT_CASE(DT, T, WT, KIND, NAME)                                   \
+    case DT_##DT:                                                             \
+        for (i = 0; i < n; i++)                                               \
+            *(T *)(p + i * step) = (T)v[i];                                   \
+        break;
+
+static void
+fromint (NumArray *r, int lo, const uint64_t *v, int n)
+{
+    // r[lo + i] = v[i], for integer dtypes (two's complement wraps)
+    char *p = (char *)ELEM(r, lo);
+    ptrdiff_t step = STEP(r);
+    int i;
+    switch (r->dtype) {
+    DTYPES(FROMINT_CASE)
+    }
+}
+
+static void
+randblock (RandJob *job, int b)
+{
+    // fill block b from stream b
+    _Alignas(ARRAY_ALIGN) double x[EW_BLOCK];
+    uint64_t v[EW_BLOCK];
+    int64_t ix[EW_BLOCK];
+    NumArray *r = job->r;
+    int lo = b * RAND_BLOCK, hi = r->size - lo < RAND_BLOCK ? r->size
+                                                            : lo + RAND_BLOCK;
+    RandBuf rb;
+    int i;
+
+    rand_bufseed(&rb, job->seed, (uint64_t)b);
+    for (; lo < hi; lo += EW_BLOCK) {
+        int n = hi - lo < EW_BLOCK ? hi - lo : EW_BLOCK;
+        switch (job->kind) {
+        case RAND_FLOAT:
+            rand_uniform(&rb.st, x, n, job->x, job->y);
+            for (i = 0; i < n; i++)
+                x[i] = x[i] > job->top ? job->top : x[i];
+            DTYPE(r)->fromdouble(ELEM(r, lo), STEP(r), x, n);
+            break;
+        case RAND_NORMAL:
+            rand_normal(&rb.st, x, n, job->x, job->y);
+            DTYPE(r)->fromdouble(ELEM(r, lo), STEP(r), x, n);
+            break;
+        case RAND_INT:
+            for (i = 0; i < n; i++)
+                v[i] = job->lo + rand_below(&rb, job->span);
+            fromint(r, lo, v, n);
+            break;
+        default:  // RAND_INDEX
+            for (i = 0; i < n; i++)
+                ix[i] = (int64_t)rand_below(&rb, (uint64_t)job->a->size);
+            gather(ELEM(r, lo), STEP(r), job->a->data, STEP(job->a), ix,
+                   DTYPE(r)->size, n);
+            break;
+        }
+    }
+}
+
+static void
+randtask (void *ctx, int chunk)
+{
+    RandJob *job = (RandJob *)ctx;
+    int nblocks = (job->r->size + RAND_BLOCK - 1) / RAND_BLOCK;
+    int b = chunk * job->perchunk;
+    int end = nblocks - b < job->perchunk ? nblocks : b + job->perchunk;
+
+    for (; b < end; b++)
+        randblock(job, b);
+}
+
+static void
+randfill (RandJob *job)
+{
+    // fill job->r, in chunks of whole blocks of about grain elements
+    int nblocks = (job->r->size + RAND_BLOCK - 1) / RAND_BLOCK;
+
+    job->perchunk = grain > RAND_BLOCK ? grain / RAND_BLOCK : 1;
+    pool_run(randtask, job, (nblocks + job->perchunk - 1) / job->perchunk);
+}
+
+static int
+randomuniform (lua_State *L)
+{
+    // [ud lo hi seed] -> [ud]
+    NumArray *a = checkarray(L, 1);
+    RandJob job = { .r = a, .kind = RAND_FLOAT };
+    checkwritable(L, 1, a);
+
+    if (DTYPE(a)->kind == KIND_FLOAT) {
+        // lo + (hi - lo) * u rounds to hi now and then, and more often
+        // so once narrowed to f32, which top keeps out of [lo, hi)
+        job.x = luaL_optnumber(L, 2, 0.0);
+        job.y = luaL_optnumber(L, 3, 1.0);
+        job.top = HUGE_VAL;
+        if (job.x < job.y && a->dtype == DT_F32) {
+            float f = (float)job.y;
+            job.top = (double)f < job.y ? f : nextafterf(f, -INFINITY);
+        } else if (job.x < job.y)
+            job.top = nextafter(job.y, job.x);
+    } else {
+        lua_Integer lo = luaL_optinteger(L, 2, 0);
+        lua_Integer hi = luaL_optinteger(L, 3, 1);
+        Elem s;
+        if (!lua_isnoneornil(L, 2))
+            checkvalue(L, DTYPE(a), 2, &s);
+        if (!lua_isnoneornil(L, 3))
+            checkvalue(L, DTYPE(a), 3, &s);
+        // u64 bounds past 2^63 come as negative integers
+        luaL_argcheck(L, a->dtype == DT_U64 ? (uint64_t)lo <= (uint64_t)hi
+                                            : lo <= hi, 3,
+                      "interval is empty");
+        job.kind = RAND_INT;
+        job.lo = (uint64_t)lo;
+        job.span = (uint64_t)hi - (uint64_t)lo + 1;
+    }
+    job.seed = checkseed(L, 4);
+    randfill(&job);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int
+randomnormal (lua_State *L)
+{
+    // [ud mu sigma seed] -> [ud]
+    NumArray *a = checkarray(L, 1);
+    RandJob job = { .r = a, .kind = RAND_NORMAL };
+    luaL_argcheck(L, DTYPE(a)->fromdouble != NULL, 1,
+                  "f32 or f64 array expected");
+    checkwritable(L, 1, a);
+
+    job.x = luaL_optnumber(L, 2, 0.0);
+    job.y = luaL_optnumber(L, 3, 1.0);
+    job.seed = checkseed(L, 4);
+    randfill(&job);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+#define SHUFFLE_ELEMS(T)                                                      \
+    for (i = n - 1; i > 0; i--) {                                             \
+        T *x = (T *)(p + i * step);                                           \
+        T *y = (T *)(p + (ptrdiff_t)rand_below(rb, (uint64_t)i + 1) * step);  \
+        T t = *x;                                                             \
+        *x = *y;                                                              \
+        *y = t;                                                               \
+    }
+
+static void
+shuffleelems (void *p_, ptrdiff_t step, size_t size, int n, RandBuf *rb)
+{
+    // Fisher-Yates: swap each element, from the last one down, with one
+    // at or before it
+    char *p = (char *)p_;
+    int i;
+    switch (size) {
+    case 1: SHUFFLE_ELEMS(uint8_t); break;
+    case 2: SHUFFLE_ELEMS(uint16_t); break;
+    case 4: SHUFFLE_ELEMS(uint32_t); break;
+    default: SHUFFLE_ELEMS(uint64_t); break;
+    }
+}
+
+static int
+shuffle (lua_State *L)
+{
+    // [ud seed] -> [ud]
+    NumArray *a = checkarray(L, 1);
+    RandBuf rb;
+    checkwritable(L, 1, a);
+
+    rand_bufseed(&rb, checkseed(L, 2), 0);
+    shuffleelems(a->data, STEP(a), DTYPE(a)->size, a->size, &rb);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+#define SAMPLE_SPARSE  16   /* hash the moved indices if k < #a / this */
+
+static uint32_t
+sampleslot (const int *key, int bits, int i)
+{
+    // the slot of i in an open-addressed table of 2^bits keys, or the
+    // empty (-1) one where it goes
+    uint32_t mask = ((uint32_t)1 << bits) - 1;
+    uint32_t h = (uint32_t)i * 2654435769u >> (32 - bits);
+    while (key[h] != i && key[h] != -1)
+        h = (h + 1) & mask;
+    return h;
+}
+
+static void
+samplesparse (int *pick, int k, int n, int *key, int *val, int bits,
+              RandBuf *rb)
+{
+    // the first k of a partial Fisher-Yates of 0 .. n-1, the same as
+    // swapping in a whole array of them, which the table holds the
+    // changed entries of: key[h] was swapped to hold val[h].  Position i
+    // is not looked at again after step i, so it need not be stored.
+    int i;
+    for (i = 0; i < k; i++) {
+        int j = i + (int)rand_below(rb, (uint64_t)(n - i));
+        uint32_t hi = sampleslot(key, bits, i);
+        uint32_t hj = sampleslot(key, bits, j);
+        int vi = key[hi] == i ? val[hi] : i;
+        pick[i] = key[hj] == j ? val[hj] : j;
+        key[hj] = j;
+        val[hj] = vi;
+    }
+}
+
+static int
+sample (lua_State *L)
+{
+    // [ud k replace seed] -> [.. r], k elements of ud in random order
+    NumArray *a = checkarray(L, 1);
+    lua_Integer k = luaL_checkinteger(L, 2);
+    int replace = lua_toboolean(L, 3);
+    RandJob job = { .a = a, .kind = RAND_INDEX };
+    int64_t ix[EW_BLOCK];
+    RandBuf rb;
+    int *perm, *pick, i, lo, bits;
+
+    luaL_argcheck(L, 0 <= k && k <= INT_MAX, 2, "invalid sample size");
+    luaL_argcheck(L, replace ? k == 0 || a->size > 0 : k <= a->size, 2,
+                  "sample larger than the array");
+    job.seed = checkseed(L, 4);
+    job.r = pusharray(L, (int)k, a->dtype);
+    if (replace || k == 0) {
+        randfill(&job);
+        return 1;
+    }
+
+    // a partial Fisher-Yates of the indices: the first k are the sample
+    rand_bufseed(&rb, job.seed, 0);
+    if (k < a->size / SAMPLE_SPARSE) {
+        // a table of 2^bits >= 2k slots, at most half full
+        for (bits = 1; ((int64_t)1 << bits) < 2 * k; bits++)
+            ;
+        perm = malloc(((size_t)k + ((size_t)2 << bits)) * sizeof(int));
+        if (perm == NULL)
+            return luaL_error(L, "not enough memory");
+        pick = perm + ((size_t)2 << bits);
+        memset(perm, 0xff, ((size_t)1 << bits) * sizeof(int));
+        samplesparse(pick, (int)k, a->size, perm, perm + ((size_t)1 << bits),
+                     bits, &rb);
+    } else {
+        if ((perm = malloc((size_t)a->size * sizeof(int))) == NULL)
+            return luaL_error(L, "not enough memory");
+        for (i = 0; i < a->size; i++)
+            perm[i] = i;
+        for (i = 0; i < k; i++) {
+            int j = i + (int)rand_below(&rb, (uint64_t)(a->size - i));
+            int t = perm[i];
+            perm[i] = perm[j];
+            perm[j] = t;
+        }
+        pick = perm;
+    }
+    for (lo = 0; lo < k; lo += EW_BLOCK) {
+        int n = k - lo < EW_BLOCK ? (int)k - lo : EW_BLOCK;
+        for (i = 0; i < n; i++)
+            ix[i] = pick[lo + i];
+        gather(ELEM(job.r, lo), STEP(job.r), a->data, STEP(a), ix,
+               DTYPE(a)->size, n);
+    }
+    free(perm);
+
+    return 1;
+}
+
+static int
+randomseed (lua_State *L)
+{
+    // array.randomseed(n) restarts the sequence of seeds
+    atomic_store(&randseeds, (uint64_t)luaL_checkinteger(L, 1));
+    return 0;
+}
+
+// scans
+// a:cumsum(), a:cumprod(), a:cummin(), a:cummax() and a:scan(op), with op
+// one of "add", "mul", "min" or "max", compute running results and take an
+// optional out array like the elementwise methods.  Large arrays scan in
+// two passes over chunks of grain elements: the first finds the total of
+// each chunk (scanning it into a block on the C stack, so nothing gets
+// written), the totals are scanned in chunk order, and the second pass
+// scans each chunk again starting from the total of the chunks before it.
+// Like for reductions, results depend on grain but not on the number of
+// threads.  a:diff() returns the n-1 differences a[i+1] - a[i].
+
+typedef struct ScanJob {
+    ScanKernel f;
+    NumArray *a, *r;
+    Elem *total;            // per chunk
+} ScanJob;
+
+static void
+scantotal (void *ctx, int chunk)
+{
+    ScanJob *job = (ScanJob *)ctx;
+    _Alignas(ARRAY_ALIGN) Elem buf[EW_BLOCK];
+    NumArray *a = job->a;
+    size_t size = DTYPE(a)->size;
+    int lo = chunk * grain;
+    int hi = a->size - lo < grain ? a->size : lo + grain;
+    const void *carry = NULL;   // the last result, read before overwritten
+    int i;
+
+    for (i = lo; i < hi; i += EW_BLOCK) {
+        int m = hi - i < EW_BLOCK ? hi - i : EW_BLOCK;
+        job->f(buf, size, ELEM(a, i), STEP(a), m, carry);
+        carry = (char *)buf + (size_t)(m - 1) * size;
+    }
+    memcpy(&job->total[chunk], carry, size);
+}
+
+static void
+scanchunk (void *ctx, int chunk)
+{
+    ScanJob *job = (ScanJob *)ctx;
+    int lo = chunk * grain;
+    int hi = job->a->size - lo < grain ? job->a->size : lo + grain;
+    job->f(ELEM(job->r, lo), STEP(job->r), ELEM(job->a, lo), STEP(job->a),
+           hi - lo, chunk > 0 ? &job->total[chunk - 1] : NULL);
+}
+
+static int
+scanarray (lua_State *L, int op, int outarg)
+{
+    // [ud .. out] -> [.. r], r the scan of ud with op
+    NumArray *a = checkarray(L, 1);
+    NumArray *r = checkresult(L, outarg, a, 0);
+    int nchunks = NCHUNKS(a->size);
+    ScanJob job = { DTYPE(a)->scan[op], a, r, NULL };
+    NumArray copy;
+
+    if (a != r && overlaps(a, r, a->size)
+        && !(a->data == r->data && a->stride == r->stride)) {
+        // scan a copy of a, on the Lua stack below r
+        NumArray *t = pusharray(L, a->size, a->dtype);
+        copyelems(L, t->data, DTYPE(a)->size, a, a->size);
+        lua_insert(L, -2);
+        copy = *t;
+        job.a = &copy;
+    }
+    if (nchunks <= 1) {
+        scanchunk(&job, 0);
+        return 1;
+    }
+    if ((job.total = malloc((size_t)nchunks * sizeof(Elem))) == NULL)
+        return luaL_error(L, "not enough memory");
+    pool_run(scantotal, &job, nchunks);
+    job.f(job.total, sizeof(Elem), job.total, sizeof(Elem), nchunks, NULL);
+    pool_run(scanchunk, &job, nchunks);
+    free(job.total);
+
+    return 1;
+}
+
+static int cumsum (lua_State *L) { return scanarray(L, SCAN_ADD, 2); }
+static int cumprod (lua_State *L) { return scanarray(L, SCAN_MUL, 2); }
+static int cummin (lua_State *L) { return scanarray(L, SCAN_MIN, 2); }
+static int cummax (lua_State *L) { return scanarray(L, SCAN_MAX, 2); }
+
+static int
+scan (lua_State *L)
+{
+    // [ud op out] -> [.. r]
+    static const char *const ops[] = {"add", "mul", "min", "max", NULL};
+    return scanarray(L, luaL_checkoption(L, 2, NULL, ops), 3);
+}
+
+static int
+diff (lua_State *L)
+{
+    // [ud out] -> [.. r], r[i] = ud[i+1] - ud[i], one element less than ud
+    NumArray *a = checkarray(L, 1);
+    NumArray hi, lo, *r;
+    int n = a->size > 0 ? a->size - 1 : 0;
+
+    if (lua_isnoneornil(L, 2))
+        r = pusharray(L, n, a->dtype);
+    else {
+        r = checkarray(L, 2);
+        luaL_argcheck(L, r->size == n, 2, "array of #a - 1 elements expected");
+        luaL_argcheck(L, r->dtype == a->dtype, 2, "array dtypes differ");
+        checkwritable(L, 2, r);
+        lua_pushvalue(L, 2);
+    }
+    hi = lo = *a;
+    hi.size = lo.size = n;
+    hi.data = ELEM(a, 1);
+    binop(L, OP_SUB, r, &hi, &lo, NULL, 0);
+
+    return 1;
+}
+
+// sorting
+// Elements are turned into unsigned 64-bit keys that sort the same way
+// (see dtypes.h), sorted by sortkeys (sort.h) and, for a:sort(), turned
+// back into elements.  Options, all optional:
+// - stable  false allows an in-place, unstable sort that needs no extra
+//           memory (default true; lexsort is always stable)
+// - nans    "last" (default) or "first", where NaNs end up
+// argsort & lexsort return 1-based indices in a new i32 array.
+
+static int
+sortflags (lua_State *L, int arg, int *stable)
+{
+    // [.. opts ..] -> KEY_xxx flags & stable
+    int flags = 0;
+    *stable = 1;
+    if (lua_isnoneornil(L, arg))
+        return flags;
+    luaL_checktype(L, arg, LUA_TTABLE);
+    if (lua_getfield(L, arg, "stable") != LUA_TNIL)
+        *stable = lua_toboolean(L, -1);
+    if (lua_getfield(L, arg, "nans") != LUA_TNIL) {
+        const char *nans = lua_tostring(L, -1);
+        if (nans != NULL && strcmp(nans, "first") == 0)
+            flags |= KEY_NANFIRST;
+        else if (nans == NULL || strcmp(nans, "last") != 0)
+            luaL_argerror(L, arg, "nans must be 'first' or 'last'");
+    }
+    lua_pop(L, 2);
+    return flags;
+}
+
+static int
+sortarray (lua_State *L)
+{
+    // [ud opts] -> [ud], sorted in place
+    NumArray *a = checkarray(L, 1);
+    int stable, flags = sortflags(L, 2, &stable);
+    uint64_t *k;
+    checkwritable(L, 1, a);
+
+    lua_settop(L, 1);
+    if (a->size < 2)
+        return 1;
+    if ((k = malloc((size_t)a->size * sizeof(uint64_t))) == NULL)
+        return luaL_error(L, "not enough memory");
+    DTYPE(a)->tokeys(k, a->data, STEP(a), NULL, a->size, flags);
+    if (sortkeys(k, NULL, a->size, stable, grain) != 0) {
+        free(k);
+        return luaL_error(L, "not enough memory");
+    }
+    DTYPE(a)->fromkeys(a->data, STEP(a), k, a->size);
+    free(k);
+
+    return 1;
+}
+
+static int
+sortindex (lua_State *L, NumArray **keys, int nkeys, int flags, int stable)
+{
+    // [..] -> [.. ix], ix the 1-based indices that sort the elements of
+    // keys[0], ties broken by keys[1] and so on.  Sorts on the last key
+    // first, then stably on the ones before, each time gathering the keys
+    // in the order found so far.
+    int n = keys[0]->size, i, j;
+    NumArray *r = pusharray(L, n, DT_I32);
+    int *ix = (int *)r->data;
+    uint64_t *k;
+
+    for (i = 0; i < n; i++)
+        ix[i] = i;
+    if (n < 2)
+        goto done;
+    if ((k = malloc((size_t)n * sizeof(uint64_t))) == NULL)
+        return luaL_error(L, "not enough memory");
+    for (j = nkeys - 1; j >= 0; j--) {
+        NumArray *a = keys[j];
+        DTYPE(a)->tokeys(k, a->data, STEP(a), j < nkeys - 1 ? ix : NULL, n,
+                         flags | KEY_ZERO);
+        if (sortkeys(k, ix, n, stable || nkeys > 1, grain) != 0) {
+            free(k);
+            return luaL_error(L, "not enough memory");
+        }
+    }
+    free(k);
+done:
+    for (i = 0; i < n; i++)
+        ix[i]++;
+    return 1;
+}
+
+static int
+argsort (lua_State *L)
+{
+    // [ud opts] -> [.. ix], a[ix[1]] <= a[ix[2]] <= ..
+    NumArray *a = checkarray(L, 1);
+    int stable, flags = sortflags(L, 2, &stable);
+    return sortindex(L, &a, 1, flags, stable);
+}
+
+#define LEXSORT_MAXKEYS 32
+
+static int
+lexsort (lua_State *L)
+{
+    // [{k1, k2, ..} opts] -> [.. ix], sorts on k1, ties broken by k2, ..
+    NumArray *keys[LEXSORT_MAXKEYS];
+    int stable, flags = sortflags(L, 2, &stable);
+    int nkeys, j;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    nkeys = (int)lua_rawlen(L, 1);
+    luaL_argcheck(L, 0 < nkeys && nkeys <= LEXSORT_MAXKEYS, 1,
+            "invalid number of keys");
+    for (j = 0; j < nkeys; j++) {
+        lua_rawgeti(L, 1, j + 1);
+        keys[j] = (NumArray *)udata_test(L, -1, UV_ARRAY, "ex04.array");
+        if (keys[j] == NULL)
+            return luaL_argerror(L, 1, lua_pushfstring(L,
+                        "key %d is not an array", j + 1));
+        if (keys[j]->size != keys[0]->size)
+            return luaL_argerror(L, 1, lua_pushfstring(L,
+                        "key %d differs in size", j + 1));
+        lua_pop(L, 1);  // the table keeps it alive
+    }
+    return sortindex(L, keys, nkeys, flags, 1);
+}
+
+// selection
+// a:quantile(q) returns the q-quantile of the elements, for 0 <= q <= 1,
+// interpolating linearly between the elements of ranks just below & above
+// q * (n - 1), like numpy's default.  For a table of them, the quantiles
+// come in an f64 array.  NaNs are left out, so the quantiles of nothing
+// but NaNs are NaN.  a:median() is a:quantile(0.5).  a:partition(k, opts)
+// reorders a in place so that a[k] is the element a sorted a would have
+// there, with no larger elements before it & no smaller ones after it; k
+// may be a table of indices too, and opts.nans is as for a:sort().  All of
+// them select on the sort keys of the elements with selectkeys (sort.h),
+// once for all the ranks asked for, which beats a full sort.
+
+static double
+keyvalue (const DType *dt, uint64_t key)
+{
+    Elem e;
+    double v;
+    dt->fromkeys(&e, 0, &key, 1);
+    dt->todouble(&v, &e, 0, 1);
+    return v;
+}
+
+static int
+checkranks (lua_State *L, int arg, int n)
+{
+    // number of 1-based indices, in a table or not, at arg
+    int i, nk = lua_istable(L, arg) ? (int)lua_rawlen(L, arg) : 1;
+    for (i = 1; i <= nk; i++) {
+        lua_Integer k;
+        if (lua_istable(L, arg))
+            lua_rawgeti(L, arg, i);
+        else
+            lua_pushvalue(L, arg);
+        k = luaL_checkinteger(L, -1);
+        luaL_argcheck(L, 1 <= k && k <= n, arg, "index out of range");
+        lua_pop(L, 1);
+    }
+    return nk;
+}
+
+static int
+partition (lua_State *L)
+{
+    // [ud k opts] -> [ud]
+    NumArray *a = checkarray(L, 1);
+    int stable, flags = sortflags(L, 3, &stable);
+    int i, nk = checkranks(L, 2, a->size), *ranks;
+    uint64_t *k;
+    checkwritable(L, 1, a);
+
+    lua_settop(L, 2);
+    k = malloc((size_t)a->size * sizeof(uint64_t) + nk * sizeof(int));
+    if (k == NULL)
+        return luaL_error(L, "not enough memory");
+    ranks = (int *)(k + a->size);
+    for (i = 0; i < nk; i++) {
+        if (lua_istable(L, 2))
+            lua_rawgeti(L, 2, i + 1);
+        else
+            lua_pushvalue(L, 2);
+        ranks[i] = (int)lua_tointeger(L, -1) - 1;
+        lua_pop(L, 1);
+    }
+    DTYPE(a)->tokeys(k, a->data, STEP(a), NULL, a->size, flags);
+    selectkeys(k, a->size, ranks, nk);
+    DTYPE(a)->fromkeys(a->data, STEP(a), k, a->size);
+    free(k);
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int
+quantiles (lua_State *L, NumArray *a, double *q, int nq)
+{
+    // q[i] = the q[i]-quantile of a, for i = 0 .. nq-1
+    const DType *dt = DTYPE(a);
+    int i, n = 0, *ranks;
+    uint64_t *k;
+
+    k = malloc((size_t)a->size * sizeof(uint64_t) + 2 * nq * sizeof(int));
+    if (k == NULL)
+        return luaL_error(L, "not enough memory");
+    ranks = (int *)(k + a->size);
+    dt->tokeys(k, a->data, STEP(a), NULL, a->size, 0);
+    for (i = 0; i < a->size; i++)
+        if (dt->kind != KIND_FLOAT || k[i] != ~(uint64_t)0)  // not a NaN
+            k[n++] = k[i];
+    for (i = 0; n > 0 && i < nq; i++) {
+        int lo = (int)(q[i] * (n - 1));
+        ranks[2 * i] = lo;
+        ranks[2 * i + 1] = lo < n - 1 ? lo + 1 : lo;
+    }
+    if (n > 0)
+        selectkeys(k, n, ranks, 2 * nq);
+    for (i = 0; i < nq; i++) {
+        double pos = q[i] * (n - 1), lo, hi;
+        int j = (int)pos;
+        if (n == 0) {
+            q[i] = NAN;
+            continue;
+        }
+        lo = keyvalue(dt, k[j]);
+        hi = j < n - 1 ? keyvalue(dt, k[j + 1]) : lo;
+        q[i] = pos > j ? lo + (hi - lo) * (pos - j) : lo;
+    }
+    free(k);
+
+    return nq;
+}
+
+static int
+quantile (lua_State *L)
+{
+    // [ud q] -> [.. v], v a number, or an f64 array for a table of q's
+    NumArray *a = checkarray(L, 1);
+    double q;
+    int i, nq;
+
+    if (!lua_istable(L, 2)) {
+        q = luaL_checknumber(L, 2);
+        luaL_argcheck(L, 0 <= q && q <= 1, 2, "quantile not in [0, 1]");
+        quantiles(L, a, &q, 1);
+        lua_pushnumber(L, q);
+        return 1;
+    }
+    nq = (int)lua_rawlen(L, 2);
+    NumArray *r = pusharray(L, nq, DT_F64);
+    double *qs = (double *)r->data;
+    for (i = 0; i < nq; i++) {
+        lua_rawgeti(L, 2, i + 1);
+        qs[i] = luaL_checknumber(L, -1);
+        luaL_argcheck(L, 0 <= qs[i] && qs[i] <= 1, 2,
+                "quantile not in [0, 1]");
+        lua_pop(L, 1);
+    }
+    quantiles(L, a, qs, nq);
+
+    return 1;
+}
+
+static int
+median (lua_State *L)
+{
+    // [ud] -> [.. v]
+    NumArray *a = checkarray(L, 1);
+    double q = 0.5;
+    quantiles(L, a, &q, 1);
+    lua_pushnumber(L, q);
+    return 1;
+}
+
+// searching
+// a:searchsorted(x, side) returns the 1-based index at which x would be
+// inserted to keep sorted array a sorted: before any equal elements for
+// side "left" (the default), after them for "right".  x is a number or an
+// array of them (then the result is an i32 array), of a's dtype.
+// a:build_index() keeps a copy of the elements in Eytzinger order, which
+// later searches use until a is modified.  Modifications of a through one
+// of its views go unnoticed, so call build_index again after those.
+
+typedef struct Index {
+    int n;
+    void *nodes;    // ARRAY_ALIGN aligned, node k (1..n) at k * size
+    int *rank;      // 0-based index into a of node k
+} Index;
+
+static void
+dropindex (NumArray *a)
+{
+    if (a->index == NULL)
+        return;
+    free(a->index->nodes);
+    free(a->index->rank);
+    free(a->index);
+    a->index = NULL;
+}
+
+static int
+eytzinger (const NumArray *a, Index *ix, int i, uint64_t k)
+{
+    // in-order walk of the implicit tree with children 2k & 2k+1, node k
+    // gets element i of a; returns the next element
+    size_t size = DTYPE(a)->size;
+    if (k > (uint64_t)ix->n)
+        return i;
+    i = eytzinger(a, ix, i, 2 * k);
+    memcpy((char *)ix->nodes + k * size, ELEM(a, i), size);
+    ix->rank[k] = i;
+    return eytzinger(a, ix, i + 1, 2 * k + 1);
+}
+
+static int
+buildindex (lua_State *L)
+{
+    // [ud] -> [ud]
+    NumArray *a = checkarray(L, 1);
+    size_t size = DTYPE(a)->size;
+    Index *ix;
+
+    dropindex(a);
+    if ((ix = malloc(sizeof(Index))) == NULL)
+        return luaL_error(L, "not enough memory");
+    ix->n = a->size;
+    ix->rank = malloc(((size_t)a->size + 1) * sizeof(int));
+    if (ix->rank == NULL || posix_memalign(&ix->nodes, ARRAY_ALIGN,
+                                          ((size_t)a->size + 1) * size)) {
+        free(ix->rank);
+        free(ix);
+        return luaL_error(L, "not enough memory");
+    }
+    memset(ix->nodes, 0, size);  // the dummy node 0
+    eytzinger(a, ix, 0, 1);
+    a->index = ix;
+
+    lua_settop(L, 1);
+    return 1;
+}
+
+typedef struct SearchJob {
+    NumArray *a, *q;
+    int right;
+    int *out;
+} SearchJob;
+
+static void
+searchrange (SearchJob *job, int lo, int hi)
+{
+    // 0-based insertion points of queries lo .. hi-1 in out[lo .. hi-1]
+    NumArray *a = job->a, *q = job->q;
+    if (a->index)
+        DTYPE(a)->eytzsearch(a->index->nodes, a->index->rank, a->size,
+                ELEM(q, lo), STEP(q), hi - lo, job->right, job->out + lo);
+    else
+        DTYPE(a)->search(a->data, STEP(a), a->size,
+                ELEM(q, lo), STEP(q), hi - lo, job->right, job->out + lo);
+}
+
+static void
+searchtask (void *ctx, int chunk)
+{
+    SearchJob *job = (SearchJob *)ctx;
+    int n = job->q->size, lo = chunk * grain;
+    searchrange(job, lo, n - lo < grain ? n : lo + grain);
+}
+
+static int
+searchsorted (lua_State *L)
+{
+    // [ud x side] -> [.. i] or [.. ix] for an array x
+    static const char *const sides[] = {"left", "right", NULL};
+    NumArray *a = checkarray(L, 1);
+    int right = luaL_checkoption(L, 3, "left", sides);
+    SearchJob job = { a, NULL, right, NULL };
+    int i, pos;
+
+    if (lua_isnumber(L, 2)) {
+        // a single query, as a one element array on the C stack
+        NumArray q = *a;
+        Elem v;
+        checkvalue(L, DTYPE(a), 2, &v);
+        q.size = 1;
+        q.data = &v;
+        job.q = &q;
+        job.out = &pos;
+        searchrange(&job, 0, 1);
+        lua_pushinteger(L, pos + 1);
+        return 1;
+    }
+
+    job.q = checkarray(L, 2);
+    luaL_argcheck(L, job.q->dtype == a->dtype, 2, "array dtypes differ");
+    NumArray *r = pusharray(L, job.q->size, DT_I32);
+    job.out = (int *)r->data;
+    pool_run(searchtask, &job, NCHUNKS(job.q->size));
+    for (i = 0; i < r->size; i++)
+        job.out[i]++;
+
+    return 1;
+}
+
+// histograms
+// a:digitize(edges) is searchsorted on the edges, a:bincount() and
+// a:histogram() count values (or sum their weights) per bin.  Each thread
+// of the pool counts into a private histogram that starts on a cache line
+// of its own (HIST_PAD counters apart), so no two threads ever write the
+// same line; the private histograms are added up at the end.  Counts are
+// exact, weighted sums may differ in the last bits between runs on more
+// than one thread (they are added in whatever order threads take chunks).
+
+#define HIST_PAD (ARRAY_ALIGN / 8)      // int64_t or double counters
+
+typedef struct HistJob {
+    NumArray *a, *w;        // values & optional weights
+    int nbins;
+    ptrdiff_t pitch;        // counters per private histogram
+    int byvalue;            // bincount, else histogram over [lo, hi]
+    double lo, hi, scale;
+    void *hist;             // nslots private histograms, int64_t or double
+} HistJob;
+
+static void
+histtask (void *ctx, int chunk)
+{
+    HistJob *job = (HistJob *)ctx;
+    _Alignas(ARRAY_ALIGN) double x[EW_BLOCK], w[EW_BLOCK];
+    int64_t *count = (int64_t *)job->hist + pool_self() * job->pitch;
+    double *sum = (double *)job->hist + pool_self() * job->pitch;
+    NumArray *a = job->a;
+    int lo = chunk * grain;
+    int hi = a->size - lo < grain ? a->size : lo + grain;
+    int i, j;
+
+    for (i = lo; i < hi; i += EW_BLOCK) {
+        int m = hi - i < EW_BLOCK ? hi - i : EW_BLOCK;
+        DTYPE(a)->todouble(x, ELEM(a, i), STEP(a), m);
+        if (job->w)
+            DTYPE(job->w)->todouble(w, ELEM(job->w, i), STEP(job->w), m);
+        for (j = 0; j < m; j++) {
+            int b;
+            if (job->byvalue)
+                b = (int)x[j];      // checked to be in range before
+            else if (x[j] >= job->lo && x[j] <= job->hi) {
+                b = (int)((x[j] - job->lo) * job->scale);
+                if (b >= job->nbins)    // hi itself, or rounding up
+                    b = job->nbins - 1;
+            } else
+                continue;           // out of range or NaN
+            if (job->w)
+                sum[b] += w[j];
+            else
+                count[b]++;
+        }
+    }
+}
+
+static int
+runhist (lua_State *L, HistJob *job, int warg)
+{
+    // count a into job->nbins bins, with the optional weights at warg
+    int nslots = pool_threads(), s, b;
+    NumArray *r;
+
+    if (!lua_isnoneornil(L, warg)) {
+        job->w = checkarray(L, warg);
+        luaL_argcheck(L, job->w->size == job->a->size, warg,
+                      "array sizes differ");
+    }
+    job->pitch = ((ptrdiff_t)job->nbins + HIST_PAD - 1) / HIST_PAD * HIST_PAD;
+    r = pusharray(L, job->nbins, job->w ? DT_F64 : DT_I64);
+    if (posix_memalign(&job->hist, ARRAY_ALIGN,
+                       (size_t)nslots * job->pitch * 8) != 0)
+        return luaL_error(L, "not enough memory");
+    memset(job->hist, 0, (size_t)nslots * job->pitch * 8);
+
+    pool_runmax(histtask, job, NCHUNKS(job->a->size), nslots);
+
+    for (b = 0; b < job->nbins; b++) {
+        if (job->w) {
+            double t = 0.0;
+            for (s = 0; s < nslots; s++)
+                t += ((double *)job->hist)[s * job->pitch + b];
+            ((double *)r->data)[b] = t;
+        } else {
+            int64_t t = 0;
+            for (s = 0; s < nslots; s++)
+                t += ((int64_t *)job->hist)[s * job->pitch + b];
+            ((int64_t *)r->data)[b] = t;
+        }
+    }
+    free(job->hist);
+
+    return 1;
+}
+
+static int
+bincount (lua_State *L)
+{
+    // [ud nbins weights] -> [.. r], r[v + 1] counts the elements equal to v
+    // (or sums their weights); at least nbins bins, more if needed
+    NumArray *a = checkarray(L, 1);
+    const DType *dt = DTYPE(a);
+    HistJob job = { .a = a, .byvalue = 1 };
+    int64_t max = -1;
+
+    luaL_argcheck(L, dt->kind != KIND_FLOAT, 1, "integer array expected");
+    job.nbins = luaL_optinteger(L, 2, 0);
+    luaL_argcheck(L, job.nbins >= 0, 2, "invalid number of bins");
+    if (a->size > 0) {
+        Acc lo = reduce(dt->min, combineminmax(dt, 0), a, NULL, 0.0);
+        Acc hi = reduce(dt->max, combineminmax(dt, 1), a, NULL, 0.0);
+        luaL_argcheck(L, dt->kind == KIND_UNSIGNED || lo.i >= 0, 1,
+                      "negative value");
+        luaL_argcheck(L, dt->kind == KIND_SIGNED ? hi.i < INT_MAX
+                                                 : hi.u < INT_MAX, 1,
+                      "value too large for a bin");
+        max = dt->kind == KIND_SIGNED ? hi.i : (int64_t)hi.u;
+    }
+    if (max + 1 > job.nbins)
+        job.nbins = (int)max + 1;
+
+    return runhist(L, &job, 3);
+}
+
+static int
+histogram (lua_State *L)
+{
+    // [ud lo hi n weights] -> [.. r], counts (or weights) in n equal bins
+    // over [lo, hi]: bin i is [lo + (i-1)*d, lo + i*d), the last includes hi
+    NumArray *a = checkarray(L, 1);
+    HistJob job = { .a = a, .byvalue = 0 };
+
+    job.lo = luaL_checknumber(L, 2);
+    job.hi = luaL_checknumber(L, 3);
+    job.nbins = luaL_checkinteger(L, 4);
+    luaL_argcheck(L, job.lo < job.hi, 3, "empty range");
+    luaL_argcheck(L, job.nbins > 0, 4, "invalid number of bins");
+    job.scale = job.nbins / (job.hi - job.lo);
+
+    return runhist(L, &job, 5);
+}
+
+static int
+digitize (lua_State *L)
+{
+    // [ud edges right] -> [.. bins], bin i for edges[i] <= x < edges[i+1]
+    // (edges[i] < x <= edges[i+1] with right), 0 & #edges beyond the edges
+    NumArray *a = checkarray(L, 1);
+    NumArray *edges = checkarray(L, 2);
+    SearchJob job = { edges, a, !lua_toboolean(L, 3), NULL };
+
+    luaL_argcheck(L, edges->dtype == a->dtype, 2, "array dtypes differ");
+    job.out = (int *)pusharray(L, a->size, DT_I32)->data;
+    pool_run(searchtask, &job, NCHUNKS(a->size));
+
+    return 1;
+}
+
+// lazy expressions
+// e = a:lazy() wraps array a in an expression.  Arithmetic on expressions
+// (+, -, *, /, unary -, e:min(x), e:max(x), e:abs()) with arrays, numbers
+// or other expressions of the same size & dtype builds a tree instead of
+// computing anything.  The tree is compiled into a small stack program
+// that runs per block of EW_BLOCK elements, with all intermediate results
+// in registers (blocks on the C stack) that stay in L1 cache:
+//   e:eval([out])                    a new array (or out) with the result
+//   e:sum(), e:mean(), e:min(), e:max()   reductions of the result
+// Either way, each array is read once and no temporaries are allocated.
+// Large expressions run in chunks of grain elements on the thread pool.
+
+#define EX_MAXNODES 64          // per expression tree
+#define EX_MAXREGS 8            // deepest stack of intermediate results
+
+enum { EX_LEAF = NBINOPS, EX_SCALAR, EX_NEG, EX_ABS };
+
+typedef struct Expr {
+    int size;
+    int dtype;
+    int op;             // OP_xxx, or EX_xxx
+    int nodes;          // in this tree
+    Elem s;             // EX_SCALAR's value
+} Expr;
+// the uservalue of an expression is: the array (EX_LEAF), the operand
+// (EX_NEG, EX_ABS) or a table with both operands (OP_xxx)
+
+typedef struct Instr {
+    int op;
+    NumArray *a;        // EX_LEAF
+    const Elem *s;      // EX_SCALAR
+} Instr;
+
+typedef struct Program {
+    int n;              // instructions
+    const DType *dt;
+    Instr code[EX_MAXNODES];
+} Program;
+
+static Expr *
+pushexpr (lua_State *L, int op, int size, int dtype, int nodes)
+{
+    Expr *e = (Expr *)lua_newuserdata(L, sizeof(Expr));
+    udata_meta(L, UV_EXPR, "ex04.expr");
+    lua_setmetatable(L, -2);
+    e->size = size;
+    e->dtype = dtype;
+    e->op = op;
+    e->nodes = nodes;
+    return e;
+}
+
+static Expr *
+toexpr (lua_State *L, int arg, const Expr *like)
+{
+    // replace the expression, array or number (needs like) at arg with an
+    // expression
+    Expr *e = (Expr *)udata_test(L, arg, UV_EXPR, "ex04.expr");
+    NumArray *a;
+
+    if (e == NULL
+        && (a = (NumArray *)udata_test(L, arg, UV_ARRAY, "ex04.array"))) {
+        e = pushexpr(L, EX_LEAF, a->size, a->dtype, 1);
+        lua_pushvalue(L, arg);
+        lua_setuservalue(L, -2);
+        lua_replace(L, arg);
+    } else if (e == NULL) {
+        Elem s;
+        luaL_argcheck(L, like != NULL, arg, "array or expression expected");
+        checkvalue(L, &dtypes[like->dtype], arg, &s);
+        e = pushexpr(L, EX_SCALAR, like->size, like->dtype, 1);
+        e->s = s;
+        lua_replace(L, arg);
+    }
+    return e;
+}
+
+static int
+exprbinary (lua_State *L, int op)
+{
+    // [x y] -> [x y e], e the node for x op y
+    Expr *x = (Expr *)udata_test(L, 1, UV_EXPR, "ex04.expr");
+    Expr *y = (Expr *)udata_test(L, 2, UV_EXPR, "ex04.expr");
+    Expr *like = x ? x : y;
 
-static NumArray *
-checkarray (lua_State *L)
+    lua_settop(L, 2);
+    if (like == NULL)
+        like = toexpr(L, 1, NULL);
+    x = toexpr(L, 1, like);
+    y = toexpr(L, 2, like);
+    luaL_argcheck(L, x->size == y->size, 2, "array sizes differ");
+    luaL_argcheck(L, x->dtype == y->dtype, 2, "array dtypes differ");
+    luaL_argcheck(L, x->nodes + y->nodes < EX_MAXNODES, 2,
+            "expression too large, eval() part of it");
+    if (op == OP_DIV && y->op == EX_SCALAR
+        && dtypes[y->dtype].kind != KIND_FLOAT
+        && !memcmp(&y->s, &(Elem){0}, dtypes[y->dtype].size))
+        luaL_error(L, "attempt to perform 'n//0'");
+
+    pushexpr(L, op, x->size, x->dtype, x->nodes + y->nodes + 1);
+    lua_createtable(L, 2, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, 2);
+    lua_setuservalue(L, -2);
+
+    return 1;
+}
+
+static int
+exprunary (lua_State *L, int op)
 {
-    // check 1st argument (valid userdatum) & return as ptr to NumArray
-    void *ud = luaL_checkudata(L, 1, "ex04.array");
-    luaL_argcheck(L, ud != NULL, 1, "`array' expected");
+    Expr *x = (Expr *)udata_check(L, 1, UV_EXPR, "ex04.expr");
+    luaL_argcheck(L, x->nodes < EX_MAXNODES, 1,
+            "expression too large, eval() part of it");
+    pushexpr(L, op, x->size, x->dtype, x->nodes + 1);
+    lua_pushvalue(L, 1);
+    lua_setuservalue(L, -2);
+    return 1;
+}
 
-    return (NumArray *)ud;
+static int lazy (lua_State *L) { checkarray(L, 1); toexpr(L, 1, NULL);
+                                 lua_settop(L, 1); return 1; }
+static int exprunm (lua_State *L) { return exprunary(L, EX_NEG); }
+static int exprabs (lua_State *L) { return exprunary(L, EX_ABS); }
+static int expradd (lua_State *L) { return exprbinary(L, OP_ADD); }
+static int exprsub (lua_State *L) { return exprbinary(L, OP_SUB); }
+static int exprmul (lua_State *L) { return exprbinary(L, OP_MUL); }
+static int exprdiv (lua_State *L) { return exprbinary(L, OP_DIV); }
+
+static int
+compile (lua_State *L, int idx, Program *pg, int sp)
+{
+    // append the postfix code of the expression at idx to pg, sp is the
+    // stack depth before, returns the deepest stack reached
+    Expr *e = (Expr *)lua_touserdata(L, idx);
+    Instr *in = &pg->code[pg->n++];
+    int deepest = sp + 1;
+
+    lua_getuservalue(L, idx);
+    switch (e->op) {
+    case EX_LEAF:
+        in->a = (NumArray *)lua_touserdata(L, -1);
+        if (in->a->size != e->size)  // a growable one, since
+            luaL_error(L, "array size changed since lazy()");
+        break;
+    case EX_SCALAR:
+        in->s = &e->s;
+        break;
+    case EX_NEG:
+    case EX_ABS:
+        pg->n--;
+        deepest = compile(L, lua_gettop(L), pg, sp);
+        in = &pg->code[pg->n++];
+        break;
+    default: {
+        int d;
+        pg->n--;
+        lua_rawgeti(L, -1, 1);
+        deepest = compile(L, lua_gettop(L), pg, sp);
+        lua_rawgeti(L, -2, 2);
+        d = compile(L, lua_gettop(L), pg, sp + 1);
+        deepest = d > deepest ? d : deepest;
+        lua_pop(L, 2);
+        in = &pg->code[pg->n++];
+    }
+    }
+    lua_pop(L, 1);
+    in->op = e->op;
+    if (deepest > EX_MAXREGS)
+        luaL_error(L, "expression too deep, eval() part of it");
+    return deepest;
 }
 
-static double *
-getelem (lua_State *L)
+static int
+runblock (const Program *pg, Elem reg[][EW_BLOCK], int lo, int m,
+          const void **result)
 {
-    // check 2nd argument (valid integer) & return ptr to indexed array elm
-    NumArray *a = checkarray(L);
-    int index = luaL_checkinteger(L, 2);
+    // run the program on elements lo .. lo+m-1, *result points to the m
+    // results; returns 0 or -1 for an integer division by zero
+    const DType *dt = pg->dt;
+    const void *p[EX_MAXREGS];  // the stack, scalars have their ..
+    int scalar[EX_MAXREGS];     // .. flag set
+    int sp = 0, i;
 
-    luaL_argcheck(L, 1 <= index && index <= a->size, 2,
-            "index out of range");
+    for (i = 0; i < pg->n; i++) {
+        const Instr *in = &pg->code[i];
+        switch (in->op) {
+        case EX_LEAF:
+            scalar[sp] = 0;
+            if (CONTIGUOUS(in->a))
+                p[sp] = ELEM(in->a, lo);
+            else {
+                scatter(reg[sp], dt->size, ELEM(in->a, lo), STEP(in->a),
+                        dt->size, m);
+                p[sp] = reg[sp];
+            }
+            sp++;
+            break;
+        case EX_SCALAR:
+            scalar[sp] = 1;
+            p[sp++] = in->s;
+            break;
+        case EX_NEG:
+        case EX_ABS:
+            (in->op == EX_NEG ? dt->neg : dt->abs)(reg[sp - 1], p[sp - 1], m);
+            p[sp - 1] = reg[sp - 1];
+            break;
+        default: {
+            const BinOp *bo = &dt->binop[in->op];
+            if (in->op == OP_DIV && dt->kind != KIND_FLOAT && !scalar[sp - 1]
+                && dt->findfirst(p[sp - 1], m, (Acc){0}) >= 0)
+                return -1;
+            BinKernel k = scalar[sp - 2] ? bo->sa
+                        : scalar[sp - 1] ? bo->as : bo->aa;
+            k(reg[sp - 2], p[sp - 2], p[sp - 1], m);
+            p[sp - 2] = reg[sp - 2];
+            scalar[sp - 2] = 0;
+            sp--;
+        }
+        }
+    }
+    *result = p[0];
+    return 0;
+}
 
-    /* return element address */
-    return &a->values[index - 1];
+typedef struct ExprJob {
+    const Program *pg;
+    int size;
+    NumArray *r;        // eval: the result
+    Reducer f;          // or a reduction ..
+    Combine how;
+    Acc *result;        // .. per chunk
+    _Atomic int err;
+} ExprJob;
+
+static void
+exprtask (void *ctx, int chunk)
+{
+    ExprJob *job = (ExprJob *)ctx;
+    _Alignas(ARRAY_ALIGN) Elem reg[EX_MAXREGS][EW_BLOCK];
+    size_t size = job->pg->dt->size;
+    int lo = chunk * grain;
+    int hi = job->size - lo < grain ? job->size : lo + grain;
+    double comp = 0.0;
+    Acc r;
+    int i;
+
+    for (i = lo; i < hi && !atomic_load(&job->err); i += EW_BLOCK) {
+        int m = hi - i < EW_BLOCK ? hi - i : EW_BLOCK;
+        const void *p;
+        if (runblock(job->pg, reg, i, m, &p) != 0) {
+            atomic_store(&job->err, 1);
+            return;
+        }
+        if (job->r == NULL) {
+            Acc v = job->f(p, NULL, 0.0, 0, m);
+            if (i == lo)
+                r = v;
+            else
+                combine(job->how, &r, v, &comp);
+        } else if (CONTIGUOUS(job->r))
+            memcpy(ELEM(job->r, i), p, (size_t)m * size);
+        else
+            scatter(ELEM(job->r, i), STEP(job->r), p, size, size, m);
+    }
+    if (job->r == NULL) {
+        if (job->how == COMBINE_FSUM)
+            r.d += comp;
+        job->result[chunk] = r;
+    }
 }
 
-// the array library
+static Expr *
+checkprogram (lua_State *L, Program *pg)
+{
+    // compile the expression at index 1 into pg
+    Expr *e = (Expr *)udata_check(L, 1, UV_EXPR, "ex04.expr");
+    pg->n = 0;
+    pg->dt = &dtypes[e->dtype];
+    compile(L, 1, pg, 0);
+    return e;
+}
+
+static void
+runexpr (lua_State *L, const Program *pg, ExprJob *job)
+{
+    // run the program of the expression at index 1 as job says
+    Expr *e = (Expr *)lua_touserdata(L, 1);
+    int nchunks = NCHUNKS(e->size), t;
+
+    job->pg = pg;
+    job->size = e->size;
+    atomic_init(&job->err, 0);
+    if (job->r == NULL && (job->result =
+            malloc((size_t)(nchunks > 0 ? nchunks : 1) * sizeof(Acc))) == NULL)
+        luaL_error(L, "not enough memory");
+    if (job->r == NULL && nchunks == 0) {
+        job->result[0] = job->f(NULL, NULL, 0.0, 0, 0);
+        return;
+    }
+
+    pool_run(exprtask, job, nchunks);
+
+    if (atomic_load(&job->err)) {
+        free(job->result);
+        luaL_error(L, "attempt to perform 'n//0'");
+    }
+    if (job->r == NULL) {
+        double comp = 0.0;
+        for (t = 1; t < nchunks; t++)
+            combine(job->how, &job->result[0], job->result[t], &comp);
+        if (job->how == COMBINE_FSUM)
+            job->result[0].d += comp;
+    }
+}
+
+static Acc
+exprreduce (lua_State *L, Reducer f, Combine how)
+{
+    Program pg;
+    ExprJob job = { .f = f, .how = how };
+    checkprogram(L, &pg);
+    runexpr(L, &pg, &job);
+    Acc r = job.result[0];
+    free(job.result);
+    return r;
+}
 
 static int
-newarray (lua_State *L)
+expreval (lua_State *L)
 {
-    // Due to the fact that in C89 you cannot declare an array of 0, we need
-    // to use an array of 1 elm in NumArray, so:
-    // - sizeof(NumArray) == sizeof(int) + sizeof(double)
-    // - hence, the (n-1)*sizeof(double)
-    // - so nbytes == sizeof(int) + sizeof(double) + (n-1)*sizeof(double)
-    //             == sizeof(int) + n*sizeof(double)
+    // [e out] -> [.. r], r = out or a new array
+    Program pg;
+    Expr *e = checkprogram(L, &pg);
+    ExprJob job = { .r = NULL };
+    int i;
 
+    if (lua_isnoneornil(L, 2)) {
+        lua_settop(L, 1);
+        job.r = pusharray(L, e->size, e->dtype);
+    } else {
+        job.r = checkarray(L, 2);
+        luaL_argcheck(L, job.r->size == e->size, 2, "array sizes differ");
+        luaL_argcheck(L, job.r->dtype == e->dtype, 2, "array dtypes differ");
+        checkwritable(L, 2, job.r);
+        lua_settop(L, 2);
+    }
+    for (i = 0; i < pg.n; i++) {
+        NumArray *a = pg.code[i].a;
+        // reading and writing the same elements is fine, others are not
+        luaL_argcheck(L, pg.code[i].op != EX_LEAF || a == job.r
+                || !overlaps(a, job.r, e->size)
+                || (a->data == job.r->data && a->stride == job.r->stride),
+                2, "overlaps an operand of the expression");
+    }
+    runexpr(L, &pg, &job);
 
-    int n = luaL_checkinteger(L, 1);
-    printf("newarray\n");
-    stackDump(L, "1");                // [n]
+    return 1;
+}
 
-    size_t nbytes = sizeof(NumArray) + (n - 1)*sizeof(double);
-    NumArray *a = (NumArray *)lua_newuserdata(L, nbytes);
-    stackDump(L, "2");               // [n, ud]
-    luaL_getmetatable(L, "ex04.array");
-    stackDump(L, "3");              // [n, ud{}, M{}]
-    printf("Top elm %p\n", lua_touserdata(L,-2));
-    printf("Top elm %p\n", lua_touserdata(L,-1));
+static int
+exprsum (lua_State *L)
+{
+    Expr *e = (Expr *)udata_check(L, 1, UV_EXPR, "ex04.expr");
+    const DType *dt = &dtypes[e->dtype];
+    pushacc(L, dt, exprreduce(L, dt->sum, combinesum(dt)));
+    return 1;
+}
+
+static int
+exprmean (lua_State *L)
+{
+    Expr *e = (Expr *)udata_check(L, 1, UV_EXPR, "ex04.expr");
+    lua_pushnumber(L, exprreduce(L, dtypes[e->dtype].fsum, COMBINE_FSUM).d
+                      / e->size);
+    return 1;
+}
+
+static int
+exprminmax (lua_State *L, int ismax)
+{
+    // e:min() & e:max() reduce, e:min(x) & e:max(x) are elementwise
+    Expr *e = (Expr *)udata_check(L, 1, UV_EXPR, "ex04.expr");
+    const DType *dt = &dtypes[e->dtype];
+    Acc m;
+
+    if (!lua_isnoneornil(L, 2))
+        return exprbinary(L, ismax ? OP_MAX : OP_MIN);
+    luaL_argcheck(L, e->size > 0, 1, "empty expression");
+    m = exprreduce(L, ismax ? dt->max : dt->min, combineminmax(dt, ismax));
+    if (dt->kind == KIND_FLOAT && isinf(m.d) && (m.d > 0) != ismax) {
+        // nothing but NaNs leaves the min at +inf and the max at -inf
+        Acc o = exprreduce(L, ismax ? dt->min : dt->max,
+                           combineminmax(dt, !ismax));
+        if (isinf(o.d) && (o.d > 0) == ismax)
+            m.d = NAN;
+    }
+    pushacc(L, dt, m);
+    return 1;
+}
+
+static int exprmin (lua_State *L) { return exprminmax(L, 0); }
+static int exprmax (lua_State *L) { return exprminmax(L, 1); }
+
+static int
+exprlen (lua_State *L)
+{
+    Expr *e = (Expr *)udata_check(L, 1, UV_EXPR, "ex04.expr");
+    lua_pushinteger(L, e->size);
+    return 1;
+}
+
+static int
+expr2string (lua_State *L)
+{
+    Expr *e = (Expr *)udata_check(L, 1, UV_EXPR, "ex04.expr");
+    lua_pushfstring(L, "expr(%d, %s)", e->size, dtypes[e->dtype].name);
+    return 1;
+}
+
+// formulas
+// A formula is compiled once (formula.h) into a userdatum that keeps its
+// source in its uservalue.  Compiled formulas are cached in a weak table
+// in the registry, keyed by their source, so array.eval(src, ..) in a loop
+// parses src only once.  A formula runs in chunks of grain elements on the
+// thread pool, converting the elements of its variables to doubles one
+// block at a time (contiguous f64 arrays are used in place).  The result
+// is a new f64 array or goes into out, which must have a float dtype.
+
+typedef struct FormulaJob {
+    const Formula *f;
+    int size;
+    NumArray *var[FORMULA_MAXREGS];     // or NULL for numbers ..
+    double scalar[FORMULA_MAXREGS];     // .. with their value here
+    NumArray *r;
+} FormulaJob;
+
+static void
+formulatask (void *ctx, int chunk)
+{
+    FormulaJob *job = (FormulaJob *)ctx;
+    const Formula *f = job->f;
+    _Alignas(ARRAY_ALIGN) double reg[FORMULA_MAXREGS][FORMULA_BLOCK];
+    const double *p[FORMULA_MAXREGS];
+    int lo = chunk * grain;
+    int hi = job->size - lo < grain ? job->size : lo + grain;
+    int i, k, j;
+
+    // numbers & constants are blocks of the same value
+    for (k = 0; k < f->nvars + f->nconsts; k++) {
+        double v = k < f->nvars ? job->scalar[k] : f->konst[k - f->nvars];
+        if (k < f->nvars && job->var[k] != NULL)
+            continue;
+        for (j = 0; j < FORMULA_BLOCK; j++)
+            reg[k][j] = v;
+        p[k] = reg[k];
+    }
+    for (i = lo; i < hi; i += FORMULA_BLOCK) {
+        int m = hi - i < FORMULA_BLOCK ? hi - i : FORMULA_BLOCK;
+        for (k = 0; k < f->nvars; k++) {
+            NumArray *a = job->var[k];
+            if (a == NULL)
+                continue;
+            if (a->dtype == DT_F64 && CONTIGUOUS(a))
+                p[k] = (const double *)ELEM(a, i);
+            else {
+                DTYPE(a)->todouble(reg[k], ELEM(a, i), STEP(a), m);
+                p[k] = reg[k];
+            }
+        }
+        formula_block(f, p, reg, m);
+        if (job->r->dtype == DT_F64 && CONTIGUOUS(job->r))
+            memcpy(ELEM(job->r, i), p[f->result], (size_t)m * sizeof(double));
+        else
+            DTYPE(job->r)->fromdouble(ELEM(job->r, i), STEP(job->r),
+                                      p[f->result], m);
+    }
+}
+
+static Formula *
+checkformula (lua_State *L, int arg)
+{
+    // the formula at arg, or the one compiled from the source at arg (which
+    // replaces it)
+    Formula *f = (Formula *)udata_test(L, arg, UV_FORMULA, "ex04.formula");
+    char err[128];
+
+    if (f != NULL)
+        return f;
+    luaL_checkstring(L, arg);
+    lua_getfield(L, LUA_REGISTRYINDEX, "ex04.formulas");
+    lua_pushvalue(L, arg);
+    if (lua_rawget(L, -2) == LUA_TUSERDATA) {         // [.. cache f]
+        f = (Formula *)lua_touserdata(L, -1);
+    } else {
+        lua_pop(L, 1);                                 // [.. cache]
+        f = (Formula *)lua_newuserdata(L, sizeof(Formula));
+        if (formula_compile(f, lua_tostring(L, arg), err, sizeof(err)) != 0)
+            luaL_argerror(L, arg, err);
+        udata_meta(L, UV_FORMULA, "ex04.formula");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, arg);
+        lua_setuservalue(L, -2);
+        lua_pushvalue(L, arg);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);                             // cache[src] = f
+    }
+    lua_replace(L, arg);
+    lua_pop(L, 1);
+
+    return f;
+}
+
+static int
+runformula (lua_State *L)
+{
+    // [f env out] -> [.. r], r = out or a new f64 array
+    Formula *f = checkformula(L, 1);
+    FormulaJob job;
+    int k;
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 3);
+    luaL_checkstack(L, f->nvars, "too many variables");
+    job.f = f;
+    job.size = -1;
+    for (k = 0; k < f->nvars; k++) {
+        lua_getfield(L, 2, f->var[k]);          // kept on the stack
+        job.var[k] = (NumArray *)udata_test(L, -1, UV_ARRAY, "ex04.array");
+        if (job.var[k] != NULL) {
+            if (job.size >= 0 && job.var[k]->size != job.size)
+                luaL_error(L, "array sizes differ in formula, at '%s'",
+                           f->var[k]);
+            job.size = job.var[k]->size;
+        } else if (lua_type(L, -1) == LUA_TNUMBER)
+            job.scalar[k] = lua_tonumber(L, -1);
+        else
+            luaL_error(L, "formula variable '%s' is not an array or number",
+                       f->var[k]);
+    }
+
+    if (lua_isnil(L, 3)) {
+        luaL_argcheck(L, job.size >= 0, 2, "no arrays, size unknown");
+        job.r = pusharray(L, job.size, DT_F64);
+    } else {
+        job.r = checkarray(L, 3);
+        luaL_argcheck(L, job.size < 0 || job.r->size == job.size, 3,
+                      "array sizes differ");
+        luaL_argcheck(L, DTYPE(job.r)->fromdouble != NULL, 3,
+                      "f32 or f64 array expected");
+        checkwritable(L, 3, job.r);
+        job.size = job.r->size;
+        for (k = 0; k < f->nvars; k++) {
+            NumArray *a = job.var[k];
+            // reading and writing the same elements is fine, others are not
+            luaL_argcheck(L, a == NULL || a == job.r
+                    || !overlaps(a, job.r, job.size)
+                    || (a->data == job.r->data && a->stride == job.r->stride
+                        && a->dtype == job.r->dtype),
+                    3, "overlaps a variable of the formula");
+        }
+        lua_pushvalue(L, 3);
+    }
+
+    pool_run(formulatask, &job, NCHUNKS(job.size));
+
+    return 1;
+}
+
+static int
+compileformula (lua_State *L)
+{
+    checkformula(L, 1);
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int
+formula2string (lua_State *L)
+{
+    udata_check(L, 1, UV_FORMULA, "ex04.formula");
+    lua_getuservalue(L, 1);
+    lua_pushfstring(L, "formula(%s)", lua_tostring(L, -1));
+    return 1;
+}
+
+// matrices
+// A matrix is a 2D view on the elements of an f64 array: rows x cols
+// elements, element (i, j) at offset + (i-1)*rstep + (j-1)*cstep of the
+// array.  The array is the matrix's uservalue and any change to it shows
+// in the matrix (and vice versa).  m:t() and m:sub(..) are views as well,
+// on the same array; m:row(i) and m:col(j) are array views.  Products and
+// transposes use the kernels of gemm.h:
+//   m:matmul(n [, out])   m * n, also as m * n
+//   m:matvec(x [, out])   m * x for an array x, also as m * x
+//   m:transpose([out])    a transposed copy (m:t() is a view)
+//   m:sum([dim]), m:mean([dim]), m:min([dim]), m:max([dim])
+// reduce all elements, or with dim 1 each column (giving an array of cols
+// results) or with dim 2 each row (an array of rows results).  Like for
+// arrays, min & max skip NaNs.
+
+typedef struct Matrix {
+    int rows, cols;
+    int offset;         // of element (1, 1) in the array, in elements
+    int rstep, cstep;   // between rows & columns, in elements of the array
+    int pinning;        // counts in the array's views (a growable one)
+    NumArray *base;     // the array, also the uservalue
+} Matrix;
+
+enum { MAT_SUM, MAT_MIN, MAT_MAX };
+
+static Matrix *
+checkmatrix (lua_State *L, int arg)
+{
+    return (Matrix *)udata_check(L, arg, UV_MATRIX, "ex04.matrix");
+}
+
+static Mat
+tomat (const Matrix *m)
+{
+    Mat r;
+    r.p = (double *)ELEM(m->base, m->offset);
+    r.rs = (ptrdiff_t)m->rstep * m->base->stride;
+    r.cs = (ptrdiff_t)m->cstep * m->base->stride;
+    return r;
+}
+
+static Matrix *
+pushmatrix (lua_State *L, int arg, int rows, int cols, int offset,
+            int rstep, int cstep)
+{
+    // push a matrix on the elements of the f64 array at arg
+    NumArray *a = checkarray(L, arg);
+    Matrix *m;
+
+    luaL_argcheck(L, a->dtype == DT_F64, arg, "f64 array expected");
+    m = (Matrix *)lua_newuserdata(L, sizeof(Matrix));
+    udata_meta(L, UV_MATRIX, "ex04.matrix");
     lua_setmetatable(L, -2);
-    stackDump(L, "4");              // [n, ud{}]
-    a->size = n;
+    m->rows = rows;
+    m->cols = cols;
+    m->offset = offset;
+    m->rstep = rstep;
+    m->cstep = cstep;
+    m->base = a;
+    m->pinning = (a->flags & ARRAY_GROWABLE) != 0;
+    if (m->pinning)
+        a->views++;     // a must not move its elements, like for views
+    lua_pushvalue(L, arg);
+    lua_setuservalue(L, -2);
 
-    return 1;  /* new userdatum is already on the stack */
+    return m;
+}
+
+static Matrix *
+pushresult (lua_State *L, int arg, int rows, int cols)
+{
+    // push & return the optional output matrix at arg, or a new matrix
+    Matrix *r;
+    if (lua_isnoneornil(L, arg)) {
+        pusharray(L, rows * cols, DT_F64);
+        r = pushmatrix(L, lua_gettop(L), rows, cols, 0, cols, 1);
+        lua_remove(L, -2);
+        return r;
+    }
+    r = checkmatrix(L, arg);
+    luaL_argcheck(L, r->rows == rows && r->cols == cols, arg,
+                  "matrix shapes differ");
+    checkwritable(L, arg, r->base);
+    lua_pushvalue(L, arg);
+    return r;
+}
+
+static void
+matspan (const Matrix *m, const char **lo, const char **hi)
+{
+    // the bytes spanned by the elements of m
+    Mat a = tomat(m);
+    const double *p = a.p, *q = a.p;
+    if (m->rows > 0 && m->cols > 0) {
+        ptrdiff_t r = (m->rows - 1) * a.rs, c = (m->cols - 1) * a.cs;
+        p += (r < 0 ? r : 0) + (c < 0 ? c : 0);
+        q += (r > 0 ? r : 0) + (c > 0 ? c : 0) + 1;
+    }
+    *lo = (const char *)p;
+    *hi = (const char *)q;
+}
+
+static void
+checkdisjoint (lua_State *L, int arg, const Matrix *r, const Matrix *a)
+{
+    const char *rlo, *rhi, *alo, *ahi;
+    matspan(r, &rlo, &rhi);
+    matspan(a, &alo, &ahi);
+    luaL_argcheck(L, !(rlo < ahi && alo < rhi), arg,
+                  "output overlaps an operand");
 }
 
 static int
-setarray (lua_State *L)
-{   // [userdata index value]
-    double newval = luaL_checknumber(L, 3);
-    *getelem(L) = newval;
+matrixnew (lua_State *L)
+{
+    // array.matrix(rows, cols) -> zeros, or array.matrix({{..}, ..}) -> rows
+    int rows, cols, i, j;
+    Matrix *m;
 
-    return 0;
+    if (lua_istable(L, 1)) {
+        rows = (int)lua_rawlen(L, 1);
+        lua_rawgeti(L, 1, 1);
+        cols = lua_istable(L, -1) ? (int)lua_rawlen(L, -1) : 0;
+        lua_pop(L, 1);
+    } else {
+        rows = luaL_checkinteger(L, 1);
+        cols = luaL_checkinteger(L, 2);
+        luaL_argcheck(L, rows >= 0, 1, "invalid size");
+        luaL_argcheck(L, cols >= 0, 2, "invalid size");
+    }
+    luaL_argcheck(L, (long long)rows * cols <= INT_MAX, 1, "matrix too large");
+    NumArray *a = pusharray(L, rows * cols, DT_F64);
+    memset(a->data, 0, (size_t)a->size * sizeof(double));
+    m = pushmatrix(L, lua_gettop(L), rows, cols, 0, cols, 1);
+
+    if (lua_istable(L, 1))
+        for (i = 0; i < rows; i++) {
+            lua_rawgeti(L, 1, i + 1);
+            if (!lua_istable(L, -1) || (int)lua_rawlen(L, -1) != cols)
+                return luaL_error(L, "row %d: table of %d numbers expected",
+                                  i + 1, cols);
+            for (j = 0; j < cols; j++) {
+                lua_rawgeti(L, -1, j + 1);
+                if (!lua_isnumber(L, -1))
+                    return luaL_error(L, "row %d: table of %d numbers "
+                                      "expected", i + 1, cols);
+                MAT(tomat(m), i, j) = lua_tonumber(L, -1);
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
+        }
+
+    return 1;
 }
 
 static int
-getarray (lua_State *L)
+tomatrix (lua_State *L)
+{
+    // a:matrix(rows, cols), a matrix on the elements of a, row by row
+    NumArray *a = checkarray(L, 1);
+    int rows = luaL_checkinteger(L, 2);
+    int cols = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, rows >= 0 && cols >= 0
+                  && (long long)rows * cols == a->size, 2,
+                  "rows * cols must equal the array size");
+    pushmatrix(L, 1, rows, cols, 0, cols, 1);
+    return 1;
+}
+
+static int
+matrixshape (lua_State *L)
+{
+    Matrix *m = checkmatrix(L, 1);
+    lua_pushinteger(L, m->rows);
+    lua_pushinteger(L, m->cols);
+    return 2;
+}
+
+static double *
+checkentry (lua_State *L, Matrix *m)
 {
-    lua_pushnumber(L, *getelem(L));
+    // the element (i, j) of m, i & j at arg 2 & 3
+    int i = luaL_checkinteger(L, 2);
+    int j = luaL_checkinteger(L, 3);
+    luaL_argcheck(L, 1 <= i && i <= m->rows, 2, "row out of range");
+    luaL_argcheck(L, 1 <= j && j <= m->cols, 3, "column out of range");
+    return &MAT(tomat(m), i - 1, j - 1);
+}
 
+static int
+matrixget (lua_State *L)
+{
+    lua_pushnumber(L, *checkentry(L, checkmatrix(L, 1)));
     return 1;
 }
 
 static int
-getsize (lua_State *L)
+matrixset (lua_State *L)
 {
-  NumArray *a = checkarray(L);
-  lua_pushnumber(L, a->size);
+    // [m i j v] -> [m i j v m]
+    Matrix *m = checkmatrix(L, 1);
+    double *p = checkentry(L, m);
+    double v = luaL_checknumber(L, 4);
+    checkwritable(L, 1, m->base);
+    *p = v;
+    lua_pushvalue(L, 1);
+    return 1;
+}
 
-  return 1;
+static int
+matrixrow (lua_State *L)
+{
+    Matrix *m = checkmatrix(L, 1);
+    int i = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, 1 <= i && i <= m->rows, 2, "row out of range");
+    lua_getuservalue(L, 1);
+    pushview(L, lua_gettop(L), m->offset + (i - 1) * m->rstep, m->cols,
+             m->cstep);
+    return 1;
 }
 
-// __tostring method
-int
-array2string (lua_State *L)
+static int
+matrixcol (lua_State *L)
+{
+    Matrix *m = checkmatrix(L, 1);
+    int j = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, 1 <= j && j <= m->cols, 2, "column out of range");
+    lua_getuservalue(L, 1);
+    pushview(L, lua_gettop(L), m->offset + (j - 1) * m->cstep, m->rows,
+             m->rstep);
+    return 1;
+}
+
+static int
+matrixt (lua_State *L)
+{
+    // m:t() -> the transpose of m, as a view
+    Matrix *m = checkmatrix(L, 1);
+    lua_getuservalue(L, 1);
+    pushmatrix(L, lua_gettop(L), m->cols, m->rows, m->offset, m->cstep,
+               m->rstep);
+    return 1;
+}
+
+static int
+matrixsub (lua_State *L)
+{
+    // m:sub(i, j, rows, cols) -> the rows x cols view on m starting at (i, j)
+    Matrix *m = checkmatrix(L, 1);
+    int i = luaL_checkinteger(L, 2);
+    int j = luaL_checkinteger(L, 3);
+    int rows = luaL_optinteger(L, 4, m->rows - i + 1);
+    int cols = luaL_optinteger(L, 5, m->cols - j + 1);
+    luaL_argcheck(L, 1 <= i && i <= m->rows + 1, 2, "row out of range");
+    luaL_argcheck(L, 1 <= j && j <= m->cols + 1, 3, "column out of range");
+    luaL_argcheck(L, 0 <= rows && rows <= m->rows - i + 1, 4,
+                  "rows out of range");
+    luaL_argcheck(L, 0 <= cols && cols <= m->cols - j + 1, 5,
+                  "columns out of range");
+    lua_getuservalue(L, 1);
+    pushmatrix(L, lua_gettop(L), rows, cols,
+               m->offset + (i - 1) * m->rstep + (j - 1) * m->cstep,
+               m->rstep, m->cstep);
+    return 1;
+}
+
+static int
+matrixarray (lua_State *L)
+{
+    checkmatrix(L, 1);
+    lua_getuservalue(L, 1);
+    return 1;
+}
+
+static int
+matrixtotable (lua_State *L)
+{
+    // [m] -> [m tbl], a table of rows
+    Matrix *m = checkmatrix(L, 1);
+    Mat a = tomat(m);
+    int i, j;
+
+    lua_createtable(L, m->rows, 0);
+    for (i = 0; i < m->rows; i++) {
+        lua_createtable(L, m->cols, 0);
+        for (j = 0; j < m->cols; j++) {
+            lua_pushnumber(L, MAT(a, i, j));
+            lua_rawseti(L, -2, j + 1);
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+}
+
+static int
+matmul (lua_State *L)
+{
+    // [a b out] -> [.. r], r = a * b (out or a new matrix)
+    Matrix *a = checkmatrix(L, 1);
+    Matrix *b = checkmatrix(L, 2);
+    Matrix *r;
+
+    luaL_argcheck(L, a->cols == b->rows, 2, "matrix shapes do not match");
+    r = pushresult(L, 3, a->rows, b->cols);
+    checkdisjoint(L, 3, r, a);
+    checkdisjoint(L, 3, r, b);
+    if (gemm(tomat(r), tomat(a), tomat(b), a->rows, b->cols, a->cols) != 0)
+        return luaL_error(L, "not enough memory");
+
+    return 1;
+}
+
+static int
+matvec (lua_State *L)
+{
+    // [a x out] -> [.. y], y = a * x (out or a new array)
+    Matrix *a = checkmatrix(L, 1);
+    NumArray *x = checkarray(L, 2);
+    NumArray *y, xc;
+    Mat am = tomat(a);
+
+    luaL_argcheck(L, x->dtype == DT_F64, 2, "f64 array expected");
+    luaL_argcheck(L, x->size == a->cols, 2, "array size does not match");
+    if (lua_isnoneornil(L, 3))
+        y = pusharray(L, a->rows, DT_F64);
+    else {
+        const char *lo, *hi, *ylo, *yhi;
+        y = checkarray(L, 3);
+        luaL_argcheck(L, y->dtype == DT_F64 && y->size == a->rows, 3,
+                      "f64 array of #rows elements expected");
+        checkwritable(L, 3, y);
+        matspan(a, &lo, &hi);
+        span(y, y->size, &ylo, &yhi);
+        luaL_argcheck(L, !(lo < yhi && ylo < hi)
+                      && !intersects(x, x->size, y, y->size),
+                      3, "output overlaps an operand");
+        lua_pushvalue(L, 3);
+    }
+    if (!CONTIGUOUS(x)) {
+        // gemv wants x contiguous: a copy on the stack
+        NumArray *t = pusharray(L, x->size, DT_F64);
+        copyelems(L, t->data, sizeof(double), x, x->size);
+        lua_insert(L, -2);
+        xc = *t;
+        x = &xc;
+    }
+    if (CONTIGUOUS(y))
+        gemv((double *)y->data, am, (const double *)x->data, a->rows,
+             a->cols, grain);
+    else {
+        NumArray *t = pusharray(L, y->size, DT_F64);
+        gemv((double *)t->data, am, (const double *)x->data, a->rows,
+             a->cols, grain);
+        copyelems(L, y->data, STEP(y), t, t->size);
+        lua_pop(L, 1);
+    }
+
+    return 1;
+}
+
+static int
+matrixtranspose (lua_State *L)
+{
+    // [m out] -> [.. r], r = m' (out or a new matrix)
+    Matrix *m = checkmatrix(L, 1);
+    Matrix *r = pushresult(L, 2, m->cols, m->rows);
+    checkdisjoint(L, 2, r, m);
+    transpose(tomat(r), tomat(m), m->rows, m->cols);
+    return 1;
+}
+
+static int
+matrixmul (lua_State *L)
+{
+    // m * n for matrices, m * x for an array x
+    checkmatrix(L, 1);
+    lua_settop(L, 2);
+    return udata_test(L, 2, UV_ARRAY, "ex04.array") ? matvec(L) : matmul(L);
+}
+
+static double
+lineop (int op, const double *x, ptrdiff_t step, int n)
+{
+    // sum, min or max of n elements, step apart; min & max skip NaNs
+    const DType *dt = &dtypes[DT_F64];
+    double r;
+    int i;
+
+    if (step == 1) {
+        r = (op == MAT_SUM ? dt->sum : op == MAT_MIN ? dt->min : dt->max)
+            (x, NULL, 0.0, 0, n).d;
+        // only NaNs reduce to the initial +/-HUGE_VAL
+        if (op != MAT_SUM && isinf(r)
+            && dt->findfirst(x, n, (Acc){.d = r}) < 0)
+            r = NAN;
+        return r;
+    }
+    r = op == MAT_SUM ? 0.0 : NAN;
+    for (i = 0; i < n; i++, x += step)
+        if (op == MAT_SUM)
+            r += *x;
+        else if (isnan(r) || (op == MAT_MIN ? *x < r : *x > r))
+            r = *x;
+    return r;
+}
+
+static double
+combineop (int op, double r, double v)
+{
+    if (op == MAT_SUM) return r + v;
+    if (isnan(r) || (op == MAT_MIN ? v < r : v > r)) return v;
+    return r;
+}
+
+static int
+matrixreduce (lua_State *L, int op, int mean)
+{
+    // [m dim] -> [.. r], r a number (no dim) or an array
+    Matrix *m = checkmatrix(L, 1);
+    int dim = luaL_optinteger(L, 2, 0);
+    Mat a = tomat(m);
+    int i, j;
+
+    luaL_argcheck(L, 0 <= dim && dim <= 2, 2, "dim 1 or 2 expected");
+    if (op != MAT_SUM || mean)
+        luaL_argcheck(L, m->rows > 0 && m->cols > 0, 1, "empty matrix");
+
+    if (dim == 0) {
+        double r = op == MAT_SUM ? 0.0 : NAN;
+        if (a.cs == 1 && a.rs == m->cols)
+            r = lineop(op, a.p, 1, m->rows * m->cols);
+        else if (a.cs == 1 || a.rs != 1)
+            for (i = 0; i < m->rows; i++)
+                r = combineop(op, r, lineop(op, &MAT(a, i, 0), a.cs, m->cols));
+        else
+            for (j = 0; j < m->cols; j++)
+                r = combineop(op, r, lineop(op, &MAT(a, 0, j), a.rs, m->rows));
+        lua_pushnumber(L, mean ? r / ((double)m->rows * m->cols) : r);
+        return 1;
+    }
+
+    // dim 1: each column, down its rows; dim 2: each row, along its columns
+    int n = dim == 1 ? m->cols : m->rows, len = dim == 1 ? m->rows : m->cols;
+    ptrdiff_t along = dim == 1 ? a.rs : a.cs, across = dim == 1 ? a.cs : a.rs;
+    double *r = (double *)pusharray(L, n, DT_F64)->data;
+
+    if (op == MAT_SUM && across == 1 && along != 1) {
+        // sums of strided lines: add the contiguous lines across them
+        memset(r, 0, (size_t)n * sizeof(double));
+        for (i = 0; i < len; i++)
+            dtypes[DT_F64].binop[OP_ADD].aa(r, r, a.p + i * along, n);
+    } else
+        for (i = 0; i < n; i++)
+            r[i] = lineop(op, a.p + i * across, along, len);
+    if (mean)
+        for (i = 0; i < n; i++)
+            r[i] /= len;
+
+    return 1;
+}
+
+static int matrixsum (lua_State *L) { return matrixreduce(L, MAT_SUM, 0); }
+static int matrixmean (lua_State *L) { return matrixreduce(L, MAT_SUM, 1); }
+static int matrixmin (lua_State *L) { return matrixreduce(L, MAT_MIN, 0); }
+static int matrixmax (lua_State *L) { return matrixreduce(L, MAT_MAX, 0); }
+
+static int
+matrix2string (lua_State *L)
 {
-    NumArray *a = checkarray(L);
-    lua_pushfstring(L, "array(%d)", a->size);
+    Matrix *m = checkmatrix(L, 1);
+    lua_pushfstring(L, "matrix(%d, %d)", m->rows, m->cols);
     return 1;
 }
 
+static int
+matrixgc (lua_State *L)
+{
+    Matrix *m = checkmatrix(L, 1);
+    if (m->pinning) {
+        m->base->views--;
+        m->pinning = 0;
+    }
+    return 0;
+}
+
 //  REGISTER LIBRARY
 
 static const struct luaL_Reg funcs [] = {
     {"new", newarray},
+    {"from_table", fromtable},
+    {"mmap", mmaparray},
+    {"frombytes", frombytes},
+    {"load", load},
+    {"growable", growable},
+    {"threads", setthreads},
+    {"grain", setgrain},
+    {"lexsort", lexsort},
+    {"eval", runformula},
+    {"compile", compileformula},
+    {"matrix", matrixnew},
+    {"where", where},
+    {"randomseed", randomseed},
+    {"parse_csv", parsecsv},
+    {"read_csv", readcsv},
+    {"mathmode", mathmode},
+    {"sin", sinmath},
+    {"cos", cosmath},
+    {"tan", tanmath},
+    {"exp", expmath},
+    {"log", logmath},
+    {"log1p", log1pmath},
+    {"sqrt", sqrtmath},
+    {"pow", powmath},
+    {"tanh", tanhmath},
+    {"sigmoid", sigmoidmath},
+    {"erf", erfmath},
     {NULL, NULL}
 };
 
 static const struct luaL_Reg meths [] = {
+    {"dtype", getdtype},
+    {"to_table", totable},
+    {"fill", fill},
+    {"unpack", unpack},
+    {"copy_from", copyfrom},
+    {"view", view},
+    {"slice", slice},
+    {"copy", copy},
+    {"advise", advisearray},
+    {"sync", syncarray},
+    {"tobytes", tobytes},
+    {"save", save},
+    {"format", format},
+    {"write_text", writetext},
+    {"push", push},
+    {"pop", pop},
+    {"extend", extend},
+    {"reserve", reserve},
+    {"shrink_to_fit", shrinktofit},
+    {"capacity", getcapacity},
+    {"alignment", alignment},
+    {"add", addarith},
+    {"add_", addarith_},
+    {"sub", subarith},
+    {"sub_", subarith_},
+    {"mul", mularith},
+    {"mul_", mularith_},
+    {"div", divarith},
+    {"div_", divarith_},
+    {"min", minmethod},
+    {"min_", minarith_},
+    {"max", maxmethod},
+    {"max_", maxarith_},
+    {"fma", fmaarith},
+    {"fma_", fmaarith_},
+    {"axpy", axpyarith},
+    {"axpy_", axpyarith_},
+    {"abs", absarith},
+    {"abs_", absarith_},
+    {"clip", cliparith},
+    {"clip_", cliparith_},
+    {"sin", sinmath},
+    {"cos", cosmath},
+    {"tan", tanmath},
+    {"exp", expmath},
+    {"log", logmath},
+    {"log1p", log1pmath},
+    {"sqrt", sqrtmath},
+    {"pow", powmath},
+    {"tanh", tanhmath},
+    {"sigmoid", sigmoidmath},
+    {"erf", erfmath},
+    {"eq", eqcompare},
+    {"ne", necompare},
+    {"lt", ltcompare},
+    {"le", lecompare},
+    {"gt", gtcompare},
+    {"ge", gecompare},
+    {"land", landmask},
+    {"lor", lormask},
+    {"lnot", lnotmask},
+    {"count", count},
+    {"any", anymask},
+    {"all", allmask},
+    {"compress", compress},
+    {"sum", sum},
+    {"mean", mean},
+    {"var", var},
+    {"dot", dot},
+    {"norm", norm},
+    {"argmin", argmin},
+    {"argmax", argmax},
+    {"take", take},
+    {"put", put},
+    {"scatter_add", scatteradd},
+    {"random_uniform", randomuniform},
+    {"random_normal", randomnormal},
+    {"shuffle", shuffle},
+    {"sample", sample},
+    {"cumsum", cumsum},
+    {"cumprod", cumprod},
+    {"cummin", cummin},
+    {"cummax", cummax},
+    {"scan", scan},
+    {"diff", diff},
+    {"sort", sortarray},
+    {"argsort", argsort},
+    {"partition", partition},
+    {"quantile", quantile},
+    {"median", median},
+    {"searchsorted", searchsorted},
+    {"build_index", buildindex},
+    {"digitize", digitize},
+    {"bincount", bincount},
+    {"histogram", histogram},
+    {"lazy", lazy},
+    {"matrix", tomatrix},
+    {"__add", addmeta},
+    {"__sub", submeta},
+    {"__mul", mulmeta},
+    {"__div", divmeta},
+    {"__unm", unmmeta},
+    {"__band", landmask},
+    {"__bor", lormask},
+    {"__bnot", lnotmask},
     {"__tostring", array2string},
     {"__newindex", setarray},
     {"__index", getarray},
     {"__len", getsize},
+    {"__gc", destroy},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg exprmeths [] = {
+    {"eval", expreval},
+    {"sum", exprsum},
+    {"mean", exprmean},
+    {"min", exprmin},
+    {"max", exprmax},
+    {"abs", exprabs},
+    {"__add", expradd},
+    {"__sub", exprsub},
+    {"__mul", exprmul},
+    {"__div", exprdiv},
+    {"__unm", exprunm},
+    {"__len", exprlen},
+    {"__tostring", expr2string},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg formulameths [] = {
+    {"__call", runformula},
+    {"__tostring", formula2string},
+    {NULL, NULL}
+};
+
+static const struct luaL_Reg matrixmeths [] = {
+    {"shape", matrixshape},
+    {"get", matrixget},
+    {"set", matrixset},
+    {"row", matrixrow},
+    {"col", matrixcol},
+    {"t", matrixt},
+    {"sub", matrixsub},
+    {"array", matrixarray},
+    {"to_table", matrixtotable},
+    {"matmul", matmul},
+    {"matvec", matvec},
+    {"transpose", matrixtranspose},
+    {"sum", matrixsum},
+    {"mean", matrixmean},
+    {"min", matrixmin},
+    {"max", matrixmax},
+    {"__mul", matrixmul},
+    {"__tostring", matrix2string},
+    {"__gc", matrixgc},
     {NULL, NULL}
 };
 
 //luaopen_<name_as_required>
+static void
+setfuncs (lua_State *L, const luaL_Reg *l)
+{
+    // [T] -> [T], with the functions of l, each holding the metatables as
+    // upvalues UV_ARRAY .. UV_FORMULA
+    luaL_getmetatable(L, "ex04.array");
+    luaL_getmetatable(L, "ex04.expr");
+    luaL_getmetatable(L, "ex04.matrix");
+    luaL_getmetatable(L, "ex04.formula");
+    luaL_setfuncs(L, l, NUPVALUES);
+}
+
 int luaopen_ex04 (lua_State *L)
 {
     /* Initialize the library:
@@ -150,12 +5601,46 @@ int luaopen_ex04 (lua_State *L)
     stackDump(L, "pushvalue");
     lua_setfield(L, -2, "__index");      // [ M{__index=M} ]
     stackDump(L, "setfield __index");
-    luaL_setfuncs(L, meths, 0);          // [ M{__index=M, set=setarray, ..} ]
+
+    // all metatables exist before any function gets them as upvalues
+    luaL_newmetatable(L, "ex04.expr");   // [ M{..} E{} ], lazy expressions
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_newmetatable(L, "ex04.matrix");  // [ M{..} E{..} X{} ], matrices
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_newmetatable(L, "ex04.formula");  // [ M{..} E{..} X{..} F{} ]
+
+    setfuncs(L, formulameths);
+    lua_pop(L, 1);
+    setfuncs(L, matrixmeths);
+    lua_pop(L, 1);
+    setfuncs(L, exprmeths);
+    lua_pop(L, 1);                       // [ M{..} ]
+    setfuncs(L, meths);                  // [ M{__index=M, set=setarray, ..} ]
     stackDump(L, "setfuncs");
 
-    luaL_newlib(L, funcs);               // [ M{..} {new=newarray} ]
+    lua_newtable(L);                     // the formulas' cache, weak valued
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, "ex04.formulas");
+
+    luaL_newlibtable(L, funcs);          // [ M{..} {} ]
+    setfuncs(L, funcs);                  // [ M{..} {new=newarray} ]
     stackDump(L, "newlib");
     printf("\n");
 
+    // the pool's workers are stopped when the last lua_State using them is
+    // closed, before the library gets unloaded
+    pool_acquire();
+    lua_newuserdata(L, 1);               // [ M{..} {..} sentinel ]
+    lua_newtable(L);
+    lua_pushcfunction(L, releasepool);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, "ex04.pool");
+
     return 1;
 }
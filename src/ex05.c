@@ -47,6 +47,7 @@
 // debug functions
 
 #include "stackdump.h"  // stackDump(L, "txt")
+#include "udata.h"      // udata_check(L, arg, up, "type")
 
 // the C-datastructure
 
@@ -62,7 +63,7 @@ new (lua_State *L)
 {
     // create userdatum, its metatable & set it.
     Item *p = (Item *)lua_newuserdata(L, 2 * sizeof(Item));
-    luaL_getmetatable(L, "ex05.OddlyEven");
+    udata_meta(L, 1, "ex05.OddlyEven");  // M, held in upvalue 1
     lua_setmetatable(L, -2);
 
     // init the structure
@@ -78,7 +79,7 @@ Item *
 checkUserDatum (lua_State *L)
 {
     // check 1st argument is a valid OddlyEven store & return a ptr to it.
-    void *ud = luaL_checkudata(L, 1, "ex05.OddlyEven");
+    void *ud = udata_check(L, 1, 1, "ex05.OddlyEven");
     luaL_argcheck(L, ud != NULL, 1, "`OddlyEven' storage expected");
 
     return (Item *)ud;
@@ -302,8 +303,11 @@ int luaopen_ex05 (lua_State *L)
     luaL_newmetatable(L, "ex05.OddlyEven");  // [ M ]
     lua_pushvalue(L, -1);                    // [ M, M ]
     lua_setfield(L, -2, "__index");          // [ M{__index=M} ]
-    luaL_setfuncs(L, meths, 0);              // [ M ..} ]
-    luaL_newlib(L, funcs);                   // [ M{..} {new=newarray} ]
+    lua_pushvalue(L, -1);                    // [ M{..} M ]
+    luaL_setfuncs(L, meths, 1);              // [ M ..} ], M is upvalue 1
+    luaL_newlibtable(L, funcs);              // [ M{..} {} ]
+    lua_pushvalue(L, -2);                    // [ M{..} {} M ]
+    luaL_setfuncs(L, funcs, 1);              // [ M{..} {new=newarray} ]
 
     return 1;
 }
@@ -22,6 +22,7 @@
 // debug functions
 
 #include "stackdump.h"  // stackDump(L, "txt")
+#include "udata.h"      // udata_check(L, arg, up, "type")
 
 // the C-datastructure
 
@@ -43,7 +44,7 @@ new (lua_State *L)
 
     stackDump(L, "2");    // [ud]
 
-    luaL_getmetatable(L, "ex06.OddlyEven");
+    udata_meta(L, 1, "ex06.OddlyEven");  // M, held in upvalue 1
 
     stackDump(L, "3");    // [ud M]
 
@@ -63,7 +64,7 @@ Item *
 checkUserDatum (lua_State *L)
 {
     // check 1st argument is a valid OddlyEven store & return a ptr to it.
-    void *ud = luaL_checkudata(L, 1, "ex06.OddlyEven");
+    void *ud = udata_check(L, 1, 1, "ex06.OddlyEven");
     luaL_argcheck(L, ud != NULL, 1, "`OddlyEven' storage expected");
 
     return (Item *)ud;
@@ -161,8 +162,11 @@ int luaopen_ex06 (lua_State *L)
     luaL_newmetatable(L, "ex06.OddlyEven");  // [ M ]
     lua_pushvalue(L, -1);                    // [ M, M ]
     lua_setfield(L, -2, "__index");          // [ M{__index=M} ]
-    luaL_setfuncs(L, meths, 0);              // [ M ..} ]
-    luaL_newlib(L, funcs);                   // [ M{..} {new=newarray} ]
+    lua_pushvalue(L, -1);                    // [ M{..} M ]
+    luaL_setfuncs(L, meths, 1);              // [ M ..} ], M is upvalue 1
+    luaL_newlibtable(L, funcs);              // [ M{..} {} ]
+    lua_pushvalue(L, -2);                    // [ M{..} {} M ]
+    luaL_setfuncs(L, funcs, 1);              // [ M{..} {new=newarray} ]
 
     return 1;
 }
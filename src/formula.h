@@ -0,0 +1,427 @@
+// file formula.h
+// A compiler for arithmetic formulas over arrays, like "x*2 + sin(y)".
+//
+// formula_compile() parses the source once, in a single pass (like Lua's
+// own parser), into register bytecode: every instruction applies one
+// operation to whole blocks of FORMULA_BLOCK doubles, so the interpreter's
+// dispatch costs once per block and the inner loops are plain (and, for
+// the arithmetic, vectorized) loops over doubles.
+//
+// - operators  + - * / ^ and unary -, with Lua's precedence & associativity
+// - functions  abs sqrt exp log sin cos tan asin acos atan tanh floor ceil
+//              min(x, y) max(x, y) pow(x, y) atan2(y, x)
+// - numbers    as in C (1, .5, 1e-3), parts without variables are folded
+// - names      variables, bound to arrays or numbers when the formula runs
+//
+// Registers are numbered: variables first, then constants, then the
+// temporaries.  formula_block() runs the code on one block, where the
+// caller has set p[] to the blocks of the variables & constants; results
+// of operations go into the blocks in reg[].  Math is the C library's, as
+// in ex01's c_sin, and min & max follow vmin & vmax.
+//
+// Uses the vector macros of simd.h.
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define FORMULA_BLOCK 256       // doubles per block
+#define FORMULA_MAXREGS 32      // variables, constants & temporaries
+#define FORMULA_MAXCODE 128     // instructions
+#define FORMULA_NAMELEN 32      // longest name + 1
+#define FORMULA_MAXDEPTH 200    // nesting, like Lua's LUAI_MAXCCALLS
+
+enum {
+    // binary
+    FOP_ADD, FOP_SUB, FOP_MUL, FOP_DIV, FOP_POW, FOP_MIN, FOP_MAX, FOP_ATAN2,
+    // unary
+    FOP_NEG, FOP_ABS, FOP_SQRT, FOP_EXP, FOP_LOG, FOP_SIN, FOP_COS, FOP_TAN,
+    FOP_ASIN, FOP_ACOS, FOP_ATAN, FOP_TANH, FOP_FLOOR, FOP_CEIL
+};
+
+typedef struct FInstr {
+    unsigned char op, r, x, y;  // r = x op y, or r = op(x)
+} FInstr;
+
+typedef struct Formula {
+    int nvars, nconsts, nregs, ncode;
+    int result;                 // register with the result
+    char var[FORMULA_MAXREGS][FORMULA_NAMELEN];
+    double konst[FORMULA_MAXREGS];
+    FInstr code[FORMULA_MAXCODE];
+} Formula;
+
+static const struct { const char *name; int op, nargs; } formula_funcs[] = {
+    {"abs", FOP_ABS, 1}, {"sqrt", FOP_SQRT, 1}, {"exp", FOP_EXP, 1},
+    {"log", FOP_LOG, 1}, {"sin", FOP_SIN, 1}, {"cos", FOP_COS, 1},
+    {"tan", FOP_TAN, 1}, {"asin", FOP_ASIN, 1}, {"acos", FOP_ACOS, 1},
+    {"atan", FOP_ATAN, 1}, {"tanh", FOP_TANH, 1}, {"floor", FOP_FLOOR, 1},
+    {"ceil", FOP_CEIL, 1}, {"min", FOP_MIN, 2}, {"max", FOP_MAX, 2},
+    {"pow", FOP_POW, 2}, {"atan2", FOP_ATAN2, 2},
+    {NULL, 0, 0}
+};
+
+#define FORMULA_VBIN(VOP, SEXP)                                               \
+    for (; i + VLEN <= n; i += VLEN)                                          \
+        vstore(r + i, VOP(vload(x + i), vload(y + i)));                       \
+    for (; i < n; i++)                                                        \
+        r[i] = SEXP;                                                          \
+    break
+#define FORMULA_BIN(SEXP)   for (; i < n; i++) r[i] = SEXP; break
+#define FORMULA_UN(F)       for (; i < n; i++) r[i] = F(x[i]); break
+
+static void
+formula_op (int op, double *r, const double *x, const double *y, int n)
+{
+    // r[i] = x[i] op y[i] (y unused by unary ops), also used for folding
+    int i = 0;
+    switch (op) {
+    case FOP_ADD:   FORMULA_VBIN(vadd, x[i] + y[i]);
+    case FOP_SUB:   FORMULA_VBIN(vsub, x[i] - y[i]);
+    case FOP_MUL:   FORMULA_VBIN(vmul, x[i] * y[i]);
+    case FOP_DIV:   FORMULA_VBIN(vdiv, x[i] / y[i]);
+    case FOP_MIN:   FORMULA_VBIN(vmin, smin(x[i], y[i]));
+    case FOP_MAX:   FORMULA_VBIN(vmax, smax(x[i], y[i]));
+    case FOP_POW:   FORMULA_BIN(pow(x[i], y[i]));
+    case FOP_ATAN2: FORMULA_BIN(atan2(x[i], y[i]));
+    case FOP_NEG:   FORMULA_UN(-);
+    case FOP_ABS:   FORMULA_UN(fabs);
+    case FOP_SQRT:  FORMULA_UN(sqrt);
+    case FOP_EXP:   FORMULA_UN(exp);
+    case FOP_LOG:   FORMULA_UN(log);
+    case FOP_SIN:   FORMULA_UN(sin);
+    case FOP_COS:   FORMULA_UN(cos);
+    case FOP_TAN:   FORMULA_UN(tan);
+    case FOP_ASIN:  FORMULA_UN(asin);
+    case FOP_ACOS:  FORMULA_UN(acos);
+    case FOP_ATAN:  FORMULA_UN(atan);
+    case FOP_TANH:  FORMULA_UN(tanh);
+    case FOP_FLOOR: FORMULA_UN(floor);
+    case FOP_CEIL:  FORMULA_UN(ceil);
+    }
+}
+
+static void
+formula_block (const Formula *f, const double **p,
+               double reg[][FORMULA_BLOCK], int n)
+{
+    // run f on blocks of n elements, p[f->result] points to the results
+    int i;
+    for (i = 0; i < f->ncode; i++) {
+        const FInstr *in = &f->code[i];
+        formula_op(in->op, reg[in->r], p[in->x], p[in->y], n);
+        p[in->r] = reg[in->r];
+    }
+}
+
+// the parser
+
+enum { FK_VAR, FK_CONST, FK_TEMP };     // kinds of operands
+
+typedef struct FExp {
+    int kind;
+    int idx;            // FK_VAR & FK_TEMP
+    double v;           // FK_CONST
+} FExp;
+
+enum { FT_EOS = 256, FT_NUMBER, FT_NAME };   // tokens, besides chars
+
+typedef struct FParser {
+    Formula *f;
+    const char *src, *p, *tokstart;
+    int tok;
+    double num;
+    char name[FORMULA_NAMELEN];
+    int ntemps, maxtemps;
+    int depth;                  // of formula_unary's recursion
+    unsigned char xkind[FORMULA_MAXCODE], ykind[FORMULA_MAXCODE];
+    char *err;
+    size_t errlen;
+    jmp_buf fail;
+} FParser;
+
+static void
+formula_error (FParser *ps, const char *msg)
+{
+    if (ps->tok == FT_EOS)
+        snprintf(ps->err, ps->errlen, "formula:%d: %s near <eos>",
+                 (int)(ps->tokstart - ps->src) + 1, msg);
+    else
+        snprintf(ps->err, ps->errlen, "formula:%d: %s near '%.*s'",
+                 (int)(ps->tokstart - ps->src) + 1, msg,
+                 (int)(ps->p - ps->tokstart), ps->tokstart);
+    longjmp(ps->fail, 1);
+}
+
+static void
+formula_next (FParser *ps)
+{
+    const char *p = ps->p;
+
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+        p++;
+    ps->tokstart = p;
+    if (*p == '\0')
+        ps->tok = FT_EOS;
+    else if ((*p >= '0' && *p <= '9') || (*p == '.' && p[1] >= '0'
+                                          && p[1] <= '9')) {
+        char *end;
+        ps->num = strtod(p, &end);
+        ps->tok = FT_NUMBER;
+        p = end;
+    } else if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')
+               || *p == '_') {
+        int len = 0;
+        while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z')
+               || (*p >= '0' && *p <= '9') || *p == '_') {
+            if (len < FORMULA_NAMELEN - 1)
+                ps->name[len++] = *p;
+            p++;
+        }
+        ps->name[len] = '\0';
+        ps->tok = FT_NAME;
+        ps->p = p;
+        if (p - ps->tokstart >= FORMULA_NAMELEN)
+            formula_error(ps, "name too long");
+    } else
+        ps->tok = (unsigned char)*p++;
+    ps->p = p;
+    if (ps->tok < FT_EOS && !strchr("+-*/^(),", ps->tok))
+        formula_error(ps, "unexpected symbol");
+}
+
+static void
+formula_expect (FParser *ps, int tok)
+{
+    char msg[16];
+    if (ps->tok != tok) {
+        snprintf(msg, sizeof(msg), "'%c' expected", tok);
+        formula_error(ps, msg);
+    }
+    formula_next(ps);
+}
+
+static void
+formula_free (FParser *ps, const FExp *e)
+{
+    // temporaries are used once & freed in stack order
+    if (e->kind == FK_TEMP)
+        ps->ntemps--;
+}
+
+static FExp
+formula_operand (FParser *ps, FExp e)
+{
+    // number a constant that ends up in a register, equal ones share it
+    Formula *f = ps->f;
+    int k;
+
+    if (e.kind != FK_CONST)
+        return e;
+    for (k = 0; k < f->nconsts; k++)
+        if (memcmp(&f->konst[k], &e.v, sizeof(double)) == 0)
+            break;
+    if (k == f->nconsts) {
+        if (f->nconsts == FORMULA_MAXREGS)
+            formula_error(ps, "formula too complex");
+        f->konst[f->nconsts++] = e.v;
+    }
+    e.idx = k;
+    return e;
+}
+
+static FExp
+formula_emit (FParser *ps, int op, FExp x, FExp y)
+{
+    // x op y (y is ignored by unary ops), folded when x & y are constants
+    Formula *f = ps->f;
+    FExp r = { FK_TEMP, 0, 0.0 };
+    FInstr *in = &f->code[f->ncode];
+
+    if (op >= FOP_NEG)
+        y = x;
+    if (x.kind == FK_CONST && y.kind == FK_CONST) {
+        r.kind = FK_CONST;
+        formula_op(op, &r.v, &x.v, &y.v, 1);
+        return r;
+    }
+    if (f->ncode == FORMULA_MAXCODE)
+        formula_error(ps, "formula too long");
+    x = formula_operand(ps, x);
+    y = formula_operand(ps, y);
+    formula_free(ps, &x);
+    if (op < FOP_NEG)
+        formula_free(ps, &y);
+    r.idx = ps->ntemps++;
+    if (ps->ntemps > ps->maxtemps)
+        ps->maxtemps = ps->ntemps;
+
+    // registers are numbered by kind for now, see formula_compile
+    in->op = (unsigned char)op;
+    in->r = (unsigned char)r.idx;
+    in->x = (unsigned char)x.idx;
+    in->y = (unsigned char)y.idx;
+    ps->xkind[f->ncode] = (unsigned char)x.kind;
+    ps->ykind[f->ncode] = (unsigned char)y.kind;
+    f->ncode++;
+
+    return r;
+}
+
+static FExp formula_expr (FParser *ps);
+
+static FExp
+formula_primary (FParser *ps)
+{
+    FExp e = { FK_CONST, 0, 0.0 };
+    Formula *f = ps->f;
+    int k;
+
+    if (ps->tok == FT_NUMBER) {
+        e.v = ps->num;
+        formula_next(ps);
+    } else if (ps->tok == '(') {
+        formula_next(ps);
+        e = formula_expr(ps);
+        formula_expect(ps, ')');
+    } else if (ps->tok == FT_NAME) {
+        char name[FORMULA_NAMELEN];
+        memcpy(name, ps->name, sizeof(name));
+        formula_next(ps);
+        if (ps->tok == '(') {
+            FExp a[2];
+            int nargs = 0;
+            for (k = 0; formula_funcs[k].name; k++)
+                if (strcmp(formula_funcs[k].name, name) == 0)
+                    break;
+            if (formula_funcs[k].name == NULL) {
+                char msg[FORMULA_NAMELEN + 24];
+                snprintf(msg, sizeof(msg), "unknown function '%s'", name);
+                formula_error(ps, msg);
+            }
+            do {
+                formula_next(ps);
+                if (nargs == formula_funcs[k].nargs)
+                    formula_error(ps, "too many arguments");
+                a[nargs++] = formula_expr(ps);
+            } while (ps->tok == ',');
+            if (nargs < formula_funcs[k].nargs)
+                formula_error(ps, "too few arguments");
+            formula_expect(ps, ')');
+            e = formula_emit(ps, formula_funcs[k].op, a[0], a[nargs - 1]);
+        } else {
+            for (k = 0; k < f->nvars; k++)
+                if (strcmp(f->var[k], name) == 0)
+                    break;
+            if (k == f->nvars) {
+                if (f->nvars == FORMULA_MAXREGS)
+                    formula_error(ps, "too many variables");
+                memcpy(f->var[f->nvars++], name, FORMULA_NAMELEN);
+            }
+            e.kind = FK_VAR;
+            e.idx = k;
+        }
+    } else
+        formula_error(ps, "unexpected symbol");
+
+    return e;
+}
+
+static FExp formula_unary (FParser *ps);
+
+static FExp
+formula_power (FParser *ps)
+{
+    // right associative, with an exponent that may be negated: 2^-x^2
+    FExp x = formula_primary(ps);
+    if (ps->tok == '^') {
+        formula_next(ps);
+        x = formula_emit(ps, FOP_POW, x, formula_unary(ps));
+    }
+    return x;
+}
+
+static FExp
+formula_unary (FParser *ps)
+{
+    // binds looser than ^, so -x^2 is -(x^2); every nesting of (, - or ^
+    // passes through here, so this limits the C stack the parser takes
+    FExp x;
+    if (++ps->depth > FORMULA_MAXDEPTH)
+        formula_error(ps, "formula too complex");
+    if (ps->tok == '-') {
+        formula_next(ps);
+        x = formula_emit(ps, FOP_NEG, formula_unary(ps), (FExp){ 0 });
+    } else
+        x = formula_power(ps);
+    ps->depth--;
+    return x;
+}
+
+static FExp
+formula_term (FParser *ps)
+{
+    FExp x = formula_unary(ps);
+    while (ps->tok == '*' || ps->tok == '/') {
+        int op = ps->tok == '*' ? FOP_MUL : FOP_DIV;
+        formula_next(ps);
+        x = formula_emit(ps, op, x, formula_unary(ps));
+    }
+    return x;
+}
+
+static FExp
+formula_expr (FParser *ps)
+{
+    FExp x = formula_term(ps);
+    while (ps->tok == '+' || ps->tok == '-') {
+        int op = ps->tok == '+' ? FOP_ADD : FOP_SUB;
+        formula_next(ps);
+        x = formula_emit(ps, op, x, formula_term(ps));
+    }
+    return x;
+}
+
+static int
+formula_compile (Formula *f, const char *src, char *err, size_t errlen)
+{
+    // compile src into f; 0 on success, -1 with a message in err
+    FParser ps;
+    FExp e;
+    int i, base;
+
+    memset(f, 0, sizeof(*f));
+    memset(&ps, 0, sizeof(ps));
+    ps.f = f;
+    ps.src = ps.p = ps.tokstart = src;
+    ps.err = err;
+    ps.errlen = errlen;
+    if (setjmp(ps.fail))
+        return -1;
+
+    formula_next(&ps);
+    e = formula_operand(&ps, formula_expr(&ps));
+    if (ps.tok != FT_EOS)
+        formula_error(&ps, "operator expected");
+
+    // number the registers: variables, constants, then temporaries
+    base = f->nvars + f->nconsts;
+    f->nregs = base + ps.maxtemps;
+    if (f->nregs > FORMULA_MAXREGS)
+        formula_error(&ps, "formula too complex");
+    for (i = 0; i < f->ncode; i++) {
+        FInstr *in = &f->code[i];
+        int xk = ps.xkind[i], yk = ps.ykind[i];
+        in->r = (unsigned char)(base + in->r);
+        in->x = (unsigned char)(in->x + (xk == FK_VAR ? 0 :
+                                         xk == FK_CONST ? f->nvars : base));
+        in->y = (unsigned char)(in->y + (yk == FK_VAR ? 0 :
+                                         yk == FK_CONST ? f->nvars : base));
+    }
+    f->result = e.idx + (e.kind == FK_VAR ? 0 :
+                         e.kind == FK_CONST ? f->nvars : base);
+
+    return 0;
+}
@@ -0,0 +1,253 @@
+// file gemm.h
+// Dense matrix kernels on doubles for ex04's matrices: C = A * B, y = A x
+// and transposes.  Every matrix is a pointer to its element (1, 1) with a
+// row stride and a column stride (in doubles), so transposed & sub matrix
+// views need no copies.
+//
+// - gemm       C = A * B.  Small products (dense layers of a few dozen
+//              units) run an i-k-j loop that streams rows of B & C.
+//              Large ones follow the GotoBLAS scheme: B is packed in
+//              panels of GEMM_KC x GEMM_NC that stay in L2/L3, A in blocks
+//              of GEMM_MC x GEMM_KC that stay in L2, and a register-blocked
+//              micro-kernel computes GEMM_MR x GEMM_NR tiles of C from
+//              slivers of both: 8 vector FMAs per 2 vector loads of B and
+//              4 broadcasts of A.  The blocks of A (for one panel of B)
+//              are spread over the thread pool.
+// - gemv       y = A x, row by row with the pairwise dot kernel when rows
+//              are contiguous, column by column (axpy) when columns are
+// - transpose  in tiles of GEMM_TILE x GEMM_TILE, so that both the reads
+//              and the writes stay within a few pages at a time
+//
+// Uses simd.h, the thread pool of pool.h and the f64 kernels of dtypes.h.
+
+#define GEMM_MR 4               // rows of a micro-kernel tile
+#define GEMM_NR (2 * VLEN)      // columns of a micro-kernel tile
+#define GEMM_MC 64              // rows of a packed block of A
+#define GEMM_KC 256             // depth of the packed blocks
+#define GEMM_NC 2048            // columns of a packed panel of B
+#define GEMM_SMALL (48*48*48)   // m*n*k up to which gemm does not pack
+#define GEMM_TILE 32            // transpose tiles
+
+typedef struct Mat {
+    double *p;                  // element (1, 1)
+    ptrdiff_t rs, cs;           // row & column stride
+} Mat;
+
+#define MAT(m, i, j)  ((m).p[(ptrdiff_t)(i) * (m).rs + (ptrdiff_t)(j) * (m).cs])
+
+static void
+gemm_small (Mat c, Mat a, Mat b, int m, int n, int k)
+{
+    // C row i = sum over p of A[i, p] * B row p
+    int i, j, p;
+    for (i = 0; i < m; i++) {
+        for (j = 0; j < n; j++)
+            MAT(c, i, j) = 0.0;
+        for (p = 0; p < k; p++) {
+            double aip = MAT(a, i, p);
+            double *cr = &MAT(c, i, 0);
+            const double *br = &MAT(b, p, 0);
+            j = 0;
+            if (c.cs == 1 && b.cs == 1) {
+                vdouble va = vset1(aip);
+                for (; j + VLEN <= n; j += VLEN)
+                    vstore(cr + j, vfma(va, vload(br + j), vload(cr + j)));
+            }
+            for (; j < n; j++)
+                cr[j * c.cs] = sfma(aip, br[j * b.cs], cr[j * c.cs]);
+        }
+    }
+}
+
+static void
+gemm_packa (double *pa, Mat a, int mc, int kc)
+{
+    // slivers of GEMM_MR rows, column by column; short slivers get zeros
+    int i, p, r;
+    for (i = 0; i < mc; i += GEMM_MR)
+        for (p = 0; p < kc; p++)
+            for (r = 0; r < GEMM_MR; r++)
+                *pa++ = i + r < mc ? MAT(a, i + r, p) : 0.0;
+}
+
+static void
+gemm_packb (double *pb, Mat b, int kc, int nc)
+{
+    // slivers of GEMM_NR columns, row by row; short slivers get zeros
+    int j, p, r;
+    for (j = 0; j < nc; j += GEMM_NR)
+        for (p = 0; p < kc; p++)
+            for (r = 0; r < GEMM_NR; r++)
+                *pb++ = j + r < nc ? MAT(b, p, j + r) : 0.0;
+}
+
+static void
+gemm_micro (int kc, const double *pa, const double *pb, Mat c, int mr,
+            int nr, int first)
+{
+    // the mr x nr tile at c (+)= sliver pa * sliver pb, = if first
+    _Alignas(64) double t[GEMM_MR * GEMM_NR];
+    vdouble c00 = vset1(0.0), c01 = c00, c10 = c00, c11 = c00;
+    vdouble c20 = c00, c21 = c00, c30 = c00, c31 = c00;
+    int p, i, j;
+
+    for (p = 0; p < kc; p++, pa += GEMM_MR, pb += GEMM_NR) {
+        vdouble b0 = vload(pb), b1 = vload(pb + VLEN), ai;
+        ai = vset1(pa[0]); c00 = vfma(ai, b0, c00); c01 = vfma(ai, b1, c01);
+        ai = vset1(pa[1]); c10 = vfma(ai, b0, c10); c11 = vfma(ai, b1, c11);
+        ai = vset1(pa[2]); c20 = vfma(ai, b0, c20); c21 = vfma(ai, b1, c21);
+        ai = vset1(pa[3]); c30 = vfma(ai, b0, c30); c31 = vfma(ai, b1, c31);
+    }
+    vstore(t, c00); vstore(t + VLEN, c01);
+    vstore(t + GEMM_NR, c10); vstore(t + GEMM_NR + VLEN, c11);
+    vstore(t + 2*GEMM_NR, c20); vstore(t + 2*GEMM_NR + VLEN, c21);
+    vstore(t + 3*GEMM_NR, c30); vstore(t + 3*GEMM_NR + VLEN, c31);
+
+    for (i = 0; i < mr; i++)
+        for (j = 0; j < nr; j++)
+            MAT(c, i, j) = first ? t[i * GEMM_NR + j]
+                                 : MAT(c, i, j) + t[i * GEMM_NR + j];
+}
+
+typedef struct GemmJob {
+    Mat c, a;                   // of the current panel
+    const double *pb;           // the packed panel of B
+    double *pa;                 // GEMM_MC x GEMM_KC per block of A
+    int m, nc, kc, first;
+} GemmJob;
+
+static void
+gemm_block (void *ctx, int blk)
+{
+    // C[block rows, panel columns] (+)= A[block rows, panel depth] * panel
+    GemmJob *job = (GemmJob *)ctx;
+    int ic = blk * GEMM_MC;
+    int mc = job->m - ic < GEMM_MC ? job->m - ic : GEMM_MC;
+    double *pa = job->pa + (size_t)blk * GEMM_MC * GEMM_KC;
+    Mat a = job->a, c = job->c;
+    int i, j;
+
+    a.p = &MAT(a, ic, 0);
+    gemm_packa(pa, a, mc, job->kc);
+    for (j = 0; j < job->nc; j += GEMM_NR) {
+        int nr = job->nc - j < GEMM_NR ? job->nc - j : GEMM_NR;
+        for (i = 0; i < mc; i += GEMM_MR) {
+            int mr = mc - i < GEMM_MR ? mc - i : GEMM_MR;
+            Mat t = c;
+            t.p = &MAT(c, ic + i, j);
+            gemm_micro(job->kc, pa + (size_t)i * job->kc,
+                       job->pb + (size_t)j * job->kc, t, mr, nr, job->first);
+        }
+    }
+}
+
+static int
+gemm (Mat c, Mat a, Mat b, int m, int n, int k)
+{
+    // C (m x n) = A (m x k) * B (k x n), C must not overlap A or B; 0 on
+    // success, -1 when out of memory
+    GemmJob job;
+    int jc, pc, nblocks = (m + GEMM_MC - 1) / GEMM_MC;
+    double *pb;
+
+    if ((double)m * n * k <= GEMM_SMALL || k == 0) {
+        gemm_small(c, a, b, m, n, k);
+        return 0;
+    }
+    pb = malloc((size_t)GEMM_KC * (GEMM_NC + GEMM_NR) * sizeof(double));
+    job.pa = malloc((size_t)nblocks * GEMM_MC * GEMM_KC * sizeof(double));
+    if (pb == NULL || job.pa == NULL) {
+        free(pb);
+        free(job.pa);
+        return -1;
+    }
+    job.pb = pb;
+    job.m = m;
+    for (jc = 0; jc < n; jc += GEMM_NC) {
+        job.nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;
+        for (pc = 0; pc < k; pc += GEMM_KC) {
+            Mat bp = b;
+            job.kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+            job.first = pc == 0;
+            bp.p = &MAT(b, pc, jc);
+            gemm_packb(pb, bp, job.kc, job.nc);
+            job.a = a;
+            job.a.p = &MAT(a, 0, pc);
+            job.c = c;
+            job.c.p = &MAT(c, 0, jc);
+            pool_run(gemm_block, &job, nblocks);
+        }
+    }
+    free(pb);
+    free(job.pa);
+
+    return 0;
+}
+
+typedef struct GemvJob {
+    Mat a;
+    const double *x;            // contiguous
+    double *y;                  // contiguous
+    int m, n, rows;             // rows per chunk
+} GemvJob;
+
+static void
+gemv_rows (void *ctx, int chunk)
+{
+    GemvJob *job = (GemvJob *)ctx;
+    int lo = chunk * job->rows;
+    int hi = job->m - lo < job->rows ? job->m : lo + job->rows;
+    int i, j;
+
+    if (job->a.cs == 1) {
+        // contiguous rows: dot products
+        for (i = lo; i < hi; i++)
+            job->y[i] = dtypes[DT_F64].dot(&MAT(job->a, i, 0), job->x, 0.0,
+                                           0, job->n).d;
+    } else if (job->a.rs == 1) {
+        // contiguous columns: y += column j * x[j]
+        for (i = lo; i < hi; i++)
+            job->y[i] = 0.0;
+        for (j = 0; j < job->n; j++) {
+            const double *col = &MAT(job->a, 0, j);
+            vdouble xj = vset1(job->x[j]);
+            for (i = lo; i + VLEN <= hi; i += VLEN)
+                vstore(job->y + i, vfma(xj, vload(col + i),
+                                        vload(job->y + i)));
+            for (; i < hi; i++)
+                job->y[i] = sfma(job->x[j], col[i], job->y[i]);
+        }
+    } else {
+        for (i = lo; i < hi; i++) {
+            double s = 0.0;
+            for (j = 0; j < job->n; j++)
+                s = sfma(MAT(job->a, i, j), job->x[j], s);
+            job->y[i] = s;
+        }
+    }
+}
+
+static void
+gemv (double *y, Mat a, const double *x, int m, int n, int grain)
+{
+    // y (m) = A (m x n) x (n), with x & y contiguous, y not overlapping
+    GemvJob job = { a, x, y, m, n, 0 };
+    job.rows = n > 0 && grain / n > 0 ? grain / n : 1;
+    pool_run(gemv_rows, &job, (m + job.rows - 1) / job.rows);
+}
+
+static void
+transpose (Mat t, Mat a, int m, int n)
+{
+    // T (n x m) = A' (A is m x n), T must not overlap A
+    int i0, j0, i, j;
+    for (i0 = 0; i0 < m; i0 += GEMM_TILE) {
+        int i1 = m - i0 < GEMM_TILE ? m : i0 + GEMM_TILE;
+        for (j0 = 0; j0 < n; j0 += GEMM_TILE) {
+            int j1 = n - j0 < GEMM_TILE ? n : j0 + GEMM_TILE;
+            for (i = i0; i < i1; i++)
+                for (j = j0; j < j1; j++)
+                    MAT(t, j, i) = MAT(a, i, j);
+        }
+    }
+}
@@ -0,0 +1,278 @@
+// file pool.h
+// A work-stealing thread pool for ex04's kernels.
+//
+// pool_run(task, ctx, n) calls task(ctx, i) once for every chunk i in
+// [0, n), spread over the calling thread and the pool's worker threads,
+// and returns when all chunks are done.  Workers only ever run tasks, they
+// never touch a lua_State, so tasks must not either.
+//
+// - each participant (the caller is participant 0) starts out with an
+//   equal, contiguous range of chunks in its own slot
+// - a participant takes chunks from the front of its own range and, when
+//   that runs dry, steals the back half of the range of another one
+// - a range is a single 64-bit word (lo | hi << 32), so both taking and
+//   stealing are one compare-and-swap, without locks
+// - a job of a single chunk runs on the caller without waking anyone, so
+//   small arrays pay no handoff cost
+//
+// pool_self() tells a task which participant runs it, so that tasks can
+// keep per-thread state (like private histograms) in an array of as many
+// entries as pool_runmax() was allowed participants.
+//
+// Workers are started on first use and sleep on a condition variable in
+// between jobs.  pool_setthreads() changes the number of participants,
+// pool_release() stops the workers once the last lua_State using the
+// pool is closed (so the library can be unloaded safely).  One job runs
+// at a time, a job submitted while another is running runs on its caller
+// only.
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#define POOL_MAXTHREADS 256
+
+typedef void (*PoolTask)(void *ctx, int chunk);
+
+typedef struct PoolSlot {
+    _Alignas(64) _Atomic uint64_t range;    /* own cache line */
+} PoolSlot;
+
+static _Thread_local int pool_me;  /* participant number, 0 unless a worker */
+
+static struct Pool {
+    pthread_mutex_t submit;     /* held by the caller during a job */
+    pthread_mutex_t lock;       /* guards the fields below, except slot */
+    pthread_cond_t wake;        /* workers wait here for a job */
+    pthread_cond_t idle;        /* the caller waits here for the workers */
+    pthread_t tid[POOL_MAXTHREADS];
+    int nthreads;               /* participants, 0 until known */
+    int nworkers;               /* worker threads running */
+    int users;                  /* lua_States using the pool */
+    int quit;                   /* workers should exit */
+    unsigned long job, startjob;  /* job counter, its value at start */
+    int busy;                   /* workers still in the current job */
+    int nparts;                 /* participants in the current job */
+    PoolTask task;
+    void *ctx;
+    PoolSlot slot[POOL_MAXTHREADS];
+} pool = {
+    .submit = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .idle = PTHREAD_COND_INITIALIZER,
+};
+
+#define RANGE(lo, hi)  ((uint64_t)(uint32_t)(lo) | (uint64_t)(hi) << 32)
+#define RANGE_LO(r)    ((int)(uint32_t)(r))
+#define RANGE_HI(r)    ((int)((r) >> 32))
+
+static int
+pool_take (int me)
+{
+    // next chunk from the front of my own range, -1 if none
+    uint64_t r = atomic_load(&pool.slot[me].range);
+    while (RANGE_LO(r) < RANGE_HI(r))
+        if (atomic_compare_exchange_weak(&pool.slot[me].range, &r,
+                RANGE(RANGE_LO(r) + 1, RANGE_HI(r))))
+            return RANGE_LO(r);
+    return -1;
+}
+
+static int
+pool_steal (int me, int nparts)
+{
+    // steal the back half of someone's range: run its first chunk & keep
+    // the rest as my own range (which is empty, so no one else touches it)
+    int k;
+    for (k = 1; k < nparts; k++) {
+        PoolSlot *victim = &pool.slot[(me + k) % nparts];
+        uint64_t r = atomic_load(&victim->range);
+        while (RANGE_LO(r) < RANGE_HI(r)) {
+            int lo = RANGE_LO(r), hi = RANGE_HI(r);
+            int mid = hi - (hi - lo + 1) / 2;
+            if (atomic_compare_exchange_weak(&victim->range, &r,
+                    RANGE(lo, mid))) {
+                atomic_store(&pool.slot[me].range, RANGE(mid + 1, hi));
+                return mid;
+            }
+        }
+    }
+    return -1;
+}
+
+static void
+pool_work (int me, int nparts, PoolTask task, void *ctx)
+{
+    // until no chunk can be found anywhere; chunks stolen by others but
+    // not yet announced in their slot are done by those others
+    int c;
+    while ((c = pool_take(me)) >= 0 || (c = pool_steal(me, nparts)) >= 0)
+        task(ctx, c);
+}
+
+static void *
+pool_worker (void *arg)
+{
+    int me = (int)(intptr_t)arg;
+
+    pool_me = me;
+    pthread_mutex_lock(&pool.lock);
+    unsigned long seen = pool.startjob;
+    for (;;) {
+        while (!pool.quit && pool.job == seen)
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        if (pool.quit)
+            break;
+        seen = pool.job;
+        if (me < pool.nparts) {
+            int nparts = pool.nparts;
+            PoolTask task = pool.task;
+            void *ctx = pool.ctx;
+            pthread_mutex_unlock(&pool.lock);
+            pool_work(me, nparts, task, ctx);
+            pthread_mutex_lock(&pool.lock);
+            if (--pool.busy == 0)
+                pthread_cond_signal(&pool.idle);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return NULL;
+}
+
+static int
+pool_defaultthreads (void)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1) ncpu = 1;
+    return ncpu > POOL_MAXTHREADS ? POOL_MAXTHREADS : (int)ncpu;
+}
+
+static void
+pool_start (void)
+{
+    // start the workers, with pool.submit held; fewer if threads run out
+    if (pool.nthreads == 0)
+        pool.nthreads = pool_defaultthreads();
+    pthread_mutex_lock(&pool.lock);
+    pool.startjob = pool.job;
+    while (pool.nworkers < pool.nthreads - 1) {
+        intptr_t me = pool.nworkers + 1;
+        if (pthread_create(&pool.tid[pool.nworkers], NULL, pool_worker,
+                           (void *)me) != 0)
+            break;
+        pool.nworkers++;
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+static void
+pool_stop (void)
+{
+    // stop & join the workers, with pool.submit held
+    int t;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+    for (t = 0; t < pool.nworkers; t++)
+        pthread_join(pool.tid[t], NULL);
+    pool.nworkers = 0;
+    pool.quit = 0;
+}
+
+static void
+pool_runmax (PoolTask task, void *ctx, int nchunks, int maxparts)
+{
+    // pool_run with at most maxparts participants, numbered 0 .. maxparts-1
+    int p, nparts;
+
+    if (nchunks <= 1 || maxparts <= 1
+        || pthread_mutex_trylock(&pool.submit) != 0) {
+        // too small or the pool is busy: all by ourselves
+        for (p = 0; p < nchunks; p++)
+            task(ctx, p);
+        return;
+    }
+    if (pool.nworkers < pool.nthreads - 1 || pool.nthreads == 0)
+        pool_start();
+
+    nparts = pool.nworkers + 1 < nchunks ? pool.nworkers + 1 : nchunks;
+    if (nparts > maxparts)
+        nparts = maxparts;
+    for (p = 0; p < nparts; p++)
+        atomic_store(&pool.slot[p].range,
+                     RANGE((long long)nchunks * p / nparts,
+                           (long long)nchunks * (p + 1) / nparts));
+
+    pthread_mutex_lock(&pool.lock);
+    pool.task = task;
+    pool.ctx = ctx;
+    pool.nparts = nparts;
+    pool.busy = nparts - 1;
+    pool.job++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    pool_work(0, nparts, task, ctx);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy > 0)
+        pthread_cond_wait(&pool.idle, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_mutex_unlock(&pool.submit);
+}
+
+static void
+pool_run (PoolTask task, void *ctx, int nchunks)
+{
+    pool_runmax(task, ctx, nchunks, POOL_MAXTHREADS);
+}
+
+static int
+pool_self (void)
+{
+    // the participant running the current task
+    return pool_me;
+}
+
+static int
+pool_threads (void)
+{
+    // number of participants in a job, the caller included
+    return pool.nthreads > 0 ? pool.nthreads : pool_defaultthreads();
+}
+
+static void
+pool_setthreads (int n)
+{
+    // n participants from now on (1 means no workers), 0 for one per cpu
+    pthread_mutex_lock(&pool.submit);
+    if (n <= 0) n = pool_defaultthreads();
+    if (n > POOL_MAXTHREADS) n = POOL_MAXTHREADS;
+    if (pool.nworkers > n - 1)
+        pool_stop();
+    pool.nthreads = n;
+    pthread_mutex_unlock(&pool.submit);
+}
+
+static void
+pool_acquire (void)
+{
+    pthread_mutex_lock(&pool.submit);
+    pool.users++;
+    pthread_mutex_unlock(&pool.submit);
+}
+
+static void
+pool_release (void)
+{
+    pthread_mutex_lock(&pool.submit);
+    if (--pool.users == 0)
+        pool_stop();
+    pthread_mutex_unlock(&pool.submit);
+}
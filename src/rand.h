@@ -0,0 +1,154 @@
+// file rand.h
+// Random numbers for ex04's arrays, from xoshiro256** generators.
+//
+// A RandState holds RAND_LANES xoshiro256** generators side by side (one
+// array per state word), so a step of all of them is a loop without
+// dependencies between iterations that the compiler vectorizes: the
+// generator is nothing but shifts, rotations, xors & multiplications by 5
+// and 9.  rand_seed(r, seed, stream) starts the lanes of stream number
+// stream of a seed, each lane's 256 bits of state coming from splitmix64
+// over a hash of (seed, stream, lane), as xoshiro's authors recommend.
+// With a period of 2^256 - 1, sequences that start at such hashed points
+// do not overlap in practice, so streams are independent.
+//
+// ex04 fills block b of RAND_BLOCK elements of an array from stream b, so
+// the numbers depend on the seed only, not on which thread fills which
+// block (nor on how many blocks a chunk of the thread pool gets).
+//
+// - rand_uniform  n doubles uniform in [lo, hi), 53 random bits each
+// - rand_normal   n doubles from N(mu, sigma^2), Box-Muller in pairs
+// - rand_below    a word in [0, bound), Lemire's multiply-and-reject, from
+//                 a RandBuf that hands out a stream's words one at a time
+//
+// Uses vmath.h.
+
+#define RAND_LANES   8
+#define RAND_BLOCK   4096         /* elements per stream */
+#define RAND_PAIRS   64           /* Box-Muller pairs per step */
+#define RAND_GOLDEN  0x9e3779b97f4a7c15ULL
+#define RAND_2PI     6.283185307179586
+
+#define RAND_ROTL(x, k)  ((x) << (k) | (x) >> (64 - (k)))
+
+typedef struct RandState {
+    _Alignas(64) uint64_t s[4][RAND_LANES];
+} RandState;
+
+typedef struct RandBuf {
+    RandState st;
+    uint64_t w[RAND_LANES];
+    int left;                   /* words of w not handed out yet */
+} RandBuf;
+
+static inline uint64_t
+rand_mix (uint64_t z)
+{
+    // splitmix64's finalizer
+    z = (z ^ z >> 30) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ z >> 27) * 0x94d049bb133111ebULL;
+    return z ^ z >> 31;
+}
+
+static void
+rand_seed (RandState *r, uint64_t seed, uint64_t stream)
+{
+    int i, j;
+    for (j = 0; j < RAND_LANES; j++) {
+        uint64_t x = seed ^ rand_mix(stream * RAND_LANES + j + 1);
+        for (i = 0; i < 4; i++)
+            r->s[i][j] = rand_mix(x += RAND_GOLDEN);
+    }
+}
+
+static inline void
+rand_step (RandState *r, uint64_t *out)
+{
+    // one word from every lane
+    uint64_t *s0 = r->s[0], *s1 = r->s[1], *s2 = r->s[2], *s3 = r->s[3];
+    int j;
+    for (j = 0; j < RAND_LANES; j++) {
+        uint64_t x = s1[j] * 5, t = s1[j] << 17;
+        out[j] = RAND_ROTL(x, 7) * 9;
+        s2[j] ^= s0[j];
+        s3[j] ^= s1[j];
+        s1[j] ^= s2[j];
+        s0[j] ^= s3[j];
+        s2[j] ^= t;
+        s3[j] = RAND_ROTL(s3[j], 45);
+    }
+}
+
+static void
+rand_uniform (RandState *r, double *x, int n, double lo, double hi)
+{
+    uint64_t w[RAND_LANES];
+    double d = hi - lo;
+    int i, j;
+    for (i = 0; i < n; i += RAND_LANES) {
+        int m = n - i < RAND_LANES ? n - i : RAND_LANES;
+        rand_step(r, w);
+        for (j = 0; j < m; j++)
+            x[i + j] = lo + d * ((double)(w[j] >> 11) * 0x1p-53);
+    }
+}
+
+static void
+rand_normal (RandState *r, double *x, int n, double mu, double sigma)
+{
+    // pairs of uniforms u in (0, 1] & v in [0, 2pi) give the two deviates
+    // sqrt(-2 log u) * cos(v) and * sin(v), computed by vmath's kernels
+    // for RAND_PAIRS pairs at a time; an odd n drops the last sin
+    double u[RAND_PAIRS], v[RAND_PAIRS], c[RAND_PAIRS];
+    int i, k;
+    for (i = 0; i < n; i += 2 * RAND_PAIRS) {
+        int cnt = n - i < 2 * RAND_PAIRS ? n - i : 2 * RAND_PAIRS;
+        int m = (cnt + 1) / 2;
+        rand_uniform(r, u, m, 1.0, 0.0);           // 1 - [0, 1)
+        rand_uniform(r, v, m, 0.0, RAND_2PI);
+        vm_log(u, u, m);
+        for (k = 0; k < m; k++)
+            u[k] *= -2.0;
+        vm_sqrt(u, u, m);
+        vm_cos(c, v, m);
+        vm_sin(v, v, m);
+        for (k = 0; k < m; k++)
+            x[i + k] = mu + sigma * u[k] * c[k];
+        for (k = 0; k < cnt - m; k++)
+            x[i + m + k] = mu + sigma * u[k] * v[k];
+    }
+}
+
+static void
+rand_bufseed (RandBuf *b, uint64_t seed, uint64_t stream)
+{
+    rand_seed(&b->st, seed, stream);
+    b->left = 0;
+}
+
+static inline uint64_t
+rand_word (RandBuf *b)
+{
+    if (b->left == 0) {
+        rand_step(&b->st, b->w);
+        b->left = RAND_LANES;
+    }
+    return b->w[--b->left];
+}
+
+static inline uint64_t
+rand_below (RandBuf *b, uint64_t bound)
+{
+    // the high word of word * bound, rejecting the few words that would
+    // make some results more likely than others; bound 0 stands for 2^64
+    unsigned __int128 m;
+    uint64_t t;
+    if (bound == 0)
+        return rand_word(b);
+    m = (unsigned __int128)rand_word(b) * bound;
+    if ((uint64_t)m < bound) {
+        t = -bound % bound;
+        while ((uint64_t)m < t)
+            m = (unsigned __int128)rand_word(b) * bound;
+    }
+    return (uint64_t)(m >> 64);
+}
@@ -0,0 +1,218 @@
+// file simd.h
+// A thin layer over the SIMD instruction sets for vectors of doubles.
+//
+// Kernels are written once against these macros and compile to AVX, SSE2
+// or plain scalar code, depending on what the compiler targets (see the
+// CFLAGS in the Makefile).  Loads and stores are unaligned, so kernels
+// work on any double*, views with an offset included.  A NumArray payload
+// starts at a 64-byte boundary though, so on whole arrays these loads are
+// aligned and never split a cache line, which is what costs on current
+// hardware (not the unaligned instruction as such).
+//
+// - VLEN          number of doubles in a vector
+// - vdouble       the vector type
+// - vload(p)      load VLEN doubles from p
+// - vstore(p, v)  store VLEN doubles at p
+// - vset1(x)      broadcast x to all lanes
+// - vadd, vsub, vmul, vdiv, vmin, vmax, vneg, vabs, vfma(x, y, z) = x*y + z
+// - vhsum(v), vhmin(v), vhmax(v)  horizontal sum/min/max of the lanes
+// - veq, vne, vlt, vle, vgt, vge(x, y)  compare lanes, bit i of the int
+//                 result is lane i's outcome (as in C: only != holds on NaN)
+// - vsqrt(x)      square root, correctly rounded like sqrt()
+// - vand, vor, vxor(x, y)  bitwise operations on the lanes' bit patterns
+// - vbits(u)      broadcast the 64-bit pattern u (not its value) to all lanes
+// - vaddi(x, y)   add the lanes' bit patterns as 64-bit integers
+// - vshl, vshr(x, n)  shift the lanes' bit patterns left/right by n bits,
+//                 shifting in zeros
+//
+// The bit operations serve the math kernels of vmath.h, which take doubles
+// apart into exponent and mantissa.
+//
+// vmin/vmax follow the SSE semantics: if either operand is NaN, the second
+// operand is returned.  smin/smax are the scalar versions with the same
+// semantics, for the tail of the loops.
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX__)
+
+#include <immintrin.h>
+
+#define VLEN 4
+typedef __m256d vdouble;
+#define vload(p)      _mm256_loadu_pd(p)
+#define vstore(p, v)  _mm256_storeu_pd(p, v)
+#define vset1(x)      _mm256_set1_pd(x)
+#define vadd(x, y)    _mm256_add_pd(x, y)
+#define vsub(x, y)    _mm256_sub_pd(x, y)
+#define vmul(x, y)    _mm256_mul_pd(x, y)
+#define vdiv(x, y)    _mm256_div_pd(x, y)
+#define vmin(x, y)    _mm256_min_pd(x, y)
+#define vmax(x, y)    _mm256_max_pd(x, y)
+#define vneg(x)       _mm256_xor_pd(_mm256_set1_pd(-0.0), x)
+#define vabs(x)       _mm256_andnot_pd(_mm256_set1_pd(-0.0), x)
+#define vcmp(x, y, p) _mm256_movemask_pd(_mm256_cmp_pd(x, y, p))
+#define veq(x, y)     vcmp(x, y, _CMP_EQ_OQ)
+#define vne(x, y)     vcmp(x, y, _CMP_NEQ_UQ)
+#define vlt(x, y)     vcmp(x, y, _CMP_LT_OQ)
+#define vle(x, y)     vcmp(x, y, _CMP_LE_OQ)
+#define vgt(x, y)     vcmp(x, y, _CMP_GT_OQ)
+#define vge(x, y)     vcmp(x, y, _CMP_GE_OQ)
+#define vsqrt(x)      _mm256_sqrt_pd(x)
+#define vand(x, y)    _mm256_and_pd(x, y)
+#define vor(x, y)     _mm256_or_pd(x, y)
+#define vxor(x, y)    _mm256_xor_pd(x, y)
+#define vbits(u)      _mm256_castsi256_pd(_mm256_set1_epi64x((int64_t)(u)))
+
+#if defined(__AVX2__)
+#define VINT(OP, x, y)                                                        \
+    _mm256_castsi256_pd(OP(_mm256_castpd_si256(x), y))
+#define vaddi(x, y)   VINT(_mm256_add_epi64, x, _mm256_castpd_si256(y))
+#define vshl(x, n)    VINT(_mm256_sll_epi64, x, _mm_cvtsi32_si128(n))
+#define vshr(x, n)    VINT(_mm256_srl_epi64, x, _mm_cvtsi32_si128(n))
+#else
+// AVX proper has no 256-bit integer instructions: per 128-bit half
+#define VHALF(x, i)   _mm_castpd_si128(_mm256_extractf128_pd(x, i))
+#define VJOIN(lo, hi) _mm256_insertf128_pd(_mm256_castpd128_pd256(           \
+                          _mm_castsi128_pd(lo)), _mm_castsi128_pd(hi), 1)
+#define vaddi(x, y)   VJOIN(_mm_add_epi64(VHALF(x, 0), VHALF(y, 0)),          \
+                            _mm_add_epi64(VHALF(x, 1), VHALF(y, 1)))
+#define vshl(x, n)    VJOIN(_mm_sll_epi64(VHALF(x, 0), _mm_cvtsi32_si128(n)), \
+                            _mm_sll_epi64(VHALF(x, 1), _mm_cvtsi32_si128(n)))
+#define vshr(x, n)    VJOIN(_mm_srl_epi64(VHALF(x, 0), _mm_cvtsi32_si128(n)), \
+                            _mm_srl_epi64(VHALF(x, 1), _mm_cvtsi32_si128(n)))
+#endif
+
+#elif defined(__SSE2__)
+
+#include <emmintrin.h>
+
+#define VLEN 2
+typedef __m128d vdouble;
+#define vload(p)      _mm_loadu_pd(p)
+#define vstore(p, v)  _mm_storeu_pd(p, v)
+#define vset1(x)      _mm_set1_pd(x)
+#define vadd(x, y)    _mm_add_pd(x, y)
+#define vsub(x, y)    _mm_sub_pd(x, y)
+#define vmul(x, y)    _mm_mul_pd(x, y)
+#define vdiv(x, y)    _mm_div_pd(x, y)
+#define vmin(x, y)    _mm_min_pd(x, y)
+#define vmax(x, y)    _mm_max_pd(x, y)
+#define vneg(x)       _mm_xor_pd(_mm_set1_pd(-0.0), x)
+#define vabs(x)       _mm_andnot_pd(_mm_set1_pd(-0.0), x)
+#define veq(x, y)     _mm_movemask_pd(_mm_cmpeq_pd(x, y))
+#define vne(x, y)     _mm_movemask_pd(_mm_cmpneq_pd(x, y))
+#define vlt(x, y)     _mm_movemask_pd(_mm_cmplt_pd(x, y))
+#define vle(x, y)     _mm_movemask_pd(_mm_cmple_pd(x, y))
+#define vgt(x, y)     _mm_movemask_pd(_mm_cmpgt_pd(x, y))
+#define vge(x, y)     _mm_movemask_pd(_mm_cmpge_pd(x, y))
+#define vsqrt(x)      _mm_sqrt_pd(x)
+#define vand(x, y)    _mm_and_pd(x, y)
+#define vor(x, y)     _mm_or_pd(x, y)
+#define vxor(x, y)    _mm_xor_pd(x, y)
+#define vbits(u)      _mm_castsi128_pd(_mm_set1_epi64x((int64_t)(u)))
+#define VINT(OP, x, y)  _mm_castsi128_pd(OP(_mm_castpd_si128(x), y))
+#define vaddi(x, y)   VINT(_mm_add_epi64, x, _mm_castpd_si128(y))
+#define vshl(x, n)    VINT(_mm_sll_epi64, x, _mm_cvtsi32_si128(n))
+#define vshr(x, n)    VINT(_mm_srl_epi64, x, _mm_cvtsi32_si128(n))
+
+#else
+
+#define VLEN 1
+typedef double vdouble;
+#define vload(p)      (*(p))
+#define vstore(p, v)  (*(p) = (v))
+#define vset1(x)      (x)
+#define vadd(x, y)    ((x) + (y))
+#define vsub(x, y)    ((x) - (y))
+#define vmul(x, y)    ((x) * (y))
+#define vdiv(x, y)    ((x) / (y))
+#define vmin(x, y)    smin(x, y)
+#define vmax(x, y)    smax(x, y)
+#define vneg(x)       (-(x))
+#define vabs(x)       fabs(x)
+#define veq(x, y)     ((x) == (y))
+#define vne(x, y)     ((x) != (y))
+#define vlt(x, y)     ((x) < (y))
+#define vle(x, y)     ((x) <= (y))
+#define vgt(x, y)     ((x) > (y))
+#define vge(x, y)     ((x) >= (y))
+#define vsqrt(x)      sqrt(x)
+#define vand(x, y)    sfrombits(sasbits(x) & sasbits(y))
+#define vor(x, y)     sfrombits(sasbits(x) | sasbits(y))
+#define vxor(x, y)    sfrombits(sasbits(x) ^ sasbits(y))
+#define vbits(u)      sfrombits(u)
+#define vaddi(x, y)   sfrombits(sasbits(x) + sasbits(y))
+#define vshl(x, n)    sfrombits(sasbits(x) << (n))
+#define vshr(x, n)    sfrombits(sasbits(x) >> (n))
+
+static inline uint64_t
+sasbits (double x)
+{
+    uint64_t u;
+    memcpy(&u, &x, sizeof(u));
+    return u;
+}
+
+static inline double
+sfrombits (uint64_t u)
+{
+    double x;
+    memcpy(&x, &u, sizeof(x));
+    return x;
+}
+
+#endif
+
+#define smin(x, y)    ((x) < (y) ? (x) : (y))
+#define smax(x, y)    ((x) > (y) ? (x) : (y))
+
+// fused multiply-add only when the hardware has it, so the vector body and
+// the scalar tail of a loop round the same way.
+// VFMA_FUSED tells which.
+#if defined(__FMA__) && defined(__AVX__)
+#define VFMA_FUSED 1
+#define vfma(x, y, z) _mm256_fmadd_pd(x, y, z)
+#define sfma(x, y, z) fma(x, y, z)
+#else
+#define VFMA_FUSED 0
+#define vfma(x, y, z) vadd(vmul(x, y), z)
+#define sfma(x, y, z) ((x) * (y) + (z))
+#endif
+
+// horizontal reductions, only used once per block so no need to be clever
+
+static inline double
+vhsum (vdouble v)
+{
+    double t[VLEN], s = 0.0;
+    int i;
+    vstore(t, v);
+    for (i = 0; i < VLEN; i++)
+        s += t[i];
+    return s;
+}
+
+static inline double
+vhmin (vdouble v)
+{
+    double t[VLEN], m;
+    int i;
+    vstore(t, v);
+    for (m = t[0], i = 1; i < VLEN; i++)
+        m = smin(t[i], m);
+    return m;
+}
+
+static inline double
+vhmax (vdouble v)
+{
+    double t[VLEN], m;
+    int i;
+    vstore(t, v);
+    for (m = t[0], i = 1; i < VLEN; i++)
+        m = smax(t[i], m);
+    return m;
+}
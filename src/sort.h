@@ -0,0 +1,400 @@
+// file sort.h
+// Sorting of unsigned 64-bit keys (the sort keys of dtypes.h), each with
+// an optional int riding along (an index, for argsort & lexsort).
+//
+// - radixsort  stable LSD radix sort, a byte per pass, skipping passes
+//              in which all keys have the same byte (narrow dtypes, or
+//              keys that span a small range like timestamps)
+// - introsort  in-place, unstable quicksort with a heapsort fallback, for
+//              when there is no memory to spare for a second buffer
+// - sortkeys   picks one of them.  A large stable sort is split in runs
+//              that are radix sorted in parallel, which are then merged
+//              pairwise.  Each merge is cut into pieces of grain keys by
+//              co-ranking, so all threads take part until the last one.
+// - selectkeys puts the keys of given ranks where a sort would put them,
+//              with the smaller keys before & the larger ones after each,
+//              in O(n) on average.  Floyd & Rivest's select narrows down
+//              on a rank by recursing into a small sample around it first,
+//              and falls back to introsort when a range fails to shrink.
+//              Several ranks are selected in one pass: after the middle
+//              one, the ranks below & above it recurse into the two sides.
+//
+// Uses the thread pool of pool.h.
+
+#define SORT_SMALL 32       // insertion sort below this many keys
+
+// pointer to element i of ix, if there is an ix
+#define IXAT(ix, i)  ((ix) ? (ix) + (i) : NULL)
+
+static void
+insertionsort (uint64_t *k, int *ix, int n)
+{
+    int i, j;
+    for (i = 1; i < n; i++) {
+        uint64_t v = k[i];
+        int t = ix ? ix[i] : 0;
+        for (j = i; j > 0 && k[j - 1] > v; j--) {
+            k[j] = k[j - 1];
+            if (ix) ix[j] = ix[j - 1];
+        }
+        k[j] = v;
+        if (ix) ix[j] = t;
+    }
+}
+
+static void
+radixsort (uint64_t *k, int *ix, uint64_t *tk, int *tix, int n)
+{
+    // sort k (and ix) using tk (and tix) as scratch space
+    int count[8][256];
+    uint64_t *sk = k, *dk = tk, *swk, first;
+    int *si = ix, *di = tix, *swi;
+    int b, d, i;
+
+    if (n < SORT_SMALL) {
+        insertionsort(k, ix, n);
+        return;
+    }
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++)
+        for (b = 0; b < 8; b++)
+            count[b][(k[i] >> 8 * b) & 255]++;
+
+    first = k[0];
+    for (b = 0; b < 8; b++) {
+        int *c = count[b], shift = 8 * b, sum = 0;
+        if (c[(first >> shift) & 255] == n)
+            continue;  // all keys have this byte in common
+        for (d = 0; d < 256; d++) {
+            int t = c[d];
+            c[d] = sum;
+            sum += t;
+        }
+        for (i = 0; i < n; i++) {
+            int pos = c[(sk[i] >> shift) & 255]++;
+            dk[pos] = sk[i];
+            if (si) di[pos] = si[i];
+        }
+        swk = sk; sk = dk; dk = swk;
+        swi = si; si = di; di = swi;
+    }
+    if (sk != k) {
+        memcpy(k, sk, (size_t)n * sizeof(uint64_t));
+        if (ix) memcpy(ix, si, (size_t)n * sizeof(int));
+    }
+}
+
+#define SORT_SWAP(i, j)                                                       \
+    do {                                                                      \
+        uint64_t tk_ = k[i]; k[i] = k[j]; k[j] = tk_;                         \
+        if (ix) { int ti_ = ix[i]; ix[i] = ix[j]; ix[j] = ti_; }              \
+    } while (0)
+
+static void
+siftdown (uint64_t *k, int *ix, int i, int n)
+{
+    int c;
+    while ((c = 2 * i + 1) < n) {
+        if (c + 1 < n && k[c + 1] > k[c])
+            c++;
+        if (k[i] >= k[c])
+            return;
+        SORT_SWAP(i, c);
+        i = c;
+    }
+}
+
+static void
+heapsort (uint64_t *k, int *ix, int n)
+{
+    int i;
+    for (i = n / 2 - 1; i >= 0; i--)
+        siftdown(k, ix, i, n);
+    for (i = n - 1; i > 0; i--) {
+        SORT_SWAP(0, i);
+        siftdown(k, ix, 0, i);
+    }
+}
+
+static void
+introsort (uint64_t *k, int *ix, int n, int depth)
+{
+    while (n > SORT_SMALL) {
+        int mid = n / 2, i = -1, j = n;
+        uint64_t pivot;
+
+        if (depth-- == 0) {
+            heapsort(k, ix, n);
+            return;
+        }
+        // median of three ends up in the middle, which Hoare's partition
+        // needs to always make progress
+        if (k[mid] < k[0]) SORT_SWAP(mid, 0);
+        if (k[n - 1] < k[mid]) {
+            SORT_SWAP(n - 1, mid);
+            if (k[mid] < k[0]) SORT_SWAP(mid, 0);
+        }
+        pivot = k[mid];
+        for (;;) {
+            do i++; while (k[i] < pivot);
+            do j--; while (k[j] > pivot);
+            if (i >= j)
+                break;
+            SORT_SWAP(i, j);
+        }
+        // recurse into the smaller part, loop on the larger one
+        if (j + 1 < n - j - 1) {
+            introsort(k, ix, j + 1, depth);
+            k += j + 1;
+            if (ix) ix += j + 1;
+            n -= j + 1;
+        } else {
+            introsort(k + j + 1, IXAT(ix, j + 1), n - j - 1, depth);
+            n = j + 1;
+        }
+    }
+    insertionsort(k, ix, n);
+}
+
+#define SELECT_SAMPLE 600    // Floyd-Rivest samples ranges larger than this
+
+static void
+floydrivest (uint64_t *k, int left, int right, int kth, int depth)
+{
+    // the key of rank kth (0-based) to k[kth], for left <= kth <= right
+    int *ix = NULL;     // for SORT_SWAP
+    while (right > left) {
+        uint64_t t;
+        int i, j;
+
+        if (depth-- == 0) {
+            for (depth = 0, i = right - left + 1; i > 1; i >>= 1)
+                depth += 2;
+            introsort(k + left, NULL, right - left + 1, depth);
+            return;
+        }
+        if (right - left > SELECT_SAMPLE) {
+            // first select kth in a sample of about n^(2/3) keys around it,
+            // which makes k[kth] a pivot very close to the wanted key
+            double n = right - left + 1, r = kth - left + 1, z = log(n);
+            double s = 0.5 * exp(2 * z / 3);
+            double sd = 0.5 * sqrt(z * s * (n - s) / n) * (r < n / 2 ? -1 : 1);
+            int nl = (int)(kth - r * s / n + sd);
+            int nr = (int)(kth + (n - r) * s / n + sd);
+            floydrivest(k, nl > left ? nl : left, nr < right ? nr : right, kth,
+                        depth);
+        }
+        // partition around t = k[kth], which ends up at j
+        t = k[kth];
+        i = left;
+        j = right;
+        SORT_SWAP(left, kth);
+        if (k[right] > t)
+            SORT_SWAP(right, left);
+        while (i < j) {
+            SORT_SWAP(i, j);
+            i++;
+            j--;
+            while (k[i] < t) i++;
+            while (k[j] > t) j--;
+        }
+        if (k[left] == t) {
+            SORT_SWAP(left, j);
+        } else {
+            j++;
+            SORT_SWAP(j, right);
+        }
+        if (j <= kth) left = j + 1;
+        if (kth <= j) right = j - 1;
+    }
+}
+
+static void
+multiselect (uint64_t *k, int left, int right, const int *ranks, int nranks,
+             int depth)
+{
+    // ranks ascending, all within left .. right
+    int m = nranks / 2, lo, hi;
+    if (nranks == 0)
+        return;
+    floydrivest(k, left, right, ranks[m], depth);
+    for (lo = m; lo > 0 && ranks[lo - 1] == ranks[m]; lo--)
+        ;
+    for (hi = m + 1; hi < nranks && ranks[hi] == ranks[m]; hi++)
+        ;
+    multiselect(k, left, ranks[m] - 1, ranks, lo, depth);
+    multiselect(k, ranks[m] + 1, right, ranks + hi, nranks - hi, depth);
+}
+
+static void
+selectkeys (uint64_t *k, int n, int *ranks, int nranks)
+{
+    // k[r] = the key of 0-based rank r, for each r of ranks, which get
+    // sorted along the way
+    int depth, r, i, j;
+    for (i = 1; i < nranks; i++) {
+        r = ranks[i];
+        for (j = i; j > 0 && ranks[j - 1] > r; j--)
+            ranks[j] = ranks[j - 1];
+        ranks[j] = r;
+    }
+    for (depth = 0, r = n; r > 1; r >>= 1)
+        depth += 2;
+    multiselect(k, 0, n - 1, ranks, nranks, depth + 16);
+}
+
+static int
+corank (const uint64_t *a, int na, const uint64_t *b, int nb, int d)
+{
+    // number of keys of a among the first d of the stable merge of a & b
+    int lo = d > nb ? d - nb : 0, hi = d < na ? d : na;
+    while (lo < hi) {
+        int i = lo + (hi - lo) / 2;
+        if (a[i] <= b[d - i - 1])
+            lo = i + 1;
+        else
+            hi = i;
+    }
+    return lo;
+}
+
+static void
+merge (const uint64_t *a, const int *ai, int na,
+       const uint64_t *b, const int *bi, int nb, uint64_t *o, int *oi)
+{
+    // stable: on equal keys, a goes first
+    int i = 0, j = 0, d = 0;
+    while (i < na && j < nb) {
+        if (b[j] < a[i]) {
+            if (oi) oi[d] = bi[j];
+            o[d++] = b[j++];
+        } else {
+            if (oi) oi[d] = ai[i];
+            o[d++] = a[i++];
+        }
+    }
+    memcpy(o + d, a + i, (size_t)(na - i) * sizeof(uint64_t));
+    if (oi) memcpy(oi + d, ai + i, (size_t)(na - i) * sizeof(int));
+    d += na - i;
+    memcpy(o + d, b + j, (size_t)(nb - j) * sizeof(uint64_t));
+    if (oi) memcpy(oi + d, bi + j, (size_t)(nb - j) * sizeof(int));
+}
+
+typedef struct SortJob {
+    uint64_t *k, *tk;   // keys & scratch (the merge target)
+    int *ix, *tix;      // their ints, or NULL
+    int *bound;         // run r is bound[r] .. bound[r + 1] - 1
+    int nruns;
+    int *first;         // merges: pair p has pieces first[p] .. first[p+1]-1
+    int grain;
+} SortJob;
+
+static void
+sortrun (void *ctx, int r)
+{
+    SortJob *job = (SortJob *)ctx;
+    int lo = job->bound[r], n = job->bound[r + 1] - lo;
+    radixsort(job->k + lo, IXAT(job->ix, lo), job->tk + lo,
+              IXAT(job->tix, lo), n);
+}
+
+static void
+mergepiece (void *ctx, int c)
+{
+    // merge piece c of some pair of runs 2p & 2p+1 into the scratch space,
+    // where the run 2p+1 may not exist (the odd one out is just copied)
+    SortJob *job = (SortJob *)ctx;
+    int npairs = (job->nruns + 1) / 2, p = 0, hi = npairs - 1;
+    int *bound = job->bound;
+
+    while (p < hi) {
+        int m = (p + hi + 1) / 2;
+        if (job->first[m] <= c) p = m; else hi = m - 1;
+    }
+    int lo = bound[2 * p];
+    int mid = bound[2 * p + 1 < job->nruns ? 2 * p + 1 : job->nruns];
+    int end = bound[2 * p + 2 < job->nruns ? 2 * p + 2 : job->nruns];
+    int na = mid - lo, nb = end - mid;
+    int d0 = (c - job->first[p]) * job->grain;
+    int d1 = na + nb - d0 < job->grain ? na + nb : d0 + job->grain;
+    const uint64_t *a = job->k + lo, *b = job->k + mid;
+    int i0 = corank(a, na, b, nb, d0), i1 = corank(a, na, b, nb, d1);
+
+    merge(a + i0, IXAT(job->ix, lo + i0), i1 - i0,
+          b + d0 - i0, IXAT(job->ix, mid + d0 - i0), (d1 - i1) - (d0 - i0),
+          job->tk + lo + d0, IXAT(job->tix, lo + d0));
+}
+
+static int
+sortkeys (uint64_t *k, int *ix, int n, int stable, int grain)
+{
+    // sort k, moving ix (if not NULL) along; 0 on success, -1 when out of
+    // memory (k & ix are left in some order then)
+    SortJob job;
+    int nruns, r, p, depth, rc = -1;
+
+    if (!stable) {
+        for (depth = 0, r = n; r > 1; r >>= 1)
+            depth += 2;
+        introsort(k, ix, n, depth);
+        return 0;
+    }
+    if (n < SORT_SMALL) {
+        insertionsort(k, ix, n);
+        return 0;
+    }
+
+    nruns = n / grain < pool_threads() ? n / grain : pool_threads();
+    if (nruns < 1)
+        nruns = 1;
+    job.k = k; job.ix = ix;
+    job.tk = malloc((size_t)n * sizeof(uint64_t));
+    job.tix = ix ? malloc((size_t)n * sizeof(int)) : NULL;
+    job.bound = malloc((size_t)(nruns + 1) * sizeof(int));
+    job.first = malloc((size_t)(nruns / 2 + 2) * sizeof(int));
+    job.nruns = nruns;
+    job.grain = grain;
+    if (!job.tk || (ix && !job.tix) || !job.bound || !job.first)
+        goto done;
+
+    for (r = 0; r <= nruns; r++)
+        job.bound[r] = (int)((long long)n * r / nruns);
+    pool_run(sortrun, &job, nruns);
+
+    while (job.nruns > 1) {
+        int npairs = (job.nruns + 1) / 2;
+        uint64_t *swk;
+        int *swi;
+
+        job.first[0] = 0;
+        for (p = 0; p < npairs; p++) {
+            int end = 2 * p + 2 < job.nruns ? 2 * p + 2 : job.nruns;
+            int len = job.bound[end] - job.bound[2 * p];
+            int pieces = (int)(((long long)len + grain - 1) / grain);
+            job.first[p + 1] = job.first[p] + (pieces > 0 ? pieces : 1);
+        }
+        pool_run(mergepiece, &job, job.first[npairs]);
+
+        for (p = 0; p < npairs; p++)
+            job.bound[p] = job.bound[2 * p];
+        job.bound[npairs] = n;
+        job.nruns = npairs;
+        swk = job.k; job.k = job.tk; job.tk = swk;
+        swi = job.ix; job.ix = job.tix; job.tix = swi;
+    }
+    if (job.k != k) {
+        // an odd number of merge rounds, the result is in the scratch space
+        memcpy(k, job.k, (size_t)n * sizeof(uint64_t));
+        if (ix) memcpy(ix, job.ix, (size_t)n * sizeof(int));
+        job.tk = job.k;
+        job.tix = job.ix;
+    }
+    rc = 0;
+
+done:
+    free(job.tk);
+    free(job.tix);
+    free(job.bound);
+    free(job.first);
+    return rc;
+}
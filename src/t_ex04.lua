@@ -34,3 +34,741 @@ end
 
 print(a[10])           --> 0.1
 
+
+-- bulk transfers, one C call per transfer instead of one per element
+
+b = array.from_table({1, 2, 3, 4, 5})
+print("from_table          ", b, b[1], b[5])   --> array(5) 1.0 5.0
+print("unpack              ", b:unpack())      --> 1.0 2.0 3.0 4.0 5.0
+print("unpack(2, 3)        ", b:unpack(2, 3))  --> 2.0 3.0
+
+t = b:to_table()
+print("to_table            ", #t, t[1], t[5])  --> 5 1.0 5.0
+
+a:fill(0)
+print("fill(0)             ", a[1], a[10])     --> 0.0 0.0
+
+a:copy_from(b, 4)
+print("copy_from(b, 4)     ", a:unpack(3, 9))  --> 0.0 1.0 2.0 3.0 4.0 5.0 0.0
+
+print("copy_from(b, 7) fails:", pcall(a.copy_from, a, b, 7))
+print("unpack(0) fails:      ", pcall(a.unpack, a, 0))
+
+-- elementwise arithmetic: new array, output array or in-place
+
+x = array.from_table({1, -2, 3, -4, 5, -6, 7})
+y = array.from_table({2, 2, 2, 2, 2, 2, 2})
+
+print("x:add(y)            ", x:add(y):unpack())     --> 3 0 5 -2 7 -4 9
+print("x:mul(10)           ", x:mul(10):unpack())    --> 10 -20 .. 70
+print("x - 1               ", (x - 1):unpack())      --> 0 -3 2 -5 4 -7 6
+print("1 - x               ", (1 - x):unpack())      --> 0 3 -2 5 -4 7 -6
+print("-x / y              ", (-x / y):unpack())     --> -0.5 1 .. -3.5
+print("x:min(0)            ", x:min(0):unpack())     --> 0 -2 0 -4 0 -6 0
+print("x:abs()             ", x:abs():unpack())      --> 1 2 3 4 5 6 7
+print("x:clip(-3, 3)       ", x:clip(-3, 3):unpack()) --> 1 -2 3 -3 3 -3 3
+print("x:fma(y, 1)         ", x:fma(y, 1):unpack())  --> 3 -3 7 -7 11 -11 15
+
+out = array.new(7)
+r = y:axpy(0.5, x, out)
+print("y:axpy(0.5, x, out) ", r == out, out:unpack()) --> true 2.5 1 .. -1 5.5
+
+y:add_(x):sub_(x)
+print("y:add_(x):sub_(x)   ", y:unpack())            --> 2 2 2 2 2 2 2
+
+print("x:add(b) fails:     ", pcall(x.add, x, b))     --> sizes differ
+
+-- reductions
+
+print("x:sum(), x:mean()   ", x:sum(), x:mean())     --> 4.0 0.57142857142857
+print("x:min(), x:max()    ", x:min(), x:max())      --> -6.0 7.0
+print("x:argmin(), argmax()", x:argmin(), x:argmax()) --> 6 7
+print("x:dot(y), y:norm()  ", x:dot(y), y:norm())    --> 8.0 5.2915026221292
+print("y:var(), x:var(1)   ", y:var(), x:var(1))     --> 0.0 22.952380952381
+print("ddof #a fails       ", pcall(x.var, x, #x))
+print("ddof -1 fails       ", pcall(x.var, x, -1))
+print("ddof #a - 1         ", array.from_table({1, 3}):var(1)) --> 2.0
+ev = array.new(0):var()
+print("empty var is NaN    ", ev ~= ev)              --> true
+
+-- large enough to be split across threads
+big = array.new(3000000):fill(0.1)
+big[12345] = -1
+big[2999999] = 5
+print("big:sum()           ", big:sum())             --> 300003.8 (approx.)
+print("big:argmin(), argmax", big:argmin(), big:argmax()) --> 12345 2999999
+assert(math.abs(big:sum() - 300003.8) < 1e-6)
+
+-- typed arrays, default dtype is f64
+
+c = array.new(4, "i8")
+print("array.new(4, 'i8')  ", c, c:dtype())          --> array(4, i8) i8
+c:fill(100)
+print("c + c wraps around  ", (c + c):unpack())      --> -56 -56 -56 -56
+c[1] = -7
+print("c // 2 (floor)      ", c:div(2):unpack(1, 2)) --> -4 50
+print("c[1] = 1000 fails:  ", pcall(function () c[1] = 1000 end))
+print("c[1] = 1.5 fails:   ", pcall(function () c[1] = 1.5 end))
+print("c:div(0) fails:     ", pcall(c.div, c, 0))
+c[2] = 2.0
+print("c[2] = 2.0          ", c[2], math.type(c[2]))  --> 2 integer
+
+u = array.from_table({1, 2, 3, 250}, "u8")
+print("u8 sum, min, argmax ", u:sum(), u:min(), u:argmax()) --> 256 1 4
+print("u8 mean, norm       ", u:mean(), u:norm())
+
+i64 = array.from_table({math.maxinteger, 1}, "i64")
+print("i64 sum wraps       ", i64:sum() == math.mininteger) --> true
+
+f = array.from_table({0.5, 1.5, 2.5}, "f32")
+print("f32 sum, dot        ", f:sum(), f:dot(f))     --> 4.5 8.75
+print("c:add(f) fails:     ", pcall(c.add, c, f))
+
+-- views share storage with their parent, nothing gets copied
+
+v = x:view(2, 3)
+print("x:view(2, 3)        ", v, v:unpack())         --> array(3, f64) -2 3 -4
+v[1] = 20
+print("v[1] = 20 -> x[2]   ", x[2])                   --> 20.0
+x[2] = -2
+
+r = x:slice(#x, 1, -2)
+print("x:slice(#x, 1, -2)  ", r:unpack())            --> 7 5 3 1
+print("r:sum(), r:argmax() ", r:sum(), r:argmax())   --> 16.0 1
+print("r * 2               ", (r * 2):unpack())      --> 14 10 6 2
+print("r:view(2):max()     ", r:view(2):max())        --> 5.0
+
+x:slice(1, #x, 2):mul_(10)
+print("x:slice(1,#x,2):mul_", x:unpack())            --> 10 -2 30 -4 50 -6 70
+x:slice(1, #x, 2):div_(10)
+
+-- overlapping in-place updates see the original values
+w = array.from_table({1, 2, 3, 4})
+w:add_(w:slice(4, 1, -1))
+print("w:add_(reversed w)  ", w:unpack())            --> 5 5 5 5
+
+w = array.from_table({1, 2, 3, 4, 5})
+w:view(2):copy_from(w:view(1, 4))
+print("shift w right by 1  ", w:unpack())            --> 1 1 2 3 4
+
+e = x:slice(3, 1)
+print("empty slice         ", #e, e:sum())           --> 0.0 0.0
+print("step math.mininteger", pcall(x.slice, x, 1, #x, math.mininteger))
+print("stride overflows int", pcall(x:slice(1, #x, 2).slice, x:slice(1, #x, 2), 1, 1, 2^30))
+print("huge j fails        ", pcall(x.slice, x, 1, 2^40))
+print("x:view(9) fails:    ", pcall(x.view, x, 9))
+
+-- the parent stays alive as long as one of its views does
+do
+  local tmp = array.from_table({1, 2, 3})
+  v = tmp:view(2)
+end
+collectgarbage()
+print("view outlives parent", v:unpack())            --> 2.0 3.0
+
+-- memory-mapped arrays live in a file, shared through the page cache
+
+path = os.tmpname()
+m = array.mmap(path, "i32", "w+", 5)
+print("array.mmap(.., 'w+')", m, m:dtype())          --> array(5, i32) i32
+m:fill(3)
+m[5] = 42
+print("m:advise('willneed')", m:advise("willneed"))  --> true
+print("m:sync()            ", m:sync())              --> true
+m = nil
+collectgarbage()
+
+m = array.mmap(path, "i32")
+print("array.mmap(path, ..)", m:unpack())            --> 3 3 3 3 42
+print("m:sum(), m:view(4)  ", m:sum(), m:view(4):sum()) --> 54 45
+print("m[1] = 1 fails:     ", pcall(function () m[1] = 1 end))
+print("m:add_(1) fails:    ", pcall(m.add_, m, 1))
+print("x:sync() fails:     ", pcall(x.sync, x))
+print("wrong size          ", array.mmap(path, "f64"))
+m = nil
+collectgarbage()
+os.remove(path)
+print("missing file        ", array.mmap(path))       --> nil ... 2
+m = array.mmap(path, "f64", "w+", 0)
+keep = array.from_table({1, 2, 3})
+print("empty mapping       ", #m, m:advise("dontneed"), m:sync()) --> 0.0 true true
+print("heap untouched      ", keep:sum(), m:view(1, 0):sync()) --> 6.0 true
+m = nil
+collectgarbage()
+os.remove(path)
+
+-- serialization: a small header followed by the raw elements
+
+s = x:tobytes()
+print("#x:tobytes()        ", #s)                     --> 88 (32 + 7 * 8)
+y = array.frombytes(s)
+print("array.frombytes(s)  ", y, y:unpack())         --> array(7, f64) 1 -2 3 -4 5 -6 7
+print("of a strided view   ", array.frombytes(x:slice(1, #x, 3):tobytes()):unpack()) --> 1 -4 7
+print("dtype must match:   ", pcall(array.frombytes, s, "i32"))
+print("corrupt payload:    ", pcall(array.frombytes, s:sub(1, -2) .. "x"))
+print("truncated:          ", pcall(array.frombytes, s:sub(1, -2)))
+
+path = os.tmpname()
+c = array.from_table({-1, 2, -3, 4}, "i16")
+print("c:save(path)        ", c:save(path))          --> true
+d = array.load(path)
+print("array.load(path)    ", d, d:unpack())         --> array(4, i16) -1 2 -3 4
+fh = io.open(path, "ab"); fh:write("junk"); fh:close()
+print("trailing junk       ", array.load(path))      --> nil ... size does not match
+os.remove(path)
+print("missing file        ", array.load(path))      --> nil ... 2
+
+-- growable arrays keep their elements in a buffer that doubles when full
+
+g = array.growable("i32")
+print("array.growable('i32')", g, g:capacity())      --> array(0, i32) 0
+for i = 1, 100 do g:push(i) end
+print("100 pushes          ", #g, g:capacity(), g:sum()) --> 100 128 5050
+print("g:push(1, 2, 3)     ", #g:push(1, 2, 3))      --> 103
+print("g:pop(), #g         ", g:pop(), #g)           --> 3 102
+print("g:push(1, 2.5) fails", pcall(g.push, g, 1, 2.5))
+print("... and adds nothing", #g)                    --> 102
+g:extend(g)
+print("g:extend(g)         ", #g, g:sum())           --> 204 10106
+print("g:shrink_to_fit()   ", g:shrink_to_fit():capacity()) --> 204
+print("g:reserve(1000)     ", g:reserve(1000):capacity())  --> 1000
+print("g:extend(x) fails:  ", pcall(g.extend, g, x))
+print("x:push(1) fails:    ", pcall(x.push, x, 1))
+e = array.growable("f64")
+print("e:pop() on empty    ", e:pop())               -->
+
+-- a growable array with views cannot move its elements
+v = g:view(1, 3)
+print("g:shrink_to_fit()   ", pcall(g.shrink_to_fit, g))
+g:push(7)
+print("push within capacity", #g, v:unpack())        --> 205 1 2 3
+v = nil
+collectgarbage()
+print("once the view is gone", #g:shrink_to_fit(), g:capacity()) --> 205 205
+
+-- elements start at a 64-byte boundary, views with an offset may not
+
+print("x:alignment()       ", x:alignment())          --> 64
+print("x:view(2):alignment()", x:view(2):alignment()) --> 8
+print("x:view(3):alignment()", x:view(3):alignment()) --> 16
+print("grown g:alignment() ", g:push(1):alignment())  --> 64
+
+-- the thread pool: chunks of grain elements, results do not depend on
+-- the number of threads
+
+print("array.threads() > 0 ", array.threads() > 0)   --> true
+print("array.grain()       ", array.grain())         --> 65536
+grain = array.grain(1000)
+p = array.growable("f64", 100000)
+for i = 1, 100000 do p:push(i % 7 - 3.25) end
+q = p:slice(1, #p, 3)
+sums = {}
+for _, n in ipairs({1, 2, 4, 0}) do
+  array.threads(n)
+  local r = p:mul(p):add(1.5)
+  sums[#sums + 1] = {p:sum(), p:dot(r), q:sum(), q:mul(2):sum(), r:argmax()}
+end
+for i = 2, #sums do
+  for j = 1, #sums[1] do assert(sums[i][j] == sums[1][j]) end
+end
+print("same with 1..n threads", table.unpack(sums[1]))
+print("array.threads(-1) fails", pcall(array.threads, -1))
+array.grain(65536)
+
+-- sorting: radix sort on keys, NaNs last unless asked otherwise
+
+s = array.from_table({3, 0/0, -1, 2.5, -0.0, 0, -7})
+print("s:argsort()         ", s:argsort():unpack())  --> 7 3 5 6 4 1 2
+print("s:sort()            ", s:copy():sort():unpack()) --> -7 -1 -0.0 0 2.5 3 nan
+print("nans first          ", s:copy():sort({nans = "first"}):unpack())
+print("unstable, in place  ", s:copy():sort({stable = false}):unpack())
+print("a strided view      ", x:slice(#x, 1, -2):sort():unpack()) --> 1 3 5 7
+print("which sorts x too   ", x:unpack())            --> 7 -2 5 -4 3 -6 1
+x:slice(1, #x, 2):sort({stable = false})
+
+k1 = array.from_table({2, 1, 2, 1, 2}, "u8")
+k2 = array.from_table({0.5, 0.25, 0.25, 0.5, 0.25})
+print("array.lexsort{k1, k2}", array.lexsort({k1, k2}):unpack()) --> 2 4 3 5 1
+print("ties keep their order", array.lexsort({k1}):unpack())     --> 2 4 1 3 5
+print("bad nans option:    ", pcall(s.sort, s, {nans = "middle"}))
+print("keys differ in size:", pcall(array.lexsort, {k1, x}))
+
+-- searching sorted arrays, with or without an Eytzinger index
+
+b = array.from_table({10, 20, 20, 30, 40}, "i32")
+print("b:searchsorted(20)  ", b:searchsorted(20))    --> 2
+print("side 'right'        ", b:searchsorted(20, "right")) --> 4
+qs = array.from_table({5, 20, 35, 99}, "i32")
+print("b:searchsorted(qs)  ", b:searchsorted(qs):unpack()) --> 1 2 5 6
+b:build_index()
+print("with an index       ", b:searchsorted(qs, "right"):unpack()) --> 1 4 5 6
+b[4] = 35  -- drops the index
+print("after b[4] = 35     ", b:searchsorted(32))    --> 4
+print("b:searchsorted(2.5) fails", pcall(b.searchsorted, b, 2.5))
+
+-- lazy expressions: built by arithmetic, run in one fused pass
+
+u = array.from_table({1, 2, 3, 4})
+v = array.from_table({4, 3, 2, 1})
+e = (u:lazy() + v) * 2 - u
+print("e                   ", e, #e)                 --> expr(4, f64) 4
+print("e:eval()            ", e:eval():unpack())     --> 9 8 7 6
+print("e:sum(), e:max()    ", e:sum(), e:max())      --> 30.0 9.0
+print("(1 - u):abs():min(v)", (1 - u:lazy()):abs():min(v):eval():unpack()) --> 0 1 2 1
+print("in place            ", (u:lazy() * u + 1):eval(u):unpack()) --> 2 5 10 17
+print("same as eager       ", (u:lazy() * v):sum() == u:mul(v):sum()) --> true
+w = array.from_table({1, 2, 3, 4, 5})
+print("overlapping out:    ", pcall(e.eval, w:view(1, 4):lazy() + 1, w:view(2, 4)))
+n = array.from_table({6, 6, 6}, "i32")
+d = array.from_table({2, 0, 3}, "i32")
+print("n // 0 fails:       ", pcall(e.eval, n:lazy() / d))
+
+-- formulas: compiled once, evaluated per block of doubles
+
+fx = array.from_table({1, 2, 3, 4})
+fy = array.from_table({0, 1, 2, 3}, "i32")
+print("x*2 + y/2           ", array.eval("x*2 + y/2", {x = fx, y = fy}):unpack()) --> 2 4.5 7 9.5
+print("-x^2 + 2^-1 * k     ", array.eval("-x^2 + 2^-1 * k", {x = fx, k = 10}):unpack()) --> 4 1 -4 -11
+print("max(x, 2.5)         ", array.eval("max(x, 2.5)", {x = fx}):unpack()) --> 2.5 2.5 3 4
+sinx = array.eval("sin(x)", {x = fx})
+print("sin(x) like c_sin   ", sinx[3] == math.sin(3))   --> true
+f = array.compile("a*b - c")
+print("array.compile       ", f, f == array.compile("a*b - c")) --> formula(a*b - c) true
+print("f{a=fx, b=2, c=1}   ", f({a = fx, b = 2, c = 1}):unpack()) --> 1 3 5 7
+print("into out (f32)      ", f({a = fx, b = fx, c = 0}, array.new(4, "f32")):unpack()) --> 1 4 9 16
+print("syntax error:       ", pcall(array.eval, "sin(x", {x = fx}))
+print("unbound variable:   ", pcall(array.eval, "x + z", {x = fx}))
+print("integer out:        ", pcall(array.eval, "x", {x = fx}, array.new(4, "i32")))
+print("nested 50 deep      ", array.eval(string.rep("-(", 50) .. "x" .. string.rep(")", 50), {x = fx}):unpack()) --> 1 2 3 4
+ok, msg = pcall(array.eval, string.rep("(", 1e5) .. "x", {x = fx})
+print("deep parentheses    ", ok, msg:match("too complex")) --> false too complex
+ok, msg = pcall(array.eval, string.rep("-", 1e5) .. "x", {x = fx})
+print("deep unary minus    ", ok, msg:match("too complex")) --> false too complex
+ok, msg = pcall(array.eval, "2" .. string.rep("^2", 1e5), {})
+print("deep powers         ", ok, msg:match("too complex")) --> false too complex
+
+-- matrices: 2D views on f64 arrays, with blocked products
+
+ma = array.matrix({{1, 2, 3}, {4, 5, 6}})
+mb = array.matrix({{1, 0}, {0, 1}, {2, 2}})
+print("ma, ma:shape()      ", ma, ma:shape())        --> matrix(2, 3) 2 3
+print("ma * mb             ", (ma * mb):array():unpack()) --> 7 8 16 17
+print("ma:t() is a view    ", ma:t():get(3, 2))      --> 6.0
+print("ma:transpose()      ", ma:transpose():array():unpack()) --> 1 4 2 5 3 6
+print("ma * x              ", (ma * array.from_table({1, 1, 1})):unpack()) --> 6 15
+print("ma:t() * x          ", (ma:t() * array.from_table({1, 2})):unpack()) --> 9 12 15
+print("ma:sum(), :sum(1)   ", ma:sum(), ma:sum(1):unpack()) --> 21.0 5 7 9
+print("ma:max(2)           ", ma:max(2):unpack())   --> 3 6
+print("ma:mean(1)          ", ma:mean(1):unpack())  --> 2.5 3.5 4.5
+print("ma:row(2)           ", ma:row(2):unpack())   --> 4 5 6
+print("ma:col(3)           ", ma:col(3):unpack())   --> 3 6
+mx = array.from_table({1, 2, 3, 4})
+print("mx:matrix(..) shares", mx:matrix(2, 2):set(2, 1, 30):get(2, 1), mx[3]) --> 30.0 30.0
+mr = {}
+for i = 1, 130 * 90 do mr[i] = i % 11 - 5 end
+mc = array.from_table(mr):matrix(130, 90)
+md = mc * mc:t()                                     -- packed & blocked
+ok = true
+for _, ij in ipairs({{1, 1}, {77, 3}, {130, 129}}) do
+  local s = 0
+  for k = 1, 90 do s = s + mc:get(ij[1], k) * mc:get(ij[2], k) end
+  ok = ok and s == md:get(ij[1], ij[2])
+end
+print("blocked == naive    ", ok)                    --> true
+print("shapes must match:  ", pcall(ma.matmul, ma, ma))
+print("no overlapping out: ", pcall(ma.matmul, ma:sub(1, 1, 2, 2), ma:sub(1, 2, 2, 2), ma:sub(1, 2, 2, 2)))
+mv = array.matrix({{1, 2}, {3, 4}, {5, 6}, {7, 8}})
+print("mv:matvec(x)        ", mv:matvec(array.from_table({1, 1})):unpack()) --> 3.0 7.0 11.0 15.0
+mo = array.new(4)
+print("x in the tail of out", pcall(mv.matvec, mv, mo:view(3, 2), mo))
+
+-- binning: digitize, bincount & histogram, per-thread private counts
+
+hv = array.from_table({1, 3, 3, 0, 7, 3}, "i32")
+print("hv:bincount()       ", hv:bincount():unpack()) --> 1 1 0 3 0 0 0 1
+print("at least 10 bins    ", #hv:bincount(10))      --> 10
+hw = array.from_table({1, 1, 1, 1, 1, 0.5})
+print("weighted            ", hv:bincount(0, hw):unpack()) --> 1 1 0 2.5 0 0 0 1
+hx = array.from_table({0, 0.5, 1, 1.5, 2, -1, 0/0, 1.999})
+print("hx:histogram(0, 2, 4)", hx:histogram(0, 2, 4):unpack()) --> 1 1 1 3
+he = array.from_table({0, 1, 2})
+print("hx:digitize(he)     ", hx:digitize(he):unpack()) --> 1 1 2 2 3 0 3 2
+print("right closed        ", hx:digitize(he, true):unpack()) --> 0 1 1 2 2 0 3 2
+array.grain(1000)
+hb = array.new(100000, "i64")
+for i = 1, #hb do hb[i] = i * 7919 % 1000 end
+counts = {}
+for _, n in ipairs({1, 2, 4, 0}) do
+  array.threads(n)
+  local c, h = hb:bincount(), hb:histogram(0, 1000, 8)
+  counts[#counts + 1] = table.concat({c[1], c[1000], c:sum(), h:unpack()}, " ")
+end
+for i = 2, #counts do assert(counts[i] == counts[1]) end
+print("same with 1..n threads", counts[1])     --> 100 100 100000 12500 ..
+array.grain(65536)
+print("negative values fail", pcall(hv.bincount, array.from_table({-1}, "i8")))
+
+-- scans: cumsum, cumprod, cummin, cummax, scan(op) & diff, two-pass parallel
+
+sa = array.from_table({3, 1, 0/0, 4, 1, 5})
+print("sa:cumsum()         ", sa:cumsum():unpack())  --> 3 4 -nan -nan -nan -nan
+print("sa:cummax()         ", sa:cummax():unpack())  --> 3 3 3 4 4 5
+print("sa:scan('min')      ", sa:scan("min"):unpack()) --> 3 1 1 1 1 1
+sb = array.from_table({1, 2, 3, 4, 5}, "i8")
+print("sb:cumprod()        ", sb:cumprod():unpack()) --> 1 2 6 24 120
+print("i8 wraps around     ", array.from_table({100, 100}, "i8"):cumsum():unpack()) --> 100 -56
+print("sb:diff()           ", sb:diff():unpack())    --> 1 1 1 1
+print("#diff of 1 element  ", #sb:view(1, 1):diff()) --> 0
+print("reversed view       ", sb:slice(#sb, 1, -1):cumsum():unpack()) --> 5 9 12 14 15
+sb:cumsum(sb)
+print("in place            ", sb:unpack())           --> 1 3 6 10 15
+print("unknown op fails    ", pcall(sb.scan, sb, "sub"))
+array.grain(1000)
+sc = array.new(100000, "i64")
+for i = 1, #sc do sc[i] = i % 7 - 3 end
+sums = {}
+for _, n in ipairs({1, 2, 4, 0}) do
+  array.threads(n)
+  local c = sc:cumsum()
+  sums[#sums + 1] = table.concat({c[1], c[50001], c[#c], sc:cummax()[#c]}, " ")
+end
+for i = 2, #sums do assert(sums[i] == sums[1]) end
+print("same with 1..n threads", sums[1])              --> -2 ..
+sd = sc:cumsum()
+sd = sd:diff()
+ok = true
+for i = 1, #sd do ok = ok and sd[i] == sc[i + 1] end
+print("diff undoes cumsum  ", ok)                    --> true
+array.grain(65536)
+
+-- selection: quantile, median & partition, Floyd-Rivest multi-select
+
+qa = array.from_table({7, 1, 0/0, 3, 9, 5})
+print("qa:median()         ", qa:median())           --> 5.0
+print("qa:quantile(0.1)    ", qa:quantile(0.1))      --> 1.8
+print("qa:quantile({0,.25,1})", qa:quantile({0, 0.25, 1}):unpack()) --> 1.0 3.0 9.0
+print("even count          ", array.from_table({4, 1, 3, 2}, "i32"):median()) --> 2.5
+print("only NaNs           ", array.from_table({0/0}):median()) --> nan
+qb = array.from_table({5, 2, 8, 1, 9, 3}, "i16")
+qb:partition(3)
+print("qb:partition(3)     ", qb[3], qb[1] <= 3 and qb[2] <= 3, qb[4] >= 3) --> 3 true true
+print("out of range fails  ", pcall(qb.partition, qb, 7))
+print("q out of [0, 1] fails", pcall(qa.quantile, qa, 1.5))
+qc = array.new(20001, "i64")
+for i = 1, #qc do qc[i] = i * 7919 % 20011 % 500 end   -- many duplicates
+qs = qc:copy():sort()
+qv = qc:quantile({0, 0.01, 0.5, 0.99, 1})
+ok = qv[1] == qs[1] and qv[2] == qs[201] and qv[3] == qs[10001]
+ok = ok and qv[4] == qs[19801] and qv[5] == qs[20001]
+print("quantiles == sorted ", ok)                    --> true
+qd = qc:copy()
+qd:partition({100, 5000, 15000})
+ok = qd[100] == qs[100] and qd[5000] == qs[5000] and qd[15000] == qs[15000]
+for i = 1, #qd do
+  if i < 5000 then ok = ok and qd[i] <= qd[5000] end
+  if i > 15000 then ok = ok and qd[i] >= qd[15000] end
+end
+print("multi-partition     ", ok)                    --> true
+
+-- masks: comparisons, land/lor/lnot, count/any/all, compress & where
+
+ka = array.from_table({1, 5, 0/0, 3, 8, 2})
+kb = array.from_table({2, 5, 1, 1, 9, 2})
+print("ka:lt(3)            ", ka:lt(3):unpack())     --> 1 0 0 0 0 1
+print("ka:eq(kb)           ", ka:eq(kb):unpack())    --> 0 1 0 0 0 1
+print("ka:ne(kb), NaN      ", ka:ne(kb):unpack())    --> 1 0 1 1 1 0
+print("dtype               ", ka:ge(kb):dtype())     --> u8
+ku = array.from_table({1, 200, 255}, "u8")
+print("u8:lt(300), gt(-1)  ", ku:lt(300):all(), ku:gt(-1):all()) --> true true
+print("u8:ge(255.5), le(-1)", ku:ge(255.5):any(), ku:le(-1):any()) --> false false
+kn = array.from_table({-1, 0, 1, 2}, "i32")
+print("i32:gt(0.5)         ", kn:gt(0.5):unpack())  --> 0 0 1 1
+print("i32:le(-0.5)        ", kn:le(-0.5):unpack()) --> 1 0 0 0
+print("i32:eq/ne(0.5)      ", kn:eq(0.5):any(), kn:ne(0.5):all()) --> false true
+print("i32:ne(0/0)         ", kn:lt(0/0):any(), kn:ne(0/0):all()) --> false true
+kf = array.from_table({0.1, 1}, "f32")
+print("f32:eq(0.1)         ", kf:eq(0.1):unpack())  --> 0 0
+print("f32:gt(0.1)         ", 0.1 < kf[1], kf:gt(0.1):unpack()) --> true 1 1
+print("f32:le(0.1)         ", kf:le(0.1):unpack())  --> 0 0
+print("f32:eq(1)           ", kf:eq(1.0):unpack())  --> 0 1
+kl = array.from_table({math.maxinteger, -1}, "i64")
+print("i64:lt(maxinteger)  ", kl:lt(math.maxinteger):unpack()) --> 0 1
+kq = array.from_table({math.mininteger, -1}, "u64")   -- 2^63, 2^64 - 1
+print("u64:ge(2^64)        ", kq:ge(2^64):any())         --> false
+print("u64:gt(2^63)        ", kq:gt(2^63):unpack())      --> 0 1
+print("u64:eq(-1)          ", kq:eq(-1):any())           --> false
+km = ka:gt(1) & ka:lt(8)
+print("ka:gt(1) & ka:lt(8) ", km:unpack())           --> 0 1 0 1 0 1
+print("~km                 ", (~km):unpack())        --> 1 0 1 0 1 0
+print("km | ka:ge(8)       ", (km | ka:ge(8)):unpack()) --> 0 1 0 1 1 1
+print("km:count()          ", km:count(), km:any(), km:all()) --> 3 true false
+print("ka:compress(km)     ", ka:compress(km):unpack()) --> 5 3 2
+print("where(km, ka, 0)    ", array.where(km, ka, 0):unpack()) --> 0 5 0 3 0 2
+print("where(km, 1, -1)    ", array.where(km, 1, -1):unpack()) --> -1 1 -1 1 -1 1
+ki = array.from_table({4, 7, 1}, "i16")
+print("strided compress    ", ki:slice(3, 1, -1):compress(ki:slice(3, 1, -1):gt(2)):unpack()) --> 7 4
+print("masks must be u8    ", pcall(ka.compress, ka, ka))
+print("sizes must match    ", pcall(array.where, km, kb:view(1, 2), 0))
+array.grain(1000)
+kc = array.new(100000, "i32")
+for i = 1, #kc do kc[i] = i * 7919 % 1000 end
+res = {}
+for _, n in ipairs({1, 2, 4, 0}) do
+  array.threads(n)
+  local sel = kc:compress(kc:lt(100))
+  res[#res + 1] = table.concat({#sel, sel[1], sel[#sel], sel:sum()}, " ")
+end
+for i = 2, #res do assert(res[i] == res[1]) end
+print("same with 1..n threads", res[1])               --> 10000.0 28 0 495000
+array.grain(65536)
+
+-- gather & scatter: take, put & scatter_add, indices checked once per call
+
+ga = array.from_table({10, 20, 30, 40, 50})
+gi = array.from_table({5, 1, 3, 3}, "i32")
+print("ga:take(gi)         ", ga:take(gi):unpack())  --> 50 10 30 30
+print("strided take        ", ga:slice(5, 1, -1):take(gi):unpack()) --> 10 50 30 30
+gb = array.new(5, "i64"):fill(0)
+gb:put(array.from_table({2, 4}, "u8"), array.from_table({7, 9}, "i64"))
+print("gb:put(..)          ", gb:unpack())            --> 0 7 0 9 0
+gb:scatter_add(gi, 1)
+print("gb:scatter_add(gi, 1)", gb:unpack())           --> 1 7 2 9 1
+print("repeated put, last wins", gb:put(gi, array.from_table({1, 2, 3, 4}, "i64"))[3]) --> 4
+print("index 0 fails       ", pcall(ga.take, ga, array.from_table({0}, "i32")))
+print("index > #a fails    ", pcall(ga.put, ga, array.from_table({6}, "i32"), 0))
+print("float indices fail  ", pcall(ga.take, ga, ga))
+gp = array.from_table({3, 1, 2}, "i32")
+print("perm:take(perm)     ", gp:take(gp):unpack())   --> 2 3 1
+print("put through itself  ", pcall(gp.put, gp, gp, 1))
+array.grain(1000)
+gc = array.new(100000)
+gj = array.new(100000, "i32")
+for i = 1, #gc do gc[i] = i; gj[i] = i * 7919 % #gc + 1 end
+res = {}
+for _, n in ipairs({1, 2, 4, 0}) do
+  array.threads(n)
+  local t = gc:take(gj)
+  res[#res + 1] = table.concat({t[1], t[#t], t:sum()}, " ")
+end
+for i = 2, #res do assert(res[i] == res[1]) end
+print("same with 1..n threads", res[1])               --> 7920.0 1.0 5000050000.0
+gk = array.new(#gj, "i32")
+for i = 1, #gk do gk[i] = gj[i] % 1000 + 1 end
+gd = array.new(1000):fill(0):scatter_add(gk, 0.5)
+array.grain(65536)
+print("scatter_add of 0.5  ", gd[1], gd[1000], gd:sum()) --> 50.0 50.0 50000.0
+
+-- type checks compare against the metatables held as upvalues (udata.h)
+
+print("a:sum() on a number ", pcall(x.sum, 5))
+print("e:sum() on an array ", pcall(x:lazy().sum, x))
+
+-- math functions: SIMD polynomials (vmath.h), or the C library's (strict)
+
+ma = array.from_table({0, 0.5, 1, 2, 4})
+print("ma:sqrt()           ", ma:sqrt():unpack())    --> 0.0 0.70710678118655 1.0 1.4142135623731 2.0
+print("ma:exp()            ", ma:exp():unpack())     --> 1.0 1.6487212707001 2.718281828459 7.3890560989307 54.598150033144
+print("ma:log()            ", ma:log():unpack())     --> -inf -0.69314718055995 0.0 0.69314718055995 1.3862943611199
+print("ma:sin()            ", ma:sin():unpack())     --> 0.0 0.4794255386042 0.8414709848079 0.90929742682568 -0.75680249530793
+print("ma:cos()            ", ma:cos():unpack())     --> 1.0 0.87758256189037 0.54030230586814 -0.41614683654714 -0.65364362086361
+print("ma:tanh()           ", ma:tanh():unpack())    --> 0.0 0.46211715726001 0.76159415595576 0.96402758007582 0.99932929973907
+print("ma:sigmoid()        ", ma:sigmoid():unpack()) --> 0.5 0.62245933120185 0.73105857863 0.88079707797788 0.98201379003791
+print("ma:erf()            ", ma:erf():unpack())     --> 0.0 0.52049987781305 0.84270079294971 0.99532226501895 0.99999998458274
+print("ma:pow(0.5)         ", ma:pow(0.5):unpack())  --> 0.0 0.70710678118655 1.0 1.4142135623731 2.0
+print("ma:pow(ma)          ", ma:pow(ma):unpack())   --> 1.0 0.70710678118655 1.0 4.0 256.0
+print("array.tan({..})     ", array.tan({0, 1, -1}):unpack()) --> 0.0 1.5574077246549 -1.5574077246549
+print("array.log1p({..})   ", array.log1p({0, 1e-20, 1}):unpack()) --> 0.0 1e-20 0.69314718055995
+print("array.pow({..}, {..})", array.pow({2, 3}, {10, 0.5}):unpack()) --> 1024.0 1.7320508075689
+mi = array.from_table({1, 4, 9}, "i32")
+print("i32 -> f64          ", mi:sqrt():dtype(), mi:sqrt():unpack()) --> f64 1.0 2.0 3.0
+print("strided view        ", ma:slice(5, 1, -2):exp():unpack()) --> 54.598150033144 2.718281828459 1.0
+mb = array.new(5)
+print("into out            ", ma:exp(mb) == mb, mb[3]) --> true 2.718281828459
+mc = ma:copy()
+print("in place            ", mc:sqrt(mc)[5], mc[5]) --> 2.0 2.0
+md = array.from_table({-1, 0/0, 1/0, -1/0, 1000, -1000, 1e300})
+me = md:exp()
+print("exp specials        ", me[1], me[2] ~= me[2], me[3], me[4], me[5], me[6]) --> 0.36787944117144 true inf 0.0 inf 0.0
+mf = md:log()
+print("log specials        ", mf[1] ~= mf[1], mf[2] ~= mf[2], mf[3], mf[4] ~= mf[4], mf[7]) --> true true inf true 690.77552789821
+print("sin(1e300)          ", md:sin()[7] == math.sin(1e300)) --> true
+print("out must be f64     ", pcall(ma.sin, ma, array.new(5, "f32")))
+print("out size            ", pcall(ma.sin, ma, array.new(4)))
+print("tables of numbers   ", pcall(array.exp, {1, "x"}))
+print("pow sizes           ", pcall(ma.pow, ma, {1, 2}))
+print("array.mathmode()    ", array.mathmode())        --> fast
+print("invalid mode        ", pcall(array.mathmode, "exact"))
+-- fast vs strict: within a few units in the last place, over all ranges
+mx = array.new(40000)
+for i = 1, #mx do mx[i] = (i * 7919 % 40000 - 20000) * 10 ^ (i % 9 - 6) end
+mp = mx:abs():add(1e-300)
+function maxulp(f, x, ...)
+  local fast = f(x, ...)
+  array.mathmode("strict")
+  local strict = f(x, ...)
+  array.mathmode("fast")
+  local worst = 0
+  for i = 1, #x do
+    local a, b = fast[i], strict[i]
+    if a ~= b then
+      local ulp = b == 0 and 2^-1074 or 2^(math.floor(math.log(math.abs(b), 2)) - 52)
+      worst = math.max(worst, math.abs(a - b) / ulp)
+    end
+  end
+  return worst
+end
+ok = true
+for _, name in ipairs({"sin", "cos", "tan", "exp", "tanh", "sigmoid", "erf"}) do
+  ok = ok and maxulp(array[name], mx) <= 4
+end
+for _, name in ipairs({"log", "log1p", "sqrt"}) do
+  ok = ok and maxulp(array[name], mp) <= 4
+end
+ok = ok and maxulp(array.pow, mp:div(1000), 2.5) <= 4
+ok = ok and maxulp(array.pow, mp:log():abs(), mx:div(100000)) <= 4
+print("fast ~ strict       ", ok)                    --> true
+array.mathmode("strict")
+print("strict sin          ", array.sin({1})[1] == math.sin(1), array.mathmode()) --> true strict
+array.mathmode("fast")
+
+-- random numbers: xoshiro256** streams per block, reproducible from a seed
+
+ra = array.new(100000):random_uniform(-1, 1, 42)
+rb = array.new(100000):random_uniform(-1, 1, 42)
+print("same seed, same numbers", ra:eq(rb):all())             --> true
+print("another seed        ", ra:eq(array.new(100000):random_uniform(-1, 1, 43)):any()) --> false
+print("in [-1, 1)          ", ra:min() >= -1, ra:max() < 1)  --> true true
+rf = array.new(100000, "f32"):random_uniform(1, 1 + 2^-20, 8)   -- 8 floats
+print("f32 never hi        ", rf:lt(1 + 2^-20):all(), rf:ge(1):all()) --> true true
+rf = array.new(100000):random_uniform(1, 1 + 2^-50, 8)           -- 4 doubles
+print("f64 never hi        ", rf:lt(1 + 2^-50):all(), rf:ge(1):all()) --> true true
+print("mean ~ 0, var ~ 1/3 ", math.abs(ra:mean()) < 0.01, math.abs(ra:var() - 1/3) < 0.01) --> true true
+rn = array.new(100001, "f32"):random_normal(10, 2, 7)
+print("normal mean, sd     ", math.abs(rn:mean() - 10) < 0.05, math.abs(math.sqrt(rn:var()) - 2) < 0.05) --> true true
+ri = array.new(10000, "i8"):random_uniform(-3, 3, 1)
+print("integers in -3 .. 3 ", ri:min(), ri:max())            --> -3 3
+ru = array.new(1000, "u64"):random_uniform(math.mininteger, -1, 6) -- 2^63 .. 2^64-1
+print("u64 past 2^63       ", ru:ge(2^63):all(), ru:lt(2^64):all()) --> true true
+ru = array.new(1000, "u64"):random_uniform(0, -1, 6)            -- all of u64
+print("all of u64          ", ru:ge(2^63):any(), ru:lt(2^63):any()) --> true true
+print("u64 interval empty  ", pcall(ru.random_uniform, ru, -1, 0))
+print("default 0 & 1       ", array.new(1000, "u8"):random_uniform(nil, nil, 5):max()) --> 1
+print("no seed: next seed  ", array.new(8):random_uniform():eq(array.new(8):random_uniform()):any()) --> false
+array.randomseed(123)
+rs = array.new(8):random_uniform()
+array.randomseed(123)
+print("array.randomseed    ", rs:eq(array.new(8):random_uniform()):all()) --> true
+rv = array.new(200):fill(0)
+rv:slice(1, 200, 2):random_uniform(1, 2, 3)
+print("strided view        ", rv:slice(2, 200, 2):max(), rv:slice(1, 200, 2):min() >= 1) --> 0.0 true
+rsame = {}
+rfirst = array.new(50000):random_normal(0, 1, 99)
+for i, t in ipairs({1, 2, 4, 0}) do
+  array.threads(t)
+  array.grain(i * 3000)
+  rsame[i] = array.new(50000):random_normal(0, 1, 99):eq(rfirst):all()
+end
+array.grain(65536)
+print("same with 1..n threads", table.unpack(rsame))         --> true true true true
+rp = array.from_table({1, 2, 3, 4, 5, 6, 7, 8, 9, 10}, "i16")
+rq = rp:copy():shuffle(5)
+print("shuffle permutes    ", rq:eq(rp):all(), rq:copy():sort():eq(rp):all()) --> false true
+print("same seed, same order", rp:copy():shuffle(5):eq(rq):all()) --> true
+rk = rp:sample(10, false, 2)
+print("sample w/o replacement", rk:copy():sort():eq(rp):all()) --> true
+rk = rp:sample(1000, true, 2)
+print("sample w/ replacement", rk:dtype(), #rk, rk:min(), rk:max()) --> i16 1000.0 1 10
+print("sample(0)           ", #rp:sample(0))                  --> 0.0
+rl = array.new(1000000, "i32")
+for i = 1, #rl do rl[i] = i end
+rk = rl:sample(50, false, 3):sort()                  -- hashed, not 4 MB
+print("small k of a large a", #rk, rk:min() >= 1, rk:max() <= #rl, rk:diff():min() > 0) --> 50.0 true true true
+print("same seed, same k   ", rl:sample(50, false, 3):sort():eq(rk):all()) --> true
+print("normal needs floats ", pcall(rp.random_normal, rp))
+print("empty interval      ", pcall(rp.random_uniform, rp, 2, 1))
+print("out of range        ", pcall(rp.random_uniform, rp, 0, 40000))
+print("sample too large    ", pcall(rp.sample, rp, 11))
+
+-- parse_csv: delimited text into typed column arrays
+
+pc = array.parse_csv("1,2,3\n4,5,6\n\n7,8,9")
+print("three columns       ", #pc, pc[3]:unpack())            --> 3.0 3.0 6.0 9.0
+pc = array.parse_csv("x; y ;\"z\"\r\n1.5; -2 ;3e2\r\n 4 ;5;\r\n",
+                     {sep = ";", header = true, columns = {"z", 1},
+                      dtype = {"f32", "f64"}})
+print("by name             ", pc[1] == pc.z, pc[2] == pc.x, pc.y) --> true true nil
+print("dtypes              ", pc.z:dtype(), pc.x:dtype())      --> f32 f64
+print("empty field is NaN  ", pc.z[1], pc.z[2] ~= pc.z[2])    --> 300.0 true
+print("by position         ", array.parse_csv("1,2\n3,4\n", {columns = {2}})[1]:unpack()) --> 2.0 4.0
+print("integers            ", array.parse_csv("-128,255\n127,0\n", {dtype = {"i8", "u8"}})[2]:unpack()) --> 255 0
+print("no text, no columns ", #array.parse_csv(""))           --> 0
+print("one line, no newline", array.parse_csv("1,2,3")[3]:unpack()) --> 3.0
+print("text, not a path    ", pcall(array.parse_csv, "no/such/file.csv"))
+-- numbers as tonumber reads them, fast path or not
+pcs = {"0.1", "-0", "1e22", "1e23", "123456789012345678901234", "4.9e-324",
+       "1.7976931348623157e308", "2.2250738585072011e-308", "9007199254740993.0",
+       "0.30000000000000004", "1e-7", "123.456e10", "+7", ".5", "5."}
+for i = 1, 2000 do
+  pcs[#pcs + 1] = string.format(({"%.17g", "%.6f", "%g", "%.3e"})[i % 4 + 1],
+                                (i * 7919 % 2000 - 1000) * 10 ^ (i % 61 - 30))
+end
+pcv = array.parse_csv(table.concat(pcs, "\n"))[1]
+pcok = true
+for i = 1, #pcs do pcok = pcok and pcv[i] == tonumber(pcs[i]) end
+print("same as tonumber    ", pcok)                           --> true
+-- many pieces, parsed on 1 .. n threads, from a file
+pcrows = {"a,b,c"}
+for i = 1, 40000 do pcrows[#pcrows + 1] = string.format("%d,%.6f,%d", i, i / 7, -i) end
+path = os.tmpname()
+pcf = io.open(path, "w")
+pcf:write(table.concat(pcrows, "\n"), "\n")
+pcf:close()
+pcsame = true
+for _, t in ipairs({1, 2, 4, 0}) do
+  array.threads(t)
+  pc = array.read_csv(path, {header = true, dtype = {"i32", "f64", "i64"}})
+  pcsame = pcsame and #pc.a == 40000 and pc.a:sum() == 800020000
+                  and pc.c:sum() == -800020000 and pc.b[40000] == 5714.285714
+end
+print("same with 1..n threads", pcsame)                       --> true
+pcrows[30001] = "30000,x,1"
+pcf = io.open(path, "w")
+pcf:write(table.concat(pcrows, "\n"))
+pcf:close()
+print("error, far in       ", pcall(array.read_csv, path, {header = true}))
+os.remove(path)
+print("too few fields      ", pcall(array.parse_csv, "1,2\n3\n"))
+print("too many fields     ", pcall(array.parse_csv, "1,2\n3,4,5\n"))
+print("not a number        ", pcall(array.parse_csv, "1,2\n3,x\n"))
+print("out of range        ", pcall(array.parse_csv, "1,2\n3,300\n", {dtype = "u8"}))
+print("not an integer      ", pcall(array.parse_csv, "1,2\n3,2.5\n", {dtype = "i32"}))
+print("no such file        ", pcall(array.read_csv, "no/such/file.csv"))
+print("names need a header ", pcall(array.parse_csv, "1,2\n", {columns = {"a"}}))
+print("no such column      ", pcall(array.parse_csv, "1,2\n", {columns = {3}}))
+print("bad dtype           ", pcall(array.parse_csv, "1,2\n", {dtype = "f65"}))
+print("bad column dtype    ", pcall(array.parse_csv, "1,2\n", {dtype = {"i32", 7}}))
+print("named column dtype  ", pcall(array.parse_csv, "a,b\n1,2\n", {header = true, columns = {"b"}, dtype = {"int"}}))
+
+-- format & write_text: shortest digits that read back as the same number
+
+fa = array.from_table({0.1, 1/3, 1e23, -0.0, 1/0, -1/0, 0/0, 100, 5e-324, 1.5e-5})
+print("a:format(\", \")      ", fa:format(", "))
+--> 0.1, 0.3333333333333333, 1e+23, -0, inf, -inf, nan, 100, 5e-324, 1.5e-05
+print("f32 as f32          ", array.from_table({0.1, 1/3}, "f32"):format(" ")) --> 0.1 0.33333334
+print("precision 3         ", fa:format(" ", 3))
+--> 0.1 0.333 1e+23 -0 inf -inf nan 100 4.94e-324 1.5e-05
+print("integers            ", array.from_table({math.mininteger, 0, math.maxinteger}, "i64"):format(","))
+--> -9223372036854775808,0,9223372036854775807
+print("default sep, strided", (fa:slice(1, 3, 2):format():gsub("\n", "|"))) --> 0.1|1e+23
+print("no elements         ", array.new(0):format() == "") --> true
+fb = array.new(50000):random_normal(0, 1e10, 3):mul(array.new(50000):random_uniform(1e-20, 1, 4))
+fok = true
+for s in fb:format():gmatch("[^\n]+") do fok = fok and #s <= #string.format("%.17g", tonumber(s)) end
+print("no longer than %.17g", fok)                            --> true
+print("reads back          ", array.parse_csv(fb:format("\n"))[1]:eq(fb):all()) --> true
+path = os.tmpname()
+print("a:write_text(path)  ", fb:write_text(path))           --> true
+print("reads back from file", array.read_csv(path)[1]:eq(fb):all()) --> true
+os.remove(path)
+print("no such directory   ", fb:write_text("no/such/dir/file.txt"))
+print("precision 18        ", pcall(fb.format, fb, ",", 18))
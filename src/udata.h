@@ -0,0 +1,54 @@
+// file udata.h
+// Type checks of userdata against a metatable held in an upvalue.
+//
+// luaL_checkudata(L, arg, tname) & luaL_testudata find the metatable of
+// type tname by name, in the registry, on every call: hashing the name and
+// a table lookup, before the metatables are even compared.  On accessors
+// like __index that is more than the work they guard.  Instead, luaopen_xx
+// hands the metatables to all the C functions it registers as upvalues
+// (luaL_setfuncs(L, funcs, nup)), so a check is a comparison of two table
+// pointers.  Upvalues belong to the closures, so every lua_State that
+// requires the module gets its own.
+//
+// - udata_test   like luaL_testudata, for the metatable in upvalue up
+// - udata_check  like luaL_checkudata, same error messages
+// - udata_meta   push the metatable, like luaL_getmetatable
+//
+// All fall back to the luaL_ versions (by tname) when called from a C
+// function that lacks upvalue up, e.g. one pushed by lua_pushcfunction.
+
+static inline int
+udata_hasmeta (lua_State *L, int up)
+{
+    return lua_type(L, lua_upvalueindex(up)) == LUA_TTABLE;
+}
+
+static inline void *
+udata_test (lua_State *L, int arg, int up, const char *tname)
+{
+    void *p = lua_touserdata(L, arg);
+    int same;
+    if (!udata_hasmeta(L, up))
+        return luaL_testudata(L, arg, tname);
+    if (p == NULL || !lua_getmetatable(L, arg))
+        return NULL;
+    same = lua_rawequal(L, -1, lua_upvalueindex(up));
+    lua_pop(L, 1);
+    return same ? p : NULL;
+}
+
+static inline void *
+udata_check (lua_State *L, int arg, int up, const char *tname)
+{
+    void *p = udata_test(L, arg, up, tname);
+    return p != NULL ? p : luaL_checkudata(L, arg, tname);  // raises
+}
+
+static inline void
+udata_meta (lua_State *L, int up, const char *tname)
+{
+    if (udata_hasmeta(L, up))
+        lua_pushvalue(L, lua_upvalueindex(up));
+    else
+        luaL_getmetatable(L, tname);
+}
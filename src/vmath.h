@@ -0,0 +1,499 @@
+// file vmath.h
+// Vectorized math functions for ex04's arrays: ex01's c_sin, but for whole
+// blocks of doubles at a time.
+//
+// Every kernel computes VLEN lanes at once: the argument is reduced to a
+// small interval with integer arithmetic on the exponent bits or a
+// Cody-Waite subtraction (constants split in parts, so that the products
+// with the integer k are exact), and a polynomial does the rest.  There
+// are no lookup tables, so the kernels only read their arguments.
+//
+// - exp        k = round(x/ln2), exp(r) by its Taylor series to r^13, then
+//              scaled by 2^k built from k's bits
+// - log        x = 2^k * m with m in [sqrt(1/2), sqrt(2)), log(m) from the
+//              series of log((1+s)/(1-s)) in s = (m-1)/(m+1), as in fdlibm
+// - log1p      log(1+x), corrected for the rounding of 1+x
+// - sqrt       the hardware's, correctly rounded
+// - pow        exp(y * log(x)) for x > 0, with log(x) in two doubles (some
+//              60 bits) so the error does not grow with y*log(x)
+// - sin, cos   x reduced by multiples q of pi/2 to [-pi/4, pi/4], with a
+//              tail for the bits lost, then the series of sin & cos, one
+//              of which q selects; tan is their ratio
+// - tanh       expm1(2|x|) / (expm1(2|x|) + 2), with the sign of x
+// - sigmoid    1 / (1 + exp(-x))
+// - erf        x + x * P(x^2) up to |x| = 1, above that 1 - exp(-x^2) *
+//              R(1/x), with R a Chebyshev series on two pieces
+//
+// Lanes outside a kernel's fast range go to the C library instead: NaN,
+// infinities, zero or negative arguments of log & pow, |x| > 708 for exp
+// and sigmoid, |x| > 2^20 for sin, cos & tan, |x| >= 22 for tanh, |x| >= 6
+// for erf.  So results match the C library's in all special cases.
+//
+// Largest errors seen over 10^7 random arguments per function (uniform up
+// to the fast range's limits, log-uniform over 1e-300 .. 1e300 for log &
+// pow), in units in the last place of the exact result, with or without
+// fma: exp 0.98, log 0.86, log1p 1.23, sqrt 0.5, sin 0.78, cos 0.78, tan
+// 2.3, tanh 2.5, sigmoid 2.5, erf 1.5, pow 1.9.  The C library rounds
+// correctly or nearly so, at about 2 to 7 times the cost for arguments in
+// -5 .. 5 (b_ex04.lua); less where its own shortcuts apply, as for tanh or
+// erf of large x.
+//
+// The vm_<name>_libm kernels call the C library for every element
+// (array.mathmode("strict")).
+//
+// Uses simd.h.
+
+#include <float.h>
+#include <math.h>
+
+#define VM_ALL      ((1 << VLEN) - 1)       // the bits of all lanes
+#define VM_ROUND    0x1.8p52                // x + VM_ROUND - VM_ROUND: rint(x)
+#define VM_INVLN2   1.4426950408889634
+#define VM_LN2HI    0.69314718246459961     // 21 bits, so k*VM_LN2HI is exact
+#define VM_LN2LO    -1.904654299957768e-09
+#define VM_LG1HI    0.6666666666666666      // 2/3 = VM_LG1HI + VM_LG1LO
+#define VM_LG1LO    3.700743415417188e-17
+#define VM_INVPI    0.31830988618379067
+#define VM_PIO2_1   1.5707963267341256      // 31 bits, pi/2 = the sum of the 3
+#define VM_PIO2_2   6.077100506303966e-11   // 32 bits
+#define VM_PIO2_3   2.0222662487959506e-21
+#define VM_EXPMAX   708.0
+#define VM_TRIGMAX  0x1p20
+#define VM_TANHMAX  22.0
+#define VM_ERFMAX   6.0
+
+// exp(r) = 1 + r + r^2 * P(r): 1/n! for n = 2 .. 13
+static const double vm_expc[] = {
+    0.5, 0.16666666666666666, 0.041666666666666664, 0.0083333333333333332,
+    0.0013888888888888889, 0.00019841269841269841, 2.4801587301587302e-05,
+    2.7557319223985893e-06, 2.7557319223985888e-07, 2.505210838544172e-08,
+    2.08767569878681e-09, 1.6059043836821613e-10
+};
+
+// log((1+s)/(1-s)) = 2s + s * z * P(z), z = s^2: 2/(2n+1) for n = 1 .. 13
+static const double vm_logc[] = {
+    0.66666666666666663, 0.40000000000000002, 0.2857142857142857,
+    0.22222222222222221, 0.18181818181818182, 0.15384615384615385,
+    0.13333333333333333, 0.11764705882352941, 0.10526315789473684,
+    0.095238095238095233, 0.086956521739130432, 0.080000000000000002,
+    0.07407407407407407
+};
+
+// sin(r) = r + r^3 * P(r^2): (-1)^n/(2n+1)! for n = 1 .. 8
+static const double vm_sinc[] = {
+    -0.16666666666666666, 0.0083333333333333332, -0.00019841269841269841,
+    2.7557319223985893e-06, -2.505210838544172e-08, 1.6059043836821613e-10,
+    -7.6471637318198164e-13, 2.8114572543455206e-15
+};
+
+// cos(r) = 1 - r^2/2 + r^4 * P(r^2): (-1)^n/(2n)! for n = 2 .. 9
+static const double vm_cosc[] = {
+    0.041666666666666664, -0.0013888888888888889, 2.4801587301587302e-05,
+    -2.7557319223985888e-07, 2.08767569878681e-09, -1.1470745597729725e-11,
+    4.7794773323873853e-14, -1.5619206968586225e-16
+};
+
+// erf(x) = x + x * P(x^2) for |x| <= 1, Taylor: 2/sqrt(pi) (-1)^n/(n!(2n+1)),
+// less the 1 for n = 0
+static const double vm_erfc0[] = {
+    0.12837916709551257, -0.37612638903183754, 0.11283791670955126,
+    -0.026866170645131252, 0.0052239776254421879, -0.00085483270234508533,
+    0.00012055332981789664, -1.492565035840625e-05, 1.6462114365889248e-06,
+    -1.6365844691234924e-07, 1.4807192815879218e-08, -1.2290555301717928e-09,
+    9.4227590646504113e-11, -6.7113668551641105e-12, 4.4632242632864775e-13,
+    -2.7835162072109215e-14, 1.6342614095367152e-15, -9.0639708428086728e-17,
+    4.7633480405150683e-18
+};
+
+// erfc(x) * exp(x^2) as Chebyshev series in u = 1/x, on [1/2, 1] (1 < x
+// <= 2) and [1/6, 1/2] (2 < x < 6)
+#define VM_ERFN 17
+static const double vm_erfc1[VM_ERFN] = {
+    0.34630983395966086, 0.085908945858924765, -0.0048227258406236305,
+    0.00018649431517576382, 2.3252063776608847e-06, -1.4733383612378742e-06,
+    1.9195365298660884e-07, -1.6919351049744009e-08, 9.6522739777087541e-10,
+    4.3085383571724536e-12, -1.0902437357821795e-11, 1.9319602881246526e-12,
+    -2.3511940435564646e-13, 2.1898369241286998e-14, -1.3800918113542067e-15,
+    -2.8754094533689625e-18, 1.8533616740288539e-17
+};
+static const double vm_erfc2[VM_ERFN] = {
+    0.17652811793633821, 0.081373795337827154, -0.0024575013733779674,
+    -6.324093536658628e-05, 1.5519910419454142e-05, -1.0108306756548019e-06,
+    -1.319732774701922e-08, 1.0635365988659541e-08, -1.2284967356346472e-09,
+    4.9703371897498055e-11, 7.7738297919687371e-12, -1.8655371570026014e-12,
+    1.9513204310274661e-13, -5.5149537898573609e-15, -2.066788515569011e-15,
+    4.6765378595033533e-16, -5.316412861139794e-17
+};
+
+#define VM_NCOEF(c)  ((int)(sizeof(c) / sizeof((c)[0])))
+
+static inline vdouble
+vm_poly (vdouble x, const double *c, int n)
+{
+    // c[0] + c[1]*x + .. + c[n-1]*x^(n-1), by Horner's rule
+    vdouble p = vset1(c[n - 1]);
+    while (--n > 0)
+        p = vfma(p, x, vset1(c[n - 1]));
+    return p;
+}
+
+static inline vdouble
+vm_round (vdouble x)
+{
+    // x rounded to an integer, for |x| < 2^51
+    return vsub(vadd(x, vset1(VM_ROUND)), vset1(VM_ROUND));
+}
+
+static inline vdouble
+vm_pow2 (vdouble k)
+{
+    // 2^k for integers k in -1022 .. 1023: k + 1023 in the low bits of
+    // 2^52 + k + 1023, shifted into the exponent
+    return vshl(vadd(k, vset1(0x1p52 + 1023)), 52);
+}
+
+static inline vdouble
+vm_step (vdouble x, double a)
+{
+    // 1 where x > a, 0 where x <= a, exactly and without branches
+    vdouble t = vmul(vsub(x, vset1(a)), vset1(0x1p60));
+    return vmin(vmax(t, vset1(0.0)), vset1(1.0));
+}
+
+static inline vdouble
+vm_expm1r (vdouble x, vdouble *s)
+{
+    // exp(x) = s * (1 + result), with s = 2^k, for |x| <= VM_EXPMAX
+    vdouble k = vm_round(vmul(x, vset1(VM_INVLN2)));
+    vdouble r = vfma(k, vset1(-VM_LN2HI), x);
+    r = vfma(k, vset1(-VM_LN2LO), r);
+    *s = vm_pow2(k);
+    return vfma(vmul(r, r), vm_poly(r, vm_expc, VM_NCOEF(vm_expc)), r);
+}
+
+static inline vdouble
+vm_expv (vdouble x)
+{
+    vdouble s, q = vm_expm1r(x, &s);
+    return vfma(q, s, s);
+}
+
+static inline vdouble
+vm_mul12 (vdouble a, vdouble b, vdouble *lo)
+{
+    // a*b = result + *lo exactly: the fma's rounding error, or Dekker's
+    // product of a & b split in halves of 26 bits (Veltkamp), whose
+    // products are exact.  (The split must not be contracted into fmas,
+    // which is why it is only used when there are none.)
+    vdouble p = vmul(a, b);
+#if VFMA_FUSED
+    *lo = vfma(a, b, vneg(p));
+#else
+    vdouble ah, al, bh, bl, c;
+    c = vmul(a, vset1(134217729.0));
+    ah = vsub(c, vsub(c, a));
+    al = vsub(a, ah);
+    c = vmul(b, vset1(134217729.0));
+    bh = vsub(c, vsub(c, b));
+    bl = vsub(b, bh);
+    c = vsub(vmul(ah, bh), p);
+    c = vadd(vadd(c, vmul(ah, bl)), vmul(al, bh));
+    *lo = vadd(c, vmul(al, bl));
+#endif
+    return p;
+}
+
+static inline vdouble
+vm_add12 (vdouble a, vdouble b, vdouble *lo)
+{
+    // a+b = result + *lo exactly (Knuth's two-sum)
+    vdouble s = vadd(a, b), bb = vsub(s, a);
+    *lo = vadd(vsub(a, vsub(s, bb)), vsub(b, bb));
+    return s;
+}
+
+static inline vdouble
+vm_logf (vdouble x, vdouble *k)
+{
+    // x = 2^k * (1 + f) with 1 + f in [sqrt(1/2), sqrt(2)), for normal,
+    // finite x > 0: adding the bits of 1 - sqrt(1/2) carries into the
+    // exponent exactly when 1 + f would be >= sqrt(2)
+    vdouble ix = vaddi(x, vbits(0x3ff0000000000000 - 0x3fe6a09e667f3bcd));
+    vdouble m = vaddi(vand(ix, vbits(0x000fffffffffffff)),
+                      vbits(0x3fe6a09e667f3bcd));
+    *k = vsub(vor(vshr(ix, 52), vbits(0x4330000000000000)),
+              vset1(0x1p52 + 1023));
+    return vsub(m, vset1(1.0));
+}
+
+static inline vdouble
+vm_logv (vdouble x)
+{
+    // log(x) = k*ln2 + f - f^2/2 + s*(f^2/2 + R), s = f/(2 + f), R the
+    // series in s^2, as in fdlibm
+    vdouble k, f = vm_logf(x, &k);
+    vdouble hfsq = vmul(vset1(0.5), vmul(f, f));
+    vdouble s = vdiv(f, vadd(f, vset1(2.0)));
+    vdouble z = vmul(s, s);
+    vdouble r = vmul(z, vm_poly(z, vm_logc, VM_NCOEF(vm_logc)));
+    vdouble lo = vfma(s, vadd(hfsq, r), vmul(k, vset1(VM_LN2LO)));
+    return vfma(k, vset1(VM_LN2HI), vsub(f, vsub(hfsq, lo)));
+}
+
+static inline vdouble
+vm_logdd (vdouble x, vdouble *lo)
+{
+    // log(x) = result + *lo, to some 60 bits, for pow: log(1 + f) = 2s +
+    // 2/3 s^3 + s^5 * P(s^2), with s = f/(2 + f) = sh + sl and the first
+    // two terms in two parts as well
+    vdouble k, f = vm_logf(x, &k);
+    vdouble dl, d = vm_add12(f, vset1(2.0), &dl);
+    vdouble sh = vdiv(f, d), sl, p, pl, z, zl, c, cl, h, l;
+
+    p = vm_mul12(sh, d, &pl);
+    sl = vdiv(vsub(vsub(vsub(f, p), pl), vmul(sh, dl)), d);
+    z = vm_mul12(sh, sh, &zl);
+    c = vm_mul12(z, sh, &cl);                    // s^3
+    cl = vadd(cl, vfma(vset1(3.0), vmul(z, sl), vmul(zl, sh)));
+    p = vm_mul12(c, vset1(VM_LG1HI), &pl);       // 2/3 s^3
+    pl = vadd(pl, vfma(c, vset1(VM_LG1LO), vmul(cl, vset1(VM_LG1HI))));
+    c = vmul(vmul(c, z), vm_poly(z, vm_logc + 1, VM_NCOEF(vm_logc) - 1));
+    h = vm_add12(vmul(k, vset1(VM_LN2HI)), vadd(sh, sh), &l);
+    h = vm_add12(h, p, &p);
+    l = vadd(vadd(l, p), vadd(vadd(sl, sl), pl));
+    l = vadd(l, vfma(k, vset1(VM_LN2LO), c));
+    c = vadd(h, l);
+    *lo = vsub(l, vsub(c, h));
+    return c;
+}
+
+static inline vdouble
+vm_sincosr (vdouble ax, vdouble *sin, vdouble *cos)
+{
+    // sin & cos of ax - q*pi/2, for 0 <= ax <= VM_TRIGMAX, returns q: y + yy
+    // is the reduced argument in [-pi/4, pi/4], with yy the bits lost in y,
+    // and the polynomials follow fdlibm's __kernel_sin & __kernel_cos
+    vdouble q = vm_round(vmul(ax, vset1(2 * VM_INVPI)));
+    vdouble r1 = vfma(q, vset1(-VM_PIO2_1), ax);          // exact
+    vdouble w = vmul(q, vset1(VM_PIO2_2));                // exact
+    vdouble r = vsub(r1, w);
+    vdouble lo = vsub(vsub(vsub(r1, r), w), vmul(q, vset1(VM_PIO2_3)));
+    vdouble y = vadd(r, lo), yy = vadd(vsub(r, y), lo);
+    vdouble z = vmul(y, y), v = vmul(z, y), hz = vmul(vset1(0.5), z), t;
+
+    // w + (((1 - w) - z/2) + (z^2 * P(z) - y*yy)), w = 1 - z/2
+    w = vsub(vset1(1.0), hz);
+    t = vsub(vmul(vmul(z, z), vm_poly(z, vm_cosc, VM_NCOEF(vm_cosc))),
+             vmul(y, yy));
+    *cos = vadd(w, vadd(vsub(vsub(vset1(1.0), w), hz), t));
+    // y + v*(S1 + z*P(z)) + yy*(1 - z/2)
+    t = vm_poly(z, vm_sinc + 1, VM_NCOEF(vm_sinc) - 1);
+    t = vsub(vmul(z, vsub(vmul(vset1(0.5), yy), vmul(v, t))), yy);
+    *sin = vsub(y, vsub(t, vmul(v, vset1(vm_sinc[0]))));
+    return q;
+}
+
+enum { VM_SIN, VM_COS, VM_TAN };
+
+static inline vdouble
+vm_trigv (vdouble x, int fn)
+{
+    // sin, cos or tan of x via the quadrant n = q (+ 1 for cos): odd n swap
+    // sin & cos (w = 1), bit 1 of n flips the sign (bit 0 for tan).  Sin &
+    // tan are odd, so they reduce |x| and get x's sign back at the end.
+    vdouble sign = vand(x, vbits(fn == VM_COS ? 0 : 0x8000000000000000));
+    vdouble s, c, n = vm_sincosr(vabs(x), &s, &c);
+    vdouble w, wn, r;
+    int bit = fn == VM_TAN ? 0 : 1;
+
+    if (fn == VM_COS)
+        n = vadd(n, vset1(1.0));
+    w = vabs(vsub(n, vadd(vm_round(vmul(n, vset1(0.5))),
+                          vm_round(vmul(n, vset1(0.5))))));
+    wn = vsub(vset1(1.0), w);
+    r = vadd(vmul(w, c), vmul(wn, s));
+    if (fn == VM_TAN)
+        r = vdiv(r, vadd(vmul(w, s), vmul(wn, c)));
+    n = vshl(vshr(vadd(n, vset1(VM_ROUND)), bit), 63);
+    return vxor(r, vxor(n, sign));
+}
+
+#define VM_SINV(x)  vm_trigv(x, VM_SIN)
+#define VM_COSV(x)  vm_trigv(x, VM_COS)
+#define VM_TANV(x)  vm_trigv(x, VM_TAN)
+
+static inline vdouble
+vm_tanhv (vdouble x)
+{
+    // for |x| < VM_TANHMAX: e = expm1(2|x|) = s*q + (s - 1), s = 2^k
+    vdouble sign = vand(x, vbits(0x8000000000000000));
+    vdouble s, q = vm_expm1r(vadd(vabs(x), vabs(x)), &s);
+    vdouble e = vfma(s, q, vsub(s, vset1(1.0)));
+    return vxor(vdiv(e, vadd(e, vset1(2.0))), sign);
+}
+
+static inline vdouble
+vm_erfv (vdouble x)
+{
+    vdouble sign = vand(x, vbits(0x8000000000000000));
+    vdouble ax = vabs(x);
+    vdouble r = vm_poly(vmul(x, x), vm_erfc0, VM_NCOEF(vm_erfc0));
+
+    r = vfma(ax, r, ax);
+
+    if (vgt(ax, vset1(1.0))) {
+        // lanes in (1, 6): 1 - exp(-x^2) * R(1/x); lanes with w = 1 take
+        // the second piece, the coefficients are mixed exactly (* 0 or 1)
+        vdouble xa = vmax(ax, vset1(1.0));
+        vdouble u = vdiv(vset1(1.0), xa);
+        vdouble w = vm_step(xa, 2.0), wn = vsub(vset1(1.0), w);
+        vdouble v = vsub(vmul(u, vfma(w, vset1(2.0), vset1(4.0))),
+                         vsub(vset1(3.0), w));  // 4u - 3 or 6u - 2
+        vdouble v2 = vadd(v, v), b1 = vset1(0.0), b2 = b1, c;
+        vdouble hi, lo, e;
+        int j;
+        for (j = VM_ERFN - 1; j > 0; j--) {
+            c = vadd(vmul(wn, vset1(vm_erfc1[j])),
+                     vmul(w, vset1(vm_erfc2[j])));
+            c = vfma(v2, b1, vsub(c, b2));
+            b2 = b1;
+            b1 = c;
+        }
+        c = vadd(vmul(wn, vset1(vm_erfc1[0])), vmul(w, vset1(vm_erfc2[0])));
+        c = vfma(v, b1, vsub(c, b2));
+        // exp(-x^2), with x^2 = hi + lo exactly
+        hi = vm_mul12(xa, xa, &lo);
+        e = vmul(vm_expv(vneg(hi)), vsub(vset1(1.0), lo));
+        e = vsub(vset1(1.0), vmul(e, c));
+        w = vm_step(ax, 1.0);
+        r = vadd(vmul(w, e), vmul(vsub(vset1(1.0), w), r));
+    }
+
+    return vxor(r, sign);
+}
+
+// the lanes that the C library computes, as a bit mask like veq's
+
+#define VM_BADEXP(x)   (VM_ALL ^ vle(vabs(x), vset1(VM_EXPMAX)))
+#define VM_BADLOG(x)   (VM_ALL ^ (vge(x, vset1(DBL_MIN))                     \
+                                  & vle(x, vset1(DBL_MAX))))
+#define VM_BADLOG1P(x) (VM_ALL ^ (vgt(x, vset1(-1.0))                       \
+                                  & vle(x, vset1(DBL_MAX))))
+#define VM_BADTRIG(x)  (VM_ALL ^ vle(vabs(x), vset1(VM_TRIGMAX)))
+#define VM_BADTANH(x)  (VM_ALL ^ vlt(vabs(x), vset1(VM_TANHMAX)))
+#define VM_BADERF(x)   (VM_ALL ^ vlt(vabs(x), vset1(VM_ERFMAX)))
+#define VM_NONE(x)     0
+
+#define VM_LOG1P(x)                                                           \
+    vadd(vm_logv(vadd(vset1(1.0), x)),                                        \
+         vdiv(vsub(x, vsub(vadd(vset1(1.0), x), vset1(1.0))),                 \
+              vadd(vset1(1.0), x)))
+#define VM_SIGMOID(x)  vdiv(vset1(1.0), vadd(vset1(1.0), vm_expv(vneg(x))))
+
+static double vm_sigmoid1 (double x) { return 1.0 / (1.0 + exp(-x)); }
+
+// kernels: vm_<name> on a block of n doubles, r may be x.  The tail gets
+// padded with 1.0 (in range for all) to a full vector, so every element
+// is computed the same way wherever it is in the array.
+#define VM_UNARY(NAME, BAD, VEXPR, LIBM)                                      \
+static void                                                                   \
+vm_##NAME (void *r_, const void *x_, int n)                                   \
+{                                                                             \
+    double *r = (double *)r_;                                                 \
+    const double *x = (const double *)x_;                                     \
+    _Alignas(64) double t[VLEN];                                              \
+    int i, j, m, bad;                                                         \
+    for (i = 0; i < n; i += VLEN) {                                           \
+        vdouble v;                                                            \
+        m = n - i < VLEN ? n - i : VLEN;                                      \
+        for (j = 0; m < VLEN && j < VLEN; j++)                                \
+            t[j] = j < m ? x[i + j] : 1.0;                                    \
+        v = m < VLEN ? vload(t) : vload(x + i);                               \
+        bad = BAD(v);                                                         \
+        v = VEXPR(v);                                                         \
+        if (!bad && m == VLEN) {                                              \
+            vstore(r + i, v);                                                 \
+            continue;                                                         \
+        }                                                                     \
+        vstore(t, v);                                                         \
+        for (j = 0; j < m; j++)                                               \
+            r[i + j] = bad & (1 << j) ? LIBM(x[i + j]) : t[j];                \
+    }                                                                         \
+}                                                                             \
+static void                                                                   \
+vm_##NAME##_libm (void *r_, const void *x_, int n)                            \
+{                                                                             \
+    double *r = (double *)r_;                                                 \
+    const double *x = (const double *)x_;                                     \
+    int i;                                                                    \
+    for (i = 0; i < n; i++)                                                   \
+        r[i] = LIBM(x[i]);                                                    \
+}
+
+VM_UNARY(exp, VM_BADEXP, vm_expv, exp)
+VM_UNARY(log, VM_BADLOG, vm_logv, log)
+VM_UNARY(log1p, VM_BADLOG1P, VM_LOG1P, log1p)
+VM_UNARY(sqrt, VM_NONE, vsqrt, sqrt)
+VM_UNARY(sin, VM_BADTRIG, VM_SINV, sin)
+VM_UNARY(cos, VM_BADTRIG, VM_COSV, cos)
+VM_UNARY(tan, VM_BADTRIG, VM_TANV, tan)
+VM_UNARY(tanh, VM_BADTANH, vm_tanhv, tanh)
+VM_UNARY(sigmoid, VM_BADEXP, VM_SIGMOID, vm_sigmoid1)
+VM_UNARY(erf, VM_BADERF, vm_erfv, erf)
+
+// pow(x, y), y an array (aa) or a pointer to a scalar (as)
+#define VM_POW(SHAPE, YV, YS)                                                 \
+static void                                                                   \
+vm_pow_##SHAPE (void *r_, const void *x_, const void *y_, int n)              \
+{                                                                             \
+    double *r = (double *)r_;                                                 \
+    const double *x = (const double *)x_, *y = (const double *)y_;            \
+    _Alignas(64) double t[VLEN], u[VLEN];                                     \
+    int i, j, m, bad;                                                         \
+    for (i = 0; i < n; i += VLEN) {                                           \
+        vdouble vx, vy, z, zl, lo;                                            \
+        m = n - i < VLEN ? n - i : VLEN;                                      \
+        for (j = 0; m < VLEN && j < VLEN; j++) {                              \
+            t[j] = j < m ? x[i + j] : 1.0;                                    \
+            u[j] = j < m ? y[YS] : 1.0;                                       \
+        }                                                                     \
+        vx = m < VLEN ? vload(t) : vload(x + i);                              \
+        vy = m < VLEN ? vload(u) : YV;                                        \
+        z = vm_logdd(vx, &lo);                                                \
+        z = vm_mul12(vy, z, &zl);                                             \
+        zl = vfma(vy, lo, zl);                                                \
+        bad = VM_BADLOG(vx) | VM_BADEXP(z);                                   \
+        z = vm_expv(z);                                                       \
+        z = vfma(z, zl, z);                                                   \
+        if (!bad && m == VLEN) {                                              \
+            vstore(r + i, z);                                                 \
+            continue;                                                         \
+        }                                                                     \
+        vstore(t, z);                                                         \
+        for (j = 0; j < m; j++)                                               \
+            r[i + j] = bad & (1 << j) ? pow(x[i + j], y[YS]) : t[j];          \
+    }                                                                         \
+}
+
+VM_POW(aa, vload(y + i), i + j)
+VM_POW(as, vset1(*y), 0)
+
+static void
+vm_pow_libm_aa (void *r_, const void *x_, const void *y_, int n)
+{
+    double *r = (double *)r_;
+    const double *x = (const double *)x_, *y = (const double *)y_;
+    int i;
+    for (i = 0; i < n; i++)
+        r[i] = pow(x[i], y[i]);
+}
+
+static void
+vm_pow_libm_as (void *r_, const void *x_, const void *y_, int n)
+{
+    double *r = (double *)r_;
+    const double *x = (const double *)x_, y = *(const double *)y_;
+    int i;
+    for (i = 0; i < n; i++)
+        r[i] = pow(x[i], y);
+}